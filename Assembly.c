@@ -1,89 +1,559 @@
 #include "Assembly.h"
+#include "ElfWriter.h"
+#include "Encoder.h"
+#include "Instruction.h"
+#include "Jit.h"
+#include "Memory.h"
+#include "Options.h"
+#include "OutputBuffer.h"
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUTPUT_FLUSH_SIZE (1 << 20)  // Text collected before it is written out
 
 static FILE *f;  // File pointer for output
+static struct OutputBuffer output;  // Formatted text not yet written to f
+static _Thread_local struct InstructionBuffer instructions;  // Instructions of the function being generated on this thread
+static _Thread_local struct FunctionOutput *function_output;  // Receives the flushed function instead of output, if set
+static struct DataSection data_section;  // Strings of the translation unit, only read while functions are generated
+static struct MachineCode machine_code;  // Encoded functions, when writing an object file or loading them
+static struct JitCode *jit_output;  // Receives the loaded code instead of f, if set
+static atomic_int num_instructions = 0;  // Machine instructions flushed so far, without labels, comments and padding
+
+// Integer argument registers of the System V AMD64 calling convention, in argument order
+static enum Reg arg_regs[NUM_ARG_REGS] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+
+// Find the magic multiplier and shift that turn signed 32-bit division by divisor into a
+// multiplication: x / d == ((x * multiplier) >> shift) + (x < 0), for d > 1 and not a power of 2
+static void FindDivisionMagic(long long divisor, long long *multiplier, int *shift) {
+    int log2_ceil = 1;
+    while ((1LL << log2_ceil) < divisor) {
+        log2_ceil += 1;
+    }
+    *shift = 31 + log2_ceil;
+    *multiplier = (1LL << *shift) / divisor + 1;
+}
+
+static bool IsPowerOfTwo(long long value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+static int Log2(long long value) {
+    int log2 = 0;
+    while ((1LL << log2) < value) {
+        log2 += 1;
+    }
+    return log2;
+}
+
+static struct Instruction *Emit(enum Opcode opcode, struct Operand dst, struct Operand src) {
+    return InstructionBuffer_Add(&instructions, opcode, dst, src);
+}
+
+static void WriteOperand(struct OutputBuffer *out, struct Operand *operand) {
+    switch (operand->kind) {
+        case OPERAND_NONE: {
+        } break;
+        case OPERAND_REG: {
+            OutputBuffer_WriteString(out, Reg_Name(operand->reg, operand->size));
+        } break;
+        case OPERAND_IMM: {
+            OutputBuffer_WriteInt(out, operand->value);
+        } break;
+        case OPERAND_MEM: {
+            static char *size_names[9] = { [1] = "byte ", [2] = "word ", [4] = "dword ", [8] = "qword " };
+            char *size_name = operand->size <= 8 && size_names[operand->size] ? size_names[operand->size] : "";
+            OutputBuffer_WriteString(out, size_name);
+            OutputBuffer_Write(out, "[", 1);
+            OutputBuffer_WriteString(out, Reg_Name(operand->reg, 8));
+            if (operand->index != REG_NONE) {
+                OutputBuffer_Write(out, " + ", 3);
+                OutputBuffer_WriteString(out, Reg_Name(operand->index, 8));
+                OutputBuffer_Write(out, "*", 1);
+                OutputBuffer_WriteInt(out, operand->scale);
+            }
+            if (operand->value < 0) {
+                OutputBuffer_Write(out, " - ", 3);
+                OutputBuffer_WriteInt(out, -operand->value);
+            } else if (operand->value > 0) {
+                OutputBuffer_Write(out, " + ", 3);
+                OutputBuffer_WriteInt(out, operand->value);
+            }
+            OutputBuffer_Write(out, "]", 1);
+        } break;
+        case OPERAND_LABEL: {
+            OutputBuffer_WriteString(out, operand->label);
+        } break;
+    }
+}
+
+static bool IsYmm(struct Operand *operand) {
+    return operand->kind == OPERAND_REG && operand->size == 32;
+}
+
+// Write an SSE instruction, or its VEX encoded AVX form when it operates on ymm registers
+static void WriteVectorInstruction(struct OutputBuffer *out, struct Instruction *instr, char *mnemonic) {
+    struct Operand dst = instr->dst;
+    struct Operand src = instr->src;
+    bool vex = IsYmm(&dst) || IsYmm(&src);
+    bool repeat_dst = false;
+    switch (instr->opcode) {
+        case OP_MOVD: {
+            dst.size = 16;  // Writes the low lane and clears the rest of the register
+        } break;
+        case OP_VPBROADCASTB:
+        case OP_VPBROADCASTD: {
+            src.size = 16;  // The lane is read from an xmm register
+            vex = false;    // Only exists in VEX form, the mnemonic already has its prefix
+        } break;
+        case OP_MOVDQA:
+        case OP_MOVDQU: {
+        } break;
+        default: {
+            repeat_dst = vex;  // AVX arithmetic takes a separate destination
+        } break;
+    }
+
+    OutputBuffer_Write(out, vex ? "  v" : "  ", vex ? 3 : 2);
+    OutputBuffer_WriteString(out, mnemonic);
+    OutputBuffer_Write(out, " ", 1);
+    WriteOperand(out, &dst);
+    if (repeat_dst) {
+        OutputBuffer_Write(out, ", ", 2);
+        WriteOperand(out, &dst);
+    }
+    OutputBuffer_Write(out, ", ", 2);
+    WriteOperand(out, &src);
+    OutputBuffer_Write(out, "\n", 1);
+}
+
+static void WriteInstruction(struct OutputBuffer *out, struct Instruction *instr) {
+    static char *mnemonics[OP_COUNT] = {
+        [OP_ADD]    = "add",
+        [OP_CALL]   = "call",
+        [OP_CMP]    = "cmp",
+        [OP_CQO]    = "cqo",
+        [OP_IDIV]   = "idiv",
+        [OP_IMUL]   = "imul",
+        [OP_JMP]    = "jmp",
+        [OP_LEA]    = "lea",
+        [OP_MOV]    = "mov",
+        [OP_MOVSXD] = "movsxd",
+        [OP_MOVZX]  = "movzx",
+        [OP_NEG]    = "neg",
+        [OP_POP]    = "pop",
+        [OP_PUSH]   = "push",
+        [OP_RET]    = "ret",
+        [OP_SAR]    = "sar",
+        [OP_SHL]    = "shl",
+        [OP_SHR]    = "shr",
+        [OP_SUB]    = "sub",
+        [OP_TEST]   = "test",
+        [OP_VZEROUPPER] = "vzeroupper",
+    };
+    static char *vector_mnemonics[OP_COUNT] = {
+        [OP_MOVD]           = "movd",
+        [OP_MOVDQA]         = "movdqa",
+        [OP_MOVDQU]         = "movdqu",
+        [OP_PADDB]          = "paddb",
+        [OP_PADDD]          = "paddd",
+        [OP_PMULLD]         = "pmulld",
+        [OP_PSUBB]          = "psubb",
+        [OP_PSUBD]          = "psubd",
+        [OP_PUNPCKLBW]      = "punpcklbw",
+        [OP_PUNPCKLDQ]      = "punpckldq",
+        [OP_PUNPCKLQDQ]     = "punpcklqdq",
+        [OP_PUNPCKLWD]      = "punpcklwd",
+        [OP_PXOR]           = "pxor",
+        [OP_VPBROADCASTB]   = "vpbroadcastb",
+        [OP_VPBROADCASTD]   = "vpbroadcastd",
+    };
+
+    if (vector_mnemonics[instr->opcode]) {
+        WriteVectorInstruction(out, instr, vector_mnemonics[instr->opcode]);
+        return;
+    }
+
+    switch (instr->opcode) {
+        case OP_NOP: {
+        } return;
+        case OP_COMMENT: {
+            OutputBuffer_Write(out, "  ; ", 4);
+            OutputBuffer_WriteString(out, instr->text);
+            OutputBuffer_Write(out, "\n", 1);
+        } return;
+        case OP_LABEL: {
+            OutputBuffer_WriteString(out, instr->dst.label);
+            OutputBuffer_Write(out, ":\n", 2);
+        } return;
+        case OP_ALIGN: {
+            OutputBuffer_Write(out, "  align ", 8);
+            OutputBuffer_WriteInt(out, instr->dst.value);
+            OutputBuffer_Write(out, "\n", 1);
+        } return;
+        case OP_JCC: {
+            OutputBuffer_Write(out, "  j", 3);
+            OutputBuffer_WriteString(out, Condition_Name(instr->condition));
+            OutputBuffer_Write(out, " ", 1);
+        } break;
+        case OP_SETCC: {
+            OutputBuffer_Write(out, "  set", 5);
+            OutputBuffer_WriteString(out, Condition_Name(instr->condition));
+            OutputBuffer_Write(out, " ", 1);
+        } break;
+        default: {
+            OutputBuffer_Write(out, "  ", 2);
+            OutputBuffer_WriteString(out, mnemonics[instr->opcode]);
+            if (instr->dst.kind != OPERAND_NONE) {
+                OutputBuffer_Write(out, " ", 1);
+            }
+        } break;
+    }
+
+    WriteOperand(out, &instr->dst);
+    if (instr->src.kind != OPERAND_NONE) {
+        OutputBuffer_Write(out, ", ", 2);
+        WriteOperand(out, &instr->src);
+    }
+    OutputBuffer_Write(out, "\n", 1);
+}
+
+// Write a data field as db "text", 10, 0 with the printable runs quoted
+static void WriteDataField(struct OutputBuffer *out, struct DataField *field) {
+    OutputBuffer_Write(out, "  ", 2);
+    OutputBuffer_WriteString(out, field->label);
+    OutputBuffer_Write(out, ": db ", 5);
+    int i = 0;
+    while (i < field->size) {
+        if (i > 0) {
+            OutputBuffer_Write(out, ", ", 2);
+        }
+        int run = 0;
+        while (i + run < field->size && field->bytes[i + run] >= ' ' && field->bytes[i + run] <= '~' && field->bytes[i + run] != '"') {
+            run += 1;
+        }
+        if (run > 0) {
+            OutputBuffer_Write(out, "\"", 1);
+            OutputBuffer_Write(out, (char *) field->bytes + i, run);
+            OutputBuffer_Write(out, "\"", 1);
+            i += run;
+        } else {
+            OutputBuffer_WriteInt(out, field->bytes[i]);
+            i += 1;
+        }
+    }
+    OutputBuffer_Write(out, "\n", 1);
+}
+
+// Encode instead of writing assembly text
+static bool IsEncoding() {
+    return options.emit_object || jit_output;
+}
 
 // Function implementations
-void Add(char *destination, char *source) {
-    fprintf(f, "  add %s, %s\n", destination, source);
+void Add(struct Operand destination, struct Operand source) {
+    Emit(OP_ADD, destination, source);
+}
+
+void AlignCode(int alignment) {
+    Emit(OP_ALIGN, Operand_Imm(alignment), Operand_None());
+}
+
+// Register passing an argument, accessed with the width of the given type
+struct Operand ArgReg(int index, enum PrimitiveType primtype) {
+    assert(0 <= index && index < NUM_ARG_REGS);
+    return Operand_Reg(arg_regs[index], bytes[primtype]);
 }
 
 void Call(char *label) {
-    fprintf(f, "  call %s\n", label);
+    Emit(OP_CALL, Operand_Label(label), Operand_None());
+}
+
+void Cmp(struct Operand a, struct Operand b) {
+    Emit(OP_CMP, a, b);
+}
+
+void CmpImm(struct Operand a, int value) {
+    if (value == 0 && a.kind == OPERAND_REG) {
+        Emit(OP_TEST, a, a);  // Shorter encoding, and still macro-fuses with the jcc
+    } else {
+        Emit(OP_CMP, a, Operand_Imm(value));
+    }
 }
 
 void Comment(char *comment) {
-    fprintf(f, "  ; %s\n", comment);
+    struct Instruction *instr = Emit(OP_COMMENT, Operand_None(), Operand_None());
+    instr->text = (char *) Memory_Alloc(MEMORY_CODEGEN, strlen(comment) + 1);
+    strcpy(instr->text, comment);
+}
+
+void Compare(struct Operand a, struct Operand b, enum Condition condition) {
+    Emit(OP_CMP, a, b);
+    SetCC(condition);
+}
+
+// Add a null terminated string to the data section, decoding the escapes of the source text
+void DefineString(char *label, char *value) {
+    DataSection_AddString(&data_section, label, value);
+}
+
+void DestroyStackFrame() {
+    Emit(OP_MOV, Operand_Reg(REG_RSP, 8), Operand_Reg(REG_RBP, 8));  // Restore stack pointer
+    Emit(OP_POP, Operand_Reg(REG_RBP, 8), Operand_None());           // Restore base pointer
+}
+
+void Div(struct Operand operand) {
+    Emit(OP_CQO, Operand_None(), Operand_None());  // Prepare for signed division (convert quadword to octaword)
+    Emit(OP_IDIV, operand, Operand_None());        // Signed division
+}
+
+// Divide the signed int in eax by a constant, leaving the quotient in rax
+void DivImm(int divisor) {
+    assert(divisor != 0);
+    long long magnitude = divisor < 0 ? -(long long) divisor : divisor;
+    struct Operand rax_reg = Operand_Reg(REG_RAX, 8);
+    struct Operand rdx_reg = Operand_Reg(REG_RDX, 8);
+
+    if (magnitude != 1) {
+        Emit(OP_MOVSXD, rax_reg, Operand_Reg(REG_RAX, 4));  // Sign-extend the dividend
+    }
+
+    if (magnitude == 1) {
+        // Nothing to divide
+    } else if (IsPowerOfTwo(magnitude)) {
+        // Round towards zero by adding divisor - 1 to negative dividends before shifting
+        int log2 = Log2(magnitude);
+        Emit(OP_MOV, rdx_reg, rax_reg);
+        Emit(OP_SAR, rdx_reg, Operand_Imm(63));
+        Emit(OP_SHR, rdx_reg, Operand_Imm(64 - log2));
+        Emit(OP_ADD, rax_reg, rdx_reg);
+        Emit(OP_SAR, rax_reg, Operand_Imm(log2));
+    } else {
+        long long multiplier;
+        int shift;
+        FindDivisionMagic(magnitude, &multiplier, &shift);
+        Emit(OP_MOV, rdx_reg, Operand_Imm(multiplier));
+        Emit(OP_IMUL, rdx_reg, rax_reg);
+        Emit(OP_SAR, rdx_reg, Operand_Imm(shift));
+        Emit(OP_SHR, rax_reg, Operand_Imm(63));  // Add one for negative dividends
+        Emit(OP_ADD, rax_reg, rdx_reg);
+    }
+
+    if (divisor < 0) {
+        Emit(OP_NEG, rax_reg, Operand_None());
+    }
+}
+
+// Format the instructions of the finished function, followed by a blank line, or encode them
+// when writing an object file or loading the code. With a function output set they go there,
+// to be added to the file by WriteFunctionOutput.
+void FlushInstructions() {
+    int count = 0;
+    for (int i = 0; i < instructions.count; ++i) {
+        enum Opcode opcode = instructions.data[i].opcode;
+        if (opcode != OP_NOP && opcode != OP_LABEL && opcode != OP_COMMENT && opcode != OP_ALIGN) {
+            count += 1;
+        }
+    }
+    atomic_fetch_add(&num_instructions, count);
+
+    if (IsEncoding()) {
+        Encoder_AssembleFunction(function_output ? &function_output->code : &machine_code, &instructions);
+        InstructionBuffer_Clear(&instructions);
+        return;
+    }
+
+    struct OutputBuffer *text = function_output ? &function_output->text : &output;
+    for (int i = 0; i < instructions.count; ++i) {
+        WriteInstruction(text, &instructions.data[i]);
+    }
+    OutputBuffer_Write(text, "\n", 1);
+    InstructionBuffer_Clear(&instructions);
+
+    if (!function_output && output.size >= OUTPUT_FLUSH_SIZE) {
+        OutputBuffer_Flush(&output, f);
+    }
 }
 
-void Compare(char *a, char *b, char *comparison) {
-    fprintf(f,
-        "  cmp %s, %s\n"
-        "  %s al\n",  // Store comparison result in 'al' (lower 8 bits of rax)
-        a, b,
-        comparison
-    );
+// Write the data section and all text still buffered to the output file, or the object file, or
+// load the code into memory
+void FinishAssemblyFile() {
+    if (IsEncoding()) {
+        Encoder_ResolveFixups(&machine_code);
+        if (jit_output) {
+            Jit_Load(jit_output, &machine_code, &data_section);
+        } else {
+            ElfWriter_Write(f, &machine_code, &data_section);
+        }
+        MachineCode_Free(&machine_code);
+        DataSection_Free(&data_section);
+        return;
+    }
+
+    if (data_section.count > 0) {
+        OutputBuffer_WriteString(&output, "section .data\n");
+        for (int i = 0; i < data_section.count; ++i) {
+            WriteDataField(&output, &data_section.data[i]);
+        }
+    }
+    OutputBuffer_Flush(&output, f);
+    DataSection_Free(&data_section);
 }
 
-void Div(char *operand) {
-    fprintf(f,
-        "  cqo\n"          // Prepare for signed division (convert quadword to octaword)
-        "  idiv %s\n",     // Signed division
-        operand
-    );
+void FunctionOutput_Free(struct FunctionOutput *part) {
+    OutputBuffer_Free(&part->text);
+    MachineCode_Free(&part->code);
+}
+
+void FunctionOutput_Init(struct FunctionOutput *part) {
+    OutputBuffer_Init(&part->text);
+    MachineCode_Init(&part->code);
+}
+
+struct DataSection *GetDataSection() {
+    return &data_section;
+}
+
+struct InstructionBuffer *GetInstructions() {
+    return &instructions;
+}
+
+// Number of machine instructions flushed so far, for measuring the code generator
+int GetNumInstructions() {
+    return atomic_load(&num_instructions);
+}
+
+void Jcc(enum Condition condition, char *label) {
+    struct Instruction *instr = Emit(OP_JCC, Operand_Label(label), Operand_None());
+    instr->condition = condition;
 }
 
 void Jmp(char *label) {
-    fprintf(f, "  jmp %s\n", label);
+    Emit(OP_JMP, Operand_Label(label), Operand_None());
 }
 
 void Label(char *name) {
-    fprintf(f, "%s:\n", name);
+    Emit(OP_LABEL, Operand_Label(name), Operand_None());
 }
 
-void Lea(char *dest, int rbp_offset) {
-    fprintf(f, "  lea %s, [rbp - %d]\n", dest, rbp_offset);
+void Lea(struct Operand destination, int rbp_offset) {
+    Emit(OP_LEA, destination, Operand_Mem(REG_RBP, -rbp_offset, 0));
 }
 
-void LoadMem(enum PrimitiveType primtype) {
+// Load a value of the given type from memory into a 64-bit register
+void Load(struct Operand destination, struct Operand address, enum PrimitiveType primtype) {
+    address.size = bytes[primtype];
     if (primtype == PRIMTYPE_CHAR) {
-        fprintf(f, "  movzx rax, %s [rax]\n", size[primtype]);  // Zero-extend for char
+        Emit(OP_MOVZX, destination, address);  // Zero-extend for char
+    }
+    else if (primtype == PRIMTYPE_INT) {
+        // Sign-extend so that 64-bit compares and arithmetic see the correct int value
+        Emit(OP_MOVSXD, destination, address);
     }
     else {
-        fprintf(f, "  mov %s, %s [rax]\n", rax[primtype], size[primtype]);
+        Emit(OP_MOV, destination, address);
     }
 }
 
-void Mov(char *destination, char *source) {
-    fprintf(f, "  mov %s, %s\n", destination, source);
+void LoadMem(enum PrimitiveType primtype) {
+    Load(Operand_Reg(REG_RAX, 8), Operand_Mem(REG_RAX, 0, 0), primtype);
+}
+
+// Load an address computed by a memory operand, as in lea rax, [rax + rdi*4 + 8]
+void LeaMem(struct Operand destination, struct Operand address) {
+    Emit(OP_LEA, destination, address);
 }
 
-void MovImm(char *destination, int value) {
-    fprintf(f, "  mov %s, %d\n", destination, value);
+void Mov(struct Operand destination, struct Operand source) {
+    Emit(OP_MOV, destination, source);
 }
 
-void Mul(char *destination, char *source) {
-    fprintf(f, "  imul %s, %s\n", destination, source);
+void MovImm(struct Operand destination, int value) {
+    Emit(OP_MOV, destination, Operand_Imm(value));
 }
 
-void Neg(char *destination) {
-    fprintf(f, "  neg %s\n", destination);
+void Mul(struct Operand destination, struct Operand source) {
+    Emit(OP_IMUL, destination, source);
 }
 
-void Pop(char *destination) {
-    fprintf(f, "  pop %s\n", destination);
+// Multiply destination by a constant using shifts and lea where possible
+void MulImm(struct Operand destination, int value) {
+    struct Operand rdx_reg = Operand_Reg(REG_RDX, 8);
+    long long magnitude = value < 0 ? -(long long) value : value;
+    if (magnitude == 0 || magnitude > 0x7fffffffLL) {
+        Emit(OP_IMUL, destination, Operand_Imm(value));
+        return;
+    }
+
+    // Split the multiplier into odd * 2^shift
+    long long odd = magnitude;
+    int shift = 0;
+    while (odd % 2 == 0) {
+        odd /= 2;
+        shift += 1;
+    }
+
+    if (odd == 1 || odd == 3 || odd == 5 || odd == 9) {
+        if (odd != 1) {
+            Emit(OP_LEA, destination, Operand_MemIndex(destination.reg, destination.reg, (int) odd - 1, 0, 0));
+        }
+        if (shift > 0) {
+            Emit(OP_SHL, destination, Operand_Imm(shift));
+        }
+    } else if (IsPowerOfTwo(magnitude - 1)) {
+        Emit(OP_MOV, rdx_reg, Operand_Reg(destination.reg, 8));
+        Emit(OP_SHL, destination, Operand_Imm(Log2(magnitude - 1)));
+        Emit(OP_ADD, destination, rdx_reg);
+    } else if (IsPowerOfTwo(magnitude + 1)) {
+        Emit(OP_MOV, rdx_reg, Operand_Reg(destination.reg, 8));
+        Emit(OP_SHL, destination, Operand_Imm(Log2(magnitude + 1)));
+        Emit(OP_SUB, destination, rdx_reg);
+    } else {
+        Emit(OP_IMUL, destination, Operand_Imm(value));
+        return;
+    }
+
+    if (value < 0) {
+        Emit(OP_NEG, destination, Operand_None());
+    }
 }
 
-void Push(char *source) {
-    fprintf(f, "  push %s\n", source);
+void Neg(struct Operand destination) {
+    Emit(OP_NEG, destination, Operand_None());
+}
+
+void Pop(struct Operand destination) {
+    Emit(OP_POP, destination, Operand_None());
+}
+
+void Push(struct Operand source) {
+    Emit(OP_PUSH, source, Operand_None());
 }
 
 void RestoreStackFrame() {
-    fprintf(f,
-        "  mov rsp, rbp\n"  // Restore stack pointer
-        "  pop rbp\n"        // Restore base pointer
-        "  ret\n"            // Return from function
-    );
+    DestroyStackFrame();
+    Emit(OP_RET, Operand_None(), Operand_None());                    // Return from function
+}
+
+// Store the result of the last compare in al and clear the rest of rax
+void SetCC(enum Condition condition) {
+    struct Instruction *set = Emit(OP_SETCC, Operand_Reg(REG_RAX, 1), Operand_None());
+    set->condition = condition;
+    Emit(OP_MOVZX, Operand_Reg(REG_RAX, 4), Operand_Reg(REG_RAX, 1));
+}
+
+// Collect the functions flushed on this thread in output instead of the file, or stop doing so
+// when output is NULL. Each thread generating functions needs its own.
+void SetFunctionOutput(struct FunctionOutput *output) {
+    function_output = output;
+}
+
+// Load the code into memory of the running process instead of writing it to a file, or stop
+// doing so when jit is NULL
+void SetJitOutput(struct JitCode *jit) {
+    jit_output = jit;
 }
 
 void SetOutput(FILE *file) {
@@ -91,35 +561,124 @@ void SetOutput(FILE *file) {
 }
 
 void SetupAssemblyFile() {
-    fprintf(f,
+    if (IsEncoding()) {
+        return;  // The encoder writes the sections itself
+    }
+
+    static const char header[] =
         "bits 64\n"      // 64-bit mode
         "default rel\n"   // Default to RIP-relative addressing
         "\n"
-    );
+        "section .text\n"
+        "  extern printf\n"
+        "  global main\n"
+        "\n";
+    OutputBuffer_Write(&output, header, (int) sizeof(header) - 1);
 }
 
 void SetupStackFrame(int stack_size) {
-    fprintf(f,
-        "  push rbp\n"    // Save old base pointer
-        "  mov rbp, rsp\n" // Set new base pointer
-    );
+    Emit(OP_PUSH, Operand_Reg(REG_RBP, 8), Operand_None());          // Save old base pointer
+    Emit(OP_MOV, Operand_Reg(REG_RBP, 8), Operand_Reg(REG_RSP, 8));  // Set new base pointer
 
     if (stack_size > 0) {
-        fprintf(f, "  sub rsp, %d\n", stack_size);  // Allocate stack space
+        Emit(OP_SUB, Operand_Reg(REG_RSP, 8), Operand_Imm(stack_size));  // Allocate stack space
+    }
+}
+
+// Store the low bytes of a register holding a value of the given type
+void Store(struct Operand address, struct Operand source, enum PrimitiveType primtype) {
+    source.size = bytes[primtype];
+    Emit(OP_MOV, address, source);
+}
+
+// Store a constant of the given type, as in mov dword [rbp - 8], 5
+void StoreImm(struct Operand address, int value, enum PrimitiveType primtype) {
+    address.size = bytes[primtype];
+    Emit(OP_MOV, address, Operand_Imm(primtype == PRIMTYPE_CHAR ? (value & 0xff) : value));
+}
+
+void Sub(struct Operand destination, struct Operand source) {
+    Emit(OP_SUB, destination, source);
+}
+
+void TestImm(struct Operand a, int value) {
+    Emit(OP_TEST, a, Operand_Imm(value));
+}
+
+void VecAdd(struct Operand destination, struct Operand source, int element_size) {
+    assert(element_size == 1 || element_size == 4);
+    Emit(element_size == 1 ? OP_PADDB : OP_PADDD, destination, source);
+}
+
+// Copy the low element_size bytes of a general purpose register into every lane of a vector register
+void VecBroadcast(struct Operand destination, struct Operand source, int element_size) {
+    assert(element_size == 1 || element_size == 4);
+    Emit(OP_MOVD, destination, source);
+    if (destination.size == 32) {
+        Emit(element_size == 1 ? OP_VPBROADCASTB : OP_VPBROADCASTD, destination, destination);
+        return;
     }
+
+    // SSE2 has no broadcast, interleaving the register with itself doubles the copies each time
+    if (element_size == 1) {
+        Emit(OP_PUNPCKLBW, destination, destination);
+        Emit(OP_PUNPCKLWD, destination, destination);
+    }
+    Emit(OP_PUNPCKLDQ, destination, destination);
+    Emit(OP_PUNPCKLQDQ, destination, destination);
 }
 
-void Sub(char *destination, char *source) {
-    fprintf(f, "  sub %s, %s\n", destination, source);
+void VecLoad(struct Operand destination, struct Operand address) {
+    Emit(OP_MOVDQU, destination, address);
+}
+
+void VecMov(struct Operand destination, struct Operand source) {
+    Emit(OP_MOVDQA, destination, source);
+}
+
+void VecMul(struct Operand destination, struct Operand source, int element_size) {
+    assert(element_size == 4);  // There is no byte multiply
+    Emit(OP_PMULLD, destination, source);
+}
+
+void VecStore(struct Operand address, struct Operand source) {
+    Emit(OP_MOVDQU, address, source);
+}
+
+void VecSub(struct Operand destination, struct Operand source, int element_size) {
+    assert(element_size == 1 || element_size == 4);
+    Emit(element_size == 1 ? OP_PSUBB : OP_PSUBD, destination, source);
+}
+
+void VecZero(struct Operand destination) {
+    Emit(OP_PXOR, destination, destination);
+}
+
+// Clear the upper halves of the ymm registers to avoid AVX to SSE transition stalls
+void VecZeroUpper() {
+    Emit(OP_VZEROUPPER, Operand_None(), Operand_None());
+}
+
+// Add a function collected with SetFunctionOutput to the file, after the functions added before
+// it, and empty the function output
+void WriteFunctionOutput(struct FunctionOutput *part) {
+    if (IsEncoding()) {
+        MachineCode_Append(&machine_code, &part->code);
+    } else {
+        OutputBuffer_Append(&output, &part->text);
+        if (output.size >= OUTPUT_FLUSH_SIZE) {
+            OutputBuffer_Flush(&output, f);
+        }
+    }
+    FunctionOutput_Free(part);
 }
 
 void WriteMemOffset(int rbp_offset, int reg_idx, enum PrimitiveType primtype) {
-    assert(0 <= reg_idx && reg_idx < 4);  // Ensure reg_idx is valid
-    char **param_reg = param_regs[reg_idx];  // Get register for the given index
-    char *reg = param_reg[primtype];         // Get register for the given primitive type
-    fprintf(f, "  mov [rbp - %d], %s\n", rbp_offset, reg);  // Write to memory
+    struct Operand reg = ArgReg(reg_idx, primtype);  // Get register for the given index and primitive type
+    Emit(OP_MOV, Operand_Mem(REG_RBP, -rbp_offset, 0), reg);  // Write to memory
 }
 
-void WriteMemToReg(char *dest, char *src) {
-    fprintf(f, "  mov [%s], %s\n", dest, src);  // Write to memory
+// Store src to the address held in the register dest
+void WriteMemToReg(struct Operand dest, struct Operand src) {
+    Emit(OP_MOV, Operand_Mem(dest.reg, 0, 0), src);  // Write to memory
 }
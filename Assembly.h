@@ -1,31 +1,81 @@
 #ifndef BMS_ASSEMBLY_H
 #define BMS_ASSEMBLY_H
 
-#include "Register.h"  // Contains definitions for registers and primitive types
-#include <stdio.h>     // For FILE* and fprintf
+#include "Encoder.h"       // For the machine code of a function
+#include "Instruction.h"   // For the operands of instructions
+#include "OutputBuffer.h"  // For the assembly text of a function
+#include "Register.h"      // Contains definitions for registers and primitive types
+#include <stdio.h>         // For FILE* and fprintf
+
+struct DataSection;
+struct InstructionBuffer;
+struct JitCode;
+
+// The text or machine code of one function, generated apart from the others and added to the file
+// in source order by WriteFunctionOutput
+struct FunctionOutput {
+    struct OutputBuffer text;
+    struct MachineCode code;
+};
+
+#define NUM_ARG_REGS 6  // System V passes the first six integer arguments in registers, the rest on the stack
 
 // Function declarations
-void Add(char *destination, char *source);
+void Add(struct Operand destination, struct Operand source);
+void AlignCode(int alignment);
+struct Operand ArgReg(int index, enum PrimitiveType primtype);
 void Call(char *label);
+void Cmp(struct Operand a, struct Operand b);
+void CmpImm(struct Operand a, int value);
 void Comment(char *comment);
-void Compare(char *a, char *b, char *comparison);
-void Div(char *operand);
+void Compare(struct Operand a, struct Operand b, enum Condition condition);
+void DefineString(char *label, char *value);
+void DestroyStackFrame();
+void Div(struct Operand operand);
+void DivImm(int divisor);
+void FinishAssemblyFile();
+void FlushInstructions();
+void FunctionOutput_Free(struct FunctionOutput *part);
+void FunctionOutput_Init(struct FunctionOutput *part);
+struct DataSection *GetDataSection();
+struct InstructionBuffer *GetInstructions();
+int GetNumInstructions();
+void Jcc(enum Condition condition, char *label);
 void Jmp(char *label);
 void Label(char *name);
-void Lea(char *dest, int rbp_offset);
+void Lea(struct Operand destination, int rbp_offset);
+void LeaMem(struct Operand destination, struct Operand address);
+void Load(struct Operand destination, struct Operand address, enum PrimitiveType primtype);
 void LoadMem(enum PrimitiveType primtype);
-void Mov(char *destination, char *source);
-void MovImm(char *destination, int value);
-void Mul(char *destination, char *source);
-void Neg(char *destination);
-void Pop(char *destination);
-void Push(char *source);
+void Mov(struct Operand destination, struct Operand source);
+void MovImm(struct Operand destination, int value);
+void Mul(struct Operand destination, struct Operand source);
+void MulImm(struct Operand destination, int value);
+void Neg(struct Operand destination);
+void Pop(struct Operand destination);
+void Push(struct Operand source);
 void RestoreStackFrame();
+void SetCC(enum Condition condition);
+void SetFunctionOutput(struct FunctionOutput *output);
+void SetJitOutput(struct JitCode *jit);
 void SetOutput(FILE *file);
 void SetupAssemblyFile();
 void SetupStackFrame(int stack_size);
-void Sub(char *destination, char *source);
+void Store(struct Operand address, struct Operand source, enum PrimitiveType primtype);
+void StoreImm(struct Operand address, int value, enum PrimitiveType primtype);
+void Sub(struct Operand destination, struct Operand source);
+void TestImm(struct Operand a, int value);
+void VecAdd(struct Operand destination, struct Operand source, int element_size);
+void VecBroadcast(struct Operand destination, struct Operand source, int element_size);
+void VecLoad(struct Operand destination, struct Operand address);
+void VecMov(struct Operand destination, struct Operand source);
+void VecMul(struct Operand destination, struct Operand source, int element_size);
+void VecStore(struct Operand address, struct Operand source);
+void VecSub(struct Operand destination, struct Operand source, int element_size);
+void VecZero(struct Operand destination);
+void VecZeroUpper();
+void WriteFunctionOutput(struct FunctionOutput *part);
 void WriteMemOffset(int rbp_offset, int reg_idx, enum PrimitiveType primtype);
-void WriteMemToReg(char *dest, char *src);
+void WriteMemToReg(struct Operand dest, struct Operand src);
 
 #endif // BMS_ASSEMBLY_H
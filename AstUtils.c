@@ -0,0 +1,352 @@
+#include "AstUtils.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Check that evaluating an expression has no side effects
+bool AstUtils_IsPure(struct Expr *expr) {
+    if (!expr) {
+        return true;
+    }
+    switch (expr->type) {
+        case EXPR_NUM:
+        case EXPR_STR:
+        case EXPR_VAR:          return true;
+        case EXPR_FUNC_CALL:
+        case EXPR_ASSIGN:       return false;
+        default:                return AstUtils_IsPure(expr->lhs) && AstUtils_IsPure(expr->rhs);
+    }
+}
+
+// Check whether an expression is a comparison (==, !=, <, >, <=, >=)
+bool AstUtils_IsRelational(struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_EQU:
+        case EXPR_NEQ:
+        case EXPR_LT:
+        case EXPR_GT:
+        case EXPR_LTE:
+        case EXPR_GTE:  return true;
+        default:        return false;
+    }
+}
+
+// Check whether two expressions have the same structure and operands
+bool AstUtils_ExprEquals(struct Expr *a, struct Expr *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    if (a->type != b->type) {
+        return false;
+    }
+
+    switch (a->type) {
+        case EXPR_NUM:      return a->int_value == b->int_value;
+        case EXPR_STR:
+        case EXPR_VAR:      return strcmp(a->str_value, b->str_value) == 0;
+        case EXPR_FUNC_CALL: {
+            if (strcmp(a->str_value, b->str_value) != 0 || a->args.count != b->args.count) {
+                return false;
+            }
+            for (int i = 0; i < a->args.count; ++i) {
+                if (!AstUtils_ExprEquals((struct Expr *) List_Get(&a->args, i), (struct Expr *) List_Get(&b->args, i))) {
+                    return false;
+                }
+            }
+        } return true;
+        default: {
+            return AstUtils_ExprEquals(a->lhs, b->lhs) && AstUtils_ExprEquals(a->rhs, b->rhs);
+        }
+    }
+}
+
+// Make a deep copy of an expression
+struct Expr *AstUtils_CloneExpr(struct Expr *expr) {
+    if (!expr) {
+        return NULL;
+    }
+
+    struct Expr *copy = (struct Expr *) Memory_Alloc(MEMORY_AST, sizeof(struct Expr));
+    *copy = *expr;
+    copy->lhs = AstUtils_CloneExpr(expr->lhs);
+    copy->rhs = AstUtils_CloneExpr(expr->rhs);
+
+    List_Init(&copy->args);
+    for (int i = 0; i < expr->args.count; ++i) {
+        List_Add(&copy->args, AstUtils_CloneExpr((struct Expr *) List_Get(&expr->args, i)));
+    }
+    return copy;
+}
+
+// Make a deep copy of a statement
+struct AstNode *AstUtils_CloneStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            struct CompoundStmt *copy = NewCompoundStmt();
+            for (int i = 0; i < body->count; ++i) {
+                List_Add(&copy->body, AstUtils_CloneStmt((struct AstNode *) List_Get(body, i)));
+            }
+            return (struct AstNode *) copy;
+        }
+        case AST_VAR_DECLARATION: {
+            struct VarDeclaration *var_declaration = (struct VarDeclaration *) stmt;
+            struct VarDeclaration *copy = NewVarDeclaration();
+            copy->type = var_declaration->type;
+            for (int i = 0; i < var_declaration->declarators.count; ++i) {
+                struct Declarator *declarator = NewDeclarator();
+                *declarator = *(struct Declarator *) List_Get(&var_declaration->declarators, i);
+                declarator->value = AstUtils_CloneExpr(declarator->value);
+                List_Add(&copy->declarators, declarator);
+            }
+            return (struct AstNode *) copy;
+        }
+        case AST_EXPRESSION_STMT: {
+            return (struct AstNode *) NewExpressionStmt(AstUtils_CloneExpr(((struct ExpressionStmt *) stmt)->expr));
+        }
+        case AST_RETURN_STMT: {
+            return (struct AstNode *) NewReturnStmt(AstUtils_CloneExpr(((struct ReturnStmt *) stmt)->expr));
+        }
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return (struct AstNode *) NewIfStmt(AstUtils_CloneExpr(if_stmt->condition), AstUtils_CloneStmt(if_stmt->stmt),
+                                                AstUtils_CloneStmt(if_stmt->else_branch));
+        }
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            return (struct AstNode *) NewWhileStmt(AstUtils_CloneExpr(while_stmt->condition), AstUtils_CloneStmt(while_stmt->stmt));
+        }
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            return (struct AstNode *) NewForStmt(AstUtils_CloneExpr(for_stmt->init_expr), AstUtils_CloneExpr(for_stmt->cond_expr),
+                                                 AstUtils_CloneExpr(for_stmt->loop_expr), AstUtils_CloneStmt(for_stmt->stmt));
+        }
+        case AST_NULL_STMT: {
+            return NewNullStmt();
+        }
+        default: {
+            ReportInternalError("AstUtils::CloneStmt - unknown statement");
+        } return NULL;
+    }
+}
+
+// Replace reads of a variable by copies of another expression, in place
+struct Expr *AstUtils_SubstituteVar(struct Expr *expr, char *identifier, struct Expr *value) {
+    if (!expr) {
+        return NULL;
+    }
+    if (expr->type == EXPR_VAR && strcmp(expr->str_value, identifier) == 0) {
+        return AstUtils_CloneExpr(value);
+    }
+    for (int i = 0; i < expr->args.count; ++i) {
+        expr->args.data[i] = AstUtils_SubstituteVar((struct Expr *) List_Get(&expr->args, i), identifier, value);
+    }
+    expr->lhs = AstUtils_SubstituteVar(expr->lhs, identifier, value);
+    expr->rhs = AstUtils_SubstituteVar(expr->rhs, identifier, value);
+    return expr;
+}
+
+// Check whether an expression reads or writes the named variable
+bool AstUtils_ExprUsesVar(struct Expr *expr, char *identifier) {
+    if (!expr) {
+        return false;
+    }
+    if (expr->type == EXPR_VAR) {
+        return strcmp(expr->str_value, identifier) == 0;
+    }
+    for (int i = 0; i < expr->args.count; ++i) {
+        if (AstUtils_ExprUsesVar((struct Expr *) List_Get(&expr->args, i), identifier)) {
+            return true;
+        }
+    }
+    return AstUtils_ExprUsesVar(expr->lhs, identifier) || AstUtils_ExprUsesVar(expr->rhs, identifier);
+}
+
+// Visit every node of an expression tree, parents before children
+void AstUtils_WalkExpr(struct Expr *expr, ExprVisitor visitor, void *data) {
+    if (!expr) {
+        return;
+    }
+    visitor(expr, data);
+    for (int i = 0; i < expr->args.count; ++i) {
+        AstUtils_WalkExpr((struct Expr *) List_Get(&expr->args, i), visitor, data);
+    }
+    AstUtils_WalkExpr(expr->lhs, visitor, data);
+    AstUtils_WalkExpr(expr->rhs, visitor, data);
+}
+
+static void VisitSlot(struct Expr **slot, ExprSlotVisitor visitor, void *data) {
+    if (*slot) {
+        visitor(slot, data);
+    }
+}
+
+// Visit every top-level expression of a statement and the statements nested in it
+void AstUtils_WalkStmt(struct AstNode *stmt, ExprSlotVisitor visitor, void *data) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                AstUtils_WalkStmt((struct AstNode *) List_Get(body, i), visitor, data);
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                VisitSlot(&((struct Declarator *) List_Get(declarators, i))->value, visitor, data);
+            }
+        } break;
+        case AST_EXPRESSION_STMT:   { VisitSlot(&((struct ExpressionStmt *) stmt)->expr, visitor, data); } break;
+        case AST_RETURN_STMT:       { VisitSlot(&((struct ReturnStmt *) stmt)->expr, visitor, data); } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            VisitSlot(&if_stmt->condition, visitor, data);
+            AstUtils_WalkStmt(if_stmt->stmt, visitor, data);
+            AstUtils_WalkStmt(if_stmt->else_branch, visitor, data);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            VisitSlot(&while_stmt->condition, visitor, data);
+            AstUtils_WalkStmt(while_stmt->stmt, visitor, data);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            VisitSlot(&for_stmt->init_expr, visitor, data);
+            VisitSlot(&for_stmt->cond_expr, visitor, data);
+            VisitSlot(&for_stmt->loop_expr, visitor, data);
+            AstUtils_WalkStmt(for_stmt->stmt, visitor, data);
+        } break;
+        case AST_NULL_STMT: {
+        } break;
+        default: {
+            ReportInternalError("AstUtils::WalkStmt - unknown statement");
+        } break;
+    }
+}
+
+static void CountExpr(struct Expr *expr, void *data) {
+    (void) expr;
+    *(int *) data += 1;
+}
+
+static void CountSlot(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CountExpr, data);
+}
+
+static int CountStmts(struct AstNode *stmt) {
+    if (!stmt) {
+        return 0;
+    }
+
+    int count = 1;
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                count += CountStmts((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            count += CountStmts(if_stmt->stmt) + CountStmts(if_stmt->else_branch);
+        } break;
+        case AST_WHILE_STMT:    { count += CountStmts(((struct WhileStmt *) stmt)->stmt); } break;
+        case AST_FOR_STMT:      { count += CountStmts(((struct ForStmt *) stmt)->stmt); } break;
+        default: {
+        } break;
+    }
+    return count;
+}
+
+// Count the statement and expression nodes of all function bodies
+void AstUtils_CountNodes(struct TranslationUnit *t_unit, int *num_stmts, int *num_exprs) {
+    *num_stmts = 0;
+    *num_exprs = 0;
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        *num_stmts += CountStmts((struct AstNode *) function->body);
+        AstUtils_WalkStmt((struct AstNode *) function->body, CountSlot, num_exprs);
+    }
+}
+
+// Find the declarator of a variable in a function, or NULL if it is not declared
+struct Declarator *AstUtils_FindDeclarator(struct FunctionDef *function, char *identifier, enum PrimitiveType *type) {
+    struct List *var_decls = &function->var_decls;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        for (int j = 0; j < var_decl->declarators.count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(&var_decl->declarators, j);
+            if (strcmp(declarator->identifier, identifier) == 0) {
+                if (type) *type = var_decl->type;
+                return declarator;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Type of the value an address such as a + i * 4 points to, or PRIMTYPE_INVALID if it is not known
+enum PrimitiveType AstUtils_PointeeType(struct FunctionDef *function, struct Expr *address) {
+    switch (address->type) {
+        case EXPR_VAR: {
+            enum PrimitiveType type = PRIMTYPE_INVALID;
+            struct Declarator *declarator = AstUtils_FindDeclarator(function, address->str_value, &type);
+            if (!declarator) {
+                return PRIMTYPE_INVALID;
+            }
+            int indirection = declarator->array_dimensions + declarator->pointer_inderection;
+            if (indirection == 1) {
+                return type;
+            }
+            return indirection > 1 && declarator->pointer_inderection > 0 ? PRIMTYPE_PTR : PRIMTYPE_INVALID;
+        }
+        case EXPR_ADD: {
+            // The index side is an int and points to nothing
+            enum PrimitiveType type = AstUtils_PointeeType(function, address->lhs);
+            return type != PRIMTYPE_INVALID ? type : AstUtils_PointeeType(function, address->rhs);
+        }
+        case EXPR_SUB:  return AstUtils_PointeeType(function, address->lhs);
+        default:        return PRIMTYPE_INVALID;
+    }
+}
+
+static void AnnotateLoad(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_DEREF && expr->operand_type == PRIMTYPE_INVALID) {
+        expr->operand_type = AstUtils_PointeeType((struct FunctionDef *) data, expr->lhs);
+    }
+}
+
+static void VisitAnnotateLoads(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, AnnotateLoad, data);
+}
+
+// Record the width of every load, before later passes rewrite the addresses it goes through
+void AstUtils_AnnotateLoads(struct TranslationUnit *t_unit) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        AstUtils_WalkStmt((struct AstNode *) function->body, VisitAnnotateLoads, function);
+    }
+}
+
+// Declare a compiler generated local variable in a function
+struct Declarator *AstUtils_AddLocal(struct FunctionDef *function, char *identifier, enum PrimitiveType type, int pointer_inderection) {
+    struct VarDeclaration *var_declaration = NewVarDeclaration();
+    var_declaration->type = type;
+
+    struct Declarator *declarator = NewDeclarator();
+    strncpy(declarator->identifier, identifier, TOKEN_MAX_IDENTIFIER_LENGTH);
+    declarator->pointer_inderection = pointer_inderection;
+    List_Add(&var_declaration->declarators, declarator);
+
+    List_Add(&function->var_decls, var_declaration);
+    return declarator;
+}
@@ -0,0 +1,55 @@
+#ifndef BMS_AST_UTILS_H
+#define BMS_AST_UTILS_H
+
+#include "AstNode.h"
+#include <stdbool.h>
+
+// Called for every expression slot of a statement, the slot may be replaced
+typedef void (*ExprSlotVisitor)(struct Expr **slot, void *data);
+
+// Called for every node of an expression tree
+typedef void (*ExprVisitor)(struct Expr *expr, void *data);
+
+// Check that evaluating an expression has no side effects
+bool AstUtils_IsPure(struct Expr *expr);
+
+// Check whether an expression is a comparison (==, !=, <, >, <=, >=)
+bool AstUtils_IsRelational(struct Expr *expr);
+
+// Check whether two expressions have the same structure and operands
+bool AstUtils_ExprEquals(struct Expr *a, struct Expr *b);
+
+// Make a deep copy of an expression
+struct Expr *AstUtils_CloneExpr(struct Expr *expr);
+
+// Make a deep copy of a statement
+struct AstNode *AstUtils_CloneStmt(struct AstNode *stmt);
+
+// Replace reads of a variable by copies of another expression, in place
+struct Expr *AstUtils_SubstituteVar(struct Expr *expr, char *identifier, struct Expr *value);
+
+// Check whether an expression reads or writes the named variable
+bool AstUtils_ExprUsesVar(struct Expr *expr, char *identifier);
+
+// Visit every node of an expression tree, parents before children
+void AstUtils_WalkExpr(struct Expr *expr, ExprVisitor visitor, void *data);
+
+// Visit every top-level expression of a statement and the statements nested in it
+void AstUtils_WalkStmt(struct AstNode *stmt, ExprSlotVisitor visitor, void *data);
+
+// Count the statement and expression nodes of all function bodies
+void AstUtils_CountNodes(struct TranslationUnit *t_unit, int *num_stmts, int *num_exprs);
+
+// Find the declarator of a variable in a function, or NULL if it is not declared
+struct Declarator *AstUtils_FindDeclarator(struct FunctionDef *function, char *identifier, enum PrimitiveType *type);
+
+// Type of the value an address such as a + i * 4 points to, or PRIMTYPE_INVALID if it is not known
+enum PrimitiveType AstUtils_PointeeType(struct FunctionDef *function, struct Expr *address);
+
+// Record the width of every load, before later passes rewrite the addresses it goes through
+void AstUtils_AnnotateLoads(struct TranslationUnit *t_unit);
+
+// Declare a compiler generated local variable in a function
+struct Declarator *AstUtils_AddLocal(struct FunctionDef *function, char *identifier, enum PrimitiveType type, int pointer_inderection);
+
+#endif // BMS_AST_UTILS_H
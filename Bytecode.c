@@ -0,0 +1,110 @@
+#include "Bytecode.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <stdlib.h>
+#include <string.h>
+
+static char *opcode_names[BC_COUNT] = {
+    [BC_MOVI]    = "movi",
+    [BC_STR]     = "str",
+    [BC_MOV]     = "mov",
+    [BC_ADDR]    = "addr",
+    [BC_GETL8]   = "getl8",
+    [BC_GETL32]  = "getl32",
+    [BC_GETL64]  = "getl64",
+    [BC_SETL8]   = "setl8",
+    [BC_SETL32]  = "setl32",
+    [BC_SETL64]  = "setl64",
+    [BC_LOAD8]   = "load8",
+    [BC_LOAD32]  = "load32",
+    [BC_LOAD64]  = "load64",
+    [BC_STORE8]  = "store8",
+    [BC_STORE32] = "store32",
+    [BC_STORE64] = "store64",
+    [BC_ADD]     = "add",
+    [BC_SUB]     = "sub",
+    [BC_MUL]     = "mul",
+    [BC_DIV]     = "div",
+    [BC_ADDI]    = "addi",
+    [BC_NEG]     = "neg",
+    [BC_EQ]      = "eq",
+    [BC_NE]      = "ne",
+    [BC_LT]      = "lt",
+    [BC_GT]      = "gt",
+    [BC_LE]      = "le",
+    [BC_GE]      = "ge",
+    [BC_JMP]     = "jmp",
+    [BC_JZ]      = "jz",
+    [BC_JNZ]     = "jnz",
+    [BC_JEQ]     = "jeq",
+    [BC_JNE]     = "jne",
+    [BC_JLT]     = "jlt",
+    [BC_JGT]     = "jgt",
+    [BC_JLE]     = "jle",
+    [BC_JGE]     = "jge",
+    [BC_CALL]    = "call",
+    [BC_CALLX]   = "callx",
+    [BC_RET]     = "ret",
+};
+
+// Append an instruction and return its index
+int BytecodeFunction_Add(struct BytecodeFunction *function, enum BytecodeOpcode opcode, int a, int b, int c, int imm) {
+    if (a > 0xffff || b > 0xffff || c > 0xffff) {
+        ReportInternalError("Bytecode::BytecodeFunction_Add - too many registers in '%s'", function->name);
+    }
+    if (function->count == function->capacity) {
+        function->capacity = function->capacity == 0 ? 64 : function->capacity * 2;
+        function->code = (struct BytecodeInstruction *) Memory_Realloc(MEMORY_CODEGEN, function->code, sizeof(struct BytecodeInstruction) * function->capacity);
+        if (!function->code) {
+            exit(1);
+        }
+    }
+
+    struct BytecodeInstruction *instr = &function->code[function->count];
+    instr->opcode = (unsigned char) opcode;
+    instr->a = (unsigned short) a;
+    instr->b = (unsigned short) b;
+    instr->c = (unsigned short) c;
+    instr->imm = imm;
+    function->count += 1;
+    return function->count - 1;
+}
+
+char *Bytecode_OpcodeName(enum BytecodeOpcode opcode) {
+    return opcode_names[opcode];
+}
+
+// Write the instructions of every function in a readable form
+void BytecodeProgram_Print(FILE *file, struct BytecodeProgram *program) {
+    for (int i = 0; i < program->num_functions; ++i) {
+        struct BytecodeFunction *function = &program->functions[i];
+        fprintf(file, "%s: regs %d, locals %d\n", function->name, function->num_regs, function->locals_size);
+        for (int j = 0; j < function->count; ++j) {
+            struct BytecodeInstruction *instr = &function->code[j];
+            fprintf(file, "  %4d  %-8s r%d, r%d, r%d, %d\n", j, opcode_names[instr->opcode], instr->a, instr->b, instr->c, instr->imm);
+        }
+    }
+}
+
+void BytecodeProgram_Free(struct BytecodeProgram *program) {
+    for (int i = 0; i < program->num_functions; ++i) {
+        Memory_Free(MEMORY_CODEGEN, program->functions[i].name);
+        Memory_Free(MEMORY_CODEGEN, program->functions[i].code);
+        Memory_Free(MEMORY_CODEGEN, program->functions[i].params);
+    }
+    for (int i = 0; i < program->num_externs; ++i) {
+        Memory_Free(MEMORY_CODEGEN, program->externs[i]);
+    }
+    Memory_Free(MEMORY_CODEGEN, program->functions);
+    Memory_Free(MEMORY_CODEGEN, program->externs);
+    DataSection_Free(&program->data);
+    BytecodeProgram_Init(program);
+}
+
+void BytecodeProgram_Init(struct BytecodeProgram *program) {
+    program->functions = NULL;
+    program->num_functions = 0;
+    program->externs = NULL;
+    program->num_externs = 0;
+    DataSection_Init(&program->data);
+}
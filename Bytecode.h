@@ -0,0 +1,104 @@
+#ifndef BMS_BYTECODE_H
+#define BMS_BYTECODE_H
+
+#include "Instruction.h"
+#include <stdio.h>
+
+// Register machine instructions. Values are 64-bit; locals stay in the frame at the offsets StackFrame
+// assigned them, so pointers into the frame and into the data behave as in native code.
+enum BytecodeOpcode {
+    BC_MOVI,                        // r[a] = imm
+    BC_STR,                         // r[a] = address of data field imm
+    BC_MOV,                         // r[a] = r[b]
+    BC_ADDR,                        // r[a] = rbp - imm
+    BC_GETL8,                       // r[a] = local at rbp - imm, zero extended for char
+    BC_GETL32,                      // sign extended for int
+    BC_GETL64,
+    BC_SETL8,                       // local at rbp - imm = r[a], truncated to the width of the local
+    BC_SETL32,
+    BC_SETL64,
+    BC_LOAD8,                       // r[a] = *r[b]
+    BC_LOAD32,
+    BC_LOAD64,
+    BC_STORE8,                      // *r[a] = r[b]
+    BC_STORE32,
+    BC_STORE64,
+    BC_ADD,                         // r[a] = r[b] op r[c]
+    BC_SUB,
+    BC_MUL,
+    BC_DIV,
+    BC_ADDI,                        // r[a] = r[b] + imm
+    BC_NEG,                         // r[a] = -r[b]
+    BC_EQ,                          // r[a] = r[b] relation r[c], 0 or 1
+    BC_NE,
+    BC_LT,
+    BC_GT,
+    BC_LE,
+    BC_GE,
+    BC_JMP,                         // Continue at instruction imm
+    BC_JZ,                          // if r[a] == 0, continue at instruction imm
+    BC_JNZ,
+    BC_JEQ,                         // if r[a] relation r[b], continue at instruction imm
+    BC_JNE,
+    BC_JLT,
+    BC_JGT,
+    BC_JLE,
+    BC_JGE,
+    BC_CALL,                        // r[a] = function imm called with the c arguments in r[b] onwards
+    BC_CALLX,                       // r[a] = external function imm, such as printf, called the same way
+    BC_RET,                         // Return r[a]
+    BC_COUNT,
+};
+
+// A compact instruction, 12 bytes
+struct BytecodeInstruction {
+    unsigned char opcode;
+    unsigned short a;
+    unsigned short b;
+    unsigned short c;
+    int imm;
+};
+
+// Where the caller stores an argument: the parameter slot at rbp - rbp_offset, size bytes wide
+struct BytecodeParam {
+    int rbp_offset;
+    int size;
+};
+
+struct BytecodeFunction {
+    char *name;
+    int capacity;
+    int count;
+    struct BytecodeInstruction *code;
+    struct BytecodeParam *params;
+    int num_params;
+    int num_regs;
+    int locals_size;                // Bytes below rbp, a multiple of 16
+    int args_size;                  // Bytes above rbp, for the return address, saved rbp and stack arguments
+    long long num_calls;            // Times the interpreter entered the function
+};
+
+struct BytecodeProgram {
+    struct BytecodeFunction *functions;
+    int num_functions;
+    char **externs;                 // Names of the functions called but not defined, such as printf
+    int num_externs;
+    struct DataSection data;        // The strings, addressed by BC_STR
+};
+
+// Append an instruction and return its index
+int BytecodeFunction_Add(struct BytecodeFunction *function, enum BytecodeOpcode opcode, int a, int b, int c, int imm);
+
+// Name of an opcode (e.g. "addi")
+char *Bytecode_OpcodeName(enum BytecodeOpcode opcode);
+
+// Write the instructions of every function in a readable form
+void BytecodeProgram_Print(FILE *file, struct BytecodeProgram *program);
+
+// Free the program, its functions and its data
+void BytecodeProgram_Free(struct BytecodeProgram *program);
+
+// Initialize an empty program
+void BytecodeProgram_Init(struct BytecodeProgram *program);
+
+#endif // BMS_BYTECODE_H
@@ -0,0 +1,387 @@
+#include "BytecodeGenerator.h"
+#include "AstUtils.h"
+#include "ConstantFolding.h"
+#include "Memory.h"
+#include "Options.h"
+#include "Register.h"
+#include "ReportError.h"
+#include "StackFrame.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTECODE_MAX_EXTERN_ARGS 8      // Arguments the interpreter passes to an external function
+
+static void GenerateExpr(struct Expr *expr, int dst);
+static void GenerateStmt(struct AstNode *stmt);
+
+static struct FunctionDef *current_func;
+static struct TranslationUnit *current_t_unit;
+static struct BytecodeProgram *current_program;
+static struct BytecodeFunction *current_code;
+
+static int num_functions = 0;
+static int num_instructions = 0;
+
+// Branches for relational operators, taken when the relation holds or does not hold
+static enum BytecodeOpcode jumps_if_true[] = {
+    [EXPR_EQU] = BC_JEQ, [EXPR_NEQ] = BC_JNE, [EXPR_LT] = BC_JLT,
+    [EXPR_GT]  = BC_JGT, [EXPR_LTE] = BC_JLE, [EXPR_GTE] = BC_JGE,
+};
+static enum BytecodeOpcode jumps_if_false[] = {
+    [EXPR_EQU] = BC_JNE, [EXPR_NEQ] = BC_JEQ, [EXPR_LT] = BC_JGE,
+    [EXPR_GT]  = BC_JLE, [EXPR_LTE] = BC_JGT, [EXPR_GTE] = BC_JLT,
+};
+
+static enum BytecodeOpcode operators[] = {
+    [EXPR_ADD] = BC_ADD, [EXPR_SUB] = BC_SUB, [EXPR_MUL] = BC_MUL, [EXPR_DIV] = BC_DIV,
+    [EXPR_EQU] = BC_EQ,  [EXPR_NEQ] = BC_NE,  [EXPR_LT]  = BC_LT,
+    [EXPR_GT]  = BC_GT,  [EXPR_LTE] = BC_LE,  [EXPR_GTE] = BC_GE,
+};
+
+static int Align(int n, int offset) {
+    return (n + offset - 1) / offset * offset;
+}
+
+// Offset of the 8, 32 or 64-bit form of a load or store opcode, by the type of the value
+static int WidthIndex(enum PrimitiveType type) {
+    switch (type) {
+        case PRIMTYPE_CHAR: return 0;
+        case PRIMTYPE_INT:  return 1;
+        default:            return 2;
+    }
+}
+
+static int Emit(enum BytecodeOpcode opcode, int a, int b, int c, int imm) {
+    int reg = a > b ? a : b;
+    reg = reg > c ? reg : c;
+    if (reg + 1 > current_code->num_regs) {
+        current_code->num_regs = reg + 1;
+    }
+    return BytecodeFunction_Add(current_code, opcode, a, b, c, imm);
+}
+
+// Index of the next instruction, the target of jumps emitted before it is known
+static int Here() {
+    return current_code->count;
+}
+
+static void PatchJump(int jump, int target) {
+    current_code->code[jump].imm = target;
+}
+
+// Index of a function defined in the translation unit, or -1
+static int FindFunction(char *identifier) {
+    struct List *functions = &current_t_unit->functions;
+    for (int i = 0; i < functions->count; ++i) {
+        if (strcmp(((struct FunctionDef *) List_Get(functions, i))->identifier, identifier) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Index of an external function, added on its first call
+static int FindExtern(char *identifier) {
+    for (int i = 0; i < current_program->num_externs; ++i) {
+        if (strcmp(current_program->externs[i], identifier) == 0) {
+            return i;
+        }
+    }
+    int count = current_program->num_externs;
+    current_program->externs = (char **) Memory_Realloc(MEMORY_CODEGEN, current_program->externs, sizeof(char *) * (count + 1));
+    current_program->externs[count] = (char *) Memory_Alloc(MEMORY_CODEGEN, strlen(identifier) + 1);
+    strcpy(current_program->externs[count], identifier);
+    current_program->num_externs += 1;
+    return count;
+}
+
+static struct Declarator *FindVar(char *identifier, enum PrimitiveType *type) {
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, identifier, type);
+    if (!declarator) {
+        ReportInternalError("BytecodeGenerator::FindVar - undeclared variable '%s'", identifier);
+    }
+    if (declarator->pointer_inderection > 0) {
+        *type = PRIMTYPE_PTR;
+    }
+    return declarator;
+}
+
+// Generate code for an assignment, leaving the assigned value in dst
+static void GenerateAssign(struct Expr *expr, int dst) {
+    struct Expr *target = expr->lhs;
+    enum PrimitiveType type = target->operand_type;
+    if (type == PRIMTYPE_INVALID) {
+        ReportInternalError("BytecodeGenerator::GenerateAssign - missing operand type");
+    }
+
+    if (target->type == EXPR_VAR) {
+        enum PrimitiveType var_type;
+        struct Declarator *declarator = FindVar(target->str_value, &var_type);
+        if (declarator->array_dimensions > 0) {
+            ReportInternalError("BytecodeGenerator::GenerateAssign - assignment to an array");
+        }
+        GenerateExpr(expr->rhs, dst);
+        Emit(BC_SETL8 + WidthIndex(type), dst, 0, 0, declarator->rbp_offset);
+        return;
+    }
+    if (target->type != EXPR_DEREF) {
+        ReportInternalError("BytecodeGenerator::GenerateAssign - assignment to a value");
+    }
+
+    GenerateExpr(target->lhs, dst);
+    GenerateExpr(expr->rhs, dst + 1);
+    Emit(BC_STORE8 + WidthIndex(type), dst, dst + 1, 0, 0);
+    Emit(BC_MOV, dst, dst + 1, 0, 0);
+}
+
+// Generate code for a call, with the arguments in dst onwards and the result in dst
+static void GenerateCall(struct Expr *expr, int dst) {
+    struct List *args = &expr->args;
+    for (int i = 0; i < args->count; ++i) {
+        GenerateExpr((struct Expr *) List_Get(args, i), dst + i);
+    }
+
+    int function = FindFunction(expr->str_value);
+    if (function >= 0) {
+        Emit(BC_CALL, dst, dst, args->count, function);
+        return;
+    }
+    if (args->count > BYTECODE_MAX_EXTERN_ARGS) {
+        ReportInternalError("BytecodeGenerator::GenerateCall - too many arguments to '%s'", expr->str_value);
+    }
+    Emit(BC_CALLX, dst, dst, args->count, FindExtern(expr->str_value));
+}
+
+// Generate code for an expression, leaving its value in register dst and using the registers above it
+static void GenerateExpr(struct Expr *expr, int dst) {
+    switch (expr->type) {
+        case EXPR_NUM: {
+            Emit(BC_MOVI, dst, 0, 0, expr->int_value);
+        } break;
+        case EXPR_STR: {
+            struct List *data_fields = &current_t_unit->data_fields;
+            for (int i = 0; i < data_fields->count; ++i) {
+                if (strcmp(expr->str_value, ((struct Expr *) List_Get(data_fields, i))->str_value) == 0) {
+                    Emit(BC_STR, dst, 0, 0, i);
+                    break;
+                }
+            }
+        } break;
+        case EXPR_VAR: {
+            enum PrimitiveType type;
+            struct Declarator *declarator = FindVar(expr->str_value, &type);
+            if (declarator->array_dimensions > 0) {
+                Emit(BC_ADDR, dst, 0, 0, declarator->rbp_offset);
+            } else {
+                Emit(BC_GETL8 + WidthIndex(type), dst, 0, 0, declarator->rbp_offset);
+            }
+        } break;
+        case EXPR_ADDR: {
+            if (expr->lhs->type == EXPR_VAR) {
+                enum PrimitiveType type;
+                Emit(BC_ADDR, dst, 0, 0, FindVar(expr->lhs->str_value, &type)->rbp_offset);
+            } else if (expr->lhs->type == EXPR_DEREF) {
+                GenerateExpr(expr->lhs->lhs, dst);
+            } else {
+                ReportInternalError("BytecodeGenerator::GenerateExpr - address of a value");
+            }
+        } break;
+        case EXPR_DEREF: {
+            // Loads of unknown width read the whole register, as pointers do
+            GenerateExpr(expr->lhs, dst);
+            Emit(BC_LOAD8 + WidthIndex(expr->operand_type != PRIMTYPE_INVALID ? expr->operand_type : PRIMTYPE_PTR), dst, dst, 0, 0);
+        } break;
+        case EXPR_PLUS: {
+            GenerateExpr(expr->lhs, dst);
+        } break;
+        case EXPR_NEG: {
+            GenerateExpr(expr->lhs, dst);
+            Emit(BC_NEG, dst, dst, 0, 0);
+        } break;
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_MUL:
+        case EXPR_DIV:
+        case EXPR_EQU:
+        case EXPR_NEQ:
+        case EXPR_LT:
+        case EXPR_GT:
+        case EXPR_LTE:
+        case EXPR_GTE: {
+            GenerateExpr(expr->lhs, dst);
+            bool is_offset = (expr->type == EXPR_ADD || expr->type == EXPR_SUB) && expr->rhs->type == EXPR_NUM &&
+                             expr->rhs->int_value != INT_MIN;
+            if (is_offset) {
+                Emit(BC_ADDI, dst, dst, 0, expr->type == EXPR_ADD ? expr->rhs->int_value : -expr->rhs->int_value);
+                break;
+            }
+            GenerateExpr(expr->rhs, dst + 1);
+            Emit(operators[expr->type], dst, dst, dst + 1, 0);
+        } break;
+        case EXPR_ASSIGN: {
+            GenerateAssign(expr, dst);
+        } break;
+        case EXPR_FUNC_CALL: {
+            GenerateCall(expr, dst);
+        } break;
+        default: {
+            ReportInternalError("BytecodeGenerator::GenerateExpr - not implemented");
+        } break;
+    }
+}
+
+// Emit a branch taken when the condition evaluates to jump_if and return it for patching, or -1 if
+// it is never taken
+static int GenerateCondJump(struct Expr *cond, bool jump_if) {
+    if (!cond) {
+        return jump_if ? Emit(BC_JMP, 0, 0, 0, -1) : -1;
+    }
+    if (cond->type == EXPR_NUM) {
+        return (cond->int_value != 0) == jump_if ? Emit(BC_JMP, 0, 0, 0, -1) : -1;
+    }
+    if (AstUtils_IsRelational(cond)) {
+        GenerateExpr(cond->lhs, 0);
+        GenerateExpr(cond->rhs, 1);
+        return Emit(jump_if ? jumps_if_true[cond->type] : jumps_if_false[cond->type], 0, 1, 0, -1);
+    }
+    GenerateExpr(cond, 0);
+    return Emit(jump_if ? BC_JNZ : BC_JZ, 0, 0, 0, -1);
+}
+
+// Generate a loop with its condition at the bottom, entered through a jump to the condition
+static void GenerateLoop(struct Expr *cond, struct AstNode *body, struct Expr *loop_expr) {
+    int entry = Emit(BC_JMP, 0, 0, 0, -1);
+    int start = Here();
+    GenerateStmt(body);
+    if (loop_expr) {
+        GenerateExpr(loop_expr, 0);
+    }
+    PatchJump(entry, Here());
+    int repeat = GenerateCondJump(cond, true);
+    if (repeat >= 0) {
+        PatchJump(repeat, start);
+    }
+}
+
+static void GenerateStmt(struct AstNode *stmt) {
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                GenerateStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                struct Declarator *declarator = (struct Declarator *) List_Get(declarators, i);
+                if (declarator->value) {
+                    GenerateExpr(declarator->value, 0);
+                }
+            }
+        } break;
+        case AST_EXPRESSION_STMT: {
+            GenerateExpr(((struct ExpressionStmt *) stmt)->expr, 0);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            if (for_stmt->init_expr) {
+                GenerateExpr(for_stmt->init_expr, 0);
+            }
+            GenerateLoop(for_stmt->cond_expr, for_stmt->stmt, for_stmt->loop_expr);
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            int skip = GenerateCondJump(if_stmt->condition, false);
+            GenerateStmt(if_stmt->stmt);
+            if (if_stmt->else_branch) {
+                int end = Emit(BC_JMP, 0, 0, 0, -1);
+                if (skip >= 0) PatchJump(skip, Here());
+                GenerateStmt(if_stmt->else_branch);
+                PatchJump(end, Here());
+            } else if (skip >= 0) {
+                PatchJump(skip, Here());
+            }
+        } break;
+        case AST_NULL_STMT: {
+        } break;
+        case AST_RETURN_STMT: {
+            struct Expr *expr = ((struct ReturnStmt *) stmt)->expr;
+            if (expr) {
+                GenerateExpr(expr, 0);
+            } else {
+                Emit(BC_MOVI, 0, 0, 0, 0);
+            }
+            Emit(BC_RET, 0, 0, 0, 0);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            GenerateLoop(while_stmt->condition, while_stmt->stmt, NULL);
+        } break;
+        default: {
+            ReportInternalError("BytecodeGenerator::GenerateStmt - unknown statement");
+        } break;
+    }
+}
+
+static void GenerateFunctionDef(struct FunctionDef *function, struct BytecodeFunction *code) {
+    current_func = function;
+    current_code = code;
+
+    int frame_size = StackFrame_Layout(function, options.share_stack_slots);
+    code->name = (char *) Memory_Alloc(MEMORY_CODEGEN, strlen(function->identifier) + 1);
+    strcpy(code->name, function->identifier);
+    code->locals_size = Align(frame_size, 16);
+    code->num_params = function->num_params;
+    code->args_size = StackFrame_ArgsSize(function);
+    code->params = NEW_ARRAY(MEMORY_CODEGEN, struct BytecodeParam, function->num_params);
+    for (int i = 0; i < function->num_params; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(&function->var_decls, i);
+        struct Declarator *declarator = (struct Declarator *) List_Get(&var_decl->declarators, 0);
+        code->params[i].rbp_offset = declarator->rbp_offset;
+        code->params[i].size = declarator->pointer_inderection > 0 ? 8 : bytes[var_decl->type];
+    }
+
+    GenerateStmt((struct AstNode *) function->body);
+    Emit(BC_MOVI, 0, 0, 0, 0);
+    Emit(BC_RET, 0, 0, 0, 0);
+
+    num_functions += 1;
+    num_instructions += code->count;
+    current_code = NULL;
+    current_func = NULL;
+}
+
+// Lower the AST to register bytecode for the interpreter
+void BytecodeGenerator_GenerateCode(struct BytecodeProgram *program, struct TranslationUnit *t_unit) {
+    // Only the cheap passes, the point of this backend is starting fast
+    AstUtils_AnnotateLoads(t_unit);
+    ConstantFolding_Run(t_unit);
+
+    current_program = program;
+    current_t_unit = t_unit;
+
+    struct List *data_fields = &t_unit->data_fields;
+    for (int i = 0; i < data_fields->count; ++i) {
+        char label[32];
+        snprintf(label, sizeof(label), "fmt_%d", i);
+        DataSection_AddString(&program->data, label, ((struct Expr *) List_Get(data_fields, i))->str_value);
+    }
+
+    program->num_functions = t_unit->functions.count;
+    program->functions = NEW_ARRAY(MEMORY_CODEGEN, struct BytecodeFunction, program->num_functions);
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        GenerateFunctionDef((struct FunctionDef *) List_Get(&t_unit->functions, i), &program->functions[i]);
+    }
+
+    current_t_unit = NULL;
+    current_program = NULL;
+}
+
+// Print how many functions and instructions were generated
+void BytecodeGenerator_PrintStats(FILE *file) {
+    fprintf(file, "bytecode:\n");
+    fprintf(file, "  %-20s %d\n", "functions", num_functions);
+    fprintf(file, "  %-20s %d\n", "instructions", num_instructions);
+}
@@ -0,0 +1,15 @@
+#ifndef BMS_BYTECODE_GENERATOR_H
+#define BMS_BYTECODE_GENERATOR_H
+
+#include "AstNode.h"
+#include "Bytecode.h"
+#include <stdio.h>
+
+// Lower the AST to register bytecode for the interpreter, a backend that starts much faster than
+// generating native code for programs that run only once
+void BytecodeGenerator_GenerateCode(struct BytecodeProgram *program, struct TranslationUnit *t_unit);
+
+// Print how many functions and instructions were generated
+void BytecodeGenerator_PrintStats(FILE *file);
+
+#endif // BMS_BYTECODE_GENERATOR_H
@@ -1,14 +1,30 @@
 #include "CodeGeneratorX86.h"
 #include "Assembly.h"
+#include "AstUtils.h"
+#include "InstructionSelector.h"
+#include "Jit.h"
+#include "Memory.h"
+#include "Options.h"
+#include "PassManager.h"
+#include "Peephole.h"
 #include "Register.h"
 #include "ReportError.h"
+#include "StackFrame.h"
+#include "ThreadPool.h"
+#include "Vectorizer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define LABEL_SIZE (TOKEN_MAX_IDENTIFIER_LENGTH + 24)  // Kind, number and function of a label
+#define FUNCTION_BATCH_SIZE 256  // Functions generated in parallel before their output is written
+
 // Static function declarations
+static void GenerateCondJump(struct Expr *cond, bool jump_if, char *label);
 static void GenerateExpr(struct Expr *expr);
+static void ReduceReg(struct Selection *selection);
 static void GenerateCompoundStmt(struct CompoundStmt *compound_stmt);
+static int GenerateArgs(struct Expr *call);
 static void GenerateDecl(struct AstNode *decl);
 static void GenerateStmt(struct AstNode *stmt);
 static void GenerateFunctionDef(struct FunctionDef *function);
@@ -20,250 +36,749 @@ static void GenerateReturnStmt(struct ReturnStmt *return_stmt);
 static void GenerateWhileStmt(struct WhileStmt *while_stmt);
 static void GenerateVarDeclaration(struct VarDeclaration *var_declaration);
 
-// Global variables
-static struct FunctionDef *current_func;
+// Functions generated in parallel, each into its own output
+struct FunctionBatch {
+    struct List *functions;
+    int first;                      // Index of the first function of the batch in functions
+    struct FunctionOutput *outputs;
+};
+
+// Registers holding the arrays and pointers of a vectorized loop, the counter lives in rcx
+static enum Reg vector_base_regs[VECTORIZER_MAX_BASES] = { REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11 };
+
+// Registers holding the value of one operand while the other is computed
+static enum Reg temp_regs[] = { REG_R8, REG_R9, REG_R10, REG_R11 };
+
+// Global variables, one set per thread generating functions. The translation unit is shared and
+// only read while functions are generated.
+static _Thread_local int num_live_temps;
+static _Thread_local int stack_depth;   // Bytes pushed since the prologue, which calls must keep 16 byte aligned
+static _Thread_local int num_labels;    // Labels of the current function so far
+static _Thread_local struct FunctionDef *current_func;
+static _Thread_local bool tail_calls;   // Returned calls may reuse the frame, off when pointers into it may exist
 static struct TranslationUnit *current_t_unit;
-static FILE *f;
 
 // Align a number to the nearest multiple of offset
 static int Align(int n, int offset) {
     return (n + offset - 1) / offset * offset;
 }
 
-// Generate a new unique label ID
+// Generate a new label ID, unique within the current function
 static int MakeNewLabelId() {
-    static int num_labels = 0;
     int label_id = num_labels;
     num_labels += 1;
     return label_id;
 }
 
-// Find a declarator by identifier
-static struct Declarator *FindDeclarator(struct List *var_declarations, char *identifier) {
-    for (int i = 0; i < var_declarations->count; ++i) {
-        struct VarDeclaration *var_declaration = (struct VarDeclaration *) List_Get(var_declarations, i);
-        struct List *declarators = &var_declaration->declarators;
-        for (int j = 0; j < declarators->count; ++j) {
-            struct Declarator *declarator = (struct Declarator *) List_Get(declarators, j);
-            if (strcmp(declarator->identifier, identifier) == 0) {
-                return declarator;
-            }
+// Name a label of the current function, such as forstart2.main. IDs restart in every function, so
+// functions generated on different threads still get distinct labels.
+static void MakeLabel(char *label, char *kind, int label_id) {
+    snprintf(label, LABEL_SIZE, "%s%d.%s", kind, label_id, current_func->identifier);
+}
+
+// A general purpose register accessed with all 64 bits
+static struct Operand Reg64(enum Reg reg) {
+    return Operand_Reg(reg, 8);
+}
+
+// Memory operand of a selected address, such as [rbp + rax*4 - 56]
+static struct Operand MakeAddress(struct SelectAddress *address, enum Reg base_reg, enum Reg index_reg) {
+    enum Reg base = address->frame ? REG_RBP : base_reg;
+    if (address->index) {
+        return Operand_MemIndex(base, index_reg, address->scale, address->disp, 0);
+    }
+    return Operand_Mem(base, address->disp, 0);
+}
+
+// Load a leaf into any register: a constant, a local or the address of a local
+static void GenerateLeaf(struct Selection *leaf, enum Reg reg) {
+    switch (leaf->rule[SELECT_REG]) {
+        case RULE_REG_IMM: { MovImm(Reg64(reg), leaf->expr->int_value); } break;
+        case RULE_REG_MEM: { Load(Reg64(reg), MakeAddress(&leaf->mem, REG_NONE, REG_NONE), leaf->mem_type); } break;
+        case RULE_REG_LEA: { LeaMem(Reg64(reg), MakeAddress(&leaf->addr, REG_NONE, REG_NONE)); } break;
+        default: { ReportInternalError("CodeGeneratorX86::GenerateLeaf - not a leaf"); } break;
+    }
+}
+
+// Take a spare register to hold a value while selection is computed, or REG_NONE if it must go on the stack
+static enum Reg AcquireTemp(struct Selection *selection) {
+    int count = (int) (sizeof(temp_regs) / sizeof(temp_regs[0]));
+    if (selection->has_call || num_live_temps == count) {
+        return REG_NONE;
+    }
+    num_live_temps += 1;
+    return temp_regs[num_live_temps - 1];
+}
+
+static void ReleaseTemp(enum Reg temp) {
+    if (temp != REG_NONE) {
+        num_live_temps -= 1;
+    }
+}
+
+// Push a value that no spare register can hold
+static void Spill(enum Reg reg) {
+    Push(Reg64(reg));
+    stack_depth += 8;
+}
+
+static void Reload(enum Reg reg) {
+    Pop(Reg64(reg));
+    stack_depth -= 8;
+}
+
+// Evaluate two operands that both need registers. As in Sethi-Ullman numbering, the one needing
+// more registers goes first when neither has side effects, otherwise rhs goes first. The first value
+// waits in a spare register, or on the stack when the second makes a call. lhs ends in RAX when
+// lhs_in_rax is set.
+static void ReducePair(struct Selection *lhs_selection, struct Selection *rhs_selection, bool lhs_in_rax, struct Operand *lhs, struct Operand *rhs) {
+    bool lhs_first = lhs_selection->is_pure && rhs_selection->is_pure && lhs_selection->need > rhs_selection->need;
+    struct Selection *first = lhs_first ? lhs_selection : rhs_selection;
+    struct Selection *second = lhs_first ? rhs_selection : lhs_selection;
+
+    ReduceReg(first);
+    enum Reg temp = AcquireTemp(second);
+    if (temp != REG_NONE) {
+        Mov(Reg64(temp), Reg64(REG_RAX));
+    } else {
+        Spill(REG_RAX);
+    }
+    ReduceReg(second);
+    ReleaseTemp(temp);
+
+    *lhs = Reg64(REG_RAX);
+    *rhs = Reg64(REG_RDI);
+    if (!lhs_first) {
+        if (temp != REG_NONE) {
+            *rhs = Reg64(temp);
+        } else {
+            Reload(REG_RDI);
         }
+    } else if (temp == REG_NONE) {
+        Mov(Reg64(REG_RDI), Reg64(REG_RAX));
+        Reload(REG_RAX);
+    } else if (lhs_in_rax) {
+        Mov(Reg64(REG_RDI), Reg64(REG_RAX));
+        Mov(Reg64(REG_RAX), Reg64(temp));
+    } else {
+        *lhs = Reg64(temp);
+        *rhs = Reg64(REG_RAX);
     }
-    return NULL;
 }
 
-// Find a variable declaration by identifier
-static struct VarDeclaration *FindVarDeclaration(struct List *var_declarations, char *identifier) {
-    for (int i = 0; i < var_declarations->count; ++i) {
-        struct VarDeclaration *var_declaration = (struct VarDeclaration *) List_Get(var_declarations, i);
-        struct List *declarators = &var_declaration->declarators;
-        for (int j = 0; j < declarators->count; ++j) {
-            struct Declarator *declarator = (struct Declarator *) List_Get(declarators, j);
-            if (strcmp(declarator->identifier, identifier) == 0) {
-                return var_declaration;
-            }
+// Compute the registers of a selected address and return it as an operand. Leaves go into dest and
+// rsi, anything else is computed in rax and rdi.
+static struct Operand ReduceAddress(struct SelectAddress *address, enum Reg dest) {
+    struct Selection *base = address->base;
+    struct Selection *index = address->index;
+    if (base && index) {
+        if (base->is_leaf && index->is_leaf) {
+            GenerateLeaf(base, dest);
+            GenerateLeaf(index, REG_RSI);
+            return MakeAddress(address, dest, REG_RSI);
+        }
+        if (dest != REG_RAX) {
+            ReportInternalError("CodeGeneratorX86::ReduceAddress - computed address outside rax");
+        }
+        if (index->is_leaf) {
+            ReduceReg(base);
+            GenerateLeaf(index, REG_RDI);
+            return MakeAddress(address, REG_RAX, REG_RDI);
+        }
+        if (base->is_leaf) {
+            ReduceReg(index);
+            GenerateLeaf(base, REG_RDI);
+            return MakeAddress(address, REG_RDI, REG_RAX);
         }
+        struct Operand base_reg, index_reg;
+        ReducePair(base, index, false, &base_reg, &index_reg);
+        return MakeAddress(address, base_reg.reg, index_reg.reg);
     }
-    return NULL;
+
+    struct Selection *reg = base ? base : index;
+    if (reg && reg->is_leaf) {
+        GenerateLeaf(reg, dest);
+    } else if (reg) {
+        if (dest != REG_RAX) {
+            ReportInternalError("CodeGeneratorX86::ReduceAddress - computed address outside rax");
+        }
+        ReduceReg(reg);
+    }
+    return MakeAddress(address, dest, dest);
 }
 
-// Check if a declarator is an array
-static bool IsArray(struct Declarator *decl) {
-    return decl->array_dimensions > 0;
+// Load a constant, a memory operand or an address into reg. Unless reg is rax the expression must be
+// simple, and rax is left untouched.
+static void GenerateSimple(struct Selection *simple, enum Reg reg) {
+    if (simple->is_leaf) {
+        GenerateLeaf(simple, reg);
+    } else if (simple->rule[SELECT_REG] == RULE_REG_MEM) {
+        Load(Reg64(reg), ReduceAddress(&simple->mem, reg), simple->mem_type);
+    } else {
+        LeaMem(Reg64(reg), ReduceAddress(&simple->addr, reg));
+    }
 }
 
-// Check if a declarator is a pointer
-static bool IsPointer(struct Declarator *decl) {
-    return decl->pointer_inderection > 0;
+// Leave the address of a reduced memory operand in RAX, unless it is already [rax]
+static void LeaAddress(struct Operand address) {
+    struct Operand in_rax = Operand_Mem(REG_RAX, 0, 0);
+    if (!Operand_Equals(&address, &in_rax)) {
+        LeaMem(Reg64(REG_RAX), address);
+    }
 }
 
 // Load the address of an expression into RAX
 static void LoadAddress(struct Expr *expr) {
-    if (expr->type == EXPR_VAR) {
-        struct List *var_decls = &current_func->var_decls;
-        struct Declarator *declarator = FindDeclarator(var_decls, expr->str_value);
-        if (!declarator) {
-            ReportInternalError("variable address of '%s'", declarator->identifier);
-        }
-        Lea(RAX, declarator->rbp_offset);
-        return;
+    struct Selection *selection = InstructionSelector_Label(current_func, expr);
+    if (selection->rule[SELECT_MEM] == RULE_NONE) {
+        ReportInternalError("CodeGeneratorX86::LoadAddress - not an lvalue");
     }
 
-    if (expr->type == EXPR_DEREF) {
-        GenerateExpr(expr->lhs);
-        return;
-    }
+    LeaAddress(ReduceAddress(&selection->mem, REG_RAX));
+    InstructionSelector_Free(selection);
 }
 
-// Generate code for an expression
-static void GenerateExpr(struct Expr *expr) {
-    switch (expr->type) {
-        case EXPR_NUM: {
-            MovImm(RAX, expr->int_value);
-        } return;
-        case EXPR_STR: {
-            struct List *data_fields = &current_t_unit->data_fields;
-            for (int i = 0; i < data_fields->count; ++i) {
-                struct Expr *data_field = (struct Expr *) List_Get(data_fields, i);
-                if (strcmp(expr->str_value, data_field->str_value) == 0) {
-                    fprintf(f, "  mov rax, fmt_%d\n", data_field->id);
+// Move the argument values held in registers to their argument registers, as if all moves happened at
+// once. Only r8 and r9 both hold values and receive them, so a cycle is broken through r11.
+static void MoveArgs(enum Reg *held, int count) {
+    bool moved[NUM_ARG_REGS] = { false };
+    int remaining = 0;
+    for (int i = 0; i < count; ++i) {
+        moved[i] = held[i] == REG_NONE;
+        remaining += held[i] != REG_NONE ? 1 : 0;
+    }
+
+    while (remaining > 0) {
+        bool progress = false;
+        for (int i = 0; i < count; ++i) {
+            if (moved[i]) {
+                continue;
+            }
+            enum Reg dest = ArgReg(i, PRIMTYPE_PTR).reg;
+            bool blocked = false;
+            for (int j = 0; j < count; ++j) {
+                blocked = blocked || (j != i && !moved[j] && held[j] == dest);
+            }
+            if (!blocked) {
+                if (held[i] != dest) Mov(Reg64(dest), Reg64(held[i]));
+                moved[i] = true;
+                remaining -= 1;
+                progress = true;
+            }
+        }
+        if (!progress) {
+            for (int i = 0; i < count; ++i) {
+                if (!moved[i]) {
+                    Mov(Reg64(REG_R11), Reg64(held[i]));
+                    held[i] = REG_R11;
                     break;
                 }
             }
-        } return;
-        case EXPR_VAR: {
-            LoadAddress(expr);
-            struct List *var_decls = &current_func->var_decls;
-            struct Declarator *declarator = FindDeclarator(var_decls, expr->str_value);
-            if (!IsArray(declarator)) {
-                struct VarDeclaration *var_decl = FindVarDeclaration(var_decls, expr->str_value);
-                if (IsPointer(declarator)) {
-                    LoadMem(PRIMTYPE_PTR);
-                } else {
-                    LoadMem(var_decl->type);
-                }
+        }
+    }
+}
+
+// Evaluate the arguments of a call as the System V ABI passes them: the first six in rdi, rsi, rdx, rcx,
+// r8 and r9, and the rest pushed right to left. Arguments that make calls are computed first, then the
+// other computed ones, each waiting in a spare register, and constants and locals are loaded last
+// straight into their registers. Returns the bytes to release from the stack after the call.
+static int GenerateArgs(struct Expr *call) {
+    struct List *args = &call->args;
+    int num_reg_args = args->count < NUM_ARG_REGS ? args->count : NUM_ARG_REGS;
+    int stack_bytes = (args->count - num_reg_args) * 8;
+
+    // rsp must be 16 byte aligned at the call once the stack arguments are pushed
+    int padding = (stack_depth + stack_bytes) % 16;
+    if (padding > 0) {
+        Sub(Reg64(REG_RSP), Operand_Imm(8));
+        stack_depth += padding;
+    }
+    for (int i = args->count - 1; i >= num_reg_args; --i) {
+        GenerateExpr((struct Expr *) List_Get(args, i));
+        Spill(REG_RAX);
+    }
+
+    struct Selection *selections[NUM_ARG_REGS];
+    int order[NUM_ARG_REGS];
+    int num_computed = 0;
+    for (int i = 0; i < num_reg_args; ++i) {
+        selections[i] = InstructionSelector_Label(current_func, (struct Expr *) List_Get(args, i));
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < num_reg_args; ++i) {
+            if (!selections[i]->is_leaf && selections[i]->has_call == (pass == 0)) {
+                order[num_computed++] = i;
             }
-        } return;
+        }
     }
 
-    if (expr->type == EXPR_FUNC_CALL) {
-        struct List *args = &expr->args;
-        for (int i = 0; i < args->count; ++i) {
-            struct Expr *arg = (struct Expr *) List_Get(args, i);
-            GenerateExpr(arg);
-            Push(RAX);
+    enum Reg held[NUM_ARG_REGS], temps[NUM_ARG_REGS];
+    bool spilled[NUM_ARG_REGS] = { false };
+    for (int i = 0; i < NUM_ARG_REGS; ++i) {
+        held[i] = REG_NONE;
+        temps[i] = REG_NONE;
+    }
+    for (int i = 0; i < num_computed; ++i) {
+        int arg = order[i];
+        ReduceReg(selections[arg]);
+        if (i == num_computed - 1) {
+            held[arg] = REG_RAX;
+        } else if ((temps[arg] = AcquireTemp(selections[order[i + 1]])) != REG_NONE) {
+            Mov(Reg64(temps[arg]), Reg64(REG_RAX));
+            held[arg] = temps[arg];
+        } else {
+            Spill(REG_RAX);
+            spilled[arg] = true;
+        }
+    }
+
+    MoveArgs(held, num_reg_args);
+    for (int i = num_computed - 1; i >= 0; --i) {
+        int arg = order[i];
+        ReleaseTemp(temps[arg]);
+        if (spilled[arg]) Reload(ArgReg(arg, PRIMTYPE_PTR).reg);
+    }
+    for (int i = 0; i < num_reg_args; ++i) {
+        if (selections[i]->is_leaf) {
+            GenerateLeaf(selections[i], ArgReg(i, PRIMTYPE_PTR).reg);
         }
+        InstructionSelector_Free(selections[i]);
+    }
+    return stack_bytes + padding;
+}
 
-        for (int i = args->count - 1; i >= 0; --i) {
-            char **param_reg = param_regs[i];
-            Pop(param_reg[PRIMTYPE_PTR]);
+// Check whether a function is defined outside the translation unit, such as printf
+static bool IsExternal(char *identifier) {
+    struct List *functions = &current_t_unit->functions;
+    for (int i = 0; i < functions->count; ++i) {
+        if (strcmp(((struct FunctionDef *) List_Get(functions, i))->identifier, identifier) == 0) {
+            return false;
         }
+    }
+    return true;
+}
 
-        Call(expr->str_value);
+// Evaluate the operands of a binary operator as selected. lhs goes into RAX, and rhs into another
+// register, an immediate or a memory operand. Unless lhs_in_rax is set, lhs may be left in another
+// register and rhs in RAX instead.
+static void ReduceOperands(struct Selection *selection, bool lhs_in_rax, struct Operand *lhs, struct Operand *rhs) {
+    struct Selection *lhs_selection = selection->lhs;
+    struct Selection *rhs_selection = selection->rhs;
+    *lhs = Reg64(REG_RAX);
+    *rhs = Reg64(REG_RDI);
+    switch (selection->rule[SELECT_REG]) {
+        case RULE_REG_OP_IMM: {
+            ReduceReg(lhs_selection);
+            *rhs = Operand_Imm(rhs_selection->expr->int_value);
+        } break;
+        case RULE_REG_OP_MEM: {
+            // Compares of ints read the int in memory against the low half of rax
+            ReduceReg(lhs_selection);
+            bool is_int = rhs_selection->mem_type == PRIMTYPE_INT;
+            *rhs = ReduceAddress(&rhs_selection->mem, REG_RDI);
+            rhs->size = is_int ? 4 : 8;
+            *lhs = Operand_Reg(REG_RAX, is_int ? 4 : 8);
+        } break;
+        case RULE_REG_OP_LEAF: {
+            ReduceReg(lhs_selection);
+            GenerateSimple(rhs_selection, REG_RDI);
+        } break;
+        case RULE_REG_OP_SWAP: {
+            ReduceReg(rhs_selection);
+            if (lhs_in_rax) {
+                Mov(Reg64(REG_RDI), Reg64(REG_RAX));
+                GenerateSimple(lhs_selection, REG_RAX);
+            } else {
+                GenerateSimple(lhs_selection, REG_RDI);
+                *lhs = Reg64(REG_RDI);
+                *rhs = Reg64(REG_RAX);
+            }
+        } break;
+        case RULE_REG_OP_REG: {
+            ReducePair(lhs_selection, rhs_selection, lhs_in_rax, lhs, rhs);
+        } break;
+        default: {
+            ReportInternalError("CodeGeneratorX86::ReduceOperands - not a binary operator");
+        } break;
+    }
+}
+
+// Compare the operands of a relational operator, for a following jcc or setcc
+static void ReduceCompare(struct Selection *selection) {
+    struct Operand lhs, rhs;
+    ReduceOperands(selection, false, &lhs, &rhs);
+    if (selection->rule[SELECT_REG] == RULE_REG_OP_IMM) {
+        CmpImm(lhs, selection->rhs->expr->int_value);
+    } else {
+        Cmp(lhs, rhs);
+    }
+}
+
+// Conditions of the relational operators, inverted for jumps taken when the relation does not hold
+static enum Condition conditions[] = {
+    [EXPR_EQU] = COND_E, [EXPR_NEQ] = COND_NE, [EXPR_LT] = COND_L,
+    [EXPR_GT]  = COND_G, [EXPR_LTE] = COND_LE, [EXPR_GTE] = COND_GE,
+};
+
+// Jump to label when the condition evaluates to jump_if, without materializing it as 0 or 1
+static void GenerateCondJump(struct Expr *cond, bool jump_if, char *label) {
+    if (cond->type == EXPR_NUM) {
+        if ((cond->int_value != 0) == jump_if) {
+            Jmp(label);
+        }
         return;
     }
 
+    if (AstUtils_IsRelational(cond)) {
+        struct Selection *selection = InstructionSelector_Label(current_func, cond);
+        ReduceCompare(selection);
+        InstructionSelector_Free(selection);
+        Jcc(jump_if ? conditions[cond->type] : Condition_Invert(conditions[cond->type]), label);
+        return;
+    }
+
+    GenerateExpr(cond);
+    CmpImm(Reg64(REG_RAX), 0);
+    Jcc(jump_if ? COND_NE : COND_E, label);
+}
+
+// Generate code for an assignment, storing straight to the target when its address needs no
+// registers or only leaves that can be loaded after the value
+static void GenerateAssign(struct Selection *selection) {
+    struct Selection *target = selection->lhs;
+    struct Selection *value = selection->rhs;
+    enum PrimitiveType type = selection->expr->lhs->operand_type;
+    if (type == PRIMTYPE_INVALID) {
+        ReportInternalError("CodeGeneratorX86::GenerateExpr - missing operand type");
+    }
+    if (target->rule[SELECT_MEM] == RULE_NONE) {
+        ReportInternalError("CodeGeneratorX86::GenerateExpr - assignment to a value");
+    }
+
+    Comment("assignment");
+
+    // x = x + y and x = x - y on an int or pointer local update it in memory
+    struct Expr *update = value->expr;
+    bool is_update = (update->type == EXPR_ADD || update->type == EXPR_SUB) && AstUtils_ExprEquals(update->lhs, target->expr);
+    if (is_update && target->mem.num_regs == 0 && type != PRIMTYPE_CHAR && value->rhs->is_pure) {
+        struct Operand destination = MakeAddress(&target->mem, REG_NONE, REG_NONE);
+        struct Operand source;
+        destination.size = bytes[type];
+        if (value->rhs->rule[SELECT_REG] == RULE_REG_IMM) {
+            source = Operand_Imm(value->rhs->expr->int_value);
+        } else {
+            ReduceReg(value->rhs);
+            source = Operand_Reg(REG_RAX, bytes[type]);
+        }
+        if (update->type == EXPR_ADD) {
+            Add(destination, source);
+        } else {
+            Sub(destination, source);
+        }
+        Load(Reg64(REG_RAX), destination, type);
+        return;
+    }
+
+    if (target->mem.num_regs == 0 || (InstructionSelector_HasLeafRegs(&target->mem) && value->is_pure)) {
+        if (value->rule[SELECT_REG] == RULE_REG_IMM) {
+            StoreImm(ReduceAddress(&target->mem, REG_RDI), value->expr->int_value, type);
+            MovImm(Reg64(REG_RAX), value->expr->int_value);
+            return;
+        }
+        ReduceReg(value);
+        Store(ReduceAddress(&target->mem, REG_RDI), Reg64(REG_RAX), type);
+        return;
+    }
+
+    LeaAddress(ReduceAddress(&target->mem, REG_RAX));
+    enum Reg temp = AcquireTemp(value);
+    if (temp != REG_NONE) {
+        Mov(Reg64(temp), Reg64(REG_RAX));
+        ReduceReg(value);
+        ReleaseTemp(temp);
+        WriteMemToReg(Reg64(temp), Operand_Reg(REG_RAX, bytes[type]));
+        return;
+    }
+    Spill(REG_RAX);
+    ReduceReg(value);
+    Reload(REG_RDI);
+    WriteMemToReg(Reg64(REG_RDI), Operand_Reg(REG_RAX, bytes[type]));
+}
+
+// Generate code for a binary operator selected by one of the operator rules
+static void GenerateOperator(struct Selection *selection) {
+    struct Expr *expr = selection->expr;
+    if (AstUtils_IsRelational(expr)) {
+        ReduceCompare(selection);
+        SetCC(conditions[expr->type]);
+        return;
+    }
+
+    struct Operand lhs, rhs;
+    ReduceOperands(selection, expr->type == EXPR_SUB || expr->type == EXPR_DIV, &lhs, &rhs);
+
+    // Multiplication and division by a constant become shifts, lea and multiply-high sequences
+    if (selection->rule[SELECT_REG] == RULE_REG_OP_IMM) {
+        int value = selection->rhs->expr->int_value;
+        switch (expr->type) {
+            case EXPR_ADD: { Add(Reg64(REG_RAX), rhs); } break;
+            case EXPR_SUB: { Sub(Reg64(REG_RAX), rhs); } break;
+            case EXPR_MUL: { MulImm(Reg64(REG_RAX), value); } break;
+            case EXPR_DIV: { DivImm(value); } break;
+            default: { ReportInternalError("CodeGeneratorX86::GenerateExpr - not implemented"); } break;
+        }
+        return;
+    }
+
+    // Swapped commutative operators have their lhs in rdi
+    struct Operand rax = Reg64(REG_RAX);
+    struct Operand source = Operand_Equals(&lhs, &rax) ? rhs : lhs;
     switch (expr->type) {
-        case EXPR_PLUS: {
-            GenerateExpr(expr->lhs);
+        case EXPR_ADD: { Add(rax, source); } break;
+        case EXPR_SUB: { Sub(rax, source); } break;
+        case EXPR_MUL: { Mul(rax, source); } break;
+        case EXPR_DIV: { Div(source); } break;
+        default: { ReportInternalError("CodeGeneratorX86::GenerateExpr - not implemented"); } break;
+    }
+}
+
+// Generate code for a labeled expression, leaving its value in RAX
+static void ReduceReg(struct Selection *selection) {
+    struct Expr *expr = selection->expr;
+    switch (selection->rule[SELECT_REG]) {
+        case RULE_REG_IMM:
+        case RULE_REG_MEM:
+        case RULE_REG_LEA: {
+            GenerateSimple(selection, REG_RAX);
         } return;
-        case EXPR_NEG: {
-            GenerateExpr(expr->lhs);
-            Neg(RAX);
+        case RULE_REG_UNARY: {
+            ReduceReg(selection->lhs);
+            if (expr->type == EXPR_NEG) {
+                Neg(Reg64(REG_RAX));
+            }
         } return;
-        case EXPR_DEREF: {
-            GenerateExpr(expr->lhs);
-            Mov(RAX, "[rax]");
+        case RULE_REG_OP_IMM:
+        case RULE_REG_OP_MEM:
+        case RULE_REG_OP_LEAF:
+        case RULE_REG_OP_SWAP:
+        case RULE_REG_OP_REG: {
+            GenerateOperator(selection);
+        } return;
+        default: {
+        } break;
+    }
+
+    switch (expr->type) {
+        case EXPR_STR: {
+            struct List *data_fields = &current_t_unit->data_fields;
+            for (int i = 0; i < data_fields->count; ++i) {
+                struct Expr *data_field = (struct Expr *) List_Get(data_fields, i);
+                if (strcmp(expr->str_value, data_field->str_value) == 0) {
+                    char label[32];
+                    snprintf(label, sizeof(label), "fmt_%d", data_field->id);
+                    Mov(Reg64(REG_RAX), Operand_Label(label));
+                    break;
+                }
+            }
+        } return;
+        case EXPR_FUNC_CALL: {
+            int stack_bytes = GenerateArgs(expr);
+            if (IsExternal(expr->str_value)) {
+                // Variadic functions such as printf take the number of vector registers used in al
+                MovImm(Reg64(REG_RAX), 0);
+            }
+            Call(expr->str_value);
+            if (stack_bytes > 0) {
+                Add(Reg64(REG_RSP), Operand_Imm(stack_bytes));
+                stack_depth -= stack_bytes;
+            }
         } return;
-        case EXPR_ADDR: {
-            LoadAddress(expr->lhs);
+        case EXPR_ASSIGN: {
+            GenerateAssign(selection);
         } return;
         case EXPR_SIZEOF: {
             ReportInternalError("CodeGeneratorX86::GenerateExpr - unexpected sizeof");
         } return;
+        default: {
+            ReportInternalError("CodeGeneratorX86::GenerateExpr - not implemented");
+        } return;
     }
+}
 
-    if (!expr->rhs) {
-        ReportInternalError("CodeGeneratorX86::GenerateExpr - missing rhs");
-    }
+// Generate code for an expression, selecting instructions for the whole tree at once
+static void GenerateExpr(struct Expr *expr) {
+    struct Selection *selection = InstructionSelector_Label(current_func, expr);
+    ReduceReg(selection);
+    InstructionSelector_Free(selection);
+}
 
-    if (expr->type == EXPR_ASSIGN) {
-        Comment("assignment");
-        LoadAddress(expr->lhs);
-        Push(RAX);
-        GenerateExpr(expr->rhs);
-        Pop(RDI);
-        WriteMemToReg(RDI, rax[expr->lhs->operand_type]);
-        if (expr->lhs->operand_type == PRIMTYPE_INVALID) {
-            ReportInternalError("CodeGeneratorX86::GenerateExpr - missing operand type");
-        }
-        return;
+// Store the parameter registers in the stack slots of the parameters, the others are already on the stack
+static void StoreParams(struct FunctionDef *function) {
+    struct List *var_decls = &function->var_decls;
+    for (int i = 0; i < function->num_params && i < NUM_ARG_REGS; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        struct Declarator *decl = (struct Declarator *) List_Get(&var_decl->declarators, 0);
+
+        char comment[TOKEN_MAX_IDENTIFIER_LENGTH + 16];
+        snprintf(comment, sizeof(comment), "parameter \"%s\"", decl->identifier);
+        Comment(comment);
+        WriteMemOffset(decl->rbp_offset, i, var_decl->type);
     }
+}
 
-    GenerateExpr(expr->rhs);
-    Push(RAX);
-    GenerateExpr(expr->lhs);
-    Pop(RDI);
-    switch (expr->type) {
-        case EXPR_EQU: { Compare(RAX, RDI, "sete"); } break;
-        case EXPR_NEQ: { Compare(RAX, RDI, "setne"); } break;
-        case EXPR_LT:  { Compare(RAX, RDI, "setl"); } break;
-        case EXPR_GT:  { Compare(RAX, RDI, "setg"); } break;
-        case EXPR_LTE: { Compare(RAX, RDI, "setle"); } break;
-        case EXPR_GTE: { Compare(RAX, RDI, "setge"); } break;
-        case EXPR_ADD: { Add(RAX, RDI); } break;
-        case EXPR_SUB: { Sub(RAX, RDI); } break;
-        case EXPR_MUL: { Mul(RAX, RDI); } break;
-        case EXPR_DIV: { Div(RDI); } break;
-        default: { ReportInternalError("CodeGeneratorX86::GenerateExpr - not implemented"); } break;
+static void FindFrameAddress(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        *(bool *) data = true;
     }
 }
 
-// Generate code for a function definition
-static void GenerateFunctionDef(struct FunctionDef *function) {
-    current_func = function;
+static void VisitFindFrameAddresses(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, FindFrameAddress, data);
+}
 
-    int offset = 8;
-    struct List *var_decls = &current_func->var_decls;
+// Check whether pointers into the stack frame of a function may exist, through the address of a local or
+// an array decaying to a pointer. A tail call releases or reuses the frame while the callee may still use them.
+static bool FrameEscapes(struct FunctionDef *function) {
+    struct List *var_decls = &function->var_decls;
     for (int i = 0; i < var_decls->count; ++i) {
-        struct VarDeclaration *var_declaration = (struct VarDeclaration *) List_Get(var_decls, i);
-        int size_in_bytes = bytes[var_declaration->type];
-        if (size_in_bytes == 0) {
-            ReportInternalError("SemanticAnalysis::AnalyzeExpr - unexpected sizeof type");
+        struct List *declarators = &((struct VarDeclaration *) List_Get(var_decls, i))->declarators;
+        for (int j = 0; j < declarators->count; ++j) {
+            if (((struct Declarator *) List_Get(declarators, j))->array_dimensions > 0) {
+                return true;
+            }
         }
+    }
 
-        struct List *declarators = &var_declaration->declarators;
-        for (int j = 0; j < declarators->count; ++j) {
-            struct Declarator *declarator = (struct Declarator *) List_Get(declarators, j);
-            if (IsArray(declarator)) {
-                int total_vars = 1;
-                for (int k = 0; k < declarator->array_dimensions; ++k) {
-                    total_vars *= declarator->array_sizes[k];
-                }
+    bool address_taken = false;
+    AstUtils_WalkStmt((struct AstNode *) function->body, VisitFindFrameAddresses, &address_taken);
+    return address_taken;
+}
 
-                offset += size_in_bytes * total_vars;
-                declarator->rbp_offset = offset;
-            } else if (IsPointer(declarator)) {
-                offset += bytes[PRIMTYPE_PTR];
-                declarator->rbp_offset = offset;
-            } else {
-                offset += size_in_bytes;
-                declarator->rbp_offset = offset;
+// Check whether a return statement calls the current function with all of its parameters
+static bool IsSelfTailCall(struct ReturnStmt *return_stmt) {
+    struct Expr *expr = return_stmt->expr;
+    return expr && expr->type == EXPR_FUNC_CALL && strcmp(expr->str_value, current_func->identifier) == 0 &&
+           expr->args.count == current_func->num_params && expr->args.count <= NUM_ARG_REGS;
+}
+
+// Check whether a statement contains a return that calls the current function
+static bool HasSelfTailCall(struct AstNode *stmt) {
+    if (!stmt) {
+        return false;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                if (HasSelfTailCall((struct AstNode *) List_Get(body, i))) {
+                    return true;
+                }
             }
+        } return false;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return HasSelfTailCall(if_stmt->stmt) || HasSelfTailCall(if_stmt->else_branch);
+        }
+        case AST_RETURN_STMT:   return IsSelfTailCall((struct ReturnStmt *) stmt);
+        case AST_WHILE_STMT:    return HasSelfTailCall(((struct WhileStmt *) stmt)->stmt);
+        case AST_FOR_STMT:      return HasSelfTailCall(((struct ForStmt *) stmt)->stmt);
+        default:                return false;
+    }
+}
 
-            fprintf(f, "; %s: %d\n", declarator->identifier, declarator->rbp_offset);
+// Note the stack slot of every local in the assembly, such as "; i: 56". Stack arguments are left out.
+static void CommentFrameLayout(struct FunctionDef *function) {
+    struct List *var_decls = &function->var_decls;
+    for (int i = 0; i < var_decls->count; ++i) {
+        if (i >= NUM_ARG_REGS && i < function->num_params) {
+            continue;
+        }
+        struct List *declarators = &((struct VarDeclaration *) List_Get(var_decls, i))->declarators;
+        for (int j = 0; j < declarators->count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(declarators, j);
+            char comment[TOKEN_MAX_IDENTIFIER_LENGTH + 16];
+            snprintf(comment, sizeof(comment), "%s: %d", declarator->identifier, declarator->rbp_offset);
+            Comment(comment);
         }
     }
+}
 
-    const int shadow_space = 32;
-    function->stack_size = Align(offset + shadow_space, 16);
-    Label(function->identifier);
-    SetupStackFrame(function->stack_size);
+// Generate code for a function definition
+static void GenerateFunctionDef(struct FunctionDef *function) {
+    current_func = function;
+    stack_depth = 0;
+    num_live_temps = 0;
+    num_labels = 0;
+    tail_calls = options.tail_calls && !FrameEscapes(function);
 
-    for (int i = 0; i < function->num_params; ++i) {
-        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
-        struct Declarator *decl = (struct Declarator *) List_Get(&var_decl->declarators, 0);
+    // The body runs again from the top after a self tail call, so no variable's lifetime ends before another's starts
+    bool has_tail_loop = tail_calls && HasSelfTailCall((struct AstNode *) function->body);
+    function->stack_size = StackFrame_Layout(function, options.share_stack_slots && !has_tail_loop);
+    CommentFrameLayout(function);
+    Label(function->identifier);
+    SetupStackFrame(Align(function->stack_size, 16));
 
-        fprintf(f, "  ; parameter \"%s\"\n", decl->identifier);
-        WriteMemOffset(decl->rbp_offset, i, var_decl->type);
+    StoreParams(function);
+    if (has_tail_loop) {
+        // Self tail calls store the new arguments and jump back here
+        char tail_label[TOKEN_MAX_IDENTIFIER_LENGTH + 8];
+        snprintf(tail_label, sizeof(tail_label), "tailcall.%s", function->identifier);
+        Label(tail_label);
     }
 
     GenerateCompoundStmt(function->body);
-    fprintf(f, "return.%s:\n", function->identifier);
+    char return_label[TOKEN_MAX_IDENTIFIER_LENGTH + 8];
+    snprintf(return_label, sizeof(return_label), "return.%s", function->identifier);
+    Label(return_label);
     RestoreStackFrame();
-    fprintf(f, "\n");
+
+    Peephole_Optimize(GetInstructions());
+    StackFrame_Finalize(GetInstructions(), function->stack_size);
+    FlushInstructions();
     current_func = NULL;
 }
 
-// Generate code for a translation unit
+// Generate and optimize one function of a batch into its own output, on a thread of the pool
+static void GenerateBatchFunction(void *context, int index) {
+    struct FunctionBatch *batch = (struct FunctionBatch *) context;
+    SetFunctionOutput(&batch->outputs[index]);
+    GenerateFunctionDef((struct FunctionDef *) List_Get(batch->functions, batch->first + index));
+    SetFunctionOutput(NULL);
+
+    // Pool threads end without freeing their thread locals, so they must not keep an instruction buffer
+    InstructionBuffer_Free(GetInstructions());
+}
+
+// Generate code for a translation unit. The functions of each batch are generated on a thread pool,
+// whose threads serve every batch, and written in source order, so the output does not depend on
+// the number of threads.
 static void GenerateTranslationUnit(struct TranslationUnit *t_unit) {
     current_t_unit = t_unit;
-    for (int i = 0; i < t_unit->functions.count; ++i) {
-        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
-        GenerateFunctionDef(function);
+    int num_threads = options.num_threads > 0 ? options.num_threads : ThreadPool_DefaultThreads();
+    struct FunctionBatch batch;
+    batch.functions = &t_unit->functions;
+    batch.outputs = (struct FunctionOutput *) Memory_Alloc(MEMORY_CODEGEN, sizeof(struct FunctionOutput) * FUNCTION_BATCH_SIZE);
+    if (!batch.outputs) {
+        exit(1);
     }
 
+    for (batch.first = 0; batch.first < t_unit->functions.count; batch.first += FUNCTION_BATCH_SIZE) {
+        int count = t_unit->functions.count - batch.first;
+        if (count > FUNCTION_BATCH_SIZE) {
+            count = FUNCTION_BATCH_SIZE;
+        }
+        for (int i = 0; i < count; ++i) {
+            FunctionOutput_Init(&batch.outputs[i]);
+        }
+        ThreadPool_Run(count, GenerateBatchFunction, &batch, num_threads);
+        for (int i = 0; i < count; ++i) {
+            WriteFunctionOutput(&batch.outputs[i]);
+        }
+    }
+
+    ThreadPool_Shutdown();
+    Memory_Free(MEMORY_CODEGEN, batch.outputs);
     current_t_unit = NULL;
 }
 
@@ -285,74 +800,309 @@ static void GenerateExpressionStmt(struct ExpressionStmt *expression_stmt) {
     GenerateExpr(expression_stmt->expr);
 }
 
+// Check whether the condition of a for loop holds on entry, as in for (i = 0; i < 10; ...)
+static bool IsInitiallyTrue(struct Expr *init, struct Expr *cond) {
+    if (!init || init->type != EXPR_ASSIGN || init->lhs->type != EXPR_VAR || init->rhs->type != EXPR_NUM) {
+        return false;
+    }
+    if (!AstUtils_IsRelational(cond) || cond->lhs->type != EXPR_VAR || cond->rhs->type != EXPR_NUM) {
+        return false;
+    }
+    if (strcmp(init->lhs->str_value, cond->lhs->str_value) != 0) {
+        return false;
+    }
+
+    // Small values survive the store unchanged whatever the width of the variable
+    int a = init->rhs->int_value, b = cond->rhs->int_value;
+    if (a < 0 || a > 127) {
+        return false;
+    }
+    switch (cond->type) {
+        case EXPR_EQU:  return a == b;
+        case EXPR_NEQ:  return a != b;
+        case EXPR_LT:   return a < b;
+        case EXPR_GT:   return a > b;
+        case EXPR_LTE:  return a <= b;
+        case EXPR_GTE:  return a >= b;
+        default:        return false;
+    }
+}
+
+// Vector register n, an xmm register or with -mavx2 a ymm register
+static struct Operand VectorReg(int n) {
+    return Operand_Reg(REG_XMM0 + n, options.avx2 ? 32 : 16);
+}
+
+// Memory operand for the elements i to i + lanes - 1 at an address a + i * size
+static struct Operand VectorAddress(struct VectorLoop *loop, struct Expr *address) {
+    int base = Vectorizer_FindBase(loop, address);
+    return Operand_MemIndex(vector_base_regs[base], REG_RCX, loop->element_size, 0, 0);
+}
+
+// Find the vector register holding a broadcast invariant, false if the expression is computed per lane
+static bool InvariantReg(struct VectorLoop *loop, struct Expr *expr, struct Operand *reg) {
+    int invariant = Vectorizer_FindInvariant(loop, expr);
+    if (invariant < 0) {
+        return false;
+    }
+    *reg = VectorReg(VECTORIZER_NUM_REGS - 1 - invariant);
+    return true;
+}
+
+// Evaluate an expression for every lane into vector register depth, using the registers above it
+static void GenerateVectorExpr(struct VectorLoop *loop, struct Expr *expr, int depth) {
+    struct Operand dst = VectorReg(depth), src;
+    if (InvariantReg(loop, expr, &src)) {
+        VecMov(dst, src);
+        return;
+    }
+
+    switch (expr->type) {
+        case EXPR_DEREF: {
+            VecLoad(dst, VectorAddress(loop, expr->lhs));
+        } return;
+        case EXPR_PLUS: {
+            GenerateVectorExpr(loop, expr->lhs, depth);
+        } return;
+        case EXPR_NEG: {
+            VecZero(dst);
+            GenerateVectorExpr(loop, expr->lhs, depth + 1);
+            VecSub(dst, VectorReg(depth + 1), loop->element_size);
+        } return;
+    }
+
+    // AVX instructions accept unaligned memory operands, SSE2 ones would fault
+    GenerateVectorExpr(loop, expr->lhs, depth);
+    if (!InvariantReg(loop, expr->rhs, &src)) {
+        if (options.avx2 && expr->rhs->type == EXPR_DEREF) {
+            src = VectorAddress(loop, expr->rhs->lhs);
+        } else {
+            GenerateVectorExpr(loop, expr->rhs, depth + 1);
+            src = VectorReg(depth + 1);
+        }
+    }
+
+    switch (expr->type) {
+        case EXPR_ADD: { VecAdd(dst, src, loop->element_size); } break;
+        case EXPR_SUB: { VecSub(dst, src, loop->element_size); } break;
+        case EXPR_MUL: { VecMul(dst, src, loop->element_size); } break;
+        default: { ReportInternalError("CodeGeneratorX86::GenerateVectorExpr - not vectorizable"); } break;
+    }
+}
+
+// Load the arrays and pointers of a vectorized loop into their registers
+static void LoadVectorBases(struct VectorLoop *loop) {
+    for (int i = 0; i < loop->bases.count; ++i) {
+        struct VectorBase *base = (struct VectorBase *) List_Get(&loop->bases, i);
+        GenerateExpr(base->var);
+        Mov(Reg64(vector_base_regs[i]), Reg64(REG_RAX));
+    }
+}
+
+// Run a vectorizable for loop several iterations at a time. Overlapping pointers and the
+// iterations that do not fill a vector are left to the scalar loop at scalar_label.
+static void GenerateVectorLoop(struct VectorLoop *loop, char *scalar_label) {
+    struct ForStmt *for_stmt = loop->for_stmt;
+    int width = loop->lanes * loop->element_size;
+    int label_id = MakeNewLabelId();
+    char peel_label[LABEL_SIZE], setup_label[LABEL_SIZE], body_label[LABEL_SIZE], end_label[LABEL_SIZE];
+    MakeLabel(peel_label, "vecpeel", label_id);
+    MakeLabel(setup_label, "vecsetup", label_id);
+    MakeLabel(body_label, "vecbody", label_id);
+    MakeLabel(end_label, "vecend", label_id);
+    Comment("vectorized loop");
+
+    // Bases that are equal or at least a vector apart give the same result as the scalar loop
+    bool loaded = false;
+    for (int i = 0; i < loop->bases.count; ++i) {
+        for (int j = i + 1; j < loop->bases.count; ++j) {
+            if (!Vectorizer_MayAlias((struct VectorBase *) List_Get(&loop->bases, i), (struct VectorBase *) List_Get(&loop->bases, j))) {
+                continue;
+            }
+            if (!loaded) LoadVectorBases(loop);
+            loaded = true;
+
+            char no_alias_label[LABEL_SIZE];
+            MakeLabel(no_alias_label, "vecnoalias", MakeNewLabelId());
+            Mov(Reg64(REG_RAX), Reg64(vector_base_regs[i]));
+            Sub(Reg64(REG_RAX), Reg64(vector_base_regs[j]));
+            Jcc(COND_E, no_alias_label);
+            Add(Reg64(REG_RAX), Operand_Imm(width - 1));
+            CmpImm(Reg64(REG_RAX), 2 * width - 2);
+            Jcc(COND_BE, scalar_label);
+            Label(no_alias_label);
+        }
+    }
+
+    // Scalar prologue until the first store is aligned to the vector width, skipped when the
+    // array itself is not aligned to its element size and so never would be
+    struct Expr *first_store = (struct Expr *) List_Get(&loop->stores, 0);
+    struct Expr *store_address = first_store->lhs->lhs;
+    if (loop->element_size > 1) {
+        GenerateExpr(store_address->lhs);
+        TestImm(Reg64(REG_RAX), loop->element_size - 1);
+        Jcc(COND_NE, setup_label);
+    }
+    Label(peel_label);
+    GenerateCondJump(for_stmt->cond_expr, false, scalar_label);
+    GenerateExpr(store_address);
+    TestImm(Reg64(REG_RAX), width - 1);
+    Jcc(COND_E, setup_label);
+    GenerateStmt(for_stmt->stmt);
+    GenerateExpr(for_stmt->loop_expr);
+    Jmp(peel_label);
+
+    // Vector iterations run while i <= bound - lanes, or bound - lanes + 1 for <=
+    Label(setup_label);
+    LoadVectorBases(loop);
+    GenerateExpr(loop->bound);
+    Add(Reg64(REG_RAX), Operand_Imm((loop->inclusive ? 1 : 0) - loop->lanes));
+    Mov(Reg64(REG_RDX), Reg64(REG_RAX));
+    for (int i = 0; i < loop->invariants.count; ++i) {
+        struct Operand invariant;
+        GenerateExpr((struct Expr *) List_Get(&loop->invariants, i));
+        InvariantReg(loop, (struct Expr *) List_Get(&loop->invariants, i), &invariant);
+        VecBroadcast(invariant, Operand_Reg(REG_RAX, 4), loop->element_size);
+    }
+    GenerateExpr(loop->counter);
+    Mov(Reg64(REG_RCX), Reg64(REG_RAX));
+    Cmp(Reg64(REG_RCX), Reg64(REG_RDX));
+    Jcc(COND_G, end_label);
+
+    if (options.loop_alignment) AlignCode(options.loop_alignment);
+    Label(body_label);
+    for (int i = 0; i < loop->stores.count; ++i) {
+        struct Expr *store = (struct Expr *) List_Get(&loop->stores, i);
+        struct Operand value;
+        if (!InvariantReg(loop, store->rhs, &value)) {
+            GenerateVectorExpr(loop, store->rhs, 0);
+            value = VectorReg(0);
+        }
+        VecStore(VectorAddress(loop, store->lhs->lhs), value);
+    }
+    Add(Reg64(REG_RCX), Operand_Imm(loop->lanes));
+    Cmp(Reg64(REG_RCX), Reg64(REG_RDX));
+    Jcc(COND_LE, body_label);
+
+    // The scalar loop continues from the counter value the vector loop stopped at
+    Label(end_label);
+    LoadAddress(loop->counter);
+    Mov(Operand_Mem(REG_RAX, 0, 0), Operand_Reg(REG_RCX, 4));
+    if (options.avx2) VecZeroUpper();
+    Label(scalar_label);
+}
+
 // Generate code for a for loop statement
 static void GenerateForStmt(struct ForStmt *for_stmt) {
     if (for_stmt->init_expr) GenerateExpr(for_stmt->init_expr);
     int label_id = MakeNewLabelId();
-    fprintf(f, "forstart%d:\n", label_id);
-    if (for_stmt->cond_expr) GenerateExpr(for_stmt->cond_expr);
-    fprintf(f,
-        "  cmp rax, 0\n"
-        "  je forend%d\n",
-        label_id
-    );
+    char start_label[LABEL_SIZE], end_label[LABEL_SIZE], scalar_label[LABEL_SIZE];
+    MakeLabel(start_label, "forstart", label_id);
+    MakeLabel(end_label, "forend", label_id);
+    MakeLabel(scalar_label, "forscalar", label_id);
+
+    // The scalar loop below runs what the vector loop leaves over
+    struct VectorLoop *vector_loop = Vectorizer_Find(for_stmt);
+    if (vector_loop) GenerateVectorLoop(vector_loop, scalar_label);
+
+    if (!options.rotate_loops) {
+        Label(start_label);
+        if (for_stmt->cond_expr) GenerateCondJump(for_stmt->cond_expr, false, end_label);
+
+        GenerateStmt(for_stmt->stmt);
+        if (for_stmt->loop_expr) GenerateExpr(for_stmt->loop_expr);
+        Jmp(start_label);
+        Label(end_label);
+        return;
+    }
+
+    // Rotated: a guard skips the loop, then the condition is tested at the bottom of each iteration
+    struct Expr *cond = for_stmt->cond_expr;
+    if (cond && (vector_loop || !IsInitiallyTrue(for_stmt->init_expr, cond))) {
+        GenerateCondJump(cond, false, end_label);
+    }
+    if (options.loop_alignment) AlignCode(options.loop_alignment);
+    Label(start_label);
 
     GenerateStmt(for_stmt->stmt);
     if (for_stmt->loop_expr) GenerateExpr(for_stmt->loop_expr);
-    fprintf(f,
-        "  jmp forstart%d\n"
-        "forend%d:\n",
-        label_id,
-        label_id
-    );
+    if (cond) {
+        GenerateCondJump(cond, true, start_label);
+    } else {
+        Jmp(start_label);
+    }
+    Label(end_label);
 }
 
 // Generate code for an if statement
 static void GenerateIfStmt(struct IfStmt *if_stmt) {
-    GenerateExpr(if_stmt->condition);
     int label_id = MakeNewLabelId();
-    fprintf(f,
-        "  cmp rax, 0\n"
-        "  je ifelse%d\n",
-        label_id
-    );
+    char else_label[LABEL_SIZE], end_label[LABEL_SIZE];
+    MakeLabel(else_label, "ifelse", label_id);
+    MakeLabel(end_label, "ifend", label_id);
+
+    GenerateCondJump(if_stmt->condition, false, else_label);
 
     GenerateStmt(if_stmt->stmt);
-    fprintf(f,
-        "  jmp ifend%d\n"
-        "ifelse%d:\n",
-        label_id,
-        label_id
-    );
+    Jmp(end_label);
+    Label(else_label);
 
     if (if_stmt->else_branch) GenerateStmt(if_stmt->else_branch);
-    fprintf(f, "ifend%d:\n", label_id);
+    Label(end_label);
 }
 
 // Generate code for a return statement
 static void GenerateReturnStmt(struct ReturnStmt *return_stmt) {
-    if (return_stmt->expr) GenerateExpr(return_stmt->expr);
-    fprintf(f, "  jmp return.%s\n", current_func->identifier);
+    struct Expr *expr = return_stmt->expr;
+    // Arguments passed on the stack would have to replace our own, so those calls return normally
+    if (tail_calls && expr && expr->type == EXPR_FUNC_CALL && expr->args.count <= NUM_ARG_REGS) {
+        GenerateArgs(expr);
+        if (IsSelfTailCall(return_stmt)) {
+            // Self recursion becomes a loop: overwrite the parameters and restart the body
+            char tail_label[TOKEN_MAX_IDENTIFIER_LENGTH + 8];
+            snprintf(tail_label, sizeof(tail_label), "tailcall.%s", current_func->identifier);
+            StoreParams(current_func);
+            Jmp(tail_label);
+        } else {
+            // The callee returns straight to our caller, so the frame is released first
+            if (IsExternal(expr->str_value)) MovImm(Reg64(REG_RAX), 0);
+            DestroyStackFrame();
+            Jmp(expr->str_value);
+        }
+        return;
+    }
+
+    if (expr) GenerateExpr(expr);
+    char return_label[TOKEN_MAX_IDENTIFIER_LENGTH + 8];
+    snprintf(return_label, sizeof(return_label), "return.%s", current_func->identifier);
+    Jmp(return_label);
 }
 
 // Generate code for a while loop statement
 static void GenerateWhileStmt(struct WhileStmt *while_stmt) {
     int label_id = MakeNewLabelId();
-    fprintf(f, "whilestart%d:\n", label_id);
-    GenerateExpr(while_stmt->condition);
-    fprintf(f,
-        "  cmp rax, 0\n"
-        "  je whileend%d\n",
-        label_id
-    );
+    char start_label[LABEL_SIZE], end_label[LABEL_SIZE];
+    MakeLabel(start_label, "whilestart", label_id);
+    MakeLabel(end_label, "whileend", label_id);
+
+    if (!options.rotate_loops) {
+        Label(start_label);
+        GenerateCondJump(while_stmt->condition, false, end_label);
+
+        GenerateStmt(while_stmt->stmt);
+        Jmp(start_label);
+        Label(end_label);
+        return;
+    }
+
+    // Rotated into a guarded do-while so each iteration takes a single conditional branch
+    GenerateCondJump(while_stmt->condition, false, end_label);
+    if (options.loop_alignment) AlignCode(options.loop_alignment);
+    Label(start_label);
 
     GenerateStmt(while_stmt->stmt);
-    fprintf(f,
-        "  jmp whilestart%d\n"
-        "whileend%d:\n",
-        label_id,
-        label_id
-    );
+    GenerateCondJump(while_stmt->condition, true, start_label);
+    Label(end_label);
 }
 
 // Generate code for a variable declaration
@@ -388,43 +1138,43 @@ static void GenerateStmt(struct AstNode *stmt) {
     }
 }
 
-// Generate x86 assembly code from the AST
-void CodeGeneratorX86_GenerateCode(FILE *asm_file, struct TranslationUnit *t_unit) {
+// Run the AST passes and generate every function into the current output
+static void GenerateCode(struct TranslationUnit *t_unit) {
+    PassManager_Run(t_unit);
     current_func = NULL;
-    f = asm_file;
 
-    SetOutput(asm_file);
+    PassManager_BeginPhase("codegen");
     SetupAssemblyFile();
 
     struct List *data_fields = &t_unit->data_fields;
-    if (data_fields->count > 0) {
-        fprintf(f, "section .data\n");
-        for (int i = 0; i < data_fields->count; ++i) {
-            struct Expr *expr = (struct Expr *) List_Get(data_fields, i);
-            expr->id = i;
-            char *str = expr->str_value;
-            fprintf(f, "  fmt_%d: db \"", i);
-            for (int j = 0; str[j] != '\0'; ++j) {
-                if (str[j] == '\\') {
-                    j += 1;
-                    switch (str[j]) {
-                        case 'n': { fprintf(f, "\", 10, 0"); } break;
-                    }
-                } else {
-                    fprintf(f, "%c", str[j]);
-                }
-            }
-            fprintf(f, "\n");
-        }
+    for (int i = 0; i < data_fields->count; ++i) {
+        struct Expr *expr = (struct Expr *) List_Get(data_fields, i);
+        expr->id = i;
+        char label[32];
+        snprintf(label, sizeof(label), "fmt_%d", i);
+        DefineString(label, expr->str_value);
     }
 
-    fprintf(f,
-        "\n"
-        "section .text\n"
-        "  extern printf\n"
-        "  global main\n"
-        "\n"
-    );
-
     GenerateTranslationUnit(t_unit);
+    PassManager_EndPhase(NULL);
+
+    PassManager_BeginPhase("emit");
+    FinishAssemblyFile();
+    PassManager_EndPhase(NULL);
+    PassManager_Finish();
+}
+
+// Generate x86 assembly code from the AST
+void CodeGeneratorX86_GenerateCode(FILE *asm_file, struct TranslationUnit *t_unit) {
+    SetOutput(asm_file);
+    GenerateCode(t_unit);
+}
+
+// Compile the translation unit into memory of the running process and return its main, or NULL if
+// an external function could not be resolved
+JitFunction CodeGeneratorX86_GenerateJit(struct JitCode *jit, struct TranslationUnit *t_unit) {
+    SetJitOutput(jit);
+    GenerateCode(t_unit);
+    SetJitOutput(NULL);
+    return Jit_Lookup(jit, "main");
 }
@@ -2,6 +2,7 @@
 #define BMS_CODE_GENRATOR_X86_H
 
 #include "AstNode.h"
+#include "Jit.h"
 #include "List.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -9,4 +10,8 @@
 // Function to generate x86 assembly code from the AST
 void CodeGeneratorX86_GenerateCode(FILE *asm_file, struct TranslationUnit *t_unit);
 
+// Compile the translation unit into memory of the running process and return its main, ready to be
+// called, or NULL if an external function could not be resolved. Jit_Free releases the code.
+JitFunction CodeGeneratorX86_GenerateJit(struct JitCode *jit, struct TranslationUnit *t_unit);
+
 #endif 
@@ -0,0 +1,517 @@
+#include "ConstantFolding.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Known values of the tracked locals at a point in the function
+struct ConstantState {
+    bool *known;
+    int *values;
+};
+
+// Static function declarations
+static struct Expr *FoldExpr(struct Expr *expr, struct ConstantState *state, bool *assigned);
+static void FoldStmt(struct AstNode *stmt, struct ConstantState *state);
+
+// Scalar locals whose values can be propagated, indexed like the state arrays
+static struct Declarator **tracked_vars;
+static enum PrimitiveType *tracked_types;
+static int num_tracked_vars;
+
+static int num_folded = 0;
+static int num_identities = 0;
+static int num_propagated = 0;
+
+// Find the index of a tracked variable, or -1 if its value cannot be propagated
+static int FindTrackedVar(char *identifier) {
+    for (int i = 0; i < num_tracked_vars; ++i) {
+        if (tracked_vars[i] && strcmp(tracked_vars[i]->identifier, identifier) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Stop tracking variables whose address is taken, since they can change through pointers
+static void ExcludeAddressTaken(struct Expr *expr) {
+    if (!expr) {
+        return;
+    }
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        int index = FindTrackedVar(expr->lhs->str_value);
+        if (index >= 0) {
+            tracked_vars[index] = NULL;
+        }
+    }
+    if (expr->type == EXPR_FUNC_CALL) {
+        for (int i = 0; i < expr->args.count; ++i) {
+            ExcludeAddressTaken((struct Expr *) List_Get(&expr->args, i));
+        }
+        return;
+    }
+    if (expr->type != EXPR_NUM && expr->type != EXPR_STR && expr->type != EXPR_VAR) {
+        ExcludeAddressTaken(expr->lhs);
+        ExcludeAddressTaken(expr->rhs);
+    }
+}
+
+static void ExcludeAddressTakenInStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return;
+    }
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                ExcludeAddressTakenInStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                ExcludeAddressTaken(((struct Declarator *) List_Get(declarators, i))->value);
+            }
+        } break;
+        case AST_EXPRESSION_STMT:   { ExcludeAddressTaken(((struct ExpressionStmt *) stmt)->expr); } break;
+        case AST_RETURN_STMT:       { ExcludeAddressTaken(((struct ReturnStmt *) stmt)->expr); } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            ExcludeAddressTaken(if_stmt->condition);
+            ExcludeAddressTakenInStmt(if_stmt->stmt);
+            ExcludeAddressTakenInStmt(if_stmt->else_branch);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            ExcludeAddressTaken(while_stmt->condition);
+            ExcludeAddressTakenInStmt(while_stmt->stmt);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            ExcludeAddressTaken(for_stmt->init_expr);
+            ExcludeAddressTaken(for_stmt->cond_expr);
+            ExcludeAddressTaken(for_stmt->loop_expr);
+            ExcludeAddressTakenInStmt(for_stmt->stmt);
+        } break;
+    }
+}
+
+// Mark the tracked variables assigned anywhere in an expression
+static void CollectAssigned(struct Expr *expr, bool *assigned) {
+    if (!expr || expr->type == EXPR_NUM || expr->type == EXPR_STR || expr->type == EXPR_VAR) {
+        return;
+    }
+    if (expr->type == EXPR_FUNC_CALL) {
+        for (int i = 0; i < expr->args.count; ++i) {
+            CollectAssigned((struct Expr *) List_Get(&expr->args, i), assigned);
+        }
+        return;
+    }
+    if (expr->type == EXPR_ASSIGN && expr->lhs->type == EXPR_VAR) {
+        int index = FindTrackedVar(expr->lhs->str_value);
+        if (index >= 0) {
+            assigned[index] = true;
+        }
+    }
+    CollectAssigned(expr->lhs, assigned);
+    CollectAssigned(expr->rhs, assigned);
+}
+
+static void CollectAssignedInStmt(struct AstNode *stmt, bool *assigned) {
+    if (!stmt) {
+        return;
+    }
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                CollectAssignedInStmt((struct AstNode *) List_Get(body, i), assigned);
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                CollectAssigned(((struct Declarator *) List_Get(declarators, i))->value, assigned);
+            }
+        } break;
+        case AST_EXPRESSION_STMT:   { CollectAssigned(((struct ExpressionStmt *) stmt)->expr, assigned); } break;
+        case AST_RETURN_STMT:       { CollectAssigned(((struct ReturnStmt *) stmt)->expr, assigned); } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            CollectAssigned(if_stmt->condition, assigned);
+            CollectAssignedInStmt(if_stmt->stmt, assigned);
+            CollectAssignedInStmt(if_stmt->else_branch, assigned);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            CollectAssigned(while_stmt->condition, assigned);
+            CollectAssignedInStmt(while_stmt->stmt, assigned);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            CollectAssigned(for_stmt->init_expr, assigned);
+            CollectAssigned(for_stmt->cond_expr, assigned);
+            CollectAssigned(for_stmt->loop_expr, assigned);
+            CollectAssignedInStmt(for_stmt->stmt, assigned);
+        } break;
+    }
+}
+
+static struct ConstantState CopyState(struct ConstantState *state) {
+    struct ConstantState copy;
+    copy.known = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    copy.values = NEW_ARRAY(MEMORY_SYMBOLS, int, num_tracked_vars);
+    memcpy(copy.known, state->known, sizeof(bool) * num_tracked_vars);
+    memcpy(copy.values, state->values, sizeof(int) * num_tracked_vars);
+    return copy;
+}
+
+static void FreeState(struct ConstantState *state) {
+    Memory_Free(MEMORY_SYMBOLS, state->known);
+    Memory_Free(MEMORY_SYMBOLS, state->values);
+}
+
+// Keep only the values known to be equal in both states
+static void MeetStates(struct ConstantState *state, struct ConstantState *other) {
+    for (int i = 0; i < num_tracked_vars; ++i) {
+        if (!other->known[i] || other->values[i] != state->values[i]) {
+            state->known[i] = false;
+        }
+    }
+}
+
+static void ForgetAssigned(struct ConstantState *state, bool *assigned) {
+    for (int i = 0; i < num_tracked_vars; ++i) {
+        if (assigned[i]) {
+            state->known[i] = false;
+        }
+    }
+}
+
+// Truncate a value the way storing it into a variable of the given type would
+static int TruncateToType(int value, enum PrimitiveType type) {
+    if (type == PRIMTYPE_CHAR) {
+        return value & 0xff;
+    }
+    return value;
+}
+
+static bool IsNum(struct Expr *expr, int value) {
+    return expr->type == EXPR_NUM && expr->int_value == value;
+}
+
+// Evaluate a binary operator on constants with 32-bit wrap-around, returning false if undefined
+static bool Evaluate(enum ExprType type, int a, int b, int *result) {
+    unsigned int ua = (unsigned int) a;
+    unsigned int ub = (unsigned int) b;
+    switch (type) {
+        case EXPR_ADD:  { *result = (int) (ua + ub); } return true;
+        case EXPR_SUB:  { *result = (int) (ua - ub); } return true;
+        case EXPR_MUL:  { *result = (int) (ua * ub); } return true;
+        case EXPR_DIV: {
+            if (b == 0 || (a == INT_MIN && b == -1)) {
+                return false;
+            }
+            *result = a / b;
+        } return true;
+        case EXPR_EQU:  { *result = a == b; } return true;
+        case EXPR_NEQ:  { *result = a != b; } return true;
+        case EXPR_LT:   { *result = a < b; } return true;
+        case EXPR_GT:   { *result = a > b; } return true;
+        case EXPR_LTE:  { *result = a <= b; } return true;
+        case EXPR_GTE:  { *result = a >= b; } return true;
+        default:        return false;
+    }
+}
+
+// Simplify a binary operator whose operands have already been folded
+static struct Expr *SimplifyBinary(struct Expr *expr) {
+    struct Expr *lhs = expr->lhs;
+    struct Expr *rhs = expr->rhs;
+
+    int result;
+    if (lhs->type == EXPR_NUM && rhs->type == EXPR_NUM && Evaluate(expr->type, lhs->int_value, rhs->int_value, &result)) {
+        num_folded += 1;
+        return NewNumberExpr(result);
+    }
+
+    switch (expr->type) {
+        case EXPR_ADD: {
+            // c + x -> x + c
+            if (lhs->type == EXPR_NUM && AstUtils_IsPure(rhs)) {
+                expr->lhs = rhs;
+                expr->rhs = lhs;
+                return SimplifyBinary(expr);
+            }
+            if (IsNum(rhs, 0)) {
+                num_identities += 1;
+                return lhs;
+            }
+            // (x + c1) + c2 -> x + (c1 + c2), (x - c1) + c2 -> x + (c2 - c1)
+            if (rhs->type == EXPR_NUM && (lhs->type == EXPR_ADD || lhs->type == EXPR_SUB) && lhs->rhs->type == EXPR_NUM) {
+                if (lhs->type == EXPR_ADD) {
+                    Evaluate(EXPR_ADD, lhs->rhs->int_value, rhs->int_value, &result);
+                } else {
+                    Evaluate(EXPR_SUB, rhs->int_value, lhs->rhs->int_value, &result);
+                }
+                num_folded += 1;
+                expr->lhs = lhs->lhs;
+                expr->rhs = NewNumberExpr(result);
+                return SimplifyBinary(expr);
+            }
+        } break;
+        case EXPR_SUB: {
+            if (IsNum(rhs, 0)) {
+                num_identities += 1;
+                return lhs;
+            }
+            // x - c -> x + (-c), so that it combines with neighbouring constants
+            if (rhs->type == EXPR_NUM && rhs->int_value != INT_MIN && (lhs->type == EXPR_ADD || lhs->type == EXPR_SUB)) {
+                expr->type = EXPR_ADD;
+                expr->rhs = NewNumberExpr(-rhs->int_value);
+                return SimplifyBinary(expr);
+            }
+        } break;
+        case EXPR_MUL: {
+            // c * x -> x * c
+            if (lhs->type == EXPR_NUM && AstUtils_IsPure(rhs)) {
+                expr->lhs = rhs;
+                expr->rhs = lhs;
+                return SimplifyBinary(expr);
+            }
+            if (IsNum(rhs, 1)) {
+                num_identities += 1;
+                return lhs;
+            }
+            if (IsNum(rhs, 0) && AstUtils_IsPure(lhs)) {
+                num_identities += 1;
+                return rhs;
+            }
+            // (x * c1) * c2 -> x * (c1 * c2)
+            if (rhs->type == EXPR_NUM && lhs->type == EXPR_MUL && lhs->rhs->type == EXPR_NUM) {
+                Evaluate(EXPR_MUL, lhs->rhs->int_value, rhs->int_value, &result);
+                num_folded += 1;
+                expr->lhs = lhs->lhs;
+                expr->rhs = NewNumberExpr(result);
+                return SimplifyBinary(expr);
+            }
+        } break;
+        case EXPR_DIV: {
+            if (IsNum(rhs, 1)) {
+                num_identities += 1;
+                return lhs;
+            }
+        } break;
+    }
+
+    return expr;
+}
+
+// Fold an expression; reads of variables marked in assigned are never replaced
+static struct Expr *FoldExpr(struct Expr *expr, struct ConstantState *state, bool *assigned) {
+    if (!expr) {
+        return NULL;
+    }
+
+    switch (expr->type) {
+        case EXPR_NUM:
+        case EXPR_STR:
+        case EXPR_SIZEOF: {
+        } return expr;
+        case EXPR_VAR: {
+            int index = FindTrackedVar(expr->str_value);
+            if (index >= 0 && state->known[index] && !assigned[index]) {
+                num_propagated += 1;
+                return NewNumberExpr(state->values[index]);
+            }
+        } return expr;
+        case EXPR_FUNC_CALL: {
+            struct List *args = &expr->args;
+            for (int i = 0; i < args->count; ++i) {
+                args->data[i] = FoldExpr((struct Expr *) List_Get(args, i), state, assigned);
+            }
+        } return expr;
+        case EXPR_ADDR:
+        case EXPR_ASSIGN: {
+            // The variable itself is not read, only the address computation is folded
+            if (expr->lhs->type == EXPR_DEREF) {
+                expr->lhs->lhs = FoldExpr(expr->lhs->lhs, state, assigned);
+            }
+            expr->rhs = FoldExpr(expr->rhs, state, assigned);
+        } return expr;
+        case EXPR_PLUS: {
+            num_identities += 1;
+        } return FoldExpr(expr->lhs, state, assigned);
+        case EXPR_NEG: {
+            expr->lhs = FoldExpr(expr->lhs, state, assigned);
+            if (expr->lhs->type == EXPR_NUM) {
+                num_folded += 1;
+                return NewNumberExpr((int) (0u - (unsigned int) expr->lhs->int_value));
+            }
+            if (expr->lhs->type == EXPR_NEG) {
+                num_identities += 1;
+                return expr->lhs->lhs;
+            }
+        } return expr;
+        case EXPR_DEREF: {
+            expr->lhs = FoldExpr(expr->lhs, state, assigned);
+        } return expr;
+    }
+
+    expr->lhs = FoldExpr(expr->lhs, state, assigned);
+    expr->rhs = FoldExpr(expr->rhs, state, assigned);
+    return SimplifyBinary(expr);
+}
+
+// Fold an expression evaluated as a whole (statement, condition, initializer) and update the state
+static struct Expr *FoldFullExpr(struct Expr *expr, struct ConstantState *state) {
+    if (!expr) {
+        return NULL;
+    }
+
+    // Variables written inside the expression may be read before or after the write. The value
+    // stored by a top-level assignment is computed before the store, so its target is excluded.
+    bool *assigned = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    struct Expr *target = NULL;
+    if (expr->type == EXPR_ASSIGN && expr->lhs->type == EXPR_VAR) {
+        target = expr->lhs;
+        CollectAssigned(expr->rhs, assigned);
+    } else {
+        CollectAssigned(expr, assigned);
+    }
+    expr = FoldExpr(expr, state, assigned);
+    ForgetAssigned(state, assigned);
+    Memory_Free(MEMORY_SYMBOLS, assigned);
+
+    int index = target ? FindTrackedVar(target->str_value) : -1;
+    if (index >= 0) {
+        state->known[index] = expr->rhs->type == EXPR_NUM;
+        state->values[index] = TruncateToType(expr->rhs->int_value, tracked_types[index]);
+    }
+    return expr;
+}
+
+static void FoldLoop(struct Expr **condition, struct Expr **loop_expr, struct AstNode *body, struct ConstantState *state) {
+    // Values assigned anywhere in the loop are unknown at its header
+    bool *assigned = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    CollectAssigned(*condition, assigned);
+    CollectAssigned(*loop_expr, assigned);
+    CollectAssignedInStmt(body, assigned);
+    ForgetAssigned(state, assigned);
+    Memory_Free(MEMORY_SYMBOLS, assigned);
+
+    *condition = FoldFullExpr(*condition, state);
+    struct ConstantState body_state = CopyState(state);
+    FoldStmt(body, &body_state);
+    *loop_expr = FoldFullExpr(*loop_expr, &body_state);
+    FreeState(&body_state);
+}
+
+static void FoldStmt(struct AstNode *stmt, struct ConstantState *state) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                FoldStmt((struct AstNode *) List_Get(body, i), state);
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                struct Declarator *declarator = (struct Declarator *) List_Get(declarators, i);
+                declarator->value = FoldFullExpr(declarator->value, state);
+            }
+        } break;
+        case AST_EXPRESSION_STMT: {
+            struct ExpressionStmt *expression_stmt = (struct ExpressionStmt *) stmt;
+            expression_stmt->expr = FoldFullExpr(expression_stmt->expr, state);
+        } break;
+        case AST_RETURN_STMT: {
+            struct ReturnStmt *return_stmt = (struct ReturnStmt *) stmt;
+            return_stmt->expr = FoldFullExpr(return_stmt->expr, state);
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->condition = FoldFullExpr(if_stmt->condition, state);
+            struct ConstantState else_state = CopyState(state);
+            FoldStmt(if_stmt->stmt, state);
+            FoldStmt(if_stmt->else_branch, &else_state);
+            MeetStates(state, &else_state);
+            FreeState(&else_state);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            struct Expr *loop_expr = NULL;
+            FoldLoop(&while_stmt->condition, &loop_expr, while_stmt->stmt, state);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            for_stmt->init_expr = FoldFullExpr(for_stmt->init_expr, state);
+            FoldLoop(&for_stmt->cond_expr, &for_stmt->loop_expr, for_stmt->stmt, state);
+        } break;
+        case AST_NULL_STMT: {
+        } break;
+        default: {
+            ReportInternalError("ConstantFolding::FoldStmt - unknown statement");
+        } break;
+    }
+}
+
+static void FoldFunctionDef(struct FunctionDef *function) {
+    // Track every scalar local; arrays and pointers are addresses, not values
+    struct List *var_decls = &function->var_decls;
+    num_tracked_vars = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        num_tracked_vars += var_decl->declarators.count;
+    }
+
+    tracked_vars = NEW_ARRAY(MEMORY_SYMBOLS, struct Declarator *, num_tracked_vars);
+    tracked_types = NEW_ARRAY(MEMORY_SYMBOLS, enum PrimitiveType, num_tracked_vars);
+    int index = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        for (int j = 0; j < var_decl->declarators.count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(&var_decl->declarators, j);
+            bool is_scalar = declarator->array_dimensions == 0 && declarator->pointer_inderection == 0;
+            tracked_vars[index] = is_scalar ? declarator : NULL;
+            tracked_types[index] = var_decl->type;
+            index += 1;
+        }
+    }
+    ExcludeAddressTakenInStmt((struct AstNode *) function->body);
+
+    struct ConstantState state;
+    state.known = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    state.values = NEW_ARRAY(MEMORY_SYMBOLS, int, num_tracked_vars);
+    FoldStmt((struct AstNode *) function->body, &state);
+    FreeState(&state);
+
+    Memory_Free(MEMORY_SYMBOLS, tracked_vars);
+    Memory_Free(MEMORY_SYMBOLS, tracked_types);
+    tracked_vars = NULL;
+    tracked_types = NULL;
+    num_tracked_vars = 0;
+}
+
+// Evaluate constant subexpressions, apply algebraic identities and propagate constant locals
+void ConstantFolding_Run(struct TranslationUnit *t_unit) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        FoldFunctionDef(function);
+    }
+}
+
+// Print how many expressions were simplified
+void ConstantFolding_PrintStats(FILE *file) {
+    fprintf(file, "constant-folding:\n");
+    fprintf(file, "  %-20s %d\n", "folded", num_folded);
+    fprintf(file, "  %-20s %d\n", "identities", num_identities);
+    fprintf(file, "  %-20s %d\n", "propagated", num_propagated);
+}
@@ -0,0 +1,13 @@
+#ifndef BMS_CONSTANT_FOLDING_H
+#define BMS_CONSTANT_FOLDING_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Evaluate constant subexpressions, apply algebraic identities and propagate constant locals
+void ConstantFolding_Run(struct TranslationUnit *t_unit);
+
+// Print how many expressions were simplified
+void ConstantFolding_PrintStats(FILE *file);
+
+#endif // BMS_CONSTANT_FOLDING_H
@@ -0,0 +1,398 @@
+#include "DeadCode.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include "Vectorizer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Static function declarations
+static void LiveStmt(struct AstNode **slot, bool *live, bool remove);
+
+// Scalar locals whose stores can be removed, indexed like the live arrays
+static struct Declarator **tracked_vars;
+static int num_tracked_vars;
+
+static int num_unreachable = 0;
+static int num_dead_stores = 0;
+static int num_no_effect = 0;
+static int num_functions = 0;
+
+static int FindTrackedVar(char *identifier) {
+    for (int i = 0; i < num_tracked_vars; ++i) {
+        if (tracked_vars[i] && strcmp(tracked_vars[i]->identifier, identifier) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Stop tracking variables whose address is taken, since they can be read through pointers
+static void ExcludeAddressTaken(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        int index = FindTrackedVar(expr->lhs->str_value);
+        if (index >= 0) {
+            tracked_vars[index] = NULL;
+        }
+    }
+}
+
+static void VisitExcludeAddressTaken(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, ExcludeAddressTaken, data);
+}
+
+// Check whether executing a statement always ends in a return
+static bool AlwaysReturns(struct AstNode *stmt) {
+    if (!stmt) {
+        return false;
+    }
+
+    switch (stmt->type) {
+        case AST_RETURN_STMT:   return true;
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                if (AlwaysReturns((struct AstNode *) List_Get(body, i))) {
+                    return true;
+                }
+            }
+        } return false;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return AlwaysReturns(if_stmt->stmt) && AlwaysReturns(if_stmt->else_branch);
+        }
+        default:                return false;
+    }
+}
+
+// Remove the statements following a return and the branches of constant conditions
+static struct AstNode *RemoveUnreachable(struct AstNode *stmt) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                body->data[i] = RemoveUnreachable((struct AstNode *) List_Get(body, i));
+                if (AlwaysReturns((struct AstNode *) List_Get(body, i))) {
+                    while (body->count > i + 1) {
+                        List_Remove(body, body->count - 1);
+                        num_unreachable += 1;
+                    }
+                }
+            }
+        } return stmt;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->stmt = RemoveUnreachable(if_stmt->stmt);
+            if_stmt->else_branch = RemoveUnreachable(if_stmt->else_branch);
+            if (if_stmt->condition->type != EXPR_NUM) {
+                return stmt;
+            }
+            num_unreachable += 1;
+            struct AstNode *taken = if_stmt->condition->int_value != 0 ? if_stmt->stmt : if_stmt->else_branch;
+            return taken ? taken : NewNullStmt();
+        }
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            while_stmt->stmt = RemoveUnreachable(while_stmt->stmt);
+            if (while_stmt->condition->type == EXPR_NUM && while_stmt->condition->int_value == 0) {
+                num_unreachable += 1;
+                return NewNullStmt();
+            }
+        } return stmt;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            for_stmt->stmt = RemoveUnreachable(for_stmt->stmt);
+            struct Expr *cond = for_stmt->cond_expr;
+            if (cond && cond->type == EXPR_NUM && cond->int_value == 0) {
+                num_unreachable += 1;
+                return for_stmt->init_expr ? (struct AstNode *) NewExpressionStmt(for_stmt->init_expr) : NewNullStmt();
+            }
+        } return stmt;
+        default: {
+        } return stmt;
+    }
+}
+
+// Mark the tracked variables an expression reads
+static void AddUses(struct Expr *expr, bool *live) {
+    if (!expr) {
+        return;
+    }
+
+    switch (expr->type) {
+        case EXPR_NUM:
+        case EXPR_STR: {
+        } return;
+        case EXPR_VAR: {
+            int index = FindTrackedVar(expr->str_value);
+            if (index >= 0) live[index] = true;
+        } return;
+        case EXPR_FUNC_CALL: {
+            for (int i = 0; i < expr->args.count; ++i) {
+                AddUses((struct Expr *) List_Get(&expr->args, i), live);
+            }
+        } return;
+        case EXPR_ASSIGN: {
+            // A nested assignment is not removed, so it only contributes the uses of its operands
+            if (expr->lhs->type == EXPR_DEREF) AddUses(expr->lhs->lhs, live);
+            AddUses(expr->rhs, live);
+        } return;
+        default: {
+            AddUses(expr->lhs, live);
+            AddUses(expr->rhs, live);
+        } return;
+    }
+}
+
+// Update the live set across a full expression, removing the store of a top-level assignment to
+// a variable that is not read afterwards. Returns the expression that remains to be evaluated.
+static struct Expr *LiveExpr(struct Expr *expr, bool *live, bool remove) {
+    if (!expr) {
+        return NULL;
+    }
+
+    if (expr->type == EXPR_ASSIGN && expr->lhs->type == EXPR_VAR) {
+        int index = FindTrackedVar(expr->lhs->str_value);
+        if (index >= 0 && !live[index] && remove) {
+            num_dead_stores += 1;
+            AddUses(expr->rhs, live);
+            return expr->rhs;
+        }
+        if (index >= 0) live[index] = false;
+        AddUses(expr->rhs, live);
+        return expr;
+    }
+
+    AddUses(expr, live);
+    return expr;
+}
+
+// Drop an expression that is evaluated only for its value when the value is not used
+static struct Expr *RemoveNoEffect(struct Expr *expr, bool remove) {
+    if (expr && remove && AstUtils_IsPure(expr)) {
+        num_no_effect += 1;
+        return NULL;
+    }
+    return expr;
+}
+
+static void CopyLive(bool *dst, bool *src) {
+    memcpy(dst, src, sizeof(bool) * num_tracked_vars);
+}
+
+// Add the variables live in other to live, returning true if live changed
+static bool UnionLive(bool *live, bool *other) {
+    bool changed = false;
+    for (int i = 0; i < num_tracked_vars; ++i) {
+        if (other[i] && !live[i]) {
+            live[i] = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Compute the variables live at the header of a loop, which is the fixed point of adding the
+// variables live on entry to the body, then remove dead code from the body using that set
+static void LiveLoop(struct Expr **cond, struct AstNode **body, struct Expr **loop_expr, bool *live, bool remove) {
+    bool *header = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    bool *body_live = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    CopyLive(header, live);
+    AddUses(*cond, header);
+
+    bool changed = true;
+    while (changed) {
+        CopyLive(body_live, header);
+        if (loop_expr) LiveExpr(*loop_expr, body_live, false);
+        LiveStmt(body, body_live, false);
+        changed = UnionLive(header, body_live);
+    }
+
+    if (remove) {
+        CopyLive(body_live, header);
+        if (loop_expr) LiveExpr(*loop_expr, body_live, false);
+        LiveStmt(body, body_live, true);
+    }
+
+    CopyLive(live, header);
+    Memory_Free(MEMORY_SYMBOLS, header);
+    Memory_Free(MEMORY_SYMBOLS, body_live);
+}
+
+// Update the live set from after a statement to before it, removing dead code when remove is set
+static void LiveStmt(struct AstNode **slot, bool *live, bool remove) {
+    struct AstNode *stmt = *slot;
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = body->count - 1; i >= 0; --i) {
+                LiveStmt((struct AstNode **) &body->data[i], live, remove);
+                if (remove && ((struct AstNode *) List_Get(body, i))->type == AST_NULL_STMT) {
+                    List_Remove(body, i);
+                }
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = declarators->count - 1; i >= 0; --i) {
+                struct Declarator *declarator = (struct Declarator *) List_Get(declarators, i);
+                struct Expr *value = LiveExpr(declarator->value, live, remove);
+                declarator->value = value == declarator->value ? value : RemoveNoEffect(value, remove);
+            }
+        } break;
+        case AST_EXPRESSION_STMT: {
+            struct ExpressionStmt *expression_stmt = (struct ExpressionStmt *) stmt;
+            struct Expr *expr = RemoveNoEffect(LiveExpr(expression_stmt->expr, live, remove), remove);
+            expression_stmt->expr = expr;
+            if (!expr) *slot = NewNullStmt();
+        } break;
+        case AST_RETURN_STMT: {
+            // Nothing after a return is reached, so only the returned value is live
+            memset(live, 0, sizeof(bool) * num_tracked_vars);
+            AddUses(((struct ReturnStmt *) stmt)->expr, live);
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            bool *else_live = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+            CopyLive(else_live, live);
+            LiveStmt(&if_stmt->stmt, live, remove);
+            LiveStmt(&if_stmt->else_branch, else_live, remove);
+            UnionLive(live, else_live);
+            AddUses(if_stmt->condition, live);
+            Memory_Free(MEMORY_SYMBOLS, else_live);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            LiveLoop(&while_stmt->condition, &while_stmt->stmt, NULL, live, remove);
+        } break;
+        case AST_FOR_STMT: {
+            // Vectorized loops run copies of their body, which must stay in sync with it
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            bool remove_body = remove && !Vectorizer_Find(for_stmt);
+            LiveLoop(&for_stmt->cond_expr, &for_stmt->stmt, &for_stmt->loop_expr, live, remove_body);
+            LiveExpr(for_stmt->init_expr, live, false);
+        } break;
+        case AST_NULL_STMT: {
+        } break;
+        default: {
+            ReportInternalError("DeadCode::LiveStmt - unknown statement");
+        } break;
+    }
+}
+
+static void RemoveDeadStores(struct FunctionDef *function) {
+    struct List *var_decls = &function->var_decls;
+    num_tracked_vars = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        num_tracked_vars += var_decl->declarators.count;
+    }
+
+    tracked_vars = NEW_ARRAY(MEMORY_SYMBOLS, struct Declarator *, num_tracked_vars);
+    int index = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(var_decls, i);
+        for (int j = 0; j < var_decl->declarators.count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(&var_decl->declarators, j);
+            tracked_vars[index] = declarator->array_dimensions == 0 ? declarator : NULL;
+            index += 1;
+        }
+    }
+    AstUtils_WalkStmt((struct AstNode *) function->body, VisitExcludeAddressTaken, NULL);
+
+    // Locals are dead when the function returns
+    bool *live = NEW_ARRAY(MEMORY_SYMBOLS, bool, num_tracked_vars);
+    LiveStmt((struct AstNode **) &function->body, live, true);
+    Memory_Free(MEMORY_SYMBOLS, live);
+
+    Memory_Free(MEMORY_SYMBOLS, tracked_vars);
+    tracked_vars = NULL;
+    num_tracked_vars = 0;
+}
+
+static struct FunctionDef *FindFunction(struct TranslationUnit *t_unit, char *identifier) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        if (strcmp(function->identifier, identifier) == 0) {
+            return function;
+        }
+    }
+    return NULL;
+}
+
+static void CollectCalls(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_FUNC_CALL) {
+        List_Add((struct List *) data, expr->str_value);
+    }
+}
+
+static void VisitCollectCalls(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CollectCalls, data);
+}
+
+// Delete the functions that main never calls, directly or indirectly
+static void RemoveUncalledFunctions(struct TranslationUnit *t_unit) {
+    struct FunctionDef *main_function = FindFunction(t_unit, "main");
+    if (!main_function) {
+        return;
+    }
+
+    struct List reachable;
+    List_Init(&reachable);
+    List_Add(&reachable, main_function);
+    for (int i = 0; i < reachable.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&reachable, i);
+        struct List calls;
+        List_Init(&calls);
+        AstUtils_WalkStmt((struct AstNode *) function->body, VisitCollectCalls, &calls);
+        for (int j = 0; j < calls.count; ++j) {
+            struct FunctionDef *callee = FindFunction(t_unit, (char *) List_Get(&calls, j));
+            bool seen = false;
+            for (int k = 0; k < reachable.count; ++k) {
+                seen = seen || List_Get(&reachable, k) == callee;
+            }
+            if (callee && !seen) List_Add(&reachable, callee);
+        }
+        List_Free(&calls);
+    }
+
+    for (int i = t_unit->functions.count - 1; i >= 0; --i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        bool seen = false;
+        for (int k = 0; k < reachable.count; ++k) {
+            seen = seen || List_Get(&reachable, k) == function;
+        }
+        if (!seen) {
+            List_Remove(&t_unit->functions, i);
+            num_functions += 1;
+        }
+    }
+    List_Free(&reachable);
+}
+
+// Remove unreachable statements, dead stores, statements without effect and functions never called from main
+void DeadCode_Run(struct TranslationUnit *t_unit) {
+    RemoveUncalledFunctions(t_unit);
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        RemoveUnreachable((struct AstNode *) function->body);
+        RemoveDeadStores(function);
+    }
+}
+
+// Print how many statements and functions were removed
+void DeadCode_PrintStats(FILE *file) {
+    fprintf(file, "dead-code:\n");
+    fprintf(file, "  %-20s %d\n", "unreachable", num_unreachable);
+    fprintf(file, "  %-20s %d\n", "dead-stores", num_dead_stores);
+    fprintf(file, "  %-20s %d\n", "no-effect", num_no_effect);
+    fprintf(file, "  %-20s %d\n", "functions", num_functions);
+}
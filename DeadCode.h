@@ -0,0 +1,13 @@
+#ifndef BMS_DEAD_CODE_H
+#define BMS_DEAD_CODE_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Remove unreachable statements, dead stores, statements without effect and functions never called from main
+void DeadCode_Run(struct TranslationUnit *t_unit);
+
+// Print how many statements and functions were removed
+void DeadCode_PrintStats(FILE *file);
+
+#endif // BMS_DEAD_CODE_H
@@ -0,0 +1,252 @@
+#include "ElfWriter.h"
+#include "Memory.h"
+#include "OutputBuffer.h"
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT_ALIGNMENT 32           // Largest alignment of a loop header, see -falign-loops
+
+enum {
+    SECTION_NULL,
+    SECTION_TEXT,
+    SECTION_DATA,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_RELA_TEXT,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE_GNU_STACK,
+    SECTION_COUNT,
+};
+
+// A symbol table entry by name, sorted to find the symbol a relocation refers to
+struct SymbolName {
+    char *label;
+    int index;
+};
+
+static const char section_names[] = "\0.text\0.data\0.symtab\0.strtab\0.rela.text\0.shstrtab\0.note.GNU-stack";
+
+static int CompareSymbolNames(const void *a, const void *b) {
+    return strcmp(((struct SymbolName *) a)->label, ((struct SymbolName *) b)->label);
+}
+
+static int CompareLabels(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+// Offset of a name in section_names
+static int SectionName(const char *name) {
+    for (int i = 0; i < (int) sizeof(section_names); i += (int) strlen(section_names + i) + 1) {
+        if (strcmp(section_names + i, name) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static void WritePadding(struct OutputBuffer *output, long long *offset, int alignment) {
+    static const char zeros[16] = { 0 };
+    int padding = (int) ((alignment - *offset % alignment) % alignment);
+    OutputBuffer_Write(output, zeros, padding);
+    *offset += padding;
+}
+
+static Elf64_Sym MakeSymbol(int name, int bind, int type, int section, long long value, long long size) {
+    Elf64_Sym symbol;
+    memset(&symbol, 0, sizeof(symbol));
+    symbol.st_name = (Elf64_Word) name;
+    symbol.st_info = (unsigned char) ELF64_ST_INFO(bind, type);
+    symbol.st_shndx = (Elf64_Section) section;
+    symbol.st_value = (Elf64_Addr) value;
+    symbol.st_size = (Elf64_Xword) size;
+    return symbol;
+}
+
+static Elf64_Shdr MakeSection(const char *name, int type, int flags, long long offset, long long size, int link, int info,
+                              int alignment, int entry_size) {
+    Elf64_Shdr section;
+    memset(&section, 0, sizeof(section));
+    section.sh_name = (Elf64_Word) SectionName(name);
+    section.sh_type = (Elf64_Word) type;
+    section.sh_flags = (Elf64_Xword) flags;
+    section.sh_offset = (Elf64_Off) offset;
+    section.sh_size = (Elf64_Xword) size;
+    section.sh_link = (Elf64_Word) link;
+    section.sh_info = (Elf64_Word) info;
+    section.sh_addralign = (Elf64_Xword) alignment;
+    section.sh_entsize = (Elf64_Xword) entry_size;
+    return section;
+}
+
+// Write the encoded text and the data section as an ELF64 relocatable object
+bool ElfWriter_Write(FILE *file, struct MachineCode *code, struct DataSection *data) {
+    struct OutputBuffer strtab;
+    OutputBuffer_Init(&strtab);
+    OutputBuffer_Write(&strtab, "", 1);
+
+    // Labels that are referenced but defined in neither section, such as printf
+    char **externs = NEW_ARRAY(MEMORY_CODEGEN, char *, code->num_fixups);
+    int num_externs = 0;
+    struct SymbolName *data_names = NEW_ARRAY(MEMORY_CODEGEN, struct SymbolName, data->count);
+    for (int i = 0; i < data->count; ++i) {
+        data_names[i].label = data->data[i].label;
+        data_names[i].index = i;
+    }
+    qsort(data_names, data->count, sizeof(struct SymbolName), CompareSymbolNames);
+    for (int i = 0; i < code->num_fixups; ++i) {
+        struct SymbolName key = { code->fixups[i].label, 0 };
+        if (!bsearch(&key, data_names, data->count, sizeof(struct SymbolName), CompareSymbolNames)
+            && MachineCode_FindSymbol(code, code->fixups[i].label) < 0) {
+            externs[num_externs] = code->fixups[i].label;
+            num_externs += 1;
+        }
+    }
+    qsort(externs, num_externs, sizeof(char *), CompareLabels);
+    int num_unique = 0;
+    for (int i = 0; i < num_externs; ++i) {
+        if (num_unique == 0 || strcmp(externs[num_unique - 1], externs[i]) != 0) {
+            externs[num_unique] = externs[i];
+            num_unique += 1;
+        }
+    }
+    num_externs = num_unique;
+
+    // Local symbols come first: the section symbols, the labels of the text and the strings of the data
+    int capacity = 3 + code->num_symbols + data->count + num_externs;
+    Elf64_Sym *symbols = NEW_ARRAY(MEMORY_CODEGEN, Elf64_Sym, capacity);
+    struct SymbolName *names = NEW_ARRAY(MEMORY_CODEGEN, struct SymbolName, capacity);
+    int num_symbols = 0;
+    int num_names = 0;
+    symbols[num_symbols++] = MakeSymbol(0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+    symbols[num_symbols++] = MakeSymbol(0, STB_LOCAL, STT_SECTION, SECTION_TEXT, 0, 0);
+    symbols[num_symbols++] = MakeSymbol(0, STB_LOCAL, STT_SECTION, SECTION_DATA, 0, 0);
+
+    int main_offset = -1;
+    for (int i = 0; i < code->num_symbols; ++i) {
+        struct CodeSymbol *symbol = &code->symbols[i];
+        if (strcmp(symbol->label, "main") == 0) {
+            main_offset = symbol->offset;
+            continue;
+        }
+        symbols[num_symbols] = MakeSymbol((int) strtab.size, STB_LOCAL, STT_NOTYPE, SECTION_TEXT, symbol->offset, 0);
+        OutputBuffer_Write(&strtab, symbol->label, (int) strlen(symbol->label) + 1);
+        num_symbols += 1;
+    }
+
+    long long data_size = 0;
+    for (int i = 0; i < data->count; ++i) {
+        struct DataField *field = &data->data[i];
+        symbols[num_symbols] = MakeSymbol((int) strtab.size, STB_LOCAL, STT_OBJECT, SECTION_DATA, data_size, field->size);
+        OutputBuffer_Write(&strtab, field->label, (int) strlen(field->label) + 1);
+        names[num_names].label = field->label;
+        names[num_names].index = num_symbols;
+        num_names += 1;
+        num_symbols += 1;
+        data_size += field->size;
+    }
+
+    int first_global = num_symbols;
+    if (main_offset >= 0) {
+        symbols[num_symbols] = MakeSymbol((int) strtab.size, STB_GLOBAL, STT_FUNC, SECTION_TEXT, main_offset, 0);
+        OutputBuffer_Write(&strtab, "main", 5);
+        num_symbols += 1;
+    }
+    for (int i = 0; i < num_externs; ++i) {
+        symbols[num_symbols] = MakeSymbol((int) strtab.size, STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+        OutputBuffer_Write(&strtab, externs[i], (int) strlen(externs[i]) + 1);
+        names[num_names].label = externs[i];
+        names[num_names].index = num_symbols;
+        num_names += 1;
+        num_symbols += 1;
+    }
+    qsort(names, num_names, sizeof(struct SymbolName), CompareSymbolNames);
+
+    // Calls to external functions go through the PLT, addresses of strings are rip relative
+    Elf64_Rela *relocations = NEW_ARRAY(MEMORY_CODEGEN, Elf64_Rela, code->num_fixups);
+    for (int i = 0; i < code->num_fixups; ++i) {
+        struct CodeFixup *fixup = &code->fixups[i];
+        struct SymbolName key = { fixup->label, 0 };
+        struct SymbolName *name = (struct SymbolName *) bsearch(&key, names, num_names, sizeof(struct SymbolName), CompareSymbolNames);
+        int type = fixup->kind == FIXUP_BRANCH ? R_X86_64_PLT32 : R_X86_64_PC32;
+        relocations[i].r_offset = (Elf64_Addr) fixup->offset;
+        relocations[i].r_info = ELF64_R_INFO(name->index, type);
+        relocations[i].r_addend = fixup->addend;
+    }
+
+    // Layout: header, text, data, symbols, strings, relocations, section names, section headers
+    struct OutputBuffer output;
+    OutputBuffer_Init(&output);
+    Elf64_Shdr sections[SECTION_COUNT];
+    memset(sections, 0, sizeof(sections));
+    long long offset = sizeof(Elf64_Ehdr);
+
+    Elf64_Ehdr header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_REL;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = SECTION_COUNT;
+    header.e_shstrndx = SECTION_SHSTRTAB;
+    OutputBuffer_Write(&output, (char *) &header, sizeof(header));
+
+    WritePadding(&output, &offset, TEXT_ALIGNMENT);
+    sections[SECTION_TEXT] = MakeSection(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, offset, code->size, 0, 0, TEXT_ALIGNMENT, 0);
+    OutputBuffer_Write(&output, (char *) code->text, code->size);
+    offset += code->size;
+
+    sections[SECTION_DATA] = MakeSection(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, offset, data_size, 0, 0, 1, 0);
+    for (int i = 0; i < data->count; ++i) {
+        OutputBuffer_Write(&output, (char *) data->data[i].bytes, data->data[i].size);
+    }
+    offset += data_size;
+
+    WritePadding(&output, &offset, 8);
+    long long symtab_size = (long long) sizeof(Elf64_Sym) * num_symbols;
+    sections[SECTION_SYMTAB] = MakeSection(".symtab", SHT_SYMTAB, 0, offset, symtab_size, SECTION_STRTAB, first_global, 8, sizeof(Elf64_Sym));
+    OutputBuffer_Write(&output, (char *) symbols, (int) symtab_size);
+    offset += symtab_size;
+
+    sections[SECTION_STRTAB] = MakeSection(".strtab", SHT_STRTAB, 0, offset, strtab.size, 0, 0, 1, 0);
+    for (int i = 0; i < strtab.count; ++i) {
+        OutputBuffer_Write(&output, strtab.chunks[i].data, strtab.chunks[i].size);
+    }
+    offset += strtab.size;
+
+    WritePadding(&output, &offset, 8);
+    long long rela_size = (long long) sizeof(Elf64_Rela) * code->num_fixups;
+    sections[SECTION_RELA_TEXT] = MakeSection(".rela.text", SHT_RELA, SHF_INFO_LINK, offset, rela_size, SECTION_SYMTAB, SECTION_TEXT, 8, sizeof(Elf64_Rela));
+    OutputBuffer_Write(&output, (char *) relocations, (int) rela_size);
+    offset += rela_size;
+
+    sections[SECTION_SHSTRTAB] = MakeSection(".shstrtab", SHT_STRTAB, 0, offset, sizeof(section_names), 0, 0, 1, 0);
+    OutputBuffer_Write(&output, section_names, sizeof(section_names));
+    offset += sizeof(section_names);
+
+    // Marks the stack as not executable
+    sections[SECTION_NOTE_GNU_STACK] = MakeSection(".note.GNU-stack", SHT_PROGBITS, 0, offset, 0, 0, 0, 1, 0);
+
+    WritePadding(&output, &offset, 8);
+    OutputBuffer_Write(&output, (char *) sections, sizeof(sections));
+
+    // The section header offset is only known now, patch it into the header at the start of the first chunk
+    Elf64_Ehdr *written_header = (Elf64_Ehdr *) output.chunks[0].data;
+    written_header->e_shoff = (Elf64_Off) offset;
+
+    bool ok = OutputBuffer_Flush(&output, file);
+    OutputBuffer_Free(&output);
+    OutputBuffer_Free(&strtab);
+    Memory_Free(MEMORY_CODEGEN, relocations);
+    Memory_Free(MEMORY_CODEGEN, names);
+    Memory_Free(MEMORY_CODEGEN, symbols);
+    Memory_Free(MEMORY_CODEGEN, data_names);
+    Memory_Free(MEMORY_CODEGEN, externs);
+    return ok;
+}
@@ -0,0 +1,14 @@
+#ifndef BMS_ELF_WRITER_H
+#define BMS_ELF_WRITER_H
+
+#include "Encoder.h"
+#include "Instruction.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Write the encoded text and the data section as an ELF64 relocatable object. main is exported,
+// labels referenced but not defined (such as printf) become undefined symbols with PLT32 relocations,
+// and references to the data section become PC32 relocations. Returns false if the write failed.
+bool ElfWriter_Write(FILE *file, struct MachineCode *code, struct DataSection *data);
+
+#endif // BMS_ELF_WRITER_H
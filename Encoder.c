@@ -0,0 +1,700 @@
+#include "Encoder.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENCODING_MAX_LENGTH 16
+
+// Bytes of one encoded instruction, and the label its 32-bit or branch field refers to
+struct Encoding {
+    unsigned char bytes[ENCODING_MAX_LENGTH];
+    int length;
+    int field;                      // Position of the label field in bytes, -1 if there is none
+    char *label;
+    enum FixupKind kind;
+    int target;                     // Index of the label instruction of a local branch, -1 otherwise
+    bool is_short;                  // Local branch with a rel8 field
+};
+
+// A label of the function being assembled, sorted by name to find branch targets
+struct LocalLabel {
+    char *label;
+    int index;
+};
+
+// Instruction forms that are only told apart by prefixes and opcode bytes
+struct VectorOpcode {
+    int prefix;                     // 0x66 or 0xf3, implied by VEX.pp in AVX form
+    int map;                        // 1 for 0f, 2 for 0f 38
+    int opcode;
+    int store_opcode;               // Form with the memory operand as destination, 0 if none
+    bool has_vvvv;                  // AVX form takes a separate first source
+};
+
+static struct VectorOpcode vector_opcodes[OP_COUNT] = {
+    [OP_MOVD]           = { 0x66, 1, 0x6e, 0,    false },
+    [OP_MOVDQA]         = { 0x66, 1, 0x6f, 0x7f, false },
+    [OP_MOVDQU]         = { 0xf3, 1, 0x6f, 0x7f, false },
+    [OP_PADDB]          = { 0x66, 1, 0xfc, 0,    true },
+    [OP_PADDD]          = { 0x66, 1, 0xfe, 0,    true },
+    [OP_PMULLD]         = { 0x66, 2, 0x40, 0,    true },
+    [OP_PSUBB]          = { 0x66, 1, 0xf8, 0,    true },
+    [OP_PSUBD]          = { 0x66, 1, 0xfa, 0,    true },
+    [OP_PUNPCKLBW]      = { 0x66, 1, 0x60, 0,    true },
+    [OP_PUNPCKLDQ]      = { 0x66, 1, 0x62, 0,    true },
+    [OP_PUNPCKLQDQ]     = { 0x66, 1, 0x6c, 0,    true },
+    [OP_PUNPCKLWD]      = { 0x66, 1, 0x61, 0,    true },
+    [OP_PXOR]           = { 0x66, 1, 0xef, 0,    true },
+    [OP_VPBROADCASTB]   = { 0x66, 2, 0x78, 0,    false },
+    [OP_VPBROADCASTD]   = { 0x66, 2, 0x58, 0,    false },
+};
+
+// Condition codes in the low nibble of jcc and setcc opcodes
+static int condition_codes[COND_COUNT] = {
+    [COND_E]  = 0x4,
+    [COND_NE] = 0x5,
+    [COND_L]  = 0xc,
+    [COND_G]  = 0xf,
+    [COND_LE] = 0xe,
+    [COND_GE] = 0xd,
+    [COND_B]  = 0x2,
+    [COND_A]  = 0x7,
+    [COND_BE] = 0x6,
+    [COND_AE] = 0x3,
+};
+
+// Recommended multi-byte nops, indexed by length
+static const unsigned char nops[10][9] = {
+    { 0 },
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0f, 0x1f, 0x00 },
+    { 0x0f, 0x1f, 0x40, 0x00 },
+    { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+// Functions are assembled on several threads at once
+static atomic_int num_bytes = 0;
+static atomic_int num_short_branches = 0;
+static atomic_int num_long_branches = 0;
+
+static void Byte(struct Encoding *encoding, int value) {
+    if (encoding->length == ENCODING_MAX_LENGTH) {
+        ReportInternalError("Encoder::Byte - instruction too long");
+    }
+    encoding->bytes[encoding->length] = (unsigned char) value;
+    encoding->length += 1;
+}
+
+// Append a little endian immediate or displacement
+static void Bytes(struct Encoding *encoding, long long value, int size) {
+    for (int i = 0; i < size; ++i) {
+        Byte(encoding, (int) ((value >> (8 * i)) & 0xff));
+    }
+}
+
+static bool FitsInt8(long long value) {
+    return value >= -128 && value <= 127;
+}
+
+static bool FitsInt32(long long value) {
+    return value >= -2147483648LL && value <= 2147483647LL;
+}
+
+// Hardware number of a general purpose or vector register, 0 to 15
+static int RegCode(enum Reg reg) {
+    return reg >= REG_XMM0 ? reg - REG_XMM0 : reg;
+}
+
+// spl, bpl, sil and dil need a REX prefix, without one the same codes mean ah, ch, dh and bh
+static bool NeedsRex(struct Operand *operand) {
+    return operand->kind == OPERAND_REG && operand->size == 1 && operand->reg >= REG_RSP && operand->reg <= REG_RDI;
+}
+
+// The REX.R, REX.X and REX.B bits an operand in the r/m field needs
+static int RexBits(int reg, struct Operand *rm) {
+    int rex = (reg & 8) ? 4 : 0;
+    if (rm->kind == OPERAND_REG) {
+        rex |= (RegCode(rm->reg) & 8) ? 1 : 0;
+    } else if (rm->kind == OPERAND_MEM) {
+        rex |= rm->index != REG_NONE && (RegCode(rm->index) & 8) ? 2 : 0;
+        rex |= (RegCode(rm->reg) & 8) ? 1 : 0;
+    }
+    return rex;
+}
+
+// Append the ModRM byte, SIB byte and displacement of an r/m operand. Labels become rip relative.
+static void ModRM(struct Encoding *encoding, int reg, struct Operand *rm) {
+    reg &= 7;
+    if (rm->kind == OPERAND_REG) {
+        Byte(encoding, 0xc0 | reg << 3 | (RegCode(rm->reg) & 7));
+        return;
+    }
+    if (rm->kind == OPERAND_LABEL) {
+        Byte(encoding, 0x05 | reg << 3);
+        encoding->field = encoding->length;
+        encoding->label = rm->label;
+        encoding->kind = FIXUP_ADDRESS;
+        Bytes(encoding, 0, 4);
+        return;
+    }
+    if (rm->kind != OPERAND_MEM || rm->reg == REG_NONE) {
+        ReportInternalError("Encoder::ModRM - unsupported operand");
+    }
+
+    // rbp and r13 as base always take a displacement, rsp and r12 always take a SIB byte
+    int base = RegCode(rm->reg) & 7;
+    long long disp = rm->value;
+    int mod = disp == 0 && base != 5 ? 0 : FitsInt8(disp) ? 1 : 2;
+    bool has_sib = rm->index != REG_NONE || base == 4;
+    Byte(encoding, mod << 6 | reg << 3 | (has_sib ? 4 : base));
+    if (has_sib) {
+        int index = rm->index != REG_NONE ? RegCode(rm->index) & 7 : 4;
+        int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        Byte(encoding, scale << 6 | index << 3 | base);
+    }
+    if (mod == 1) Bytes(encoding, disp, 1);
+    if (mod == 2) Bytes(encoding, disp, 4);
+}
+
+// Encode [prefix] [REX] opcode ModRM ..., with reg holding a register or an opcode extension
+static void EncodeRM(struct Encoding *encoding, int prefix, bool rex_w, bool force_rex, int opcode_length, int opcode,
+                     int reg, struct Operand *rm) {
+    int rex = 0x40 | (rex_w ? 8 : 0) | RexBits(reg, rm);
+    if (prefix) {
+        Byte(encoding, prefix);
+    }
+    if (rex != 0x40 || force_rex) {
+        Byte(encoding, rex);
+    }
+    for (int i = opcode_length - 1; i >= 0; --i) {
+        Byte(encoding, (opcode >> (8 * i)) & 0xff);
+    }
+    ModRM(encoding, reg, rm);
+}
+
+// Encode an opcode with the register in its low three bits, as in push r64 or mov r32, imm32
+static void EncodeOpReg(struct Encoding *encoding, int prefix, bool rex_w, bool force_rex, int opcode, enum Reg reg) {
+    int rex = 0x40 | (rex_w ? 8 : 0) | ((RegCode(reg) & 8) ? 1 : 0);
+    if (prefix) {
+        Byte(encoding, prefix);
+    }
+    if (rex != 0x40 || force_rex) {
+        Byte(encoding, rex);
+    }
+    Byte(encoding, opcode | (RegCode(reg) & 7));
+}
+
+// Encode an AVX instruction with a VEX prefix, using the two byte form when no REX.X, REX.B or W is needed
+static void EncodeVex(struct Encoding *encoding, struct VectorOpcode *vector, bool rex_w, bool wide, int reg, int vvvv,
+                      struct Operand *rm) {
+    int pp = vector->prefix == 0x66 ? 1 : vector->prefix == 0xf3 ? 2 : vector->prefix == 0xf2 ? 3 : 0;
+    int rex = RexBits(reg, rm);
+    int inverted = ((rex & 4) ? 0 : 0x80) | ((rex & 2) ? 0 : 0x40) | ((rex & 1) ? 0 : 0x20);
+    int tail = (~vvvv & 15) << 3 | (wide ? 4 : 0) | pp;
+    if (vector->map == 1 && !rex_w && !(rex & 3)) {
+        Byte(encoding, 0xc5);
+        Byte(encoding, (inverted & 0x80) | tail);
+    } else {
+        Byte(encoding, 0xc4);
+        Byte(encoding, inverted | vector->map);
+        Byte(encoding, (rex_w ? 0x80 : 0) | tail);
+    }
+    Byte(encoding, vector->opcode);
+    ModRM(encoding, reg, rm);
+}
+
+static bool IsYmm(struct Operand *operand) {
+    return operand->kind == OPERAND_REG && operand->size == 32;
+}
+
+// Encode an SSE instruction, or its VEX encoded AVX form when it operates on ymm registers, as the
+// assembly writer spells it
+static void EncodeVector(struct Encoding *encoding, struct Instruction *instr) {
+    struct VectorOpcode vector = vector_opcodes[instr->opcode];
+    struct Operand *dst = &instr->dst;
+    struct Operand *src = &instr->src;
+    bool vex = IsYmm(dst) || IsYmm(src) || instr->opcode == OP_VPBROADCASTB || instr->opcode == OP_VPBROADCASTD;
+    bool wide = (IsYmm(dst) || IsYmm(src)) && instr->opcode != OP_MOVD;
+    bool rex_w = instr->opcode == OP_MOVD && src->size == 8;
+
+    // Stores put the register in the reg field and the memory in r/m
+    struct Operand *reg = dst;
+    struct Operand *rm = src;
+    if (dst->kind == OPERAND_MEM) {
+        if (!vector.store_opcode) {
+            ReportInternalError("Encoder::EncodeVector - unsupported store");
+        }
+        vector.opcode = vector.store_opcode;
+        reg = src;
+        rm = dst;
+    }
+
+    int reg_code = RegCode(reg->reg);
+    if (vex) {
+        EncodeVex(encoding, &vector, rex_w, wide, reg_code, vector.has_vvvv ? RegCode(dst->reg) : 0, rm);
+    } else {
+        int opcode = vector.map == 2 ? 0x0f3800 | vector.opcode : 0x0f00 | vector.opcode;
+        EncodeRM(encoding, vector.prefix, rex_w, false, vector.map == 2 ? 3 : 2, opcode, reg_code, rm);
+    }
+}
+
+// Width of the operation, taken from a register operand, then from the memory operand
+static int OperandSize(struct Instruction *instr) {
+    if (instr->dst.kind == OPERAND_REG) return instr->dst.size;
+    if (instr->src.kind == OPERAND_REG) return instr->src.size;
+    if (instr->dst.size) return instr->dst.size;
+    return 8;
+}
+
+// add, sub and cmp, told apart by the opcode extension ext
+static void EncodeArithmetic(struct Encoding *encoding, struct Instruction *instr, int ext) {
+    struct Operand *dst = &instr->dst;
+    struct Operand *src = &instr->src;
+    int size = OperandSize(instr);
+    int prefix = size == 2 ? 0x66 : 0;
+    bool rex_w = size == 8;
+    bool force_rex = NeedsRex(dst) || NeedsRex(src);
+
+    if (src->kind == OPERAND_IMM) {
+        if (size == 1) {
+            EncodeRM(encoding, prefix, rex_w, force_rex, 1, 0x80, ext, dst);
+            Bytes(encoding, src->value, 1);
+        } else if (FitsInt8(src->value)) {
+            EncodeRM(encoding, prefix, rex_w, force_rex, 1, 0x83, ext, dst);
+            Bytes(encoding, src->value, 1);
+        } else {
+            EncodeRM(encoding, prefix, rex_w, force_rex, 1, 0x81, ext, dst);
+            Bytes(encoding, src->value, size == 2 ? 2 : 4);
+        }
+    } else if (src->kind == OPERAND_REG) {
+        EncodeRM(encoding, prefix, rex_w, force_rex, 1, ext * 8 + (size == 1 ? 0x00 : 0x01), RegCode(src->reg), dst);
+    } else {
+        EncodeRM(encoding, prefix, rex_w, force_rex, 1, ext * 8 + (size == 1 ? 0x02 : 0x03), RegCode(dst->reg), src);
+    }
+}
+
+static void EncodeMov(struct Encoding *encoding, struct Instruction *instr) {
+    struct Operand *dst = &instr->dst;
+    struct Operand *src = &instr->src;
+    int size = OperandSize(instr);
+    int prefix = size == 2 ? 0x66 : 0;
+    bool rex_w = size == 8;
+    bool force_rex = NeedsRex(dst) || NeedsRex(src);
+
+    switch (src->kind) {
+        case OPERAND_IMM: {
+            if (dst->kind == OPERAND_MEM) {
+                EncodeRM(encoding, prefix, rex_w, false, 1, size == 1 ? 0xc6 : 0xc7, 0, dst);
+                Bytes(encoding, src->value, size == 1 ? 1 : size == 2 ? 2 : 4);
+            } else if (size == 1) {
+                EncodeOpReg(encoding, 0, false, force_rex, 0xb0, dst->reg);
+                Bytes(encoding, src->value, 1);
+            } else if (size == 8 && src->value >= 0 && src->value <= 0xffffffffLL) {
+                // Writing the 32-bit register clears the upper half
+                EncodeOpReg(encoding, 0, false, false, 0xb8, dst->reg);
+                Bytes(encoding, src->value, 4);
+            } else if (size == 8 && FitsInt32(src->value)) {
+                EncodeRM(encoding, 0, true, false, 1, 0xc7, 0, dst);
+                Bytes(encoding, src->value, 4);
+            } else {
+                EncodeOpReg(encoding, prefix, rex_w, false, 0xb8, dst->reg);
+                Bytes(encoding, src->value, size);
+            }
+        } break;
+        case OPERAND_REG: {
+            EncodeRM(encoding, prefix, rex_w, force_rex, 1, size == 1 ? 0x88 : 0x89, RegCode(src->reg), dst);
+        } break;
+        case OPERAND_MEM: {
+            EncodeRM(encoding, prefix, rex_w, force_rex, 1, size == 1 ? 0x8a : 0x8b, RegCode(dst->reg), src);
+        } break;
+        case OPERAND_LABEL: {
+            // The address of a label, as lea reg, [rel label]
+            EncodeRM(encoding, 0, true, false, 1, 0x8d, RegCode(dst->reg), src);
+        } break;
+        default: {
+            ReportInternalError("Encoder::EncodeMov - unsupported operands");
+        } break;
+    }
+}
+
+// shl, shr and sar by a constant
+static void EncodeShift(struct Encoding *encoding, struct Instruction *instr, int ext) {
+    int size = OperandSize(instr);
+    bool rex_w = size == 8;
+    bool force_rex = NeedsRex(&instr->dst);
+    if (instr->src.value == 1) {
+        EncodeRM(encoding, 0, rex_w, force_rex, 1, size == 1 ? 0xd0 : 0xd1, ext, &instr->dst);
+    } else {
+        EncodeRM(encoding, 0, rex_w, force_rex, 1, size == 1 ? 0xc0 : 0xc1, ext, &instr->dst);
+        Bytes(encoding, instr->src.value, 1);
+    }
+}
+
+// neg and idiv, which take a single r/m operand
+static void EncodeUnary(struct Encoding *encoding, struct Instruction *instr, int ext) {
+    int size = OperandSize(instr);
+    EncodeRM(encoding, size == 2 ? 0x66 : 0, size == 8, NeedsRex(&instr->dst), 1, size == 1 ? 0xf6 : 0xf7, ext, &instr->dst);
+}
+
+// Encode an instruction whose length does not depend on where it is placed
+static void Encode(struct Encoding *encoding, struct Instruction *instr) {
+    struct Operand *dst = &instr->dst;
+    struct Operand *src = &instr->src;
+    encoding->length = 0;
+    encoding->field = -1;
+    encoding->label = NULL;
+    encoding->target = -1;
+    encoding->is_short = false;
+
+    if (vector_opcodes[instr->opcode].opcode) {
+        EncodeVector(encoding, instr);
+        return;
+    }
+
+    switch (instr->opcode) {
+        case OP_NOP:
+        case OP_COMMENT:
+        case OP_LABEL:
+        case OP_ALIGN:      break;
+        case OP_ADD:        { EncodeArithmetic(encoding, instr, 0); } break;
+        case OP_SUB:        { EncodeArithmetic(encoding, instr, 5); } break;
+        case OP_CMP:        { EncodeArithmetic(encoding, instr, 7); } break;
+        case OP_MOV:        { EncodeMov(encoding, instr); } break;
+        case OP_SHL:        { EncodeShift(encoding, instr, 4); } break;
+        case OP_SHR:        { EncodeShift(encoding, instr, 5); } break;
+        case OP_SAR:        { EncodeShift(encoding, instr, 7); } break;
+        case OP_NEG:        { EncodeUnary(encoding, instr, 3); } break;
+        case OP_IDIV:       { EncodeUnary(encoding, instr, 7); } break;
+        case OP_CQO:        { Byte(encoding, 0x48); Byte(encoding, 0x99); } break;
+        case OP_RET:        { Byte(encoding, 0xc3); } break;
+        case OP_VZEROUPPER: { Byte(encoding, 0xc5); Byte(encoding, 0xf8); Byte(encoding, 0x77); } break;
+        case OP_LEA: {
+            EncodeRM(encoding, 0, dst->size == 8, false, 1, 0x8d, RegCode(dst->reg), src);
+        } break;
+        case OP_MOVSXD: {
+            EncodeRM(encoding, 0, true, false, 1, 0x63, RegCode(dst->reg), src);
+        } break;
+        case OP_MOVZX: {
+            int src_size = src->size ? src->size : 1;
+            EncodeRM(encoding, 0, dst->size == 8, NeedsRex(src), 2, src_size == 1 ? 0x0fb6 : 0x0fb7, RegCode(dst->reg), src);
+        } break;
+        case OP_IMUL: {
+            if (src->kind == OPERAND_IMM) {
+                bool is_short = FitsInt8(src->value);
+                EncodeRM(encoding, 0, dst->size == 8, false, 1, is_short ? 0x6b : 0x69, RegCode(dst->reg), dst);
+                Bytes(encoding, src->value, is_short ? 1 : 4);
+            } else {
+                EncodeRM(encoding, 0, dst->size == 8, false, 2, 0x0faf, RegCode(dst->reg), src);
+            }
+        } break;
+        case OP_TEST: {
+            int size = OperandSize(instr);
+            bool force_rex = NeedsRex(dst) || NeedsRex(src);
+            if (src->kind == OPERAND_IMM) {
+                EncodeRM(encoding, 0, size == 8, force_rex, 1, size == 1 ? 0xf6 : 0xf7, 0, dst);
+                Bytes(encoding, src->value, size == 1 ? 1 : 4);
+            } else {
+                EncodeRM(encoding, 0, size == 8, force_rex, 1, size == 1 ? 0x84 : 0x85, RegCode(src->reg), dst);
+            }
+        } break;
+        case OP_SETCC: {
+            EncodeRM(encoding, 0, false, NeedsRex(dst), 2, 0x0f90 | condition_codes[instr->condition], 0, dst);
+        } break;
+        case OP_PUSH: {
+            if (dst->kind == OPERAND_REG) {
+                EncodeOpReg(encoding, 0, false, false, 0x50, dst->reg);
+            } else if (dst->kind == OPERAND_IMM) {
+                Byte(encoding, FitsInt8(dst->value) ? 0x6a : 0x68);
+                Bytes(encoding, dst->value, FitsInt8(dst->value) ? 1 : 4);
+            } else {
+                EncodeRM(encoding, 0, false, false, 1, 0xff, 6, dst);
+            }
+        } break;
+        case OP_POP: {
+            if (dst->kind == OPERAND_REG) {
+                EncodeOpReg(encoding, 0, false, false, 0x58, dst->reg);
+            } else {
+                EncodeRM(encoding, 0, false, false, 1, 0x8f, 0, dst);
+            }
+        } break;
+        case OP_CALL: {
+            Byte(encoding, 0xe8);
+            encoding->field = encoding->length;
+            encoding->label = dst->label;
+            encoding->kind = FIXUP_BRANCH;
+            Bytes(encoding, 0, 4);
+        } break;
+        case OP_JMP:
+        case OP_JCC: {
+            // Long form, shortened later when the label is local and near
+            if (instr->opcode == OP_JMP) {
+                Byte(encoding, 0xe9);
+            } else {
+                Byte(encoding, 0x0f);
+                Byte(encoding, 0x80 | condition_codes[instr->condition]);
+            }
+            encoding->field = encoding->length;
+            encoding->label = dst->label;
+            encoding->kind = FIXUP_BRANCH;
+            Bytes(encoding, 0, 4);
+        } break;
+        default: {
+            ReportInternalError("Encoder::Encode - unsupported instruction %d", instr->opcode);
+        } break;
+    }
+}
+
+// Bytes an instruction takes at a given offset, counting the padding of align
+static int EncodedLength(struct Encoding *encoding, struct Instruction *instr, int offset) {
+    if (instr->opcode == OP_ALIGN) {
+        int alignment = (int) instr->dst.value;
+        return alignment > 1 ? (alignment - offset % alignment) % alignment : 0;
+    }
+    return encoding->is_short ? 2 : encoding->length;
+}
+
+static int CompareLocalLabels(const void *a, const void *b) {
+    return strcmp(((struct LocalLabel *) a)->label, ((struct LocalLabel *) b)->label);
+}
+
+static int CompareSymbols(const void *a, const void *b) {
+    return strcmp(((struct CodeSymbol *) a)->label, ((struct CodeSymbol *) b)->label);
+}
+
+static void Reserve(struct MachineCode *code, int size) {
+    if (code->size + size > code->capacity) {
+        while (code->size + size > code->capacity) {
+            code->capacity = code->capacity == 0 ? 4096 : code->capacity * 2;
+        }
+        code->text = (unsigned char *) Memory_Realloc(MEMORY_CODEGEN, code->text, code->capacity);
+        if (!code->text) {
+            exit(1);
+        }
+    }
+}
+
+// Pad with the fewest nop instructions
+static void FillNops(unsigned char *out, int padding) {
+    while (padding > 0) {
+        int nop = padding < 9 ? padding : 9;
+        memcpy(out, nops[nop], nop);
+        out += nop;
+        padding -= nop;
+    }
+}
+
+static void AddSymbol(struct MachineCode *code, char *label, int offset) {
+    if (code->num_symbols == code->symbols_capacity) {
+        code->symbols_capacity = code->symbols_capacity == 0 ? 64 : code->symbols_capacity * 2;
+        code->symbols = (struct CodeSymbol *) Memory_Realloc(MEMORY_SYMBOLS, code->symbols, sizeof(struct CodeSymbol) * code->symbols_capacity);
+        if (!code->symbols) {
+            exit(1);
+        }
+    }
+    struct CodeSymbol *symbol = &code->symbols[code->num_symbols];
+    code->num_symbols += 1;
+    symbol->label = (char *) Memory_Alloc(MEMORY_SYMBOLS, strlen(label) + 1);
+    strcpy(symbol->label, label);
+    symbol->offset = offset;
+    code->symbols_sorted = false;
+}
+
+static void AddFixup(struct MachineCode *code, int offset, char *label, enum FixupKind kind, int addend) {
+    if (code->num_fixups == code->fixups_capacity) {
+        code->fixups_capacity = code->fixups_capacity == 0 ? 64 : code->fixups_capacity * 2;
+        code->fixups = (struct CodeFixup *) Memory_Realloc(MEMORY_SYMBOLS, code->fixups, sizeof(struct CodeFixup) * code->fixups_capacity);
+        if (!code->fixups) {
+            exit(1);
+        }
+    }
+    struct CodeFixup *fixup = &code->fixups[code->num_fixups];
+    code->num_fixups += 1;
+    fixup->offset = offset;
+    fixup->label = (char *) Memory_Alloc(MEMORY_SYMBOLS, strlen(label) + 1);
+    strcpy(fixup->label, label);
+    fixup->kind = kind;
+    fixup->addend = addend;
+}
+
+// Encode the instructions of a function and append them to the text, choosing the shortest form of
+// each branch that still reaches its label
+void Encoder_AssembleFunction(struct MachineCode *code, struct InstructionBuffer *buffer) {
+    int count = buffer->count;
+    struct Encoding *encodings = NEW_ARRAY(MEMORY_CODEGEN, struct Encoding, count);
+    int *offsets = NEW_ARRAY(MEMORY_CODEGEN, int, count + 1);
+
+    int num_labels = 0;
+    struct LocalLabel *labels = NEW_ARRAY(MEMORY_CODEGEN, struct LocalLabel, count);
+    for (int i = 0; i < count; ++i) {
+        struct Instruction *instr = &buffer->data[i];
+        Encode(&encodings[i], instr);
+        if (instr->opcode == OP_LABEL) {
+            labels[num_labels].label = instr->dst.label;
+            labels[num_labels].index = i;
+            num_labels += 1;
+        }
+    }
+    qsort(labels, num_labels, sizeof(struct LocalLabel), CompareLocalLabels);
+
+    // Branches to labels of this function start short
+    for (int i = 0; i < count; ++i) {
+        enum Opcode opcode = buffer->data[i].opcode;
+        if (opcode != OP_JMP && opcode != OP_JCC) {
+            continue;
+        }
+        struct LocalLabel key = { encodings[i].label, 0 };
+        struct LocalLabel *label = (struct LocalLabel *) bsearch(&key, labels, num_labels, sizeof(struct LocalLabel), CompareLocalLabels);
+        if (label) {
+            encodings[i].target = label->index;
+            encodings[i].is_short = true;
+        }
+    }
+
+    // Lengthen the short branches that do not reach until every one does. Branches only grow, so this ends.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        int offset = code->size;
+        for (int i = 0; i < count; ++i) {
+            offsets[i] = offset;
+            offset += EncodedLength(&encodings[i], &buffer->data[i], offset);
+        }
+        offsets[count] = offset;
+
+        for (int i = 0; i < count; ++i) {
+            struct Encoding *encoding = &encodings[i];
+            if (encoding->is_short && !FitsInt8(offsets[encoding->target] - (offsets[i] + 2))) {
+                encoding->is_short = false;
+                changed = true;
+            }
+        }
+    }
+
+    Reserve(code, offsets[count] - code->size);
+    int short_branches = 0;
+    int long_branches = 0;
+    for (int i = 0; i < count; ++i) {
+        struct Encoding *encoding = &encodings[i];
+        struct Instruction *instr = &buffer->data[i];
+        int offset = offsets[i];
+        int length = offsets[i + 1] - offset;
+        unsigned char *out = code->text + offset;
+
+        if (instr->opcode == OP_LABEL) {
+            AddSymbol(code, instr->dst.label, offset);
+        } else if (instr->opcode == OP_ALIGN) {
+            FillNops(out, length);
+            if (instr->dst.value > code->alignment) {
+                code->alignment = (int) instr->dst.value;
+            }
+        } else if (encoding->is_short) {
+            out[0] = instr->opcode == OP_JMP ? 0xeb : (unsigned char) (0x70 | condition_codes[instr->condition]);
+            out[1] = (unsigned char) (offsets[encoding->target] - (offset + 2));
+            short_branches += 1;
+        } else {
+            memcpy(out, encoding->bytes, encoding->length);
+            if (encoding->target >= 0) {
+                int rel = offsets[encoding->target] - (offset + length);
+                memcpy(out + encoding->field, &rel, 4);
+                long_branches += 1;
+            } else if (encoding->label) {
+                int field = offset + encoding->field;
+                AddFixup(code, field, encoding->label, encoding->kind, -(offset + length - field));
+            }
+        }
+    }
+    num_bytes += offsets[count] - code->size;
+    num_short_branches += short_branches;
+    num_long_branches += long_branches;
+    code->size = offsets[count];
+
+    Memory_Free(MEMORY_CODEGEN, labels);
+    Memory_Free(MEMORY_CODEGEN, offsets);
+    Memory_Free(MEMORY_CODEGEN, encodings);
+}
+
+// Move the text, symbols and fixups of other to the end of code, padding first so that the
+// alignments other was assembled with still hold. Other is left empty.
+void MachineCode_Append(struct MachineCode *code, struct MachineCode *other) {
+    int base = code->size;
+    if (other->alignment > 1) {
+        base = (code->size + other->alignment - 1) / other->alignment * other->alignment;
+    }
+    Reserve(code, base + other->size - code->size);
+    FillNops(code->text + code->size, base - code->size);
+    memcpy(code->text + base, other->text, other->size);
+    code->size = base + other->size;
+    if (other->alignment > code->alignment) {
+        code->alignment = other->alignment;
+    }
+
+    for (int i = 0; i < other->num_symbols; ++i) {
+        AddSymbol(code, other->symbols[i].label, base + other->symbols[i].offset);
+    }
+    for (int i = 0; i < other->num_fixups; ++i) {
+        struct CodeFixup *fixup = &other->fixups[i];
+        AddFixup(code, base + fixup->offset, fixup->label, fixup->kind, fixup->addend);
+    }
+    MachineCode_Free(other);
+}
+
+// Patch the references between functions of the text, leaving the fixups of data and external labels
+void Encoder_ResolveFixups(struct MachineCode *code) {
+    int count = 0;
+    for (int i = 0; i < code->num_fixups; ++i) {
+        struct CodeFixup *fixup = &code->fixups[i];
+        int target = MachineCode_FindSymbol(code, fixup->label);
+        if (target >= 0) {
+            int rel = target + fixup->addend - fixup->offset;
+            memcpy(code->text + fixup->offset, &rel, 4);
+            Memory_Free(MEMORY_SYMBOLS, fixup->label);
+        } else {
+            code->fixups[count] = *fixup;
+            count += 1;
+        }
+    }
+    code->num_fixups = count;
+}
+
+// Offset of a label defined in the text, or -1 if it is not defined there
+int MachineCode_FindSymbol(struct MachineCode *code, char *label) {
+    if (!code->symbols_sorted) {
+        qsort(code->symbols, code->num_symbols, sizeof(struct CodeSymbol), CompareSymbols);
+        code->symbols_sorted = true;
+    }
+    struct CodeSymbol key = { label, 0 };
+    struct CodeSymbol *symbol = (struct CodeSymbol *) bsearch(&key, code->symbols, code->num_symbols, sizeof(struct CodeSymbol), CompareSymbols);
+    return symbol ? symbol->offset : -1;
+}
+
+void MachineCode_Free(struct MachineCode *code) {
+    for (int i = 0; i < code->num_symbols; ++i) {
+        Memory_Free(MEMORY_SYMBOLS, code->symbols[i].label);
+    }
+    for (int i = 0; i < code->num_fixups; ++i) {
+        Memory_Free(MEMORY_SYMBOLS, code->fixups[i].label);
+    }
+    Memory_Free(MEMORY_CODEGEN, code->text);
+    Memory_Free(MEMORY_SYMBOLS, code->symbols);
+    Memory_Free(MEMORY_SYMBOLS, code->fixups);
+    MachineCode_Init(code);
+}
+
+void MachineCode_Init(struct MachineCode *code) {
+    memset(code, 0, sizeof(struct MachineCode));
+}
+
+// Print how many bytes were encoded and how many branches were relaxed
+void Encoder_PrintStats(FILE *file) {
+    fprintf(file, "encoder:\n");
+    fprintf(file, "  %-20s %d\n", "bytes", num_bytes);
+    fprintf(file, "  %-20s %d\n", "short-branches", num_short_branches);
+    fprintf(file, "  %-20s %d\n", "long-branches", num_long_branches);
+}
@@ -0,0 +1,64 @@
+#ifndef BMS_ENCODER_H
+#define BMS_ENCODER_H
+
+#include "Instruction.h"
+#include <stdio.h>
+
+enum FixupKind {
+    FIXUP_BRANCH,                   // rel32 of a call or jmp, through the PLT when the target is external
+    FIXUP_ADDRESS,                  // rel32 of a rip relative address, such as lea rdi, [rel fmt_0]
+};
+
+// A 32-bit field of the text that refers to a label outside the function it was assembled in
+struct CodeFixup {
+    int offset;                     // Position of the field in the text
+    char *label;
+    enum FixupKind kind;
+    int addend;                     // Added to the label address before subtracting offset
+};
+
+// A label defined in the text
+struct CodeSymbol {
+    char *label;
+    int offset;
+};
+
+// Machine code of a translation unit, with its labels and the references still to be resolved
+struct MachineCode {
+    unsigned char *text;
+    int size;
+    int capacity;
+    struct CodeSymbol *symbols;
+    int num_symbols;
+    int symbols_capacity;
+    struct CodeFixup *fixups;
+    int num_fixups;
+    int fixups_capacity;
+    bool symbols_sorted;
+    int alignment;                  // Largest alignment of the code, kept when it is appended elsewhere
+};
+
+// Encode the instructions of a function and append them to the text, choosing the shortest form of
+// each branch that still reaches its label
+void Encoder_AssembleFunction(struct MachineCode *code, struct InstructionBuffer *buffer);
+
+// Move the text, symbols and fixups of other to the end of code, keeping the alignments it was
+// assembled with. Other is left empty.
+void MachineCode_Append(struct MachineCode *code, struct MachineCode *other);
+
+// Patch the references between functions of the text, leaving the fixups of data and external labels
+void Encoder_ResolveFixups(struct MachineCode *code);
+
+// Offset of a label defined in the text, or -1 if it is not defined there
+int MachineCode_FindSymbol(struct MachineCode *code, char *label);
+
+// Free the code, its symbols and its fixups
+void MachineCode_Free(struct MachineCode *code);
+
+// Initialize empty code
+void MachineCode_Init(struct MachineCode *code);
+
+// Print how many bytes were encoded and how many branches were relaxed
+void Encoder_PrintStats(FILE *file);
+
+#endif // BMS_ENCODER_H
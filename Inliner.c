@@ -0,0 +1,533 @@
+#include "Inliner.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "Options.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INLINE_SIZE_LIMIT       24      // Callees this small are inlined at every call site
+#define INLINE_SIZE_LIMIT_OS    8       // About the size of the call sequence itself
+#define INLINE_ONCE_SIZE_LIMIT  160     // Callees with a single call site may be this big
+#define INLINE_GROWTH_LIMIT     600     // Nodes inlining may add to a single function
+#define INLINE_MAX_DEPTH        4       // Calls inside inlined bodies are inlined up to this depth
+
+// A function of the translation unit that calls may be inlined to
+struct Callee {
+    struct FunctionDef *function;
+    int size;                       // Statements and expression nodes of the body
+    int call_sites;
+    bool inlinable;
+    bool writes_memory;             // Stores through a pointer or makes calls
+};
+
+// Callee variables and the caller locals that replace them
+struct Renaming {
+    struct List from;
+    struct List to;
+};
+
+// Calls of one statement chosen for inlining, in the order the code generator evaluates them
+struct InlinePlan {
+    int depth;
+    int loop_depth;
+    int size;
+    bool kept_call;                 // A call that stays was evaluated before the current one
+    bool read_values;               // A variable or memory was read before the current one
+    bool valid;
+    struct List calls;
+};
+
+// Static function declarations
+static struct AstNode *InlineStmt(struct AstNode *stmt, int depth, int loop_depth);
+
+static struct List callees;         // struct Callee * of every function
+static struct FunctionDef *current_func;
+static int growth;                  // Nodes inlined into current_func so far
+static int num_inline_ids = 0;
+
+static int num_inlined = 0;
+static int num_rejected = 0;
+
+static struct Callee *FindCallee(char *identifier) {
+    for (int i = 0; i < callees.count; ++i) {
+        struct Callee *callee = (struct Callee *) List_Get(&callees, i);
+        if (strcmp(callee->function->identifier, identifier) == 0) {
+            return callee;
+        }
+    }
+    return NULL;
+}
+
+static void CountNode(struct Expr *expr, void *data) {
+    *(int *) data += 1;
+}
+
+static void VisitCountNodes(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CountNode, data);
+}
+
+static int CountStmts(struct AstNode *stmt) {
+    if (!stmt) {
+        return 0;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            int count = 0;
+            for (int i = 0; i < body->count; ++i) {
+                count += CountStmts((struct AstNode *) List_Get(body, i));
+            }
+            return count;
+        }
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return 1 + CountStmts(if_stmt->stmt) + CountStmts(if_stmt->else_branch);
+        }
+        case AST_WHILE_STMT:    return 1 + CountStmts(((struct WhileStmt *) stmt)->stmt);
+        case AST_FOR_STMT:      return 1 + CountStmts(((struct ForStmt *) stmt)->stmt);
+        default:                return 1;
+    }
+}
+
+// Size estimate of a function body, in statements and expression nodes
+static int GetSize(struct AstNode *stmt) {
+    int size = CountStmts(stmt);
+    AstUtils_WalkStmt(stmt, VisitCountNodes, &size);
+    return size;
+}
+
+// Count the calls to each function, a function that calls itself is never inlined
+static void CountCalls(struct Expr *expr, void *data) {
+    if (expr->type != EXPR_FUNC_CALL) {
+        return;
+    }
+    struct Callee *callee = FindCallee(expr->str_value);
+    if (callee) {
+        callee->call_sites += 1;
+        if (callee->function == current_func) {
+            callee->inlinable = false;
+        }
+    }
+}
+
+static void VisitCountCalls(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CountCalls, data);
+}
+
+static void FindMemoryWrite(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_FUNC_CALL || (expr->type == EXPR_ASSIGN && expr->lhs->type != EXPR_VAR)) {
+        *(bool *) data = true;
+    }
+}
+
+static void VisitFindMemoryWrites(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, FindMemoryWrite, data);
+}
+
+// Check that every return of a statement is the last thing the function executes, so that
+// returns can become assignments of the result
+static bool HasOnlyTailReturns(struct AstNode *stmt, bool tail) {
+    if (!stmt) {
+        return true;
+    }
+
+    switch (stmt->type) {
+        case AST_RETURN_STMT:   return tail;
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                if (!HasOnlyTailReturns((struct AstNode *) List_Get(body, i), tail && i == body->count - 1)) {
+                    return false;
+                }
+            }
+        } return true;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return HasOnlyTailReturns(if_stmt->stmt, tail) && HasOnlyTailReturns(if_stmt->else_branch, tail);
+        }
+        case AST_WHILE_STMT:    return HasOnlyTailReturns(((struct WhileStmt *) stmt)->stmt, false);
+        case AST_FOR_STMT:      return HasOnlyTailReturns(((struct ForStmt *) stmt)->stmt, false);
+        default:                return true;
+    }
+}
+
+// Cost model: small callees are inlined everywhere, callees with one call site up to a larger
+// size, and calls in loops get twice the budget as they pay the call overhead every iteration
+static bool ShouldInline(struct Callee *callee, struct Expr *call, struct InlinePlan *plan) {
+    if (!callee || !callee->inlinable || callee->function == current_func) {
+        return false;
+    }
+    if (call->args.count != callee->function->num_params || plan->depth >= INLINE_MAX_DEPTH) {
+        return false;
+    }
+
+    int limit = options.optimize_for_size ? INLINE_SIZE_LIMIT_OS : INLINE_SIZE_LIMIT;
+    if (plan->loop_depth > 0 && !options.optimize_for_size) {
+        limit *= 2;
+    }
+    if (callee->call_sites == 1 && limit < INLINE_ONCE_SIZE_LIMIT) {
+        limit = INLINE_ONCE_SIZE_LIMIT;
+    }
+    if (callee->size > limit) {
+        num_rejected += 1;
+        return false;
+    }
+    return true;
+}
+
+// Choose the calls of an expression to inline, visiting them in evaluation order. Inlined calls
+// are evaluated ahead of the whole statement, which is only valid when no other call runs before
+// them and nothing else in the expression has side effects.
+static void PlanCalls(struct Expr *expr, struct InlinePlan *plan) {
+    if (!expr) {
+        return;
+    }
+
+    switch (expr->type) {
+        case EXPR_FUNC_CALL: {
+            bool read_values = plan->read_values;
+            for (int i = 0; i < expr->args.count; ++i) {
+                PlanCalls((struct Expr *) List_Get(&expr->args, i), plan);
+            }
+            struct Callee *callee = FindCallee(expr->str_value);
+            if (!ShouldInline(callee, expr, plan)) {
+                plan->kept_call = true;
+            } else if (plan->kept_call || (callee->writes_memory && read_values)) {
+                plan->valid = false;
+            } else {
+                // The arguments move ahead of the statement along with the body
+                plan->read_values = read_values;
+                plan->size += callee->size;
+                List_Add(&plan->calls, expr);
+            }
+        } break;
+        case EXPR_ASSIGN: {
+            plan->valid = false;
+        } break;
+        default: {
+            // Binary operators evaluate their right operand first
+            PlanCalls(expr->rhs, plan);
+            PlanCalls(expr->lhs, plan);
+            if (expr->type == EXPR_VAR || expr->type == EXPR_DEREF) {
+                plan->read_values = true;
+            }
+        } break;
+    }
+}
+
+static void PlanStatementExpr(struct Expr *expr, struct InlinePlan *plan) {
+    if (expr && expr->type == EXPR_ASSIGN) {
+        // The address of the target is computed before the value
+        if (expr->lhs->type == EXPR_DEREF) PlanCalls(expr->lhs->lhs, plan);
+        PlanCalls(expr->rhs, plan);
+    } else {
+        PlanCalls(expr, plan);
+    }
+}
+
+static bool IsPlanned(struct InlinePlan *plan, struct Expr *call) {
+    for (int i = 0; i < plan->calls.count; ++i) {
+        if (List_Get(&plan->calls, i) == call) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static char *FindRenaming(struct Renaming *renaming, char *identifier) {
+    for (int i = 0; i < renaming->from.count; ++i) {
+        if (strcmp((char *) List_Get(&renaming->from, i), identifier) == 0) {
+            return (char *) List_Get(&renaming->to, i);
+        }
+    }
+    return NULL;
+}
+
+static struct Expr *RenameVars(struct Expr *expr, struct Renaming *renaming) {
+    if (!expr) {
+        return NULL;
+    }
+    if (expr->type == EXPR_VAR) {
+        char *identifier = FindRenaming(renaming, expr->str_value);
+        if (!identifier) {
+            return expr;
+        }
+        struct Expr *renamed = NewVariableExpr(identifier);
+        renamed->operand_type = expr->operand_type;
+        return renamed;
+    }
+    for (int i = 0; i < expr->args.count; ++i) {
+        expr->args.data[i] = RenameVars((struct Expr *) List_Get(&expr->args, i), renaming);
+    }
+    expr->lhs = RenameVars(expr->lhs, renaming);
+    expr->rhs = RenameVars(expr->rhs, renaming);
+    return expr;
+}
+
+static void VisitRenameVars(struct Expr **slot, void *data) {
+    *slot = RenameVars(*slot, (struct Renaming *) data);
+}
+
+static void RenameDeclarations(struct AstNode *stmt, struct Renaming *renaming) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                RenameDeclarations((struct AstNode *) List_Get(body, i), renaming);
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                struct Declarator *declarator = (struct Declarator *) List_Get(declarators, i);
+                char *identifier = FindRenaming(renaming, declarator->identifier);
+                if (identifier) strncpy(declarator->identifier, identifier, TOKEN_MAX_IDENTIFIER_LENGTH);
+            }
+        } break;
+        case AST_IF_STMT: {
+            RenameDeclarations(((struct IfStmt *) stmt)->stmt, renaming);
+            RenameDeclarations(((struct IfStmt *) stmt)->else_branch, renaming);
+        } break;
+        case AST_WHILE_STMT:    { RenameDeclarations(((struct WhileStmt *) stmt)->stmt, renaming); } break;
+        case AST_FOR_STMT:      { RenameDeclarations(((struct ForStmt *) stmt)->stmt, renaming); } break;
+    }
+}
+
+// Turn the tail returns of an inlined body into assignments of the result, or into plain
+// expression statements when the result is not used
+static struct AstNode *ReplaceReturns(struct AstNode *stmt, struct Expr *result) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_RETURN_STMT: {
+            struct Expr *expr = ((struct ReturnStmt *) stmt)->expr;
+            if (!expr) {
+                return NewNullStmt();
+            }
+            if (result) {
+                struct Expr *target = AstUtils_CloneExpr(result);
+                expr = NewOperationExpr(EXPR_ASSIGN, target, expr);
+            }
+            return (struct AstNode *) NewExpressionStmt(expr);
+        }
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                body->data[i] = ReplaceReturns((struct AstNode *) List_Get(body, i), result);
+            }
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->stmt = ReplaceReturns(if_stmt->stmt, result);
+            if_stmt->else_branch = ReplaceReturns(if_stmt->else_branch, result);
+        } break;
+    }
+    return stmt;
+}
+
+// Append a copy of the callee body to prelude, with its variables renamed to fresh caller locals
+// and its parameters assigned the arguments, and return the expression holding the result
+static struct Expr *InlineCall(struct Expr *call, struct CompoundStmt *prelude, bool value_used, struct InlinePlan *plan) {
+    struct Callee *callee = FindCallee(call->str_value);
+    struct FunctionDef *function = callee->function;
+    int id = num_inline_ids;
+    num_inline_ids += 1;
+
+    struct Renaming renaming;
+    List_Init(&renaming.from);
+    List_Init(&renaming.to);
+    int num_vars = 0;
+    for (int i = 0; i < function->var_decls.count; ++i) {
+        struct VarDeclaration *var_decl = (struct VarDeclaration *) List_Get(&function->var_decls, i);
+        struct VarDeclaration *copy = NewVarDeclaration();
+        copy->type = var_decl->type;
+        for (int j = 0; j < var_decl->declarators.count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(&var_decl->declarators, j);
+            struct Declarator *local = NewDeclarator();
+            *local = *declarator;
+            local->value = NULL;
+            snprintf(local->identifier, TOKEN_MAX_IDENTIFIER_LENGTH, "inline.%d.%d", id, num_vars);
+            num_vars += 1;
+            List_Add(&copy->declarators, local);
+            List_Add(&renaming.from, declarator->identifier);
+            List_Add(&renaming.to, local->identifier);
+        }
+        List_Add(&current_func->var_decls, copy);
+    }
+
+    for (int i = 0; i < function->num_params; ++i) {
+        struct VarDeclaration *param = (struct VarDeclaration *) List_Get(&function->var_decls, i);
+        struct Declarator *declarator = (struct Declarator *) List_Get(&param->declarators, 0);
+        struct Expr *target = NewVariableExpr(FindRenaming(&renaming, declarator->identifier));
+        target->operand_type = declarator->pointer_inderection > 0 ? PRIMTYPE_PTR : param->type;
+        struct Expr *arg = (struct Expr *) List_Get(&call->args, i);
+        List_Add(&prelude->body, NewExpressionStmt(NewOperationExpr(EXPR_ASSIGN, target, arg)));
+    }
+
+    struct AstNode *body = AstUtils_CloneStmt((struct AstNode *) function->body);
+    AstUtils_WalkStmt(body, VisitRenameVars, &renaming);
+    RenameDeclarations(body, &renaming);
+    List_Free(&renaming.from);
+    List_Free(&renaming.to);
+
+    struct Expr *result = NULL;
+    if (value_used) {
+        char identifier[TOKEN_MAX_IDENTIFIER_LENGTH];
+        snprintf(identifier, sizeof(identifier), "inline.%d", id);
+        AstUtils_AddLocal(current_func, identifier, function->return_type, 0);
+        result = NewVariableExpr(identifier);
+        result->operand_type = function->return_type;
+    }
+    body = ReplaceReturns(body, result);
+
+    // Calls in the copied body are candidates as well, up to a limited depth
+    List_Add(&prelude->body, InlineStmt(body, plan->depth + 1, plan->loop_depth));
+    growth += callee->size;
+    num_inlined += 1;
+    return result ? AstUtils_CloneExpr(result) : NewNumberExpr(0);
+}
+
+// Replace the planned calls of an expression by their results, in evaluation order
+static struct Expr *InlineCalls(struct Expr *expr, struct CompoundStmt *prelude, struct InlinePlan *plan) {
+    if (!expr) {
+        return NULL;
+    }
+
+    switch (expr->type) {
+        case EXPR_FUNC_CALL: {
+            for (int i = 0; i < expr->args.count; ++i) {
+                expr->args.data[i] = InlineCalls((struct Expr *) List_Get(&expr->args, i), prelude, plan);
+            }
+            if (IsPlanned(plan, expr)) {
+                return InlineCall(expr, prelude, true, plan);
+            }
+        } return expr;
+        case EXPR_ASSIGN: {
+            expr->lhs = InlineCalls(expr->lhs, prelude, plan);
+            expr->rhs = InlineCalls(expr->rhs, prelude, plan);
+        } return expr;
+        default: {
+            expr->rhs = InlineCalls(expr->rhs, prelude, plan);
+            expr->lhs = InlineCalls(expr->lhs, prelude, plan);
+        } return expr;
+    }
+}
+
+// Inline the calls of one expression of a statement, returning the statement preceded by the
+// inlined bodies. A statement that is a single call is replaced by the body.
+static struct AstNode *InlineSlot(struct AstNode *stmt, struct Expr **slot, int depth, int loop_depth) {
+    if (!*slot) {
+        return stmt;
+    }
+
+    struct InlinePlan plan = { depth, loop_depth, 0, false, false, true };
+    List_Init(&plan.calls);
+    PlanStatementExpr(*slot, &plan);
+    if (!plan.valid || plan.calls.count == 0 || growth + plan.size > INLINE_GROWTH_LIMIT) {
+        List_Free(&plan.calls);
+        return stmt;
+    }
+
+    struct CompoundStmt *prelude = NewCompoundStmt();
+    struct Expr *expr = *slot;
+    if (stmt->type == AST_EXPRESSION_STMT && IsPlanned(&plan, expr)) {
+        for (int i = 0; i < expr->args.count; ++i) {
+            expr->args.data[i] = InlineCalls((struct Expr *) List_Get(&expr->args, i), prelude, &plan);
+        }
+        InlineCall(expr, prelude, false, &plan);
+    } else {
+        *slot = InlineCalls(expr, prelude, &plan);
+        List_Add(&prelude->body, stmt);
+    }
+    List_Free(&plan.calls);
+    return (struct AstNode *) prelude;
+}
+
+static struct AstNode *InlineStmt(struct AstNode *stmt, int depth, int loop_depth) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                body->data[i] = InlineStmt((struct AstNode *) List_Get(body, i), depth, loop_depth);
+            }
+        } return stmt;
+        case AST_VAR_DECLARATION: {
+            // Calls of a later initializer cannot move ahead of an earlier one
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            if (declarators->count != 1) {
+                return stmt;
+            }
+            return InlineSlot(stmt, &((struct Declarator *) List_Get(declarators, 0))->value, depth, loop_depth);
+        }
+        case AST_EXPRESSION_STMT:   return InlineSlot(stmt, &((struct ExpressionStmt *) stmt)->expr, depth, loop_depth);
+        case AST_RETURN_STMT:       return InlineSlot(stmt, &((struct ReturnStmt *) stmt)->expr, depth, loop_depth);
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->stmt = InlineStmt(if_stmt->stmt, depth, loop_depth);
+            if_stmt->else_branch = InlineStmt(if_stmt->else_branch, depth, loop_depth);
+            return InlineSlot(stmt, &if_stmt->condition, depth, loop_depth);
+        }
+        case AST_WHILE_STMT: {
+            // The condition is evaluated every iteration, so its calls stay
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            while_stmt->stmt = InlineStmt(while_stmt->stmt, depth, loop_depth + 1);
+        } return stmt;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            for_stmt->stmt = InlineStmt(for_stmt->stmt, depth, loop_depth + 1);
+            return InlineSlot(stmt, &for_stmt->init_expr, depth, loop_depth);
+        }
+        default: {
+        } return stmt;
+    }
+}
+
+// Replace calls to small functions by copies of their bodies
+void Inliner_Run(struct TranslationUnit *t_unit) {
+    List_Init(&callees);
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        struct FunctionDef *function = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        struct Callee *callee = (struct Callee *) Memory_Alloc(MEMORY_SYMBOLS, sizeof(struct Callee));
+        callee->function = function;
+        callee->size = GetSize((struct AstNode *) function->body);
+        callee->call_sites = 0;
+        callee->inlinable = strcmp(function->identifier, "main") != 0 && HasOnlyTailReturns((struct AstNode *) function->body, true);
+        callee->writes_memory = false;
+        AstUtils_WalkStmt((struct AstNode *) function->body, VisitFindMemoryWrites, &callee->writes_memory);
+        List_Add(&callees, callee);
+    }
+    for (int i = 0; i < callees.count; ++i) {
+        current_func = ((struct Callee *) List_Get(&callees, i))->function;
+        AstUtils_WalkStmt((struct AstNode *) current_func->body, VisitCountCalls, NULL);
+    }
+
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        current_func = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        growth = 0;
+        InlineStmt((struct AstNode *) current_func->body, 0, 0);
+    }
+    current_func = NULL;
+
+    for (int i = 0; i < callees.count; ++i) {
+        Memory_Free(MEMORY_SYMBOLS, List_Get(&callees, i));
+    }
+    List_Free(&callees);
+}
+
+// Print how many calls were inlined
+void Inliner_PrintStats(FILE *file) {
+    fprintf(file, "inliner:\n");
+    fprintf(file, "  %-20s %d\n", "inlined", num_inlined);
+    fprintf(file, "  %-20s %d\n", "too-large", num_rejected);
+}
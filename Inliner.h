@@ -0,0 +1,13 @@
+#ifndef BMS_INLINER_H
+#define BMS_INLINER_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Replace calls to small functions by copies of their bodies
+void Inliner_Run(struct TranslationUnit *t_unit);
+
+// Print how many calls were inlined
+void Inliner_PrintStats(FILE *file);
+
+#endif // BMS_INLINER_H
@@ -0,0 +1,294 @@
+#include "Instruction.h"
+#include "Memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Register names indexed by register and by width (1, 2, 4, 8, 16 and 32 bytes)
+static char *reg_names[REG_COUNT][6] = {
+    [REG_RAX] = { "al",   "ax",   "eax",  "rax" },
+    [REG_RCX] = { "cl",   "cx",   "ecx",  "rcx" },
+    [REG_RDX] = { "dl",   "dx",   "edx",  "rdx" },
+    [REG_RBX] = { "bl",   "bx",   "ebx",  "rbx" },
+    [REG_RSP] = { "spl",  "sp",   "esp",  "rsp" },
+    [REG_RBP] = { "bpl",  "bp",   "ebp",  "rbp" },
+    [REG_RSI] = { "sil",  "si",   "esi",  "rsi" },
+    [REG_RDI] = { "dil",  "di",   "edi",  "rdi" },
+    [REG_R8]  = { "r8b",  "r8w",  "r8d",  "r8" },
+    [REG_R9]  = { "r9b",  "r9w",  "r9d",  "r9" },
+    [REG_R10] = { "r10b", "r10w", "r10d", "r10" },
+    [REG_R11] = { "r11b", "r11w", "r11d", "r11" },
+    [REG_R12] = { "r12b", "r12w", "r12d", "r12" },
+    [REG_R13] = { "r13b", "r13w", "r13d", "r13" },
+    [REG_R14] = { "r14b", "r14w", "r14d", "r14" },
+    [REG_R15] = { "r15b", "r15w", "r15d", "r15" },
+    [REG_XMM0]  = { NULL, NULL, NULL, NULL, "xmm0",  "ymm0" },
+    [REG_XMM1]  = { NULL, NULL, NULL, NULL, "xmm1",  "ymm1" },
+    [REG_XMM2]  = { NULL, NULL, NULL, NULL, "xmm2",  "ymm2" },
+    [REG_XMM3]  = { NULL, NULL, NULL, NULL, "xmm3",  "ymm3" },
+    [REG_XMM4]  = { NULL, NULL, NULL, NULL, "xmm4",  "ymm4" },
+    [REG_XMM5]  = { NULL, NULL, NULL, NULL, "xmm5",  "ymm5" },
+    [REG_XMM6]  = { NULL, NULL, NULL, NULL, "xmm6",  "ymm6" },
+    [REG_XMM7]  = { NULL, NULL, NULL, NULL, "xmm7",  "ymm7" },
+    [REG_XMM8]  = { NULL, NULL, NULL, NULL, "xmm8",  "ymm8" },
+    [REG_XMM9]  = { NULL, NULL, NULL, NULL, "xmm9",  "ymm9" },
+    [REG_XMM10] = { NULL, NULL, NULL, NULL, "xmm10", "ymm10" },
+    [REG_XMM11] = { NULL, NULL, NULL, NULL, "xmm11", "ymm11" },
+    [REG_XMM12] = { NULL, NULL, NULL, NULL, "xmm12", "ymm12" },
+    [REG_XMM13] = { NULL, NULL, NULL, NULL, "xmm13", "ymm13" },
+    [REG_XMM14] = { NULL, NULL, NULL, NULL, "xmm14", "ymm14" },
+    [REG_XMM15] = { NULL, NULL, NULL, NULL, "xmm15", "ymm15" },
+};
+
+static char *condition_names[COND_COUNT] = {
+    [COND_NONE] = "",
+    [COND_E]    = "e",
+    [COND_NE]   = "ne",
+    [COND_L]    = "l",
+    [COND_G]    = "g",
+    [COND_LE]   = "le",
+    [COND_GE]   = "ge",
+    [COND_B]    = "b",
+    [COND_A]    = "a",
+    [COND_BE]   = "be",
+    [COND_AE]   = "ae",
+};
+
+static enum Condition inverted_conditions[COND_COUNT] = {
+    [COND_NONE] = COND_NONE,
+    [COND_E]    = COND_NE,
+    [COND_NE]   = COND_E,
+    [COND_L]    = COND_GE,
+    [COND_G]    = COND_LE,
+    [COND_LE]   = COND_G,
+    [COND_GE]   = COND_L,
+    [COND_B]    = COND_AE,
+    [COND_A]    = COND_BE,
+    [COND_BE]   = COND_A,
+    [COND_AE]   = COND_B,
+};
+
+// Map a width in bytes to a column of reg_names
+static int SizeIndex(int size) {
+    switch (size) {
+        case 1:  return 0;
+        case 2:  return 1;
+        case 4:  return 2;
+        case 16: return 4;
+        case 32: return 5;
+        default: return 3;
+    }
+}
+
+static char *CopyString(char *str) {
+    if (!str) {
+        return NULL;
+    }
+    char *copy = (char *) Memory_Alloc(MEMORY_CODEGEN, strlen(str) + 1);
+    strcpy(copy, str);
+    return copy;
+}
+
+static void FreeInstruction(struct Instruction *instr) {
+    Memory_Free(MEMORY_CODEGEN, instr->dst.label);
+    Memory_Free(MEMORY_CODEGEN, instr->src.label);
+    Memory_Free(MEMORY_CODEGEN, instr->text);
+}
+
+struct Operand Operand_Imm(long long value) {
+    struct Operand operand = Operand_None();
+    operand.kind = OPERAND_IMM;
+    operand.value = value;
+    return operand;
+}
+
+struct Operand Operand_Label(char *label) {
+    struct Operand operand = Operand_None();
+    operand.kind = OPERAND_LABEL;
+    operand.label = label;
+    return operand;
+}
+
+struct Operand Operand_Mem(enum Reg base, long long displacement, int size) {
+    struct Operand operand = Operand_None();
+    operand.kind = OPERAND_MEM;
+    operand.reg = base;
+    operand.value = displacement;
+    operand.size = size;
+    return operand;
+}
+
+struct Operand Operand_MemIndex(enum Reg base, enum Reg index, int scale, long long displacement, int size) {
+    struct Operand operand = Operand_Mem(base, displacement, size);
+    operand.index = index;
+    operand.scale = scale;
+    return operand;
+}
+
+struct Operand Operand_None() {
+    struct Operand operand;
+    operand.kind = OPERAND_NONE;
+    operand.reg = REG_NONE;
+    operand.index = REG_NONE;
+    operand.scale = 1;
+    operand.size = 0;
+    operand.value = 0;
+    operand.label = NULL;
+    return operand;
+}
+
+struct Operand Operand_Reg(enum Reg reg, int size) {
+    struct Operand operand = Operand_None();
+    operand.kind = OPERAND_REG;
+    operand.reg = reg;
+    operand.size = size;
+    return operand;
+}
+
+bool Operand_Equals(struct Operand *a, struct Operand *b) {
+    if (a->kind != b->kind) {
+        return false;
+    }
+    switch (a->kind) {
+        case OPERAND_NONE:  return true;
+        case OPERAND_REG:   return a->reg == b->reg && a->size == b->size;
+        case OPERAND_IMM:   return a->value == b->value;
+        case OPERAND_MEM:   return a->reg == b->reg && a->index == b->index && a->scale == b->scale &&
+                                   a->value == b->value && a->size == b->size;
+        case OPERAND_LABEL: return strcmp(a->label, b->label) == 0;
+    }
+    return false;
+}
+
+void Operand_SetLabel(struct Operand *operand, char *label) {
+    char *copy = CopyString(label);
+    Memory_Free(MEMORY_CODEGEN, operand->label);
+    operand->label = copy;
+}
+
+char *Reg_Name(enum Reg reg, int size) {
+    if (reg < 0 || reg >= REG_COUNT || !reg_names[reg][SizeIndex(size)]) {
+        return "";
+    }
+    return reg_names[reg][SizeIndex(size)];
+}
+
+enum Condition Condition_Invert(enum Condition condition) {
+    return inverted_conditions[condition];
+}
+
+char *Condition_Name(enum Condition condition) {
+    return condition_names[condition];
+}
+
+struct Instruction *InstructionBuffer_Add(struct InstructionBuffer *buffer, enum Opcode opcode, struct Operand dst, struct Operand src) {
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity == 0 ? 64 : buffer->capacity * 2;
+        buffer->data = (struct Instruction *) Memory_Realloc(MEMORY_CODEGEN, buffer->data, sizeof(struct Instruction) * buffer->capacity);
+        if (!buffer->data) {
+            exit(1);
+        }
+    }
+
+    struct Instruction *instr = &buffer->data[buffer->count];
+    buffer->count += 1;
+    instr->opcode = opcode;
+    instr->condition = COND_NONE;
+    instr->dst = dst;
+    instr->src = src;
+    instr->dst.label = CopyString(dst.label);
+    instr->src.label = CopyString(src.label);
+    instr->text = NULL;
+    return instr;
+}
+
+void InstructionBuffer_Clear(struct InstructionBuffer *buffer) {
+    for (int i = 0; i < buffer->count; ++i) {
+        FreeInstruction(&buffer->data[i]);
+    }
+    buffer->count = 0;
+}
+
+void InstructionBuffer_Compact(struct InstructionBuffer *buffer) {
+    int count = 0;
+    for (int i = 0; i < buffer->count; ++i) {
+        struct Instruction *instr = &buffer->data[i];
+        if (instr->opcode == OP_NOP) {
+            FreeInstruction(instr);
+        } else {
+            buffer->data[count] = *instr;
+            count += 1;
+        }
+    }
+    buffer->count = count;
+}
+
+void InstructionBuffer_Free(struct InstructionBuffer *buffer) {
+    InstructionBuffer_Clear(buffer);
+    Memory_Free(MEMORY_CODEGEN, buffer->data);
+    buffer->capacity = 0;
+    buffer->data = NULL;
+}
+
+void InstructionBuffer_Init(struct InstructionBuffer *buffer) {
+    buffer->capacity = 0;
+    buffer->count = 0;
+    buffer->data = NULL;
+}
+
+struct DataField *DataSection_Add(struct DataSection *section, char *label, unsigned char *bytes, int size) {
+    if (section->count == section->capacity) {
+        section->capacity = section->capacity == 0 ? 16 : section->capacity * 2;
+        section->data = (struct DataField *) Memory_Realloc(MEMORY_CODEGEN, section->data, sizeof(struct DataField) * section->capacity);
+        if (!section->data) {
+            exit(1);
+        }
+    }
+
+    struct DataField *field = &section->data[section->count];
+    section->count += 1;
+    field->label = CopyString(label);
+    field->bytes = (unsigned char *) Memory_Alloc(MEMORY_CODEGEN, size > 0 ? size : 1);
+    memcpy(field->bytes, bytes, size);
+    field->size = size;
+    return field;
+}
+
+// Append a null terminated string, decoding the escapes of the source text (\n, \t, \0)
+struct DataField *DataSection_AddString(struct DataSection *section, char *label, char *value) {
+    int length = (int) strlen(value);
+    unsigned char *bytes = (unsigned char *) Memory_Alloc(MEMORY_CODEGEN, length + 1);
+    int size = 0;
+    for (int i = 0; i < length; ++i) {
+        char c = value[i];
+        if (c == '\\' && i + 1 < length) {
+            i += 1;
+            switch (value[i]) {
+                case 'n':   c = '\n'; break;
+                case 't':   c = '\t'; break;
+                case '0':   c = '\0'; break;
+                default:    c = value[i]; break;
+            }
+        }
+        bytes[size] = (unsigned char) c;
+        size += 1;
+    }
+    bytes[size] = 0;
+    struct DataField *field = DataSection_Add(section, label, bytes, size + 1);
+    Memory_Free(MEMORY_CODEGEN, bytes);
+    return field;
+}
+
+void DataSection_Free(struct DataSection *section) {
+    for (int i = 0; i < section->count; ++i) {
+        Memory_Free(MEMORY_CODEGEN, section->data[i].label);
+        Memory_Free(MEMORY_CODEGEN, section->data[i].bytes);
+    }
+    Memory_Free(MEMORY_CODEGEN, section->data);
+    DataSection_Init(section);
+}
+
+void DataSection_Init(struct DataSection *section) {
+    section->capacity = 0;
+    section->count = 0;
+    section->data = NULL;
+}
@@ -0,0 +1,203 @@
+#ifndef BMS_INSTRUCTION_H
+#define BMS_INSTRUCTION_H
+
+#include <stdbool.h>
+
+// x86-64 general purpose registers followed by the SSE/AVX registers, each in hardware encoding order
+enum Reg {
+    REG_NONE = -1,
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_XMM0,                       // Accessed as xmm with width 16 and as ymm with width 32
+    REG_XMM1,
+    REG_XMM2,
+    REG_XMM3,
+    REG_XMM4,
+    REG_XMM5,
+    REG_XMM6,
+    REG_XMM7,
+    REG_XMM8,
+    REG_XMM9,
+    REG_XMM10,
+    REG_XMM11,
+    REG_XMM12,
+    REG_XMM13,
+    REG_XMM14,
+    REG_XMM15,
+    REG_COUNT,
+};
+
+// Condition codes used by jcc and setcc
+enum Condition {
+    COND_NONE,
+    COND_E,
+    COND_NE,
+    COND_L,
+    COND_G,
+    COND_LE,
+    COND_GE,
+    COND_B,                         // Unsigned comparisons
+    COND_A,
+    COND_BE,
+    COND_AE,
+    COND_COUNT,
+};
+
+enum Opcode {
+    OP_NOP,                         // Deleted instruction, skipped on output
+    OP_ADD,
+    OP_ALIGN,                       // Pad with nops to a multiple of dst bytes
+    OP_CALL,
+    OP_CMP,
+    OP_COMMENT,
+    OP_CQO,
+    OP_IDIV,
+    OP_IMUL,
+    OP_JCC,
+    OP_JMP,
+    OP_LABEL,
+    OP_LEA,
+    OP_MOV,
+    OP_MOVD,                        // General purpose register to the low lane of a vector register
+    OP_MOVDQA,
+    OP_MOVDQU,
+    OP_MOVSXD,
+    OP_MOVZX,
+    OP_NEG,
+    OP_PADDB,
+    OP_PADDD,
+    OP_PMULLD,
+    OP_POP,
+    OP_PSUBB,
+    OP_PSUBD,
+    OP_PUNPCKLBW,
+    OP_PUNPCKLDQ,
+    OP_PUNPCKLQDQ,
+    OP_PUNPCKLWD,
+    OP_PUSH,
+    OP_PXOR,
+    OP_RET,
+    OP_SAR,
+    OP_SETCC,
+    OP_SHL,
+    OP_SHR,
+    OP_SUB,
+    OP_TEST,
+    OP_VPBROADCASTB,                // Copy the low lane of src to every lane of dst
+    OP_VPBROADCASTD,
+    OP_VZEROUPPER,
+    OP_COUNT,
+};
+
+enum OperandKind {
+    OPERAND_NONE,
+    OPERAND_REG,                    // reg
+    OPERAND_IMM,                    // value
+    OPERAND_MEM,                    // [reg + index * scale + value]
+    OPERAND_LABEL,                  // label
+};
+
+struct Operand {
+    enum OperandKind kind;
+    enum Reg reg;                   // Register, or base register of a memory operand
+    enum Reg index;                 // Index register of a memory operand
+    int scale;                      // Multiplier of the index register (1, 2, 4 or 8)
+    int size;                       // Width in bytes, 0 if implied by the other operand
+    long long value;                // Immediate value or memory displacement
+    char *label;                    // Label or symbol name
+};
+
+struct Instruction {
+    enum Opcode opcode;
+    enum Condition condition;       // For OP_JCC and OP_SETCC
+    struct Operand dst;
+    struct Operand src;
+    char *text;                     // For OP_COMMENT
+};
+
+// Growable array of instructions for a single function
+struct InstructionBuffer {
+    int capacity;
+    int count;
+    struct Instruction *data;
+};
+
+// Initialized bytes in the data section, such as a printf format string
+struct DataField {
+    char *label;
+    unsigned char *bytes;
+    int size;
+};
+
+// Growable array of the data fields of a translation unit
+struct DataSection {
+    int capacity;
+    int count;
+    struct DataField *data;
+};
+
+// Operand constructors
+struct Operand Operand_Imm(long long value);
+struct Operand Operand_Label(char *label);
+struct Operand Operand_Mem(enum Reg base, long long displacement, int size);
+struct Operand Operand_MemIndex(enum Reg base, enum Reg index, int scale, long long displacement, int size);
+struct Operand Operand_None();
+struct Operand Operand_Reg(enum Reg reg, int size);
+
+// Compare two operands for equality
+bool Operand_Equals(struct Operand *a, struct Operand *b);
+
+// Replace the label of an operand with a copy of label
+void Operand_SetLabel(struct Operand *operand, char *label);
+
+// Name of a register when accessed with the given width in bytes
+char *Reg_Name(enum Reg reg, int size);
+
+// Condition with the opposite outcome (e.g. l -> ge)
+enum Condition Condition_Invert(enum Condition condition);
+
+// Condition suffix as used in jcc and setcc mnemonics (e.g. "ge")
+char *Condition_Name(enum Condition condition);
+
+// Append an instruction and return a pointer to it
+struct Instruction *InstructionBuffer_Add(struct InstructionBuffer *buffer, enum Opcode opcode, struct Operand dst, struct Operand src);
+
+// Remove all instructions, keeping the allocated storage
+void InstructionBuffer_Clear(struct InstructionBuffer *buffer);
+
+// Remove instructions that were replaced with OP_NOP
+void InstructionBuffer_Compact(struct InstructionBuffer *buffer);
+
+// Free the buffer and its instructions
+void InstructionBuffer_Free(struct InstructionBuffer *buffer);
+
+// Initialize an empty buffer
+void InstructionBuffer_Init(struct InstructionBuffer *buffer);
+
+// Append a copy of the bytes of a data field and return a pointer to it
+struct DataField *DataSection_Add(struct DataSection *section, char *label, unsigned char *bytes, int size);
+
+// Append a null terminated string, decoding the escapes of the source text (\n, \t, \0)
+struct DataField *DataSection_AddString(struct DataSection *section, char *label, char *value);
+
+// Free the section and its fields
+void DataSection_Free(struct DataSection *section);
+
+// Initialize an empty section
+void DataSection_Init(struct DataSection *section);
+
+#endif // BMS_INSTRUCTION_H
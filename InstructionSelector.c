@@ -0,0 +1,329 @@
+#include "InstructionSelector.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <limits.h>
+#include <stdlib.h>
+
+static _Thread_local struct FunctionDef *current_func;  // Functions are selected on several threads at once
+
+static bool IsCommutative(struct Expr *expr) {
+    return expr->type == EXPR_ADD || expr->type == EXPR_MUL || expr->type == EXPR_EQU || expr->type == EXPR_NEQ;
+}
+
+// Keep a rule for a goal if it is cheaper than the best one found so far
+static void Cover(struct Selection *selection, enum SelectGoal goal, enum SelectRule rule, int cost) {
+    if (cost < selection->cost[goal]) {
+        selection->cost[goal] = cost;
+        selection->rule[goal] = rule;
+    }
+}
+
+static bool IsLeaf(struct Selection *selection) {
+    return selection && selection->is_leaf;
+}
+
+// Registers for two values computed one after the other: the second is computed while the first is held
+static int CombineNeeds(int first, int second) {
+    return first == second ? first + 1 : (first > second ? first : second);
+}
+
+// Registers for the base and index of an address
+static int AddressNeed(struct SelectAddress *address) {
+    if (address->base && address->index) {
+        return CombineNeeds(address->base->need, address->index->need);
+    }
+    if (address->base || address->index) {
+        return address->base ? address->base->need : address->index->need;
+    }
+    return 1;
+}
+
+static bool HasCover(struct Selection *selection, enum SelectGoal goal) {
+    return selection->cost[goal] < SELECT_NO_COVER;
+}
+
+// Frame address of a local variable, [rbp - offset]
+static void LabelFrame(struct SelectAddress *address, struct Declarator *declarator) {
+    address->frame = true;
+    address->disp = -declarator->rbp_offset;
+}
+
+// addr + value, within the range of a 32-bit displacement
+static void LabelDisp(struct Selection *selection, struct Selection *address, long long value) {
+    long long disp = address->addr.disp + value;
+    if (!HasCover(address, SELECT_ADDR) || disp < INT_MIN || disp > INT_MAX) {
+        return;
+    }
+    if (address->cost[SELECT_ADDR] < selection->cost[SELECT_ADDR]) {
+        Cover(selection, SELECT_ADDR, RULE_ADDR_DISP, address->cost[SELECT_ADDR]);
+        selection->addr = address->addr;
+        selection->addr.disp = (int) disp;
+    }
+}
+
+// base + index * scale, where the base address has no index yet
+static void LabelIndex(struct Selection *selection, struct Selection *base, struct Selection *index) {
+    if (!HasCover(base, SELECT_ADDR) || base->addr.index || (!base->addr.base && !base->addr.frame)) {
+        return;
+    }
+    int scale = 1;
+    struct Expr *expr = index->expr;
+    if (expr->type == EXPR_MUL && expr->rhs->type == EXPR_NUM) {
+        int value = expr->rhs->int_value;
+        if (value == 1 || value == 2 || value == 4 || value == 8) {
+            scale = value;
+            index = index->lhs;
+        }
+    }
+
+    // A constant index, as in a + 0 * 4 left by the loop passes, is a displacement
+    if (index->expr->type == EXPR_NUM) {
+        LabelDisp(selection, base, (long long) index->expr->int_value * scale);
+        return;
+    }
+
+    // Constant parts of the index move to the displacement: a[i + 1] -> [rbp + rax*4 - 52]
+    long long disp = base->addr.disp;
+    while ((index->expr->type == EXPR_ADD || index->expr->type == EXPR_SUB) && index->expr->rhs->type == EXPR_NUM) {
+        long long offset = (long long) index->expr->rhs->int_value * scale;
+        disp += index->expr->type == EXPR_ADD ? offset : -offset;
+        index = index->lhs;
+    }
+    if (disp < INT_MIN || disp > INT_MAX) {
+        return;
+    }
+
+    // With two registers the subtrees are computed in whichever order needs fewer instructions
+    int num_regs = base->addr.num_regs + 1;
+    int cost = base->cost[SELECT_ADDR] + index->cost[SELECT_REG];
+    if (num_regs > 2 || (num_regs == 2 && (!base->is_pure || !index->is_pure))) {
+        return;
+    }
+    if (num_regs == 2 && !IsLeaf(base->addr.base) && !IsLeaf(index)) {
+        cost += 2;
+    }
+
+    if (cost < selection->cost[SELECT_ADDR]) {
+        Cover(selection, SELECT_ADDR, RULE_ADDR_INDEX, cost);
+        selection->addr = base->addr;
+        selection->addr.disp = (int) disp;
+        selection->addr.index = index;
+        selection->addr.scale = scale;
+        selection->addr.num_regs = num_regs;
+    }
+}
+
+// Check that the registers of an address are leaves, so it can be formed next to a live rax
+bool InstructionSelector_HasLeafRegs(struct SelectAddress *address) {
+    return (!address->base || IsLeaf(address->base)) && (!address->index || IsLeaf(address->index));
+}
+
+// Rules for the operators computing a value from two registers
+static void LabelOperator(struct Selection *selection) {
+    struct Expr *expr = selection->expr;
+    struct Selection *lhs = selection->lhs;
+    struct Selection *rhs = selection->rhs;
+    int operands = lhs->cost[SELECT_REG] + rhs->cost[SELECT_REG];
+    int extra = expr->type == EXPR_MUL || expr->type == EXPR_DIV ? 2 : 1;
+
+    if (expr->rhs->type == EXPR_NUM && !(expr->type == EXPR_DIV && expr->rhs->int_value == 0)) {
+        Cover(selection, SELECT_REG, RULE_REG_OP_IMM, lhs->cost[SELECT_REG] + extra);
+    }
+
+    // Only compares read an int straight from memory, arithmetic needs it sign extended first
+    bool memory_operand = (AstUtils_IsRelational(expr) && rhs->mem_type == PRIMTYPE_INT) ||
+                          ((AstUtils_IsRelational(expr) || expr->type == EXPR_ADD || expr->type == EXPR_SUB) && rhs->mem_type == PRIMTYPE_PTR);
+    if (memory_operand && HasCover(rhs, SELECT_MEM) && InstructionSelector_HasLeafRegs(&rhs->mem) && lhs->is_pure) {
+        Cover(selection, SELECT_REG, RULE_REG_OP_MEM, lhs->cost[SELECT_REG] + rhs->cost[SELECT_MEM] + extra);
+    }
+
+    // Operands may only be reordered when the one moved first has no side effects
+    if (rhs->is_simple && lhs->is_pure) {
+        Cover(selection, SELECT_REG, RULE_REG_OP_LEAF, operands + extra);
+    }
+    if (lhs->is_simple) {
+        int moves = IsCommutative(expr) || AstUtils_IsRelational(expr) ? 0 : 1;
+        Cover(selection, SELECT_REG, RULE_REG_OP_SWAP, operands + extra + moves);
+    }
+    Cover(selection, SELECT_REG, RULE_REG_OP_REG, operands + extra + 2);
+}
+
+// Label a node once its operands are labeled
+static void LabelNode(struct Selection *selection) {
+    struct Expr *expr = selection->expr;
+    struct Selection *lhs = selection->lhs;
+    struct Selection *rhs = selection->rhs;
+
+    switch (expr->type) {
+        case EXPR_NUM: {
+            Cover(selection, SELECT_IMM, RULE_IMM_NUM, 0);
+            Cover(selection, SELECT_REG, RULE_REG_IMM, 1);
+        } break;
+        case EXPR_VAR: {
+            enum PrimitiveType type;
+            struct Declarator *declarator = AstUtils_FindDeclarator(current_func, expr->str_value, &type);
+            if (!declarator) {
+                ReportInternalError("InstructionSelector::LabelNode - undeclared variable '%s'", expr->str_value);
+            }
+            if (declarator->array_dimensions > 0) {
+                Cover(selection, SELECT_ADDR, RULE_ADDR_FRAME, 0);
+                LabelFrame(&selection->addr, declarator);
+            } else {
+                Cover(selection, SELECT_MEM, RULE_MEM_VAR, 0);
+                LabelFrame(&selection->mem, declarator);
+                selection->mem_type = declarator->pointer_inderection > 0 ? PRIMTYPE_PTR : type;
+            }
+        } break;
+        case EXPR_ADDR: {
+            if (expr->lhs->type == EXPR_VAR) {
+                enum PrimitiveType type;
+                struct Declarator *declarator = AstUtils_FindDeclarator(current_func, expr->lhs->str_value, &type);
+                Cover(selection, SELECT_ADDR, RULE_ADDR_FRAME, 0);
+                LabelFrame(&selection->addr, declarator);
+            } else if (expr->lhs->type == EXPR_DEREF && HasCover(lhs->lhs, SELECT_ADDR)) {
+                Cover(selection, SELECT_ADDR, RULE_ADDR_OF, lhs->lhs->cost[SELECT_ADDR]);
+                selection->addr = lhs->lhs->addr;
+            }
+        } break;
+        case EXPR_DEREF: {
+            // Loads of unknown width read the whole register, as pointers do
+            Cover(selection, SELECT_MEM, RULE_MEM_DEREF, lhs->cost[SELECT_ADDR]);
+            selection->mem = lhs->addr;
+            selection->mem_type = expr->operand_type != PRIMTYPE_INVALID ? expr->operand_type : PRIMTYPE_PTR;
+        } break;
+        case EXPR_ADD: {
+            if (expr->rhs->type == EXPR_NUM) LabelDisp(selection, lhs, expr->rhs->int_value);
+            if (expr->lhs->type == EXPR_NUM) LabelDisp(selection, rhs, expr->lhs->int_value);
+            LabelIndex(selection, lhs, rhs);
+            LabelIndex(selection, rhs, lhs);
+        } break;
+        case EXPR_SUB: {
+            if (expr->rhs->type == EXPR_NUM) LabelDisp(selection, lhs, -(long long) expr->rhs->int_value);
+        } break;
+        default: {
+        } break;
+    }
+
+    if (HasCover(selection, SELECT_MEM)) {
+        Cover(selection, SELECT_REG, RULE_REG_MEM, selection->cost[SELECT_MEM] + 1);
+    }
+
+    switch (expr->type) {
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_MUL:
+        case EXPR_DIV:
+        case EXPR_EQU:
+        case EXPR_NEQ:
+        case EXPR_LT:
+        case EXPR_GT:
+        case EXPR_LTE:
+        case EXPR_GTE: {
+            LabelOperator(selection);
+        } break;
+        case EXPR_PLUS:
+        case EXPR_NEG: {
+            Cover(selection, SELECT_REG, RULE_REG_UNARY, lhs->cost[SELECT_REG] + 1);
+        } break;
+        case EXPR_ASSIGN: {
+            Cover(selection, SELECT_REG, RULE_REG_EXPR, lhs->cost[SELECT_MEM] + rhs->cost[SELECT_REG] + 1);
+        } break;
+        case EXPR_STR: {
+            Cover(selection, SELECT_REG, RULE_REG_EXPR, 1);
+        } break;
+        case EXPR_FUNC_CALL: {
+            Cover(selection, SELECT_REG, RULE_REG_EXPR, 10 + 2 * expr->args.count);
+        } break;
+        default: {
+        } break;
+    }
+
+    // Chain rules between a value and an address: lea computes one from the other in an instruction
+    if (HasCover(selection, SELECT_ADDR)) {
+        Cover(selection, SELECT_REG, RULE_REG_LEA, selection->cost[SELECT_ADDR] + 1);
+    }
+    if (HasCover(selection, SELECT_REG) && selection->rule[SELECT_REG] != RULE_REG_LEA) {
+        if (selection->cost[SELECT_REG] < selection->cost[SELECT_ADDR]) {
+            Cover(selection, SELECT_ADDR, RULE_ADDR_REG, selection->cost[SELECT_REG]);
+            selection->addr = (struct SelectAddress) { .base = selection, .scale = 1, .num_regs = 1 };
+        }
+    }
+    if (!HasCover(selection, SELECT_REG)) {
+        ReportInternalError("InstructionSelector::LabelNode - no cover for expression");
+    }
+
+    switch (selection->rule[SELECT_REG]) {
+        case RULE_REG_IMM:  selection->is_leaf = true; break;
+        case RULE_REG_MEM:  selection->is_leaf = selection->mem.num_regs == 0; break;
+        case RULE_REG_LEA:  selection->is_leaf = selection->addr.num_regs == 0; break;
+        default:            break;
+    }
+
+    switch (selection->rule[SELECT_REG]) {
+        case RULE_REG_IMM:      selection->need = 1; break;
+        case RULE_REG_MEM:      selection->need = AddressNeed(&selection->mem); break;
+        case RULE_REG_LEA:      selection->need = AddressNeed(&selection->addr); break;
+        case RULE_REG_UNARY:
+        case RULE_REG_OP_IMM:   selection->need = lhs->need; break;
+        case RULE_REG_OP_MEM:
+        case RULE_REG_OP_LEAF:  selection->need = lhs->need > rhs->need ? lhs->need : rhs->need + 1; break;
+        case RULE_REG_OP_SWAP:  selection->need = rhs->need > lhs->need ? rhs->need : lhs->need + 1; break;
+        case RULE_REG_OP_REG:   selection->need = CombineNeeds(lhs->need, rhs->need); break;
+        default:                selection->need = expr->type == EXPR_ASSIGN ? CombineNeeds(rhs->need, AddressNeed(&lhs->mem)) : 1; break;
+    }
+    if (selection->has_call) {
+        selection->need = SELECT_CALL_NEED;
+    }
+
+    selection->is_simple = selection->is_leaf;
+    if (selection->rule[SELECT_REG] == RULE_REG_MEM && InstructionSelector_HasLeafRegs(&selection->mem)) {
+        selection->is_simple = true;
+    }
+    if (selection->rule[SELECT_REG] == RULE_REG_LEA && InstructionSelector_HasLeafRegs(&selection->addr)) {
+        selection->is_simple = true;
+    }
+}
+
+static struct Selection *LabelExpr(struct Expr *expr) {
+    if (!expr) {
+        return NULL;
+    }
+
+    struct Selection *selection = (struct Selection *) Memory_Calloc(MEMORY_CODEGEN, 1, sizeof(struct Selection));
+    selection->expr = expr;
+    for (int goal = 0; goal < SELECT_GOAL_COUNT; ++goal) {
+        selection->cost[goal] = SELECT_NO_COVER;
+    }
+
+    // Call arguments are labeled when each is generated
+    if (expr->type != EXPR_FUNC_CALL) {
+        selection->lhs = LabelExpr(expr->lhs);
+        selection->rhs = LabelExpr(expr->rhs);
+    }
+    selection->is_pure = expr->type != EXPR_FUNC_CALL && expr->type != EXPR_ASSIGN &&
+                         (!selection->lhs || selection->lhs->is_pure) && (!selection->rhs || selection->rhs->is_pure);
+    selection->has_call = expr->type == EXPR_FUNC_CALL || (selection->lhs && selection->lhs->has_call) ||
+                          (selection->rhs && selection->rhs->has_call);
+
+    LabelNode(selection);
+    return selection;
+}
+
+// Label an expression of a function with the cheapest rule for each goal of each node
+struct Selection *InstructionSelector_Label(struct FunctionDef *function, struct Expr *expr) {
+    current_func = function;
+    struct Selection *selection = LabelExpr(expr);
+    current_func = NULL;
+    return selection;
+}
+
+// Free a labeled tree
+void InstructionSelector_Free(struct Selection *selection) {
+    if (!selection) {
+        return;
+    }
+    InstructionSelector_Free(selection->lhs);
+    InstructionSelector_Free(selection->rhs);
+    Memory_Free(MEMORY_CODEGEN, selection);
+}
@@ -0,0 +1,78 @@
+#ifndef BMS_INSTRUCTION_SELECTOR_H
+#define BMS_INSTRUCTION_SELECTOR_H
+
+#include "AstNode.h"
+#include <stdbool.h>
+
+// What a subtree is reduced to by the code generator
+enum SelectGoal {
+    SELECT_REG,         // Value in a register
+    SELECT_IMM,         // Immediate operand
+    SELECT_ADDR,        // Value used as an address operand, for lea or a memory access
+    SELECT_MEM,         // Value read from or written to memory through an address operand
+    SELECT_GOAL_COUNT
+};
+
+// Tree patterns, each deriving a goal from the goals of the operands
+enum SelectRule {
+    RULE_NONE,
+    RULE_IMM_NUM,       // imm: NUM
+    RULE_REG_IMM,       // reg: imm                     mov rax, 5
+    RULE_REG_MEM,       // reg: mem                     movsxd rax, dword [rbp + rax*4 - 56]
+    RULE_REG_LEA,       // reg: addr                    lea rax, [rax + rdi*4]
+    RULE_REG_UNARY,     // reg: NEG(reg), PLUS(reg)
+    RULE_REG_OP_IMM,    // reg: OP(reg, imm)            add rax, 5
+    RULE_REG_OP_MEM,    // reg: OP(reg, mem)            cmp eax, dword [rbp - 8]
+    RULE_REG_OP_LEAF,   // reg: OP(reg, simple)         rhs loaded into rdi after lhs
+    RULE_REG_OP_SWAP,   // reg: OP(simple, reg)         lhs loaded into rdi after rhs
+    RULE_REG_OP_REG,    // reg: OP(reg, reg)            the first operand waits in a spare register or on the stack
+    RULE_REG_EXPR,      // reg: calls, assignments and strings, generated node by node
+    RULE_ADDR_FRAME,    // addr: VAR array, ADDR(VAR)   [rbp - 56]
+    RULE_ADDR_OF,       // addr: ADDR(DEREF(addr))
+    RULE_ADDR_DISP,     // addr: ADD(addr, imm), SUB(addr, imm)
+    RULE_ADDR_INDEX,    // addr: ADD(addr, MUL(reg, 1|2|4|8)), ADD(addr, reg)
+    RULE_ADDR_REG,      // addr: reg                    [rax]
+    RULE_MEM_VAR,       // mem: VAR                     [rbp - 8]
+    RULE_MEM_DEREF,     // mem: DEREF(addr)
+};
+
+// Address operand [base + index * scale + disp], rbp based when frame is set
+struct SelectAddress {
+    struct Selection *base;         // Subtree computing the base register, NULL for rbp or none
+    struct Selection *index;        // Subtree computing the index register, or NULL
+    int scale;
+    int disp;                       // Includes the rbp offset of frame addresses
+    bool frame;
+    int num_regs;                   // Registers computed for base and index
+};
+
+// Cheapest cover of an expression tree, built by the labeler bottom up
+struct Selection {
+    struct Expr *expr;
+    struct Selection *lhs;
+    struct Selection *rhs;
+    int cost[SELECT_GOAL_COUNT];            // Instructions to derive each goal, SELECT_NO_COVER if none
+    enum SelectRule rule[SELECT_GOAL_COUNT];
+    struct SelectAddress addr;              // The expression as an address
+    struct SelectAddress mem;               // The memory the expression reads
+    enum PrimitiveType mem_type;            // Width of the memory read
+    bool is_pure;
+    bool has_call;                          // Clobbers the caller saved registers
+    int need;                               // Registers to compute the value without spilling (Sethi-Ullman number)
+    bool is_leaf;                           // Loads into any register with a single instruction
+    bool is_simple;                         // Loads into any register from leaves, using rsi as scratch
+};
+
+#define SELECT_NO_COVER 1000000
+#define SELECT_CALL_NEED 16           // A call needs every register
+
+// Label an expression of a function with the cheapest rule for each goal of each node
+struct Selection *InstructionSelector_Label(struct FunctionDef *function, struct Expr *expr);
+
+// Check that the registers of an address are leaves, so it can be formed next to a live rax
+bool InstructionSelector_HasLeafRegs(struct SelectAddress *address);
+
+// Free a labeled tree
+void InstructionSelector_Free(struct Selection *selection);
+
+#endif // BMS_INSTRUCTION_SELECTOR_H
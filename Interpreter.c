@@ -0,0 +1,373 @@
+#include "Interpreter.h"
+#include "Memory.h"
+#include "ReportError.h"
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERPRETER_MAX_EXTERN_ARGS 8
+
+// External functions are called through a variadic type, which also suits printf
+typedef long long (*ExternFunction)(long long, ...);
+
+struct ThreadedFunction;
+struct ThreadedInstruction;
+
+// The operand of an instruction, resolved before the program runs
+union ThreadedOperand {
+    long long value;                        // Constant, frame offset or address of a string
+    struct ThreadedInstruction *target;     // Jumps
+    struct ThreadedFunction *callee;        // BC_CALL
+    ExternFunction external;                // BC_CALLX
+};
+
+// An instruction with its opcode replaced by the address of its handler, so that each handler jumps
+// straight to the next one (direct threading)
+struct ThreadedInstruction {
+    const void *handler;
+    union ThreadedOperand operand;
+    unsigned short a;
+    unsigned short b;
+    unsigned short c;
+};
+
+// A function ready to run, with the layout of its frame: call record and registers, locals below
+// rbp, then the return address, saved rbp and stack arguments above it as in native code
+struct ThreadedFunction {
+    struct BytecodeFunction *function;
+    struct ThreadedInstruction *code;
+    int regs_offset;
+    int rbp_offset;
+    int frame_size;
+};
+
+// Bookkeeping of a call, at the start of the frame of the callee
+struct CallRecord {
+    struct CallRecord *caller;
+    struct ThreadedInstruction *return_ip;
+    long long *regs;
+    unsigned char *rbp;
+    int result;                     // Register of the caller receiving the return value
+};
+
+static int num_runs = 0;
+static long long num_calls = 0;
+static long long max_stack_bytes = 0;
+
+static int Align(int n, int offset) {
+    return (n + offset - 1) / offset * offset;
+}
+
+// Store the low size bytes of a value, as a store of that width does
+static void StoreValue(unsigned char *address, long long value, int size) {
+    switch (size) {
+        case 1: { *address = (unsigned char) value; } break;
+        case 4: { int word = (int) value; memcpy(address, &word, 4); } break;
+        default: { memcpy(address, &value, 8); } break;
+    }
+}
+
+static long long LoadInt(unsigned char *address) {
+    int word;
+    memcpy(&word, address, 4);
+    return word;
+}
+
+static long long LoadLong(unsigned char *address) {
+    long long value;
+    memcpy(&value, address, 8);
+    return value;
+}
+
+// Resolve the operands of a function and replace its opcodes by the handlers of Execute
+static void ThreadFunction(struct ThreadedFunction *threaded, struct ThreadedFunction *functions, ExternFunction *externs,
+                           struct BytecodeProgram *program, const void **handlers) {
+    struct BytecodeFunction *function = threaded->function;
+    threaded->code = NEW_ARRAY(MEMORY_CODEGEN, struct ThreadedInstruction, function->count);
+    for (int i = 0; i < function->count; ++i) {
+        struct BytecodeInstruction *instr = &function->code[i];
+        struct ThreadedInstruction *out = &threaded->code[i];
+        out->handler = handlers[instr->opcode];
+        out->a = instr->a;
+        out->b = instr->b;
+        out->c = instr->c;
+        switch (instr->opcode) {
+            case BC_STR: {
+                out->operand.value = (long long) (intptr_t) program->data.data[instr->imm].bytes;
+            } break;
+            case BC_JMP:
+            case BC_JZ:
+            case BC_JNZ:
+            case BC_JEQ:
+            case BC_JNE:
+            case BC_JLT:
+            case BC_JGT:
+            case BC_JLE:
+            case BC_JGE: {
+                out->operand.target = &threaded->code[instr->imm];
+            } break;
+            case BC_CALL: {
+                out->operand.callee = &functions[instr->imm];
+            } break;
+            case BC_CALLX: {
+                out->operand.external = externs[instr->imm];
+            } break;
+            default: {
+                out->operand.value = instr->imm;
+            } break;
+        }
+    }
+
+    threaded->regs_offset = Align((int) sizeof(struct CallRecord), 16);
+    threaded->rbp_offset = threaded->regs_offset + Align(function->num_regs * 8, 16) + function->locals_size;
+    threaded->frame_size = threaded->rbp_offset + Align(function->args_size, 16);
+}
+
+// Run the threaded code from a function. With handlers set, only fill in the handler table.
+static long long Execute(struct ThreadedFunction *entry, unsigned char *stack, const void ***handlers) {
+    static const void *handler_table[BC_COUNT] = {
+        [BC_MOVI]    = &&op_movi,
+        [BC_STR]     = &&op_movi,
+        [BC_MOV]     = &&op_mov,
+        [BC_ADDR]    = &&op_addr,
+        [BC_GETL8]   = &&op_getl8,
+        [BC_GETL32]  = &&op_getl32,
+        [BC_GETL64]  = &&op_getl64,
+        [BC_SETL8]   = &&op_setl8,
+        [BC_SETL32]  = &&op_setl32,
+        [BC_SETL64]  = &&op_setl64,
+        [BC_LOAD8]   = &&op_load8,
+        [BC_LOAD32]  = &&op_load32,
+        [BC_LOAD64]  = &&op_load64,
+        [BC_STORE8]  = &&op_store8,
+        [BC_STORE32] = &&op_store32,
+        [BC_STORE64] = &&op_store64,
+        [BC_ADD]     = &&op_add,
+        [BC_SUB]     = &&op_sub,
+        [BC_MUL]     = &&op_mul,
+        [BC_DIV]     = &&op_div,
+        [BC_ADDI]    = &&op_addi,
+        [BC_NEG]     = &&op_neg,
+        [BC_EQ]      = &&op_eq,
+        [BC_NE]      = &&op_ne,
+        [BC_LT]      = &&op_lt,
+        [BC_GT]      = &&op_gt,
+        [BC_LE]      = &&op_le,
+        [BC_GE]      = &&op_ge,
+        [BC_JMP]     = &&op_jmp,
+        [BC_JZ]      = &&op_jz,
+        [BC_JNZ]     = &&op_jnz,
+        [BC_JEQ]     = &&op_jeq,
+        [BC_JNE]     = &&op_jne,
+        [BC_JLT]     = &&op_jlt,
+        [BC_JGT]     = &&op_jgt,
+        [BC_JLE]     = &&op_jle,
+        [BC_JGE]     = &&op_jge,
+        [BC_CALL]    = &&op_call,
+        [BC_CALLX]   = &&op_callx,
+        [BC_RET]     = &&op_ret,
+    };
+    if (handlers) {
+        *handlers = handler_table;
+        return 0;
+    }
+
+    #define NEXT() goto *ip->handler
+    #define R(field) regs[ip->field]
+    #define ARITHMETIC(op) R(a) = (long long) ((unsigned long long) R(b) op (unsigned long long) R(c)); ip += 1; NEXT()
+    #define RELATION(op) R(a) = R(b) op R(c); ip += 1; NEXT()
+    #define BRANCH(condition) ip = (condition) ? ip->operand.target : ip + 1; NEXT()
+
+    unsigned char *stack_end = stack + INTERPRETER_STACK_SIZE;
+    struct CallRecord *record = (struct CallRecord *) stack;
+    record->caller = NULL;
+    long long *regs = (long long *) (stack + entry->regs_offset);
+    unsigned char *rbp = stack + entry->rbp_offset;
+    unsigned char *stack_top = stack + entry->frame_size;
+    struct ThreadedInstruction *ip = entry->code;
+    entry->function->num_calls += 1;
+    NEXT();
+
+op_movi:    R(a) = ip->operand.value; ip += 1; NEXT();
+op_mov:     R(a) = R(b); ip += 1; NEXT();
+op_addr:    R(a) = (long long) (intptr_t) (rbp - ip->operand.value); ip += 1; NEXT();
+op_getl8:   R(a) = rbp[-ip->operand.value]; ip += 1; NEXT();
+op_getl32:  R(a) = LoadInt(rbp - ip->operand.value); ip += 1; NEXT();
+op_getl64:  R(a) = LoadLong(rbp - ip->operand.value); ip += 1; NEXT();
+op_setl8:   StoreValue(rbp - ip->operand.value, R(a), 1); ip += 1; NEXT();
+op_setl32:  StoreValue(rbp - ip->operand.value, R(a), 4); ip += 1; NEXT();
+op_setl64:  StoreValue(rbp - ip->operand.value, R(a), 8); ip += 1; NEXT();
+op_load8:   R(a) = *(unsigned char *) (intptr_t) R(b); ip += 1; NEXT();
+op_load32:  R(a) = LoadInt((unsigned char *) (intptr_t) R(b)); ip += 1; NEXT();
+op_load64:  R(a) = LoadLong((unsigned char *) (intptr_t) R(b)); ip += 1; NEXT();
+op_store8:  StoreValue((unsigned char *) (intptr_t) R(a), R(b), 1); ip += 1; NEXT();
+op_store32: StoreValue((unsigned char *) (intptr_t) R(a), R(b), 4); ip += 1; NEXT();
+op_store64: StoreValue((unsigned char *) (intptr_t) R(a), R(b), 8); ip += 1; NEXT();
+op_add:     ARITHMETIC(+);
+op_sub:     ARITHMETIC(-);
+op_mul:     ARITHMETIC(*);
+op_div:     R(a) = (int) R(b) / (int) R(c); ip += 1; NEXT();
+op_addi:    R(a) = (long long) ((unsigned long long) R(b) + (unsigned long long) ip->operand.value); ip += 1; NEXT();
+op_neg:     R(a) = (long long) (0ULL - (unsigned long long) R(b)); ip += 1; NEXT();
+op_eq:      RELATION(==);
+op_ne:      RELATION(!=);
+op_lt:      RELATION(<);
+op_gt:      RELATION(>);
+op_le:      RELATION(<=);
+op_ge:      RELATION(>=);
+op_jmp:     ip = ip->operand.target; NEXT();
+op_jz:      BRANCH(R(a) == 0);
+op_jnz:     BRANCH(R(a) != 0);
+op_jeq:     BRANCH(R(a) == R(b));
+op_jne:     BRANCH(R(a) != R(b));
+op_jlt:     BRANCH(R(a) < R(b));
+op_jgt:     BRANCH(R(a) > R(b));
+op_jle:     BRANCH(R(a) <= R(b));
+op_jge:     BRANCH(R(a) >= R(b));
+
+op_call: {
+    struct ThreadedFunction *callee = ip->operand.callee;
+    if (stack_top + callee->frame_size > stack_end) {
+        ReportInternalError("Interpreter::Execute - stack overflow in '%s'", callee->function->name);
+    }
+
+    // Arguments go straight into the parameter slots, those past the sixth above rbp
+    struct CallRecord *callee_record = (struct CallRecord *) stack_top;
+    unsigned char *callee_rbp = stack_top + callee->rbp_offset;
+    struct BytecodeFunction *function = callee->function;
+    int count = ip->c < function->num_params ? ip->c : function->num_params;
+    for (int i = 0; i < count; ++i) {
+        StoreValue(callee_rbp - function->params[i].rbp_offset, regs[ip->b + i], function->params[i].size);
+    }
+    function->num_calls += 1;
+
+    callee_record->caller = record;
+    callee_record->return_ip = ip + 1;
+    callee_record->regs = regs;
+    callee_record->rbp = rbp;
+    callee_record->result = ip->a;
+    record = callee_record;
+    regs = (long long *) (stack_top + callee->regs_offset);
+    rbp = callee_rbp;
+    stack_top += callee->frame_size;
+    if (stack_top - stack > max_stack_bytes) {
+        max_stack_bytes = stack_top - stack;
+    }
+    ip = callee->code;
+    NEXT();
+}
+
+op_callx: {
+    long long args[INTERPRETER_MAX_EXTERN_ARGS] = { 0 };
+    for (int i = 0; i < ip->c; ++i) {
+        args[i] = regs[ip->b + i];
+    }
+    R(a) = ip->operand.external(args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
+    ip += 1;
+    NEXT();
+}
+
+op_ret: {
+    long long value = R(a);
+    if (!record->caller) {
+        return value;
+    }
+    stack_top = (unsigned char *) record;
+    ip = record->return_ip;
+    regs = record->regs;
+    rbp = record->rbp;
+    regs[record->result] = value;
+    record = record->caller;
+    NEXT();
+}
+
+    #undef NEXT
+    #undef R
+    #undef ARITHMETIC
+    #undef RELATION
+    #undef BRANCH
+}
+
+// Run a function of a program without arguments, usually main, and return its result
+long long Interpreter_Run(struct BytecodeProgram *program, char *name) {
+    const void **handlers;
+    Execute(NULL, NULL, &handlers);
+
+    ExternFunction *externs = NEW_ARRAY(MEMORY_CODEGEN, ExternFunction, program->num_externs);
+    void *process = dlopen(NULL, RTLD_LAZY);
+    for (int i = 0; i < program->num_externs; ++i) {
+        externs[i] = process ? (ExternFunction) dlsym(process, program->externs[i]) : NULL;
+        if (!externs[i]) {
+            ReportInternalError("Interpreter::Run - undefined symbol '%s'", program->externs[i]);
+        }
+    }
+
+    struct ThreadedFunction *functions = NEW_ARRAY(MEMORY_CODEGEN, struct ThreadedFunction, program->num_functions);
+    struct ThreadedFunction *entry = NULL;
+    for (int i = 0; i < program->num_functions; ++i) {
+        functions[i].function = &program->functions[i];
+        if (strcmp(program->functions[i].name, name) == 0) {
+            entry = &functions[i];
+        }
+    }
+    if (!entry) {
+        ReportInternalError("Interpreter::Run - no function '%s'", name);
+    }
+    long long calls_before = 0;
+    for (int i = 0; i < program->num_functions; ++i) {
+        ThreadFunction(&functions[i], functions, externs, program, handlers);
+        calls_before += program->functions[i].num_calls;
+    }
+
+    unsigned char *stack = (unsigned char *) Memory_Alloc(MEMORY_CODEGEN, INTERPRETER_STACK_SIZE);
+    if (!stack) {
+        exit(1);
+    }
+    long long result = Execute(entry, stack, NULL);
+
+    num_runs += 1;
+    for (int i = 0; i < program->num_functions; ++i) {
+        num_calls += program->functions[i].num_calls;
+        Memory_Free(MEMORY_CODEGEN, functions[i].code);
+    }
+    num_calls -= calls_before;
+    Memory_Free(MEMORY_CODEGEN, stack);
+    Memory_Free(MEMORY_CODEGEN, functions);
+    Memory_Free(MEMORY_CODEGEN, externs);
+    return result;
+}
+
+static struct BytecodeProgram *profile_program;
+
+static int CompareCalls(const void *a, const void *b) {
+    long long calls_a = profile_program->functions[*(int *) a].num_calls;
+    long long calls_b = profile_program->functions[*(int *) b].num_calls;
+    return calls_a < calls_b ? 1 : calls_a > calls_b ? -1 : *(int *) a - *(int *) b;
+}
+
+// Print how often each function was called, most called first
+void Interpreter_PrintProfile(FILE *file, struct BytecodeProgram *program) {
+    int *order = NEW_ARRAY(MEMORY_CODEGEN, int, program->num_functions);
+    for (int i = 0; i < program->num_functions; ++i) {
+        order[i] = i;
+    }
+    profile_program = program;
+    qsort(order, program->num_functions, sizeof(int), CompareCalls);
+    profile_program = NULL;
+
+    fprintf(file, "profile:\n");
+    for (int i = 0; i < program->num_functions; ++i) {
+        struct BytecodeFunction *function = &program->functions[order[i]];
+        fprintf(file, "  %-20s %lld\n", function->name, function->num_calls);
+    }
+    Memory_Free(MEMORY_CODEGEN, order);
+}
+
+// Print how many calls were made and the most stack they used
+void Interpreter_PrintStats(FILE *file) {
+    fprintf(file, "interpreter:\n");
+    fprintf(file, "  %-20s %d\n", "runs", num_runs);
+    fprintf(file, "  %-20s %lld\n", "calls", num_calls);
+    fprintf(file, "  %-20s %lld\n", "max-stack-bytes", max_stack_bytes);
+}
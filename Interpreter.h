@@ -0,0 +1,21 @@
+#ifndef BMS_INTERPRETER_H
+#define BMS_INTERPRETER_H
+
+#include "Bytecode.h"
+#include <stdio.h>
+
+#define INTERPRETER_STACK_SIZE (64 * 1024 * 1024)  // Bytes for the frames and registers of all active calls
+
+// Run a function of a program without arguments, usually main, and return its result. External
+// functions such as printf are called in the running process. Each call counts towards num_calls
+// of the function entered.
+long long Interpreter_Run(struct BytecodeProgram *program, char *name);
+
+// Print how often each function was called, most called first: the candidates for compiling to
+// native code
+void Interpreter_PrintProfile(FILE *file, struct BytecodeProgram *program);
+
+// Print how many calls were made and the most stack they used
+void Interpreter_PrintStats(FILE *file);
+
+#endif // BMS_INTERPRETER_H
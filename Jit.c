@@ -0,0 +1,188 @@
+#include "Jit.h"
+#include "Memory.h"
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_STUB_SIZE 16            // jmp [rip + 0] followed by the 8-byte address of the function
+
+// A label outside the text and the address it was resolved to
+struct JitLabel {
+    char *label;
+    unsigned char *address;
+};
+
+static int num_code_bytes = 0;
+static int num_data_bytes = 0;
+static int num_externs_resolved = 0;
+
+static int CompareJitLabels(const void *a, const void *b) {
+    return strcmp(((struct JitLabel *) a)->label, ((struct JitLabel *) b)->label);
+}
+
+static int CompareSymbols(const void *a, const void *b) {
+    return strcmp(((struct CodeSymbol *) a)->label, ((struct CodeSymbol *) b)->label);
+}
+
+static size_t AlignSize(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static struct JitLabel *FindJitLabel(struct JitLabel *labels, int count, char *label) {
+    struct JitLabel key = { label, NULL };
+    return (struct JitLabel *) bsearch(&key, labels, count, sizeof(struct JitLabel), CompareJitLabels);
+}
+
+// Copy resolved machine code and its data into fresh pages, point the calls to external functions
+// at their addresses in the running process and make the text executable
+bool Jit_Load(struct JitCode *jit, struct MachineCode *code, struct DataSection *data) {
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    struct JitLabel *data_labels = NEW_ARRAY(MEMORY_CODEGEN, struct JitLabel, data->count);
+    size_t data_size = 0;
+    for (int i = 0; i < data->count; ++i) {
+        data_labels[i].label = data->data[i].label;
+        data_labels[i].address = (unsigned char *) (uintptr_t) data_size;  // Offset until the pages are mapped
+        data_size += (size_t) data->data[i].size;
+    }
+    qsort(data_labels, data->count, sizeof(struct JitLabel), CompareJitLabels);
+
+    // Every external function gets a stub next to the text, since libc is usually more than a rel32 away
+    struct JitLabel *externs = NEW_ARRAY(MEMORY_CODEGEN, struct JitLabel, code->num_fixups);
+    int num_externs = 0;
+    for (int i = 0; i < code->num_fixups; ++i) {
+        if (!FindJitLabel(data_labels, data->count, code->fixups[i].label)) {
+            externs[num_externs].label = code->fixups[i].label;
+            num_externs += 1;
+        }
+    }
+    qsort(externs, num_externs, sizeof(struct JitLabel), CompareJitLabels);
+    int num_unique = 0;
+    for (int i = 0; i < num_externs; ++i) {
+        if (num_unique == 0 || strcmp(externs[num_unique - 1].label, externs[i].label) != 0) {
+            externs[num_unique] = externs[i];
+            num_unique += 1;
+        }
+    }
+    num_externs = num_unique;
+
+    void *process = dlopen(NULL, RTLD_LAZY);
+    for (int i = 0; i < num_externs; ++i) {
+        externs[i].address = process ? (unsigned char *) dlsym(process, externs[i].label) : NULL;
+        if (!externs[i].address) {
+            fprintf(stderr, "Undefined symbol: %s\n", externs[i].label);
+            Memory_Free(MEMORY_CODEGEN, externs);
+            Memory_Free(MEMORY_CODEGEN, data_labels);
+            return false;
+        }
+    }
+
+    // Layout: text, stubs, then the data on pages of its own
+    size_t stubs_offset = AlignSize((size_t) code->size, JIT_STUB_SIZE);
+    size_t text_size = AlignSize(stubs_offset + (size_t) num_externs * JIT_STUB_SIZE, page_size);
+    size_t size = text_size + AlignSize(data_size, page_size);
+    unsigned char *memory = (unsigned char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        Memory_Free(MEMORY_CODEGEN, externs);
+        Memory_Free(MEMORY_CODEGEN, data_labels);
+        return false;
+    }
+
+    memcpy(memory, code->text, (size_t) code->size);
+    memset(memory + code->size, 0xcc, text_size - (size_t) code->size);  // int3
+    for (int i = 0; i < num_externs; ++i) {
+        unsigned char *stub = memory + stubs_offset + (size_t) i * JIT_STUB_SIZE;
+        static const unsigned char jmp[6] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+        memcpy(stub, jmp, sizeof(jmp));
+        memcpy(stub + sizeof(jmp), &externs[i].address, sizeof(externs[i].address));
+        externs[i].address = stub;
+    }
+
+    unsigned char *data_memory = memory + text_size;
+    size_t offset = 0;
+    for (int i = 0; i < data->count; ++i) {
+        memcpy(data_memory + offset, data->data[i].bytes, (size_t) data->data[i].size);
+        offset += (size_t) data->data[i].size;
+    }
+    for (int i = 0; i < data->count; ++i) {
+        data_labels[i].address = data_memory + (uintptr_t) data_labels[i].address;
+    }
+
+    // Fixups between functions are already patched, the rest refer to the data or to a stub
+    for (int i = 0; i < code->num_fixups; ++i) {
+        struct CodeFixup *fixup = &code->fixups[i];
+        struct JitLabel *label = FindJitLabel(data_labels, data->count, fixup->label);
+        if (!label) {
+            label = FindJitLabel(externs, num_externs, fixup->label);
+        }
+        int value = (int) (label->address + fixup->addend - (memory + fixup->offset));
+        memcpy(memory + fixup->offset, &value, sizeof(value));
+    }
+
+    // Write xor execute: the text only becomes executable once it can no longer be written
+    if (mprotect(memory, text_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        Memory_Free(MEMORY_CODEGEN, externs);
+        Memory_Free(MEMORY_CODEGEN, data_labels);
+        return false;
+    }
+
+    jit->memory = memory;
+    jit->size = size;
+    jit->text_size = text_size;
+    jit->symbols = NEW_ARRAY(MEMORY_CODEGEN, struct CodeSymbol, code->num_symbols);
+    jit->num_symbols = code->num_symbols;
+    for (int i = 0; i < code->num_symbols; ++i) {
+        jit->symbols[i].label = (char *) Memory_Alloc(MEMORY_CODEGEN, strlen(code->symbols[i].label) + 1);
+        strcpy(jit->symbols[i].label, code->symbols[i].label);
+        jit->symbols[i].offset = code->symbols[i].offset;
+    }
+    qsort(jit->symbols, jit->num_symbols, sizeof(struct CodeSymbol), CompareSymbols);
+
+    num_code_bytes += code->size;
+    num_data_bytes += (int) data_size;
+    num_externs_resolved += num_externs;
+    Memory_Free(MEMORY_CODEGEN, externs);
+    Memory_Free(MEMORY_CODEGEN, data_labels);
+    return true;
+}
+
+// Address of a function of the loaded code, or NULL if there is no such label
+JitFunction Jit_Lookup(struct JitCode *jit, char *name) {
+    struct CodeSymbol key = { name, 0 };
+    struct CodeSymbol *symbol = (struct CodeSymbol *) bsearch(&key, jit->symbols, jit->num_symbols, sizeof(struct CodeSymbol), CompareSymbols);
+    if (!symbol) {
+        return NULL;
+    }
+    return (JitFunction) (void *) (jit->memory + symbol->offset);
+}
+
+void Jit_Free(struct JitCode *jit) {
+    if (jit->memory) {
+        munmap(jit->memory, jit->size);
+    }
+    for (int i = 0; i < jit->num_symbols; ++i) {
+        Memory_Free(MEMORY_CODEGEN, jit->symbols[i].label);
+    }
+    Memory_Free(MEMORY_CODEGEN, jit->symbols);
+    Jit_Init(jit);
+}
+
+void Jit_Init(struct JitCode *jit) {
+    jit->memory = NULL;
+    jit->size = 0;
+    jit->text_size = 0;
+    jit->symbols = NULL;
+    jit->num_symbols = 0;
+}
+
+// Print how much code was loaded and how many external functions were resolved
+void Jit_PrintStats(FILE *file) {
+    fprintf(file, "jit:\n");
+    fprintf(file, "  %-20s %d\n", "code-bytes", num_code_bytes);
+    fprintf(file, "  %-20s %d\n", "data-bytes", num_data_bytes);
+    fprintf(file, "  %-20s %d\n", "externs-resolved", num_externs_resolved);
+}
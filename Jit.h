@@ -0,0 +1,40 @@
+#ifndef BMS_JIT_H
+#define BMS_JIT_H
+
+#include "Encoder.h"
+#include "Instruction.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// A function of the compiled program, called directly from the compiler process
+typedef int (*JitFunction)(void);
+
+// Machine code loaded into memory of the running process. The text and the stubs that jump to external
+// functions are executable but never writable, the data section is writable but never executable.
+struct JitCode {
+    unsigned char *memory;
+    size_t size;                    // Bytes mapped, a multiple of the page size
+    size_t text_size;               // Bytes at the start of memory that are executable
+    struct CodeSymbol *symbols;     // Labels of the text, sorted by name
+    int num_symbols;
+};
+
+// Copy resolved machine code and its data into fresh pages, point the calls to external functions
+// at their addresses in the running process and make the text executable. Returns false if an
+// external function cannot be found.
+bool Jit_Load(struct JitCode *jit, struct MachineCode *code, struct DataSection *data);
+
+// Address of a function of the loaded code, or NULL if there is no such label
+JitFunction Jit_Lookup(struct JitCode *jit, char *name);
+
+// Unmap the code and free its symbols
+void Jit_Free(struct JitCode *jit);
+
+// Initialize empty code
+void Jit_Init(struct JitCode *jit);
+
+// Print how much code was loaded and how many external functions were resolved
+void Jit_PrintStats(FILE *file);
+
+#endif // BMS_JIT_H
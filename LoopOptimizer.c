@@ -0,0 +1,501 @@
+#include "LoopOptimizer.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "Vectorizer.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An expression computed once before the loop and kept in a compiler generated local
+struct LoopTemp {
+    char identifier[TOKEN_MAX_IDENTIFIER_LENGTH];
+    struct Expr *value;
+    bool is_pointer;
+    int step;                       // Added at the end of every iteration, 0 for invariants
+    struct Expr *base;              // Address without its constant part, for pointers only
+    long long offset;
+};
+
+// A loop being optimized
+struct Loop {
+    struct List assigned;           // Names of the variables written anywhere in the loop
+    struct List hoisted;            // Invariant expressions moved before the loop
+    struct List pointers;           // Addresses that advance with the induction variable
+    char *induction_var;
+    int step;
+};
+
+// Static function declarations
+static struct AstNode *OptimizeStmt(struct AstNode *stmt);
+
+static struct FunctionDef *current_func;
+static struct List address_taken;   // Names of the locals whose address is taken
+
+static int num_temps = 0;
+static int num_hoisted = 0;
+static int num_strength_reduced = 0;
+
+static int CountName(struct List *names, char *identifier) {
+    int count = 0;
+    for (int i = 0; i < names->count; ++i) {
+        if (strcmp((char *) List_Get(names, i), identifier) == 0) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+static void CollectAddressTaken(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        List_Add(&address_taken, expr->lhs->str_value);
+    }
+}
+
+static void VisitAddressTaken(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CollectAddressTaken, data);
+}
+
+static void CollectAssigned(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ASSIGN && expr->lhs->type == EXPR_VAR) {
+        List_Add((struct List *) data, expr->lhs->str_value);
+    }
+}
+
+static void VisitAssigned(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CollectAssigned, data);
+}
+
+// Check whether a variable holds the same value on every iteration of the loop
+static bool IsInvariantVar(struct Loop *loop, char *identifier) {
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, identifier, NULL);
+    if (!declarator) {
+        return false;
+    }
+    if (declarator->array_dimensions > 0) {
+        return true;
+    }
+    return CountName(&address_taken, identifier) == 0 && CountName(&loop->assigned, identifier) == 0;
+}
+
+// Check whether an expression has the same value on every iteration and can be evaluated early
+// without trapping. Loads are never invariant since stores and calls in the loop may change memory.
+static bool IsInvariant(struct Loop *loop, struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_NUM:
+        case EXPR_STR:      return true;
+        case EXPR_VAR:      return IsInvariantVar(loop, expr->str_value);
+        case EXPR_ADDR:     return expr->lhs->type == EXPR_VAR;
+        case EXPR_PLUS:
+        case EXPR_NEG:      return IsInvariant(loop, expr->lhs);
+        case EXPR_DIV:      return expr->rhs->type == EXPR_NUM && expr->rhs->int_value != 0 && IsInvariant(loop, expr->lhs);
+        case EXPR_EQU:
+        case EXPR_NEQ:
+        case EXPR_LT:
+        case EXPR_GT:
+        case EXPR_LTE:
+        case EXPR_GTE:
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_MUL:      return IsInvariant(loop, expr->lhs) && IsInvariant(loop, expr->rhs);
+        default:            return false;
+    }
+}
+
+// Check whether an expression computes an address rather than an integer
+static bool IsAddress(struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_STR:
+        case EXPR_ADDR:     return true;
+        case EXPR_VAR: {
+            struct Declarator *declarator = AstUtils_FindDeclarator(current_func, expr->str_value, NULL);
+            return declarator && (declarator->array_dimensions > 0 || declarator->pointer_inderection > 0);
+        }
+        case EXPR_ADD:      return IsAddress(expr->lhs) || IsAddress(expr->rhs);
+        case EXPR_SUB:      return IsAddress(expr->lhs) && !IsAddress(expr->rhs);
+        default:            return false;
+    }
+}
+
+// Check whether an expression has the form induction_var * scale + invariant and compute the scale
+static bool GetInductionScale(struct Loop *loop, struct Expr *expr, long long *scale) {
+    if (!AstUtils_ExprUsesVar(expr, loop->induction_var)) {
+        *scale = 0;
+        return IsInvariant(loop, expr);
+    }
+
+    long long a, b;
+    switch (expr->type) {
+        case EXPR_VAR: {
+            *scale = 1;
+        } return true;
+        case EXPR_PLUS: {
+            return GetInductionScale(loop, expr->lhs, scale);
+        }
+        case EXPR_NEG: {
+            if (!GetInductionScale(loop, expr->lhs, &a)) return false;
+            *scale = -a;
+        } break;
+        case EXPR_ADD:
+        case EXPR_SUB: {
+            if (!GetInductionScale(loop, expr->lhs, &a) || !GetInductionScale(loop, expr->rhs, &b)) return false;
+            *scale = expr->type == EXPR_ADD ? a + b : a - b;
+        } break;
+        case EXPR_MUL: {
+            if (expr->rhs->type == EXPR_NUM && GetInductionScale(loop, expr->lhs, &a)) {
+                *scale = a * expr->rhs->int_value;
+            } else if (expr->lhs->type == EXPR_NUM && GetInductionScale(loop, expr->rhs, &b)) {
+                *scale = b * expr->lhs->int_value;
+            } else {
+                return false;
+            }
+        } break;
+        default: {
+        } return false;
+    }
+    return *scale >= INT_MIN && *scale <= INT_MAX;
+}
+
+// Match i = i + c, i = c + i and i = i - c on an int local, returning the variable and its step
+static bool MatchInductionStep(struct Expr *expr, char **identifier, int *step) {
+    if (!expr || expr->type != EXPR_ASSIGN || expr->lhs->type != EXPR_VAR) {
+        return false;
+    }
+
+    struct Expr *rhs = expr->rhs;
+    struct Expr *var = NULL;
+    struct Expr *num = NULL;
+    if ((rhs->type == EXPR_ADD || rhs->type == EXPR_SUB) && rhs->lhs->type == EXPR_VAR && rhs->rhs->type == EXPR_NUM) {
+        var = rhs->lhs;
+        num = rhs->rhs;
+    } else if (rhs->type == EXPR_ADD && rhs->lhs->type == EXPR_NUM && rhs->rhs->type == EXPR_VAR) {
+        var = rhs->rhs;
+        num = rhs->lhs;
+    } else {
+        return false;
+    }
+    if (strcmp(var->str_value, expr->lhs->str_value) != 0 || num->int_value == 0 || num->int_value == INT_MIN) {
+        return false;
+    }
+
+    // A char wraps around where a pointer following it would not
+    enum PrimitiveType type;
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, var->str_value, &type);
+    if (!declarator || type != PRIMTYPE_INT || declarator->pointer_inderection > 0 || declarator->array_dimensions > 0) {
+        return false;
+    }
+    if (CountName(&address_taken, var->str_value) > 0) {
+        return false;
+    }
+
+    *identifier = var->str_value;
+    *step = rhs->type == EXPR_ADD ? num->int_value : -num->int_value;
+    return true;
+}
+
+// Return a read of the temporary holding value, creating the temporary on first use
+static struct Expr *UseTemp(struct List *temps, struct Expr *value, int step) {
+    for (int i = 0; i < temps->count; ++i) {
+        struct LoopTemp *temp = (struct LoopTemp *) List_Get(temps, i);
+        if (AstUtils_ExprEquals(temp->value, value)) {
+            return NewVariableExpr(temp->identifier);
+        }
+    }
+
+    struct LoopTemp *temp = (struct LoopTemp *) Memory_Calloc(MEMORY_SYMBOLS, 1, sizeof(struct LoopTemp));
+    snprintf(temp->identifier, sizeof(temp->identifier), "loop.%d", num_temps++);
+    temp->value = value;
+    temp->is_pointer = IsAddress(value);
+    temp->step = step;
+    AstUtils_AddLocal(current_func, temp->identifier, PRIMTYPE_INT, temp->is_pointer ? 1 : 0);
+    List_Add(temps, temp);
+    return NewVariableExpr(temp->identifier);
+}
+
+static struct AstNode *NewTempAssignment(struct LoopTemp *temp, struct Expr *value) {
+    struct Expr *target = NewVariableExpr(temp->identifier);
+    target->operand_type = temp->is_pointer ? PRIMTYPE_PTR : PRIMTYPE_INT;
+    return (struct AstNode *) NewExpressionStmt(NewOperationExpr(EXPR_ASSIGN, target, value));
+}
+
+// Split the constant part off an address without modifying it: a + (i + 1) * 4 -> a + i * 4 and 4.
+// Returns NULL when the whole expression is constant.
+static struct Expr *SplitConstantOffset(struct Expr *expr, long long *offset) {
+    switch (expr->type) {
+        case EXPR_NUM: {
+            *offset += expr->int_value;
+        } return NULL;
+        case EXPR_ADD:
+        case EXPR_SUB: {
+            long long rhs_offset = 0;
+            struct Expr *lhs = SplitConstantOffset(expr->lhs, offset);
+            struct Expr *rhs = SplitConstantOffset(expr->rhs, &rhs_offset);
+            *offset += expr->type == EXPR_ADD ? rhs_offset : -rhs_offset;
+            if (!rhs) return lhs;
+            if (!lhs) return expr->type == EXPR_ADD ? rhs : NewOperationExpr(EXPR_NEG, rhs, NULL);
+            if (lhs == expr->lhs && rhs == expr->rhs) return expr;
+            return NewOperationExpr(expr->type, lhs, rhs);
+        }
+        case EXPR_MUL: {
+            if (expr->rhs->type != EXPR_NUM) {
+                return expr;
+            }
+            long long lhs_offset = 0;
+            struct Expr *lhs = SplitConstantOffset(expr->lhs, &lhs_offset);
+            *offset += lhs_offset * expr->rhs->int_value;
+            if (!lhs) return NULL;
+            if (lhs == expr->lhs) return expr;
+            return NewOperationExpr(EXPR_MUL, lhs, expr->rhs);
+        }
+        default: {
+        } return expr;
+    }
+}
+
+// Return a read of the pointer following address, creating the pointer on first use. Addresses
+// that only differ by a constant, such as a[i] and a[i + 1], share a pointer.
+static struct Expr *UsePointer(struct Loop *loop, struct Expr *address, int step) {
+    long long offset = 0;
+    struct Expr *base = SplitConstantOffset(address, &offset);
+    for (int i = 0; i < loop->pointers.count; ++i) {
+        struct LoopTemp *temp = (struct LoopTemp *) List_Get(&loop->pointers, i);
+        long long delta = offset - temp->offset;
+        if (temp->step != step || !AstUtils_ExprEquals(temp->base, base) || delta < INT_MIN || delta > INT_MAX) {
+            continue;
+        }
+        if (delta == 0) {
+            return NewVariableExpr(temp->identifier);
+        }
+        return NewOperationExpr(EXPR_ADD, NewVariableExpr(temp->identifier), NewNumberExpr((int) delta));
+    }
+
+    struct LoopTemp *temp = (struct LoopTemp *) Memory_Calloc(MEMORY_SYMBOLS, 1, sizeof(struct LoopTemp));
+    snprintf(temp->identifier, sizeof(temp->identifier), "loop.%d", num_temps++);
+    temp->value = address;
+    temp->is_pointer = true;
+    temp->step = step;
+    temp->base = base;
+    temp->offset = offset;
+    AstUtils_AddLocal(current_func, temp->identifier, PRIMTYPE_INT, 1);
+    List_Add(&loop->pointers, temp);
+    List_Add(&loop->assigned, temp->identifier);
+    return NewVariableExpr(temp->identifier);
+}
+
+// a[i] -> *p, where p starts at &a[i] and advances by the element size times the step of i
+static void ReduceAddress(struct Expr *expr, void *data) {
+    struct Loop *loop = (struct Loop *) data;
+    if (expr->type != EXPR_DEREF || !IsAddress(expr->lhs)) {
+        return;
+    }
+
+    long long scale;
+    if (!GetInductionScale(loop, expr->lhs, &scale) || scale == 0) {
+        return;
+    }
+    long long step = scale * loop->step;
+    if (step < INT_MIN || step > INT_MAX) {
+        return;
+    }
+
+    expr->lhs = UsePointer(loop, expr->lhs, (int) step);
+    num_strength_reduced += 1;
+}
+
+static void VisitReduceAddress(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, ReduceAddress, data);
+}
+
+// Replace the largest invariant computations in an expression by temporaries set before the loop
+static void HoistInvariants(struct Loop *loop, struct Expr **slot) {
+    struct Expr *expr = *slot;
+    if (!expr) {
+        return;
+    }
+
+    switch (expr->type) {
+        case EXPR_NEG:
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_MUL:
+        case EXPR_DIV: {
+            if (IsInvariant(loop, expr)) {
+                *slot = UseTemp(&loop->hoisted, expr, 0);
+                num_hoisted += 1;
+                return;
+            }
+        } break;
+        case EXPR_FUNC_CALL: {
+            for (int i = 0; i < expr->args.count; ++i) {
+                HoistInvariants(loop, (struct Expr **) &expr->args.data[i]);
+            }
+        } return;
+    }
+
+    HoistInvariants(loop, &expr->lhs);
+    HoistInvariants(loop, &expr->rhs);
+}
+
+static void VisitHoistInvariants(struct Expr **slot, void *data) {
+    HoistInvariants((struct Loop *) data, slot);
+}
+
+// Find the variable stepped by a constant once per iteration, either in the loop expression of a
+// for loop or in the last statement of a while loop
+static void FindInductionVar(struct Loop *loop, struct Expr *loop_expr, struct AstNode *body) {
+    struct Expr *step_expr = loop_expr;
+    if (!step_expr && body->type == AST_COMPOUND_STMT) {
+        struct List *stmts = &((struct CompoundStmt *) body)->body;
+        struct AstNode *last = stmts->count > 0 ? (struct AstNode *) List_Get(stmts, stmts->count - 1) : NULL;
+        if (last && last->type == AST_EXPRESSION_STMT) {
+            step_expr = ((struct ExpressionStmt *) last)->expr;
+        }
+    }
+
+    char *identifier;
+    int step;
+    if (MatchInductionStep(step_expr, &identifier, &step) && CountName(&loop->assigned, identifier) == 1) {
+        loop->induction_var = identifier;
+        loop->step = step;
+    }
+}
+
+// Optimize a for or while loop, returning it wrapped together with its preheader
+static struct AstNode *OptimizeLoop(struct AstNode *stmt) {
+    struct Expr **init_expr = NULL;
+    struct Expr **cond_expr = NULL;
+    struct Expr **loop_expr = NULL;
+    struct AstNode **body = NULL;
+    if (stmt->type == AST_FOR_STMT) {
+        // The vector loop indexes its arrays itself, pointers advanced here would go stale
+        struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+        if (Vectorizer_Find(for_stmt)) {
+            return stmt;
+        }
+        init_expr = &for_stmt->init_expr;
+        cond_expr = &for_stmt->cond_expr;
+        loop_expr = &for_stmt->loop_expr;
+        body = &for_stmt->stmt;
+    } else {
+        struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+        cond_expr = &while_stmt->condition;
+        body = &while_stmt->stmt;
+    }
+
+    // Inner loops first, so that their preheaders count as part of this loop
+    *body = OptimizeStmt(*body);
+
+    struct Loop loop = { 0 };
+    List_Init(&loop.assigned);
+    List_Init(&loop.hoisted);
+    List_Init(&loop.pointers);
+    VisitAssigned(cond_expr, &loop.assigned);
+    if (loop_expr) VisitAssigned(loop_expr, &loop.assigned);
+    AstUtils_WalkStmt(*body, VisitAssigned, &loop.assigned);
+    FindInductionVar(&loop, loop_expr ? *loop_expr : NULL, *body);
+
+    // The preheader runs before the initialization, so its writes are treated as part of the loop
+    if (init_expr) VisitAssigned(init_expr, &loop.assigned);
+
+    if (loop.induction_var) {
+        VisitReduceAddress(cond_expr, &loop);
+        AstUtils_WalkStmt(*body, VisitReduceAddress, &loop);
+    }
+    HoistInvariants(&loop, cond_expr);
+    if (loop_expr) HoistInvariants(&loop, loop_expr);
+    AstUtils_WalkStmt(*body, VisitHoistInvariants, &loop);
+
+    struct CompoundStmt *preheader = NewCompoundStmt();
+    for (int i = 0; i < loop.hoisted.count; ++i) {
+        struct LoopTemp *temp = (struct LoopTemp *) List_Get(&loop.hoisted, i);
+        List_Add(&preheader->body, NewTempAssignment(temp, temp->value));
+        Memory_Free(MEMORY_SYMBOLS, temp);
+    }
+
+    if (loop.pointers.count > 0) {
+        // Pointers start at the address for the initial value of the induction variable. A
+        // simple initialization is substituted, anything else is moved into the preheader.
+        struct Expr *initial = NULL;
+        struct Expr *init = init_expr ? *init_expr : NULL;
+        if (init && init->type == EXPR_ASSIGN && init->lhs->type == EXPR_VAR && strcmp(init->lhs->str_value, loop.induction_var) == 0 &&
+            AstUtils_IsPure(init->rhs) && !AstUtils_ExprUsesVar(init->rhs, loop.induction_var)) {
+            initial = init->rhs;
+        } else if (init) {
+            List_Add(&preheader->body, NewExpressionStmt(init));
+            *init_expr = NULL;
+        }
+
+        struct CompoundStmt *new_body = (struct CompoundStmt *) *body;
+        if ((*body)->type != AST_COMPOUND_STMT) {
+            new_body = NewCompoundStmt();
+            List_Add(&new_body->body, *body);
+            *body = (struct AstNode *) new_body;
+        }
+
+        for (int i = 0; i < loop.pointers.count; ++i) {
+            struct LoopTemp *temp = (struct LoopTemp *) List_Get(&loop.pointers, i);
+            struct Expr *start = initial ? AstUtils_SubstituteVar(temp->value, loop.induction_var, initial) : temp->value;
+            List_Add(&preheader->body, NewTempAssignment(temp, start));
+
+            struct Expr *advance = NewOperationExpr(EXPR_ADD, NewVariableExpr(temp->identifier), NewNumberExpr(temp->step));
+            List_Add(&new_body->body, NewTempAssignment(temp, advance));
+            Memory_Free(MEMORY_SYMBOLS, temp);
+        }
+    }
+
+    List_Free(&loop.assigned);
+    List_Free(&loop.hoisted);
+    List_Free(&loop.pointers);
+
+    if (preheader->body.count == 0) {
+        List_Free(&preheader->body);
+        Memory_Free(MEMORY_AST, preheader);
+        return stmt;
+    }
+    List_Add(&preheader->body, stmt);
+    return (struct AstNode *) preheader;
+}
+
+static struct AstNode *OptimizeStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                body->data[i] = OptimizeStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->stmt = OptimizeStmt(if_stmt->stmt);
+            if_stmt->else_branch = OptimizeStmt(if_stmt->else_branch);
+        } break;
+        case AST_FOR_STMT:
+        case AST_WHILE_STMT: {
+        } return OptimizeLoop(stmt);
+    }
+    return stmt;
+}
+
+// Hoist loop invariant expressions and turn array indexing on induction variables into pointer increments
+void LoopOptimizer_Run(struct TranslationUnit *t_unit) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        current_func = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        List_Init(&address_taken);
+        AstUtils_WalkStmt((struct AstNode *) current_func->body, VisitAddressTaken, NULL);
+
+        OptimizeStmt((struct AstNode *) current_func->body);
+
+        List_Free(&address_taken);
+        current_func = NULL;
+    }
+}
+
+// Print how many expressions were hoisted and strength reduced
+void LoopOptimizer_PrintStats(FILE *file) {
+    fprintf(file, "loop-optimizer:\n");
+    fprintf(file, "  %-20s %d\n", "hoisted", num_hoisted);
+    fprintf(file, "  %-20s %d\n", "strength-reduced", num_strength_reduced);
+}
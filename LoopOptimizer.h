@@ -0,0 +1,13 @@
+#ifndef BMS_LOOP_OPTIMIZER_H
+#define BMS_LOOP_OPTIMIZER_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Hoist loop invariant expressions and turn array indexing on induction variables into pointer increments
+void LoopOptimizer_Run(struct TranslationUnit *t_unit);
+
+// Print how many expressions were hoisted and strength reduced
+void LoopOptimizer_PrintStats(FILE *file);
+
+#endif // BMS_LOOP_OPTIMIZER_H
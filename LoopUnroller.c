@@ -0,0 +1,341 @@
+#include "LoopUnroller.h"
+#include "AstUtils.h"
+#include "Options.h"
+#include "Vectorizer.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FULL_UNROLL_TRIPS   16      // Longest loop that is unrolled completely
+#define FULL_UNROLL_BUDGET      256     // Expression nodes a completely unrolled loop may have
+#define PARTIAL_UNROLL_BUDGET   96      // Expression nodes the body of a partially unrolled loop may have
+
+// A loop of the form for (...; i < bound; i = i + step), the body does not write i
+struct CountedLoop {
+    char *var;
+    int step;
+    enum ExprType relation;
+    struct Expr *bound;
+};
+
+// How a variable is used inside a statement
+struct VarUses {
+    char *identifier;
+    int assignments;
+    int address_taken;
+};
+
+struct Substitution {
+    char *identifier;
+    struct Expr *value;
+};
+
+// Static function declarations
+static struct AstNode *UnrollStmt(struct AstNode *stmt);
+
+static struct FunctionDef *current_func;
+
+static int num_fully_unrolled = 0;
+static int num_partially_unrolled = 0;
+
+static void CountVarUses(struct Expr *expr, void *data) {
+    struct VarUses *uses = (struct VarUses *) data;
+    if ((expr->type == EXPR_ASSIGN || expr->type == EXPR_ADDR) && expr->lhs->type == EXPR_VAR &&
+        strcmp(expr->lhs->str_value, uses->identifier) == 0) {
+        if (expr->type == EXPR_ASSIGN) {
+            uses->assignments += 1;
+        } else {
+            uses->address_taken += 1;
+        }
+    }
+}
+
+static void VisitVarUses(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CountVarUses, data);
+}
+
+static struct VarUses GetVarUses(struct AstNode *stmt, char *identifier) {
+    struct VarUses uses = { identifier, 0, 0 };
+    AstUtils_WalkStmt(stmt, VisitVarUses, &uses);
+    return uses;
+}
+
+static void CountNode(struct Expr *expr, void *data) {
+    *(int *) data += 1;
+}
+
+static void VisitCountNodes(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CountNode, data);
+}
+
+// Estimate the size of the code generated for a statement
+static int CountNodes(struct AstNode *stmt) {
+    int count = 0;
+    AstUtils_WalkStmt(stmt, VisitCountNodes, &count);
+    return count;
+}
+
+static bool ContainsLoop(struct AstNode *stmt) {
+    if (!stmt) {
+        return false;
+    }
+    switch (stmt->type) {
+        case AST_FOR_STMT:
+        case AST_WHILE_STMT: {
+        } return true;
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                if (ContainsLoop((struct AstNode *) List_Get(body, i))) {
+                    return true;
+                }
+            }
+        } return false;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            return ContainsLoop(if_stmt->stmt) || ContainsLoop(if_stmt->else_branch);
+        }
+        default: {
+        } return false;
+    }
+}
+
+static void VisitSubstitution(struct Expr **slot, void *data) {
+    struct Substitution *substitution = (struct Substitution *) data;
+    *slot = AstUtils_SubstituteVar(*slot, substitution->identifier, substitution->value);
+}
+
+// Copy the loop body for the iteration where the counter has the given value
+static struct AstNode *CopyBody(struct AstNode *body, char *identifier, struct Expr *value) {
+    struct AstNode *copy = AstUtils_CloneStmt(body);
+    if (value) {
+        struct Substitution substitution = { identifier, value };
+        AstUtils_WalkStmt(copy, VisitSubstitution, &substitution);
+    }
+    return copy;
+}
+
+static struct Expr *NewCounterAssignment(char *identifier, struct Expr *value) {
+    struct Expr *target = NewVariableExpr(identifier);
+    target->operand_type = PRIMTYPE_INT;
+    return NewOperationExpr(EXPR_ASSIGN, target, value);
+}
+
+static bool Holds(enum ExprType relation, long long a, long long b) {
+    switch (relation) {
+        case EXPR_LT:   return a < b;
+        case EXPR_GT:   return a > b;
+        case EXPR_LTE:  return a <= b;
+        case EXPR_GTE:  return a >= b;
+        default:        return false;
+    }
+}
+
+// Check whether the bound of a loop is a constant or a scalar local the loop does not change
+static bool IsLoopInvariantBound(struct ForStmt *for_stmt, struct Expr *bound, char *counter) {
+    if (bound->type == EXPR_NUM) {
+        return true;
+    }
+    if (bound->type != EXPR_VAR || strcmp(bound->str_value, counter) == 0) {
+        return false;
+    }
+
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, bound->str_value, NULL);
+    if (!declarator || declarator->pointer_inderection > 0 || declarator->array_dimensions > 0) {
+        return false;
+    }
+    if (GetVarUses((struct AstNode *) current_func->body, bound->str_value).address_taken > 0) {
+        return false;
+    }
+    return GetVarUses((struct AstNode *) for_stmt, bound->str_value).assignments == 0;
+}
+
+// Match for (...; i < bound; i = i + step) with an int counter that only the loop expression writes
+static bool MatchCountedLoop(struct ForStmt *for_stmt, struct CountedLoop *loop) {
+    struct Expr *loop_expr = for_stmt->loop_expr;
+    struct Expr *cond = for_stmt->cond_expr;
+    if (!loop_expr || !cond || loop_expr->type != EXPR_ASSIGN || loop_expr->lhs->type != EXPR_VAR) {
+        return false;
+    }
+
+    char *var = loop_expr->lhs->str_value;
+    struct Expr *rhs = loop_expr->rhs;
+    if ((rhs->type != EXPR_ADD && rhs->type != EXPR_SUB) || rhs->lhs->type != EXPR_VAR || rhs->rhs->type != EXPR_NUM ||
+        strcmp(rhs->lhs->str_value, var) != 0) {
+        return false;
+    }
+    int value = rhs->rhs->int_value;
+    if (value == 0 || value == INT_MIN) {
+        return false;
+    }
+    loop->var = var;
+    loop->step = rhs->type == EXPR_ADD ? value : -value;
+
+    if (cond->type != EXPR_LT && cond->type != EXPR_GT && cond->type != EXPR_LTE && cond->type != EXPR_GTE) {
+        return false;
+    }
+    if (cond->lhs->type != EXPR_VAR || strcmp(cond->lhs->str_value, var) != 0) {
+        return false;
+    }
+    bool counts_up = (cond->type == EXPR_LT || cond->type == EXPR_LTE) && loop->step > 0;
+    bool counts_down = (cond->type == EXPR_GT || cond->type == EXPR_GTE) && loop->step < 0;
+    if (!counts_up && !counts_down) {
+        return false;
+    }
+    loop->relation = cond->type;
+    loop->bound = cond->rhs;
+
+    enum PrimitiveType type;
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, var, &type);
+    if (!declarator || type != PRIMTYPE_INT || declarator->pointer_inderection > 0 || declarator->array_dimensions > 0) {
+        return false;
+    }
+    if (GetVarUses((struct AstNode *) current_func->body, var).address_taken > 0) {
+        return false;
+    }
+    if (GetVarUses(for_stmt->stmt, var).assignments > 0) {
+        return false;
+    }
+    return IsLoopInvariantBound(for_stmt, loop->bound, var);
+}
+
+// Count the iterations of a loop with constant start and bound, -1 if unknown or too many
+static int GetTripCount(struct ForStmt *for_stmt, struct CountedLoop *loop, long long *final_value) {
+    struct Expr *init = for_stmt->init_expr;
+    if (!init || init->type != EXPR_ASSIGN || init->lhs->type != EXPR_VAR || strcmp(init->lhs->str_value, loop->var) != 0) {
+        return -1;
+    }
+    if (init->rhs->type != EXPR_NUM || loop->bound->type != EXPR_NUM) {
+        return -1;
+    }
+
+    long long value = init->rhs->int_value;
+    int trips = 0;
+    while (Holds(loop->relation, value, loop->bound->int_value)) {
+        if (++trips > MAX_FULL_UNROLL_TRIPS) {
+            return -1;
+        }
+        value += loop->step;
+    }
+    if (value < INT_MIN || value > INT_MAX) {
+        return -1;
+    }
+    *final_value = value;
+    return trips;
+}
+
+// Replace the loop by one copy of its body per iteration, followed by the final counter value
+static struct AstNode *UnrollFully(struct ForStmt *for_stmt, struct CountedLoop *loop, int trips, long long final_value) {
+    struct Expr *init = for_stmt->init_expr;
+    struct CompoundStmt *unrolled = NewCompoundStmt();
+    for (int i = 0; i < trips; ++i) {
+        struct Expr *value = NewNumberExpr(init->rhs->int_value + i * loop->step);
+        List_Add(&unrolled->body, CopyBody(for_stmt->stmt, loop->var, value));
+    }
+
+    init->rhs = NewNumberExpr((int) final_value);
+    List_Add(&unrolled->body, NewExpressionStmt(init));
+    num_fully_unrolled += 1;
+    return (struct AstNode *) unrolled;
+}
+
+// for (init; i < n; i = i + 1) body  ->
+// for (init; i + 3 < n; i = i + 4) { body[i]; body[i + 1]; body[i + 2]; body[i + 3]; }
+// for (; i < n; i = i + 1) body
+static struct AstNode *UnrollPartially(struct ForStmt *for_stmt, struct CountedLoop *loop, int factor) {
+    long long reach = (long long) (factor - 1) * loop->step;
+    long long stride = (long long) factor * loop->step;
+    if (stride < INT_MIN || stride > INT_MAX) {
+        return (struct AstNode *) for_stmt;
+    }
+
+    struct CompoundStmt *body = NewCompoundStmt();
+    for (int i = 0; i < factor; ++i) {
+        struct Expr *value = i == 0 ? NULL : NewOperationExpr(EXPR_ADD, NewVariableExpr(loop->var), NewNumberExpr(i * loop->step));
+        List_Add(&body->body, CopyBody(for_stmt->stmt, loop->var, value));
+    }
+
+    struct Expr *reached = NewOperationExpr(EXPR_ADD, NewVariableExpr(loop->var), NewNumberExpr((int) reach));
+    struct Expr *cond = NewOperationExpr(loop->relation, reached, AstUtils_CloneExpr(loop->bound));
+    struct Expr *step = NewCounterAssignment(loop->var, NewOperationExpr(EXPR_ADD, NewVariableExpr(loop->var), NewNumberExpr((int) stride)));
+    struct ForStmt *unrolled = NewForStmt(for_stmt->init_expr, cond, step, (struct AstNode *) body);
+
+    // The original loop runs the remaining iterations
+    for_stmt->init_expr = NULL;
+    struct CompoundStmt *result = NewCompoundStmt();
+    List_Add(&result->body, unrolled);
+    List_Add(&result->body, for_stmt);
+    num_partially_unrolled += 1;
+    return (struct AstNode *) result;
+}
+
+static struct AstNode *UnrollForStmt(struct ForStmt *for_stmt) {
+    for_stmt->stmt = UnrollStmt(for_stmt->stmt);
+
+    // Only innermost loops are unrolled, vectorized loops already run several iterations at a time
+    struct CountedLoop loop;
+    if (ContainsLoop(for_stmt->stmt) || Vectorizer_Find(for_stmt) || !MatchCountedLoop(for_stmt, &loop)) {
+        return (struct AstNode *) for_stmt;
+    }
+
+    int size = CountNodes(for_stmt->stmt);
+    AstUtils_WalkExpr(for_stmt->loop_expr, CountNode, &size);
+    long long final_value;
+    int trips = GetTripCount(for_stmt, &loop, &final_value);
+    if (trips >= 0 && trips * size <= FULL_UNROLL_BUDGET) {
+        return UnrollFully(for_stmt, &loop, trips, final_value);
+    }
+
+    // Halve the factor until the unrolled body fits the budget
+    int factor = options.unroll_factor;
+    while (factor > 1 && factor * size > PARTIAL_UNROLL_BUDGET) {
+        factor /= 2;
+    }
+    if (factor < 2) {
+        return (struct AstNode *) for_stmt;
+    }
+    return UnrollPartially(for_stmt, &loop, factor);
+}
+
+static struct AstNode *UnrollStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return NULL;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                body->data[i] = UnrollStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            if_stmt->stmt = UnrollStmt(if_stmt->stmt);
+            if_stmt->else_branch = UnrollStmt(if_stmt->else_branch);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            while_stmt->stmt = UnrollStmt(while_stmt->stmt);
+        } break;
+        case AST_FOR_STMT: {
+        } return UnrollForStmt((struct ForStmt *) stmt);
+    }
+    return stmt;
+}
+
+// Unroll counted for loops, completely when the trip count is small and constant
+void LoopUnroller_Run(struct TranslationUnit *t_unit) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        current_func = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        UnrollStmt((struct AstNode *) current_func->body);
+        current_func = NULL;
+    }
+}
+
+// Print how many loops were unrolled
+void LoopUnroller_PrintStats(FILE *file) {
+    fprintf(file, "loop-unroller:\n");
+    fprintf(file, "  %-20s %d\n", "fully-unrolled", num_fully_unrolled);
+    fprintf(file, "  %-20s %d\n", "partially-unrolled", num_partially_unrolled);
+}
@@ -0,0 +1,13 @@
+#ifndef BMS_LOOP_UNROLLER_H
+#define BMS_LOOP_UNROLLER_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Unroll counted for loops, completely when the trip count is small and constant
+void LoopUnroller_Run(struct TranslationUnit *t_unit);
+
+// Print how many loops were unrolled
+void LoopUnroller_PrintStats(FILE *file);
+
+#endif // BMS_LOOP_UNROLLER_H
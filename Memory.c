@@ -0,0 +1,127 @@
+#include "Memory.h"
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Counters of one category, updated from the code generation threads as well
+struct CategoryCounters {
+    atomic_llong allocations;
+    atomic_llong frees;
+    atomic_llong allocated_bytes;
+    atomic_llong live_bytes;
+    atomic_llong peak_live_bytes;
+};
+
+static char *category_names[MEMORY_COUNT] = {
+    [MEMORY_TOKENS]     = "tokens",
+    [MEMORY_AST]        = "ast",
+    [MEMORY_LISTS]      = "lists",
+    [MEMORY_SYMBOLS]    = "symbols",
+    [MEMORY_CODEGEN]    = "codegen",
+};
+
+static struct CategoryCounters counters[MEMORY_COUNT];
+
+static void CountAllocation(enum MemoryCategory category, long long size) {
+    struct CategoryCounters *c = &counters[category];
+    atomic_fetch_add_explicit(&c->allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->allocated_bytes, size, memory_order_relaxed);
+    long long live = atomic_fetch_add_explicit(&c->live_bytes, size, memory_order_relaxed) + size;
+    long long peak = atomic_load_explicit(&c->peak_live_bytes, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&c->peak_live_bytes, &peak, live, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void CountFree(enum MemoryCategory category, long long size) {
+    struct CategoryCounters *c = &counters[category];
+    atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&c->live_bytes, size, memory_order_relaxed);
+}
+
+// malloc accounted to a category, exiting if memory is exhausted
+void *Memory_Alloc(enum MemoryCategory category, size_t size) {
+    void *pointer = malloc(size);
+    if (!pointer) {
+        exit(1);
+    }
+    CountAllocation(category, (long long) malloc_usable_size(pointer));
+    return pointer;
+}
+
+// calloc accounted to a category, exiting if memory is exhausted
+void *Memory_Calloc(enum MemoryCategory category, size_t count, size_t size) {
+    void *pointer = calloc(count, size);
+    if (!pointer) {
+        exit(1);
+    }
+    CountAllocation(category, (long long) malloc_usable_size(pointer));
+    return pointer;
+}
+
+// realloc accounted to a category, exiting if memory is exhausted. Growing a block counts as freeing
+// the old one and allocating the new one.
+void *Memory_Realloc(enum MemoryCategory category, void *pointer, size_t size) {
+    long long old_size = pointer ? (long long) malloc_usable_size(pointer) : 0;
+    void *resized = realloc(pointer, size);
+    if (!resized) {
+        exit(1);
+    }
+    if (pointer) {
+        CountFree(category, old_size);
+    }
+    CountAllocation(category, (long long) malloc_usable_size(resized));
+    return resized;
+}
+
+// Free memory allocated for the same category, NULL is ignored
+void Memory_Free(enum MemoryCategory category, void *pointer) {
+    if (!pointer) {
+        return;
+    }
+    CountFree(category, (long long) malloc_usable_size(pointer));
+    free(pointer);
+}
+
+// Read the counters of a category
+void Memory_GetCounters(enum MemoryCategory category, struct MemoryCounters *result) {
+    struct CategoryCounters *c = &counters[category];
+    result->allocations = atomic_load_explicit(&c->allocations, memory_order_relaxed);
+    result->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+    result->allocated_bytes = atomic_load_explicit(&c->allocated_bytes, memory_order_relaxed);
+    result->live_bytes = atomic_load_explicit(&c->live_bytes, memory_order_relaxed);
+    result->peak_live_bytes = atomic_load_explicit(&c->peak_live_bytes, memory_order_relaxed);
+}
+
+// Sum the counters of all categories, leaving out the peak that the categories reach at different times
+void Memory_GetTotals(struct MemoryCounters *totals) {
+    totals->allocations = 0;
+    totals->frees = 0;
+    totals->allocated_bytes = 0;
+    totals->live_bytes = 0;
+    totals->peak_live_bytes = 0;
+    for (int i = 0; i < MEMORY_COUNT; ++i) {
+        struct MemoryCounters category;
+        Memory_GetCounters((enum MemoryCategory) i, &category);
+        totals->allocations += category.allocations;
+        totals->frees += category.frees;
+        totals->allocated_bytes += category.allocated_bytes;
+        totals->live_bytes += category.live_bytes;
+    }
+}
+
+// Name of a category in reports, e.g. "tokens"
+char *Memory_CategoryName(enum MemoryCategory category) {
+    return category_names[category];
+}
+
+// Print the counters of every category
+void Memory_PrintStats(FILE *file) {
+    fprintf(file, "memory:\n");
+    fprintf(file, "  %-20s %12s %12s %14s %12s %14s\n", "category", "allocations", "frees", "allocated-kb", "live-kb", "peak-live-kb");
+    for (int i = 0; i < MEMORY_COUNT; ++i) {
+        struct MemoryCounters c;
+        Memory_GetCounters((enum MemoryCategory) i, &c);
+        fprintf(file, "  %-20s %12lld %12lld %14lld %12lld %14lld\n", category_names[i], c.allocations, c.frees,
+            c.allocated_bytes / 1024, c.live_bytes / 1024, c.peak_live_bytes / 1024);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef BMS_MEMORY_H
+#define BMS_MEMORY_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// The subsystems allocations are accounted to
+enum MemoryCategory {
+    MEMORY_TOKENS,                  // Directives and the tokens of expanded macros
+    MEMORY_AST,                     // Nodes of the syntax tree
+    MEMORY_LISTS,                   // Storage of List, mostly the children of AST nodes
+    MEMORY_SYMBOLS,                 // Per-variable tables of the passes, stack frame layouts and machine code symbols and fixups
+    MEMORY_CODEGEN,                 // Instruction buffers, assembly text, machine code and the data section
+    MEMORY_COUNT,
+};
+
+// Allocation counters of one category, or of all of them together. Sizes are those malloc
+// actually reserved, so they include its rounding.
+struct MemoryCounters {
+    long long allocations;          // malloc, calloc and realloc calls
+    long long frees;                // Including the blocks realloc replaced
+    long long allocated_bytes;      // Bytes handed out over the whole run
+    long long live_bytes;           // Bytes allocated and not yet freed
+    long long peak_live_bytes;      // Most live bytes at any time, for categories only
+};
+
+// malloc accounted to a category, exiting if memory is exhausted
+void *Memory_Alloc(enum MemoryCategory category, size_t size);
+
+// calloc accounted to a category, exiting if memory is exhausted
+void *Memory_Calloc(enum MemoryCategory category, size_t count, size_t size);
+
+// realloc accounted to a category, exiting if memory is exhausted. Growing a block counts as freeing
+// the old one and allocating the new one.
+void *Memory_Realloc(enum MemoryCategory category, void *pointer, size_t size);
+
+// Free memory allocated for the same category, NULL is ignored
+void Memory_Free(enum MemoryCategory category, void *pointer);
+
+// Zeroed array of count elements accounted to a category, with room for one when count is 0 so
+// the result is never NULL. Freed with Memory_Free of the same category.
+#define NEW_ARRAY(category, type, count) ((type *) Memory_Calloc((category), (count) > 0 ? (count) : 1, sizeof(type)))
+
+// Read the counters of a category
+void Memory_GetCounters(enum MemoryCategory category, struct MemoryCounters *counters);
+
+// Sum the counters of all categories, leaving out the peak that the categories reach at different times
+void Memory_GetTotals(struct MemoryCounters *totals);
+
+// Name of a category in reports, e.g. "tokens"
+char *Memory_CategoryName(enum MemoryCategory category);
+
+// Print the counters of every category
+void Memory_PrintStats(FILE *file);
+
+#endif // BMS_MEMORY_H
@@ -0,0 +1,192 @@
+#include "Options.h"
+#include "PassManager.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct Options options = {
+    .optimization_level = 1,
+    .optimize_for_size  = false,
+    .inline_functions   = true,
+    .tail_calls         = true,
+    .value_numbering    = true,
+    .remove_dead_code   = true,
+    .rotate_loops       = true,
+    .optimize_loops     = true,
+    .unroll_loops       = false,
+    .unroll_factor      = 4,
+    .loop_alignment     = 0,
+    .vectorize_loops    = false,
+    .avx2               = false,
+    .omit_frame_pointer = true,
+    .red_zone           = true,
+    .share_stack_slots  = true,
+    .emit_object        = false,
+    .num_threads        = 0,
+    .time_report        = false,
+    .print_stats        = false,
+    .dump_passes        = false,
+    .mem_report         = false,
+    .mem_report_json    = NULL,
+};
+
+// Parse a single command line option, returning false if it is not recognized
+bool Options_Parse(char *arg) {
+    if (strcmp(arg, "-Os") == 0) {
+        Options_SetOptimizationLevel(2, true);
+        return true;
+    }
+    if (strncmp(arg, "-O", 2) == 0 && arg[2] >= '0' && arg[2] <= '3' && arg[3] == '\0') {
+        Options_SetOptimizationLevel(arg[2] - '0', false);
+        return true;
+    }
+    if (strncmp(arg, "-falign-loops=", 14) == 0) {
+        options.loop_alignment = atoi(arg + 14);
+        return true;
+    }
+    if (strcmp(arg, "-fno-align-loops") == 0) {
+        options.loop_alignment = 0;
+        return true;
+    }
+    if (strcmp(arg, "-finline-functions") == 0) {
+        options.inline_functions = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-inline") == 0) {
+        options.inline_functions = false;
+        return true;
+    }
+    if (strcmp(arg, "-foptimize-sibling-calls") == 0) {
+        options.tail_calls = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-optimize-sibling-calls") == 0) {
+        options.tail_calls = false;
+        return true;
+    }
+    if (strcmp(arg, "-fgcse") == 0) {
+        options.value_numbering = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-gcse") == 0) {
+        options.value_numbering = false;
+        return true;
+    }
+    if (strcmp(arg, "-fdce") == 0) {
+        options.remove_dead_code = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-dce") == 0) {
+        options.remove_dead_code = false;
+        return true;
+    }
+    if (strcmp(arg, "-funroll-loops") == 0) {
+        options.unroll_loops = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-unroll-loops") == 0) {
+        options.unroll_loops = false;
+        return true;
+    }
+    if (strncmp(arg, "-funroll-factor=", 16) == 0) {
+        options.unroll_factor = atoi(arg + 16);
+        return options.unroll_factor >= 1;
+    }
+    if (strcmp(arg, "-ftree-vectorize") == 0) {
+        options.vectorize_loops = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-tree-vectorize") == 0) {
+        options.vectorize_loops = false;
+        return true;
+    }
+    if (strcmp(arg, "-mavx2") == 0) {
+        options.avx2 = true;
+        return true;
+    }
+    if (strcmp(arg, "-mno-avx2") == 0) {
+        options.avx2 = false;
+        return true;
+    }
+    if (strcmp(arg, "-fomit-frame-pointer") == 0) {
+        options.omit_frame_pointer = true;
+        return true;
+    }
+    if (strcmp(arg, "-fno-omit-frame-pointer") == 0) {
+        options.omit_frame_pointer = false;
+        return true;
+    }
+    if (strcmp(arg, "-mred-zone") == 0) {
+        options.red_zone = true;
+        return true;
+    }
+    if (strcmp(arg, "-mno-red-zone") == 0) {
+        options.red_zone = false;
+        return true;
+    }
+    if (strcmp(arg, "-fstack-reuse=all") == 0) {
+        options.share_stack_slots = true;
+        return true;
+    }
+    if (strcmp(arg, "-fstack-reuse=none") == 0) {
+        options.share_stack_slots = false;
+        return true;
+    }
+    if (strcmp(arg, "-c") == 0) {
+        options.emit_object = true;
+        return true;
+    }
+    if (strcmp(arg, "-S") == 0) {
+        options.emit_object = false;
+        return true;
+    }
+    if (strcmp(arg, "-ftime-report") == 0) {
+        options.time_report = true;
+        return true;
+    }
+    if (strcmp(arg, "-fstats") == 0) {
+        options.print_stats = true;
+        return true;
+    }
+    if (strcmp(arg, "-fdump-passes") == 0) {
+        options.dump_passes = true;
+        return true;
+    }
+    if (strcmp(arg, "--mem-report") == 0) {
+        options.mem_report = true;
+        return true;
+    }
+    if (strncmp(arg, "--mem-report-json=", 18) == 0) {
+        options.mem_report_json = arg + 18;
+        return arg[18] != '\0';
+    }
+    if (strncmp(arg, "-j", 2) == 0 && arg[2] != '\0') {
+        options.num_threads = atoi(arg + 2);
+        return options.num_threads >= 1;
+    }
+    return false;
+}
+
+// Select an optimization level and the settings it implies
+void Options_SetOptimizationLevel(int level, bool optimize_for_size) {
+    options.optimization_level = level;
+    options.optimize_for_size = optimize_for_size;
+
+    // The pipeline of the level decides which passes run, until an option turns one on or off
+    options.inline_functions = PassManager_IsInPipeline(level, optimize_for_size, PASS_INLINE);
+    options.value_numbering = PassManager_IsInPipeline(level, optimize_for_size, PASS_VALUE_NUMBERING);
+    options.remove_dead_code = PassManager_IsInPipeline(level, optimize_for_size, PASS_DEAD_CODE);
+    options.optimize_loops = PassManager_IsInPipeline(level, optimize_for_size, PASS_OPTIMIZE_LOOPS);
+    options.unroll_loops = PassManager_IsInPipeline(level, optimize_for_size, PASS_UNROLL_LOOPS);
+    options.vectorize_loops = PassManager_IsInPipeline(level, optimize_for_size, PASS_VECTORIZE);
+
+    // Rotation duplicates the loop condition, so it is skipped when optimizing for size
+    options.rotate_loops = level >= 1 && !optimize_for_size;
+    options.tail_calls = level >= 1;
+    options.omit_frame_pointer = level >= 1;
+    options.share_stack_slots = level >= 1;
+
+    // Padding costs bytes but lets the loop body start on a fetch block boundary
+    options.loop_alignment = 0;
+    if (!optimize_for_size && level == 2) options.loop_alignment = 16;
+    if (!optimize_for_size && level >= 3) options.loop_alignment = 32;
+}
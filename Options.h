@@ -0,0 +1,41 @@
+#ifndef BMS_OPTIONS_H
+#define BMS_OPTIONS_H
+
+#include <stdbool.h>
+
+// Compiler settings selected on the command line
+struct Options {
+    int optimization_level;         // -O0 to -O3
+    bool optimize_for_size;         // -Os
+    bool inline_functions;          // Substitute small callee bodies at their call sites
+    bool tail_calls;                // Jump to the callee of return f(...) instead of calling it
+    bool value_numbering;           // Eliminate repeated expressions and loads
+    bool remove_dead_code;          // Remove unreachable code, dead stores and uncalled functions
+    bool rotate_loops;              // Test loop conditions at the bottom instead of the top
+    bool optimize_loops;            // Hoist invariants and strength reduce induction variables
+    bool unroll_loops;              // -funroll-loops
+    int unroll_factor;              // Largest number of iterations per unrolled loop body
+    int loop_alignment;             // Alignment of loop headers in bytes, 0 to disable
+    bool vectorize_loops;           // -ftree-vectorize
+    bool avx2;                      // -mavx2, vectorize with 32-byte ymm registers instead of SSE2
+    bool omit_frame_pointer;        // -fomit-frame-pointer, address locals through rsp where possible
+    bool red_zone;                  // -mred-zone, leaf functions keep their locals below rsp without allocating them
+    bool share_stack_slots;         // -fstack-reuse=all, locals with disjoint lifetimes share a stack slot
+    bool emit_object;               // -c, write an ELF64 relocatable object instead of assembly text (-S)
+    int num_threads;                // -jN, threads generating functions in parallel, 0 for one per processor
+    bool time_report;               // -ftime-report, print the time and memory of every phase and pass
+    bool print_stats;               // -fstats, print the counters of every pass
+    bool dump_passes;               // -fdump-passes, print the passes the optimization level runs
+    bool mem_report;                // --mem-report, print the allocations of every phase and subsystem
+    char *mem_report_json;          // --mem-report-json=FILE, write the same report as JSON, NULL if not
+};
+
+extern struct Options options;
+
+// Parse a single command line option, returning false if it is not recognized
+bool Options_Parse(char *arg);
+
+// Select an optimization level and the settings it implies
+void Options_SetOptimizationLevel(int level, bool optimize_for_size);
+
+#endif // BMS_OPTIONS_H
@@ -0,0 +1,151 @@
+#include "OutputBuffer.h"
+#include "Memory.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Make room for one more chunk in the array of chunks
+static void ReserveChunk(struct OutputBuffer *buffer) {
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity == 0 ? 16 : buffer->capacity * 2;
+        buffer->chunks = (struct OutputChunk *) Memory_Realloc(MEMORY_CODEGEN, buffer->chunks, sizeof(struct OutputChunk) * buffer->capacity);
+        if (!buffer->chunks) {
+            exit(1);
+        }
+    }
+}
+
+// Start a new chunk once the last one is full
+static struct OutputChunk *AddChunk(struct OutputBuffer *buffer) {
+    ReserveChunk(buffer);
+    struct OutputChunk *chunk = &buffer->chunks[buffer->count];
+    int capacity = buffer->count > 0 ? buffer->chunks[buffer->count - 1].capacity * 2 : OUTPUT_FIRST_CHUNK_SIZE;
+    buffer->count += 1;
+    chunk->capacity = capacity < OUTPUT_CHUNK_SIZE ? capacity : OUTPUT_CHUNK_SIZE;
+    chunk->data = (char *) Memory_Alloc(MEMORY_CODEGEN, chunk->capacity);
+    chunk->size = 0;
+    if (!chunk->data) {
+        exit(1);
+    }
+    return chunk;
+}
+
+void OutputBuffer_Write(struct OutputBuffer *buffer, const char *text, int length) {
+    buffer->size += length;
+    while (length > 0) {
+        struct OutputChunk *chunk = buffer->count > 0 ? &buffer->chunks[buffer->count - 1] : NULL;
+        if (!chunk || chunk->size == chunk->capacity) {
+            chunk = AddChunk(buffer);
+        }
+
+        int space = chunk->capacity - chunk->size;
+        int count = length < space ? length : space;
+        memcpy(chunk->data + chunk->size, text, count);
+        chunk->size += count;
+        text += count;
+        length -= count;
+    }
+}
+
+void OutputBuffer_WriteString(struct OutputBuffer *buffer, const char *text) {
+    OutputBuffer_Write(buffer, text, (int) strlen(text));
+}
+
+void OutputBuffer_WriteInt(struct OutputBuffer *buffer, long long value) {
+    char digits[24];
+    int length = 0;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+    do {
+        digits[sizeof(digits) - 1 - length] = (char) ('0' + magnitude % 10);
+        length += 1;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        digits[sizeof(digits) - 1 - length] = '-';
+        length += 1;
+    }
+    OutputBuffer_Write(buffer, digits + sizeof(digits) - length, length);
+}
+
+// Move the chunks of other to the end of buffer without copying the text, leaving other empty.
+// The last chunk of buffer stays partly filled, later writes go to the last chunk of other.
+void OutputBuffer_Append(struct OutputBuffer *buffer, struct OutputBuffer *other) {
+    for (int i = 0; i < other->count; ++i) {
+        ReserveChunk(buffer);
+        buffer->chunks[buffer->count] = other->chunks[i];
+        buffer->count += 1;
+    }
+    buffer->size += other->size;
+    Memory_Free(MEMORY_CODEGEN, other->chunks);
+    OutputBuffer_Init(other);
+}
+
+// Write the collected text to a file and empty the buffer, returning false if the write failed
+bool OutputBuffer_Flush(struct OutputBuffer *buffer, FILE *file) {
+    // Text already written through stdio goes first
+    bool ok = fflush(file) == 0;
+    int fd = fileno(file);
+
+    struct iovec vectors[IOV_MAX];
+    int next = 0;
+    while (ok && next < buffer->count) {
+        int count = 0;
+        while (count < IOV_MAX && next + count < buffer->count) {
+            vectors[count].iov_base = buffer->chunks[next + count].data;
+            vectors[count].iov_len = (size_t) buffer->chunks[next + count].size;
+            count += 1;
+        }
+        next += count;
+
+        // Resume after partial writes, such as to a pipe
+        struct iovec *vector = vectors;
+        while (count > 0) {
+            ssize_t written = writev(fd, vector, count);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            while (count > 0 && (size_t) written >= vector->iov_len) {
+                written -= (ssize_t) vector->iov_len;
+                vector += 1;
+                count -= 1;
+            }
+            if (count > 0) {
+                vector->iov_base = (char *) vector->iov_base + written;
+                vector->iov_len -= (size_t) written;
+            }
+        }
+    }
+
+    for (int i = 0; i < buffer->count; ++i) {
+        Memory_Free(MEMORY_CODEGEN, buffer->chunks[i].data);
+    }
+    buffer->count = 0;
+    buffer->size = 0;
+    return ok;
+}
+
+void OutputBuffer_Free(struct OutputBuffer *buffer) {
+    for (int i = 0; i < buffer->count; ++i) {
+        Memory_Free(MEMORY_CODEGEN, buffer->chunks[i].data);
+    }
+    Memory_Free(MEMORY_CODEGEN, buffer->chunks);
+    OutputBuffer_Init(buffer);
+}
+
+void OutputBuffer_Init(struct OutputBuffer *buffer) {
+    buffer->capacity = 0;
+    buffer->count = 0;
+    buffer->chunks = NULL;
+    buffer->size = 0;
+}
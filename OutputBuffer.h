@@ -0,0 +1,47 @@
+#ifndef BMS_OUTPUT_BUFFER_H
+#define BMS_OUTPUT_BUFFER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+#define OUTPUT_FIRST_CHUNK_SIZE 1024  // Chunks double from here, so the text of a small function stays small
+
+// A filled block of output text
+struct OutputChunk {
+    char *data;
+    int size;
+    int capacity;
+};
+
+// Output text collected in large chunks, written to a file with a few writev calls instead of one
+// formatted write per instruction
+struct OutputBuffer {
+    int capacity;
+    int count;
+    struct OutputChunk *chunks;
+    long long size;                 // Bytes held in all chunks
+};
+
+// Append length bytes of text
+void OutputBuffer_Write(struct OutputBuffer *buffer, const char *text, int length);
+
+// Append a null terminated string
+void OutputBuffer_WriteString(struct OutputBuffer *buffer, const char *text);
+
+// Append a signed integer in decimal
+void OutputBuffer_WriteInt(struct OutputBuffer *buffer, long long value);
+
+// Move the chunks of other to the end of buffer without copying the text, leaving other empty
+void OutputBuffer_Append(struct OutputBuffer *buffer, struct OutputBuffer *other);
+
+// Write the collected text to a file and empty the buffer, returning false if the write failed
+bool OutputBuffer_Flush(struct OutputBuffer *buffer, FILE *file);
+
+// Free the buffer and its chunks
+void OutputBuffer_Free(struct OutputBuffer *buffer);
+
+// Initialize an empty buffer
+void OutputBuffer_Init(struct OutputBuffer *buffer);
+
+#endif // BMS_OUTPUT_BUFFER_H
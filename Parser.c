@@ -6,7 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define NEW_TYPE(type) ((struct type *) malloc(sizeof(struct type)))
+#define NEW_TYPE(type) ((struct type *) Memory_Alloc(MEMORY_AST, sizeof(struct type)))
 #define UNUSED(x) ((void) x)
 
 // Static function declarations
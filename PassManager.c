@@ -0,0 +1,306 @@
+#include "PassManager.h"
+#include "AstUtils.h"
+#include "ConstantFolding.h"
+#include "DeadCode.h"
+#include "Encoder.h"
+#include "Inliner.h"
+#include "Jit.h"
+#include "LoopOptimizer.h"
+#include "LoopUnroller.h"
+#include "Memory.h"
+#include "Options.h"
+#include "Peephole.h"
+#include "ReportError.h"
+#include "StackFrame.h"
+#include "ThreadPool.h"
+#include "ValueNumbering.h"
+#include "Vectorizer.h"
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+typedef void (*PassFunction)(struct TranslationUnit *t_unit);
+typedef void (*PrintStatsFunction)(FILE *file);
+
+// A pass over the whole translation unit
+struct Pass {
+    char *name;
+    PassFunction Run;
+    PrintStatsFunction PrintStats;  // NULL if the pass keeps no counters
+    bool *enabled;                  // Option turning the pass on and off, NULL if only the pipeline decides
+    int runs;
+};
+
+// The passes an optimization level runs. They always run in the order of the pass table, a
+// pipeline only selects them.
+struct Pipeline {
+    char *name;
+    int level;
+    bool optimize_for_size;
+    const enum PassId *passes;
+    int num_passes;
+};
+
+// Time and memory of one phase or pass of the compilation
+struct PhaseTiming {
+    char *name;
+    double wall_ms;
+    long peak_rss_kb;               // Most memory the process had resident so far
+    long rss_growth_kb;             // How much the phase raised that peak
+    int expr_nodes;                 // Expression nodes of the AST afterwards, -1 if not measured
+    long long allocations;          // Allocations the phase made
+    long long allocated_bytes;      // Bytes those allocations took
+    long long live_bytes;           // Bytes allocated and not freed at the end of the phase
+};
+
+static struct Pass passes[PASS_COUNT] = {
+    // Loads keep their width when later passes replace the arrays they index by pointers
+    [PASS_ANNOTATE_LOADS]   = { "annotate-loads", AstUtils_AnnotateLoads, NULL, NULL, 0 },
+    // Inline first so that the other passes see the callee bodies
+    [PASS_INLINE]           = { "inline", Inliner_Run, Inliner_PrintStats, &options.inline_functions, 0 },
+    [PASS_CONSTANT_FOLDING] = { "constant-folding", ConstantFolding_Run, ConstantFolding_PrintStats, NULL, 0 },
+    [PASS_VECTORIZE]        = { "vectorize", Vectorizer_Run, Vectorizer_PrintStats, &options.vectorize_loops, 0 },
+    [PASS_UNROLL_LOOPS]     = { "unroll-loops", LoopUnroller_Run, LoopUnroller_PrintStats, &options.unroll_loops, 0 },
+    // Fold the copies of the loop bodies again now that the counters are known
+    [PASS_REFOLD_CONSTANTS] = { "refold-constants", ConstantFolding_Run, NULL, &options.unroll_loops, 0 },
+    [PASS_OPTIMIZE_LOOPS]   = { "optimize-loops", LoopOptimizer_Run, LoopOptimizer_PrintStats, &options.optimize_loops, 0 },
+    [PASS_VALUE_NUMBERING]  = { "value-numbering", ValueNumbering_Run, ValueNumbering_PrintStats, &options.value_numbering, 0 },
+    [PASS_DEAD_CODE]        = { "dead-code", DeadCode_Run, DeadCode_PrintStats, &options.remove_dead_code, 0 },
+};
+
+static const enum PassId o0_passes[] = {
+    PASS_ANNOTATE_LOADS, PASS_CONSTANT_FOLDING,
+};
+static const enum PassId o1_passes[] = {
+    PASS_ANNOTATE_LOADS, PASS_INLINE, PASS_CONSTANT_FOLDING, PASS_OPTIMIZE_LOOPS, PASS_VALUE_NUMBERING,
+    PASS_DEAD_CODE,
+};
+static const enum PassId o2_passes[] = {
+    PASS_ANNOTATE_LOADS, PASS_INLINE, PASS_CONSTANT_FOLDING, PASS_VECTORIZE, PASS_OPTIMIZE_LOOPS,
+    PASS_VALUE_NUMBERING, PASS_DEAD_CODE,
+};
+static const enum PassId o3_passes[] = {
+    PASS_ANNOTATE_LOADS, PASS_INLINE, PASS_CONSTANT_FOLDING, PASS_VECTORIZE, PASS_UNROLL_LOOPS,
+    PASS_REFOLD_CONSTANTS, PASS_OPTIMIZE_LOOPS, PASS_VALUE_NUMBERING, PASS_DEAD_CODE,
+};
+// Vector and unrolled loops trade bytes for speed
+static const enum PassId os_passes[] = {
+    PASS_ANNOTATE_LOADS, PASS_INLINE, PASS_CONSTANT_FOLDING, PASS_OPTIMIZE_LOOPS, PASS_VALUE_NUMBERING,
+    PASS_DEAD_CODE,
+};
+
+#define PIPELINE(name, level, optimize_for_size, list) { name, level, optimize_for_size, list, (int) (sizeof(list) / sizeof(list[0])) }
+
+static struct Pipeline pipelines[] = {
+    PIPELINE("-O0", 0, false, o0_passes),
+    PIPELINE("-O1", 1, false, o1_passes),
+    PIPELINE("-O2", 2, false, o2_passes),
+    PIPELINE("-O3", 3, false, o3_passes),
+    PIPELINE("-Os", 2, true, os_passes),
+};
+
+#define NUM_PIPELINES ((int) (sizeof(pipelines) / sizeof(pipelines[0])))
+
+// Counters of the code generator, printed after those of the passes
+static PrintStatsFunction backend_stats[] = {
+    StackFrame_PrintStats,
+    Peephole_PrintStats,
+    Encoder_PrintStats,
+    Jit_PrintStats,
+    ThreadPool_PrintStats,
+};
+
+static struct PhaseTiming *timings;
+static int num_timings = 0;
+static int timings_capacity = 0;
+
+static char *phase_name;            // Phase being timed, NULL if none
+static struct timespec phase_start;
+static long phase_start_rss_kb;
+static struct MemoryCounters phase_start_memory;
+
+static struct Pipeline *FindPipeline(int level, bool optimize_for_size) {
+    for (int i = 0; i < NUM_PIPELINES; ++i) {
+        if (pipelines[i].level == level && pipelines[i].optimize_for_size == optimize_for_size) {
+            return &pipelines[i];
+        }
+    }
+    ReportInternalError("PassManager::FindPipeline - no pipeline for level %d", level);
+    return NULL;
+}
+
+static bool Contains(struct Pipeline *pipeline, enum PassId pass) {
+    for (int i = 0; i < pipeline->num_passes; ++i) {
+        if (pipeline->passes[i] == pass) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Options decide the passes that have one, so -fno-inline and -ftree-vectorize work at any level
+static bool IsEnabled(struct Pipeline *pipeline, enum PassId pass) {
+    return passes[pass].enabled ? *passes[pass].enabled : Contains(pipeline, pass);
+}
+
+static long PeakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int CountExprNodes(struct TranslationUnit *t_unit) {
+    int num_stmts = 0;
+    int num_exprs = 0;
+    AstUtils_CountNodes(t_unit, &num_stmts, &num_exprs);
+    return num_exprs;
+}
+
+// Check whether the pipeline of an optimization level runs a pass, the default of its option
+bool PassManager_IsInPipeline(int level, bool optimize_for_size, enum PassId pass) {
+    return Contains(FindPipeline(level, optimize_for_size), pass);
+}
+
+// Run the passes of the selected optimization level over the translation unit, leaving out
+// those whose option was turned off
+void PassManager_Run(struct TranslationUnit *t_unit) {
+    struct Pipeline *pipeline = FindPipeline(options.optimization_level, options.optimize_for_size);
+    for (int i = 0; i < PASS_COUNT; ++i) {
+        if (!IsEnabled(pipeline, (enum PassId) i)) {
+            continue;
+        }
+        PassManager_BeginPhase(passes[i].name);
+        passes[i].Run(t_unit);
+        passes[i].runs += 1;
+        PassManager_EndPhase(t_unit);
+    }
+}
+
+// Release what the passes keep for code generation, at the end of a compile
+void PassManager_Finish() {
+    Vectorizer_Free();
+}
+
+// Start timing a phase of the compilation for -ftime-report, such as parsing or code generation
+void PassManager_BeginPhase(char *name) {
+    if (phase_name) {
+        ReportInternalError("PassManager::BeginPhase - '%s' started inside '%s'", name, phase_name);
+    }
+    phase_name = name;
+    phase_start_rss_kb = PeakRssKb();
+    Memory_GetTotals(&phase_start_memory);
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+// Finish the phase begun last, measuring the size of the AST afterwards unless t_unit is NULL
+void PassManager_EndPhase(struct TranslationUnit *t_unit) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!phase_name) {
+        ReportInternalError("PassManager::EndPhase - no phase started");
+    }
+
+    // Read the counters before the timings grow, so that growing them is not charged to the phase
+    struct MemoryCounters memory;
+    Memory_GetTotals(&memory);
+    if (num_timings == timings_capacity) {
+        timings_capacity = timings_capacity == 0 ? 16 : timings_capacity * 2;
+        timings = (struct PhaseTiming *) Memory_Realloc(MEMORY_SYMBOLS, timings, sizeof(struct PhaseTiming) * timings_capacity);
+    }
+    struct PhaseTiming *timing = &timings[num_timings];
+    num_timings += 1;
+    timing->name = phase_name;
+    timing->wall_ms = (double) (end.tv_sec - phase_start.tv_sec) * 1e3 + (double) (end.tv_nsec - phase_start.tv_nsec) / 1e6;
+    timing->peak_rss_kb = PeakRssKb();
+    timing->rss_growth_kb = timing->peak_rss_kb - phase_start_rss_kb;
+
+    timing->allocations = memory.allocations - phase_start_memory.allocations;
+    timing->allocated_bytes = memory.allocated_bytes - phase_start_memory.allocated_bytes;
+    timing->live_bytes = memory.live_bytes;
+
+    // Walking the AST after every pass costs time of its own, so only when it is reported
+    timing->expr_nodes = t_unit && options.time_report ? CountExprNodes(t_unit) : -1;
+    phase_name = NULL;
+}
+
+// Print the passes the selected optimization level runs (-fdump-passes)
+void PassManager_PrintPipeline(FILE *file) {
+    struct Pipeline *pipeline = FindPipeline(options.optimization_level, options.optimize_for_size);
+    fprintf(file, "pipeline %s:\n", pipeline->name);
+    for (int i = 0; i < PASS_COUNT; ++i) {
+        bool enabled = IsEnabled(pipeline, (enum PassId) i);
+        bool in_pipeline = Contains(pipeline, (enum PassId) i);
+        char *note = enabled == in_pipeline ? "" : enabled ? " (added by option)" : " (removed by option)";
+        fprintf(file, "  %-20s %s%s\n", passes[i].name, enabled ? "on" : "off", note);
+    }
+}
+
+// Print the wall time, peak memory and AST size after each phase and pass (-ftime-report)
+void PassManager_PrintTimeReport(FILE *file) {
+    fprintf(file, "time report:\n");
+    fprintf(file, "  %-20s %10s %12s %12s %10s\n", "phase", "wall-ms", "peak-rss-kb", "growth-kb", "expr-nodes");
+    double total_ms = 0;
+    long peak_rss_kb = 0;
+    for (int i = 0; i < num_timings; ++i) {
+        struct PhaseTiming *timing = &timings[i];
+        fprintf(file, "  %-20s %10.3f %12ld %12ld ", timing->name, timing->wall_ms, timing->peak_rss_kb, timing->rss_growth_kb);
+        if (timing->expr_nodes >= 0) {
+            fprintf(file, "%10d\n", timing->expr_nodes);
+        } else {
+            fprintf(file, "%10s\n", "-");
+        }
+        total_ms += timing->wall_ms;
+        if (timing->peak_rss_kb > peak_rss_kb) peak_rss_kb = timing->peak_rss_kb;
+    }
+    fprintf(file, "  %-20s %10.3f %12ld\n", "total", total_ms, peak_rss_kb);
+}
+
+// Print the allocations and peak memory of each phase and pass, then the allocations of each
+// subsystem (--mem-report)
+void PassManager_PrintMemoryReport(FILE *file) {
+    fprintf(file, "memory report:\n");
+    fprintf(file, "  %-20s %12s %14s %12s %12s\n", "phase", "allocations", "allocated-kb", "live-kb", "peak-rss-kb");
+    for (int i = 0; i < num_timings; ++i) {
+        struct PhaseTiming *timing = &timings[i];
+        fprintf(file, "  %-20s %12lld %14lld %12lld %12ld\n", timing->name, timing->allocations,
+            timing->allocated_bytes / 1024, timing->live_bytes / 1024, timing->peak_rss_kb);
+    }
+    Memory_PrintStats(file);
+}
+
+// Write the memory report as JSON (--mem-report-json)
+void PassManager_WriteMemoryJson(FILE *file) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n", PeakRssKb());
+    fprintf(file, "  \"phases\": [\n");
+    for (int i = 0; i < num_timings; ++i) {
+        struct PhaseTiming *timing = &timings[i];
+        fprintf(file, "    { \"name\": \"%s\", \"wall_ms\": %.3f, \"allocations\": %lld, \"allocated_bytes\": %lld, "
+            "\"live_bytes\": %lld, \"peak_rss_kb\": %ld, \"rss_growth_kb\": %ld }%s\n", timing->name, timing->wall_ms,
+            timing->allocations, timing->allocated_bytes, timing->live_bytes, timing->peak_rss_kb, timing->rss_growth_kb,
+            i + 1 < num_timings ? "," : "");
+    }
+    fprintf(file, "  ],\n");
+    fprintf(file, "  \"categories\": [\n");
+    for (int i = 0; i < MEMORY_COUNT; ++i) {
+        struct MemoryCounters c;
+        Memory_GetCounters((enum MemoryCategory) i, &c);
+        fprintf(file, "    { \"name\": \"%s\", \"allocations\": %lld, \"frees\": %lld, \"allocated_bytes\": %lld, "
+            "\"live_bytes\": %lld, \"peak_live_bytes\": %lld }%s\n", Memory_CategoryName((enum MemoryCategory) i),
+            c.allocations, c.frees, c.allocated_bytes, c.live_bytes, c.peak_live_bytes, i + 1 < MEMORY_COUNT ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+// Print the counters of every pass and of the code generator (-fstats)
+void PassManager_PrintStats(FILE *file) {
+    for (int i = 0; i < PASS_COUNT; ++i) {
+        if (passes[i].runs > 0 && passes[i].PrintStats) {
+            passes[i].PrintStats(file);
+        }
+    }
+    for (int i = 0; i < (int) (sizeof(backend_stats) / sizeof(backend_stats[0])); ++i) {
+        backend_stats[i](file);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef BMS_PASS_MANAGER_H
+#define BMS_PASS_MANAGER_H
+
+#include "AstNode.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// The passes over the AST, in the order they run
+enum PassId {
+    PASS_ANNOTATE_LOADS,
+    PASS_INLINE,
+    PASS_CONSTANT_FOLDING,
+    PASS_VECTORIZE,
+    PASS_UNROLL_LOOPS,
+    PASS_REFOLD_CONSTANTS,
+    PASS_OPTIMIZE_LOOPS,
+    PASS_VALUE_NUMBERING,
+    PASS_DEAD_CODE,
+    PASS_COUNT,
+};
+
+// Check whether the pipeline of an optimization level runs a pass, the default of its option
+bool PassManager_IsInPipeline(int level, bool optimize_for_size, enum PassId pass);
+
+// Run the passes of the selected optimization level over the translation unit, leaving out
+// those whose option was turned off
+void PassManager_Run(struct TranslationUnit *t_unit);
+
+// Release what the passes keep for code generation, at the end of a compile
+void PassManager_Finish();
+
+// Start timing a phase of the compilation for -ftime-report, such as parsing or code generation
+void PassManager_BeginPhase(char *name);
+
+// Finish the phase begun last, measuring the size of the AST afterwards unless t_unit is NULL
+void PassManager_EndPhase(struct TranslationUnit *t_unit);
+
+// Print the passes the selected optimization level runs (-fdump-passes)
+void PassManager_PrintPipeline(FILE *file);
+
+// Print the wall time, peak memory and AST size after each phase and pass (-ftime-report)
+void PassManager_PrintTimeReport(FILE *file);
+
+// Print the allocations and peak memory of each phase and pass, then the allocations of each
+// subsystem (--mem-report)
+void PassManager_PrintMemoryReport(FILE *file);
+
+// Write the memory report as JSON (--mem-report-json)
+void PassManager_WriteMemoryJson(FILE *file);
+
+// Print the counters of every pass and of the code generator (-fstats)
+void PassManager_PrintStats(FILE *file);
+
+#endif // BMS_PASS_MANAGER_H
@@ -0,0 +1,504 @@
+#include "Peephole.h"
+#include <stdatomic.h>
+#include <string.h>
+
+#define REG_BIT(reg) (1u << (reg))
+#define PEEPHOLE_MAX_ITERATIONS 64
+#define PEEPHOLE_SCAN_BUDGET 256
+
+typedef bool (*PeepholeRuleFunction)(struct InstructionBuffer *, int);
+
+struct PeepholeRule {
+    char *name;
+    PeepholeRuleFunction Apply;
+    atomic_int hits;                // Functions are optimized on several threads at once
+};
+
+static bool IsDeadFrom(struct InstructionBuffer *buffer, int index, enum Reg reg, int *budget);
+
+// Registers used to pass arguments, assumed to be read by every call
+static const unsigned call_reads =
+    REG_BIT(REG_RAX) | REG_BIT(REG_RCX) | REG_BIT(REG_RDX) | REG_BIT(REG_RSI) |
+    REG_BIT(REG_RDI) | REG_BIT(REG_R8) | REG_BIT(REG_R9) | REG_BIT(REG_RSP);
+
+// Caller-saved registers, clobbered by every call
+static const unsigned call_writes =
+    REG_BIT(REG_RAX) | REG_BIT(REG_RCX) | REG_BIT(REG_RDX) | REG_BIT(REG_RSI) |
+    REG_BIT(REG_RDI) | REG_BIT(REG_R8) | REG_BIT(REG_R9) | REG_BIT(REG_R10) | REG_BIT(REG_R11);
+
+// Registers that must hold their value when returning
+static const unsigned ret_reads =
+    REG_BIT(REG_RAX) | REG_BIT(REG_RBX) | REG_BIT(REG_RSP) | REG_BIT(REG_RBP) |
+    REG_BIT(REG_R12) | REG_BIT(REG_R13) | REG_BIT(REG_R14) | REG_BIT(REG_R15);
+
+// Registers referenced by an operand, including the base of a memory operand
+static unsigned OperandRegs(struct Operand *operand) {
+    unsigned regs = 0;
+    if ((operand->kind == OPERAND_REG || operand->kind == OPERAND_MEM) && operand->reg != REG_NONE) {
+        regs |= REG_BIT(operand->reg);
+    }
+    if (operand->kind == OPERAND_MEM && operand->index != REG_NONE) {
+        regs |= REG_BIT(operand->index);
+    }
+    return regs;
+}
+
+// Registers whose value is defined entirely by a write to this operand
+static unsigned FullyWrittenRegs(struct Operand *operand) {
+    if (operand->kind == OPERAND_REG && operand->size >= 4) {
+        return REG_BIT(operand->reg);
+    }
+    return 0;
+}
+
+// Registers read by an instruction
+static unsigned ReadRegs(struct Instruction *instr) {
+    struct Operand *dst = &instr->dst;
+    struct Operand *src = &instr->src;
+    unsigned dst_address = dst->kind == OPERAND_MEM ? OperandRegs(dst) : 0;
+    unsigned dst_partial = dst->kind == OPERAND_REG && dst->size < 4 ? OperandRegs(dst) : 0;
+
+    switch (instr->opcode) {
+        case OP_MOV:
+        case OP_MOVSXD:
+        case OP_MOVZX:
+        case OP_LEA:    return OperandRegs(src) | dst_address | dst_partial;
+        case OP_ADD:
+        case OP_CMP:
+        case OP_IMUL:
+        case OP_SUB:
+        case OP_TEST:   return OperandRegs(dst) | OperandRegs(src);
+        case OP_NEG:
+        case OP_SAR:
+        case OP_SHL:
+        case OP_SHR:    return OperandRegs(dst);
+        case OP_SETCC:  return dst_address | dst_partial;
+        case OP_CQO:    return REG_BIT(REG_RAX);
+        case OP_IDIV:   return REG_BIT(REG_RAX) | REG_BIT(REG_RDX) | OperandRegs(dst);
+        case OP_PUSH:   return OperandRegs(dst) | REG_BIT(REG_RSP);
+        case OP_POP:    return dst_address | REG_BIT(REG_RSP);
+        case OP_CALL:   return call_reads;
+        case OP_RET:    return ret_reads;
+        default:        return OperandRegs(dst) | OperandRegs(src);  // Assume that both operands are read
+    }
+}
+
+// Registers whose whole value is overwritten by an instruction
+static unsigned WrittenRegs(struct Instruction *instr) {
+    switch (instr->opcode) {
+        case OP_MOV:
+        case OP_MOVSXD:
+        case OP_MOVZX:
+        case OP_LEA:
+        case OP_ADD:
+        case OP_IMUL:
+        case OP_NEG:
+        case OP_SAR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_SUB:    return FullyWrittenRegs(&instr->dst);
+        case OP_CQO:    return REG_BIT(REG_RDX);
+        case OP_IDIV:   return REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        case OP_PUSH:   return REG_BIT(REG_RSP);
+        case OP_POP:    return FullyWrittenRegs(&instr->dst) | REG_BIT(REG_RSP);
+        case OP_CALL:   return call_writes;
+        default:        return 0;
+    }
+}
+
+static bool IsControlFlow(struct Instruction *instr) {
+    switch (instr->opcode) {
+        case OP_ALIGN:
+        case OP_CALL:
+        case OP_JCC:
+        case OP_JMP:
+        case OP_LABEL:
+        case OP_RET:    return true;
+        default:        return false;
+    }
+}
+
+static bool IsReg(struct Operand *operand, enum Reg reg, int size) {
+    return operand->kind == OPERAND_REG && operand->reg == reg && operand->size == size;
+}
+
+// Index of the next instruction after index, skipping deleted ones and comments
+static int Next(struct InstructionBuffer *buffer, int index) {
+    for (int i = index + 1; i < buffer->count; ++i) {
+        enum Opcode opcode = buffer->data[i].opcode;
+        if (opcode != OP_NOP && opcode != OP_COMMENT) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int FindLabel(struct InstructionBuffer *buffer, char *label) {
+    for (int i = 0; i < buffer->count; ++i) {
+        struct Instruction *instr = &buffer->data[i];
+        if (instr->opcode == OP_LABEL && strcmp(instr->dst.label, label) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Check that the value of reg at index is never read, following jumps within the function
+static bool IsDeadFrom(struct InstructionBuffer *buffer, int index, enum Reg reg, int *budget) {
+    unsigned bit = REG_BIT(reg);
+    for (int i = index; i < buffer->count; ++i) {
+        *budget -= 1;
+        if (*budget <= 0) {
+            return false;
+        }
+
+        struct Instruction *instr = &buffer->data[i];
+        if (ReadRegs(instr) & bit) {
+            return false;
+        }
+        if (WrittenRegs(instr) & bit) {
+            return true;
+        }
+
+        if (instr->opcode == OP_RET) {
+            return true;
+        }
+        if (instr->opcode == OP_JMP || instr->opcode == OP_JCC) {
+            int target = FindLabel(buffer, instr->dst.label);
+            if (target < 0 || !IsDeadFrom(buffer, target, reg, budget)) {
+                return false;
+            }
+            if (instr->opcode == OP_JMP) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool IsDeadAfter(struct InstructionBuffer *buffer, int index, enum Reg reg) {
+    int budget = PEEPHOLE_SCAN_BUDGET;
+    return IsDeadFrom(buffer, index + 1, reg, &budget);
+}
+
+// mov rax, rax
+static bool ApplySelfMove(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *instr = &buffer->data[i];
+    if (instr->opcode != OP_MOV || instr->dst.kind != OPERAND_REG || instr->dst.size != 8) {
+        return false;
+    }
+    if (!IsReg(&instr->src, instr->dst.reg, 8)) {
+        return false;
+    }
+    instr->opcode = OP_NOP;
+    return true;
+}
+
+// jmp L / L:
+static bool ApplyRedundantJump(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *instr = &buffer->data[i];
+    if (instr->opcode != OP_JMP && instr->opcode != OP_JCC) {
+        return false;
+    }
+    for (int j = i + 1; j < buffer->count; ++j) {
+        struct Instruction *next = &buffer->data[j];
+        if (next->opcode == OP_LABEL && strcmp(next->dst.label, instr->dst.label) == 0) {
+            instr->opcode = OP_NOP;
+            return true;
+        }
+        if (next->opcode != OP_LABEL && next->opcode != OP_ALIGN && next->opcode != OP_COMMENT && next->opcode != OP_NOP) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Instructions between jmp/ret and the next label can never execute
+static bool ApplyUnreachableCode(struct InstructionBuffer *buffer, int i) {
+    enum Opcode opcode = buffer->data[i].opcode;
+    if (opcode != OP_JMP && opcode != OP_RET) {
+        return false;
+    }
+    int j = Next(buffer, i);
+    if (j < 0 || buffer->data[j].opcode == OP_LABEL || buffer->data[j].opcode == OP_ALIGN) {
+        return false;
+    }
+    buffer->data[j].opcode = OP_NOP;
+    return true;
+}
+
+// jmp L1 ... L1: jmp L2  ->  jmp L2
+static bool ApplyJumpThreading(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *instr = &buffer->data[i];
+    if (instr->opcode != OP_JMP && instr->opcode != OP_JCC) {
+        return false;
+    }
+    int target = FindLabel(buffer, instr->dst.label);
+    if (target < 0) {
+        return false;
+    }
+
+    int j = target;
+    while (j >= 0 && (buffer->data[j].opcode == OP_LABEL || buffer->data[j].opcode == OP_ALIGN)) {
+        j = Next(buffer, j);
+    }
+    if (j < 0 || j == i || buffer->data[j].opcode != OP_JMP) {
+        return false;
+    }
+
+    char *final_label = buffer->data[j].dst.label;
+    if (strcmp(final_label, instr->dst.label) == 0) {
+        return false;
+    }
+    Operand_SetLabel(&instr->dst, final_label);
+    return true;
+}
+
+// push src ... pop dst  ->  mov dst, src ...
+static bool ApplyPushPop(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *push = &buffer->data[i];
+    if (push->opcode != OP_PUSH) {
+        return false;
+    }
+    if (push->dst.kind != OPERAND_IMM && !(push->dst.kind == OPERAND_REG && push->dst.size == 8)) {
+        return false;
+    }
+
+    unsigned touched = 0;
+    for (int j = Next(buffer, i); j >= 0; j = Next(buffer, j)) {
+        struct Instruction *instr = &buffer->data[j];
+        if (instr->opcode == OP_POP) {
+            if (instr->dst.kind != OPERAND_REG || instr->dst.size != 8) {
+                return false;
+            }
+            enum Reg dst = instr->dst.reg;
+            if (touched & REG_BIT(dst)) {
+                return false;
+            }
+
+            if (push->dst.kind == OPERAND_REG && push->dst.reg == dst) {
+                push->opcode = OP_NOP;
+            } else {
+                push->opcode = OP_MOV;
+                push->src = push->dst;
+                push->dst = Operand_Reg(dst, 8);
+            }
+            instr->opcode = OP_NOP;
+            return true;
+        }
+
+        unsigned regs = ReadRegs(instr) | WrittenRegs(instr) | OperandRegs(&instr->dst);
+        if (IsControlFlow(instr) || instr->opcode == OP_PUSH || (regs & REG_BIT(REG_RSP))) {
+            return false;
+        }
+        touched |= regs;
+    }
+    return false;
+}
+
+// mov rax, imm / push rax  ->  push imm
+static bool ApplyPushImm(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *mov = &buffer->data[i];
+    if (mov->opcode != OP_MOV || mov->dst.kind != OPERAND_REG || mov->dst.size != 8 || mov->src.kind != OPERAND_IMM) {
+        return false;
+    }
+    int j = Next(buffer, i);
+    if (j < 0) {
+        return false;
+    }
+    struct Instruction *push = &buffer->data[j];
+    if (push->opcode != OP_PUSH || !IsReg(&push->dst, mov->dst.reg, 8)) {
+        return false;
+    }
+    if (mov->src.value < -2147483648LL || mov->src.value > 2147483647LL || !IsDeadAfter(buffer, j, mov->dst.reg)) {
+        return false;
+    }
+    push->dst = mov->src;
+    mov->opcode = OP_NOP;
+    return true;
+}
+
+// mov/lea rax, x / mov rdi, rax  ->  mov/lea rdi, x
+static bool ApplyCopyCoalesce(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *def = &buffer->data[i];
+    if (def->opcode != OP_MOV && def->opcode != OP_MOVZX && def->opcode != OP_LEA) {
+        return false;
+    }
+    if (!FullyWrittenRegs(&def->dst)) {
+        return false;
+    }
+    int j = Next(buffer, i);
+    if (j < 0) {
+        return false;
+    }
+    struct Instruction *copy = &buffer->data[j];
+    if (copy->opcode != OP_MOV || copy->dst.kind != OPERAND_REG || copy->dst.size != 8 || !IsReg(&copy->src, def->dst.reg, 8)) {
+        return false;
+    }
+    if (copy->dst.reg == def->dst.reg || copy->dst.reg == REG_RSP || !IsDeadAfter(buffer, j, def->dst.reg)) {
+        return false;
+    }
+    def->dst.reg = copy->dst.reg;
+    copy->opcode = OP_NOP;
+    return true;
+}
+
+// mov rax, x where rax is overwritten before being read
+static bool ApplyDeadMove(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *instr = &buffer->data[i];
+    if (instr->opcode != OP_MOV && instr->opcode != OP_MOVZX && instr->opcode != OP_MOVSXD && instr->opcode != OP_LEA) {
+        return false;
+    }
+    if (!FullyWrittenRegs(&instr->dst) || instr->dst.reg == REG_RSP || instr->dst.reg == REG_RBP) {
+        return false;
+    }
+    if (!IsDeadAfter(buffer, i, instr->dst.reg)) {
+        return false;
+    }
+    instr->opcode = OP_NOP;
+    return true;
+}
+
+// lea rax, [rbp - 8] / mov eax, dword [rax]  ->  mov eax, dword [rbp - 8]
+static bool ApplyFoldAddress(struct InstructionBuffer *buffer, int i) {
+    struct Instruction *lea = &buffer->data[i];
+    if (lea->opcode != OP_LEA || lea->dst.kind != OPERAND_REG || lea->dst.size != 8 || lea->src.index != REG_NONE) {
+        return false;
+    }
+    int j = Next(buffer, i);
+    if (j < 0) {
+        return false;
+    }
+
+    enum Reg reg = lea->dst.reg;
+    struct Instruction *use = &buffer->data[j];
+    struct Operand *mem = NULL;
+    if (use->dst.kind == OPERAND_MEM && use->dst.reg == reg) {
+        mem = &use->dst;
+    } else if (use->src.kind == OPERAND_MEM && use->src.reg == reg) {
+        mem = &use->src;
+    } else {
+        return false;
+    }
+
+    // The address must be the only use of the register
+    mem->reg = REG_NONE;
+    bool reads_reg = ReadRegs(use) & REG_BIT(reg);
+    mem->reg = reg;
+    if (reads_reg) {
+        return false;
+    }
+    if (!(WrittenRegs(use) & REG_BIT(reg)) && !IsDeadAfter(buffer, j, reg)) {
+        return false;
+    }
+
+    mem->reg = lea->src.reg;
+    mem->value += lea->src.value;
+    lea->opcode = OP_NOP;
+    return true;
+}
+
+// Check for cmp rax, 0 or test rax, rax, with either 64-bit or 32-bit registers
+static bool IsZeroTest(struct Instruction *instr) {
+    struct Operand *dst = &instr->dst;
+    if (dst->kind != OPERAND_REG || dst->reg != REG_RAX || dst->size < 4) {
+        return false;
+    }
+    if (instr->opcode == OP_CMP) {
+        return instr->src.kind == OPERAND_IMM && instr->src.value == 0;
+    }
+    return instr->opcode == OP_TEST && Operand_Equals(dst, &instr->src);
+}
+
+// cmp a, b / setcc al / [movzx eax, al] / cmp rax, 0 / je L  ->  cmp a, b / jncc L
+static bool ApplyCompareBranch(struct InstructionBuffer *buffer, int i) {
+    if (buffer->data[i].opcode != OP_CMP) {
+        return false;
+    }
+    int j = Next(buffer, i);
+    if (j < 0 || buffer->data[j].opcode != OP_SETCC || !IsReg(&buffer->data[j].dst, REG_RAX, 1)) {
+        return false;
+    }
+
+    int k = Next(buffer, j);
+    int extend = -1;
+    if (k >= 0 && buffer->data[k].opcode == OP_MOVZX && IsReg(&buffer->data[k].src, REG_RAX, 1)) {
+        extend = k;
+        k = Next(buffer, k);
+    }
+    int m = k >= 0 ? Next(buffer, k) : -1;
+    if (m < 0 || !IsZeroTest(&buffer->data[k])) {
+        return false;
+    }
+
+    struct Instruction *set = &buffer->data[j];
+    struct Instruction *jump = &buffer->data[m];
+    if (jump->opcode != OP_JCC || (jump->condition != COND_E && jump->condition != COND_NE)) {
+        return false;
+    }
+
+    int target = FindLabel(buffer, jump->dst.label);
+    int budget = PEEPHOLE_SCAN_BUDGET;
+    if (target < 0 || !IsDeadFrom(buffer, target, REG_RAX, &budget) || !IsDeadAfter(buffer, m, REG_RAX)) {
+        return false;
+    }
+
+    jump->condition = jump->condition == COND_E ? Condition_Invert(set->condition) : set->condition;
+    set->opcode = OP_NOP;
+    buffer->data[k].opcode = OP_NOP;
+    if (extend >= 0) {
+        buffer->data[extend].opcode = OP_NOP;
+    }
+    return true;
+}
+
+static struct PeepholeRule rules[] = {
+    { "self-move",          ApplySelfMove, 0 },
+    { "redundant-jump",     ApplyRedundantJump, 0 },
+    { "unreachable-code",   ApplyUnreachableCode, 0 },
+    { "jump-threading",     ApplyJumpThreading, 0 },
+    { "compare-branch",     ApplyCompareBranch, 0 },
+    { "push-imm",           ApplyPushImm, 0 },
+    { "push-pop",           ApplyPushPop, 0 },
+    { "fold-address",       ApplyFoldAddress, 0 },
+    { "copy-coalesce",      ApplyCopyCoalesce, 0 },
+    { "dead-move",          ApplyDeadMove, 0 },
+};
+
+#define NUM_RULES ((int) (sizeof(rules) / sizeof(rules[0])))
+
+static atomic_int instructions_before = 0;
+static atomic_int instructions_after = 0;
+
+// Rewrite the instructions of a function until no peephole rule applies
+void Peephole_Optimize(struct InstructionBuffer *buffer) {
+    instructions_before += buffer->count;
+
+    bool changed = true;
+    for (int iteration = 0; changed && iteration < PEEPHOLE_MAX_ITERATIONS; ++iteration) {
+        changed = false;
+        for (int i = 0; i < buffer->count; ++i) {
+            for (int r = 0; r < NUM_RULES; ++r) {
+                enum Opcode opcode = buffer->data[i].opcode;
+                if (opcode == OP_NOP || opcode == OP_COMMENT) {
+                    break;
+                }
+                if (rules[r].Apply(buffer, i)) {
+                    rules[r].hits += 1;
+                    changed = true;
+                }
+            }
+        }
+        InstructionBuffer_Compact(buffer);
+    }
+
+    instructions_after += buffer->count;
+}
+
+// Print how many times each rule was applied
+void Peephole_PrintStats(FILE *file) {
+    fprintf(file, "peephole: %d -> %d instructions\n", instructions_before, instructions_after);
+    for (int r = 0; r < NUM_RULES; ++r) {
+        fprintf(file, "  %-20s %d\n", rules[r].name, rules[r].hits);
+    }
+}
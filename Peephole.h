@@ -0,0 +1,13 @@
+#ifndef BMS_PEEPHOLE_H
+#define BMS_PEEPHOLE_H
+
+#include "Instruction.h"
+#include <stdio.h>
+
+// Rewrite the instructions of a function until no peephole rule applies
+void Peephole_Optimize(struct InstructionBuffer *buffer);
+
+// Print how many times each rule was applied
+void Peephole_PrintStats(FILE *file);
+
+#endif // BMS_PEEPHOLE_H
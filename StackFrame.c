@@ -0,0 +1,438 @@
+#include "StackFrame.h"
+#include "Assembly.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "Options.h"
+#include "ReportError.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A local variable and the range of statement positions in which its slot holds a value
+struct FrameVar {
+    struct Declarator *declarator;
+    int size;
+    int align;
+    int first;                      // -1 if the variable is never referenced
+    int last;
+    int slot;
+};
+
+// A stack slot shared by variables of the same size
+struct FrameSlot {
+    int size;
+    int align;
+    int end;                        // Last position of the variables placed in the slot so far
+    int offset;
+};
+
+// Variables of the function being laid out on this thread
+static _Thread_local struct FrameVar *frame_vars;
+static _Thread_local int num_frame_vars;
+static _Thread_local int position;
+
+static atomic_int num_frames_omitted = 0;
+static atomic_int num_red_zone_leaves = 0;
+static atomic_int num_shared_slots = 0;
+static atomic_int num_bytes_saved = 0;
+
+// Align a number to the nearest multiple of offset
+static int Align(int n, int offset) {
+    return (n + offset - 1) / offset * offset;
+}
+
+static struct FrameVar *FindFrameVar(char *identifier) {
+    for (int i = 0; i < num_frame_vars; ++i) {
+        if (strcmp(frame_vars[i].declarator->identifier, identifier) == 0) {
+            return &frame_vars[i];
+        }
+    }
+    return NULL;
+}
+
+// Extend the live range of a variable to cover the positions from first to last
+static void Touch(struct FrameVar *var, int first, int last) {
+    if (!var) {
+        return;
+    }
+    if (var->first < 0 || first < var->first) var->first = first;
+    if (last > var->last) var->last = last;
+}
+
+// Record a reference to a variable at the current position, or for the whole function if its address is taken
+static void MarkLive(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_VAR) {
+        Touch(FindFrameVar(expr->str_value), position, position);
+    } else if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        Touch(FindFrameVar(expr->lhs->str_value), 0, INT_MAX);
+    }
+}
+
+// Keep every variable used in a loop live from the loop start to the current position, since the
+// values it holds at the end of an iteration may be read again by the next one
+static void ExtendLoop(int start) {
+    for (int i = 0; i < num_frame_vars; ++i) {
+        struct FrameVar *var = &frame_vars[i];
+        if (var->first >= 0 && var->last >= start) {
+            Touch(var, start, position);
+        }
+    }
+}
+
+// Number the statements of a function in the order their code is emitted, marking the variables they use
+static void LiveStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                LiveStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                struct Declarator *declarator = (struct Declarator *) List_Get(declarators, i);
+                if (declarator->value) {
+                    position += 1;
+                    Touch(FindFrameVar(declarator->identifier), position, position);
+                    AstUtils_WalkExpr(declarator->value, MarkLive, NULL);
+                }
+            }
+        } break;
+        case AST_EXPRESSION_STMT: {
+            position += 1;
+            AstUtils_WalkExpr(((struct ExpressionStmt *) stmt)->expr, MarkLive, NULL);
+        } break;
+        case AST_RETURN_STMT: {
+            position += 1;
+            AstUtils_WalkExpr(((struct ReturnStmt *) stmt)->expr, MarkLive, NULL);
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            position += 1;
+            AstUtils_WalkExpr(if_stmt->condition, MarkLive, NULL);
+            LiveStmt(if_stmt->stmt);
+            LiveStmt(if_stmt->else_branch);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            position += 1;
+            int start = position;
+            AstUtils_WalkExpr(while_stmt->condition, MarkLive, NULL);
+            LiveStmt(while_stmt->stmt);
+            ExtendLoop(start);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            position += 1;
+            AstUtils_WalkExpr(for_stmt->init_expr, MarkLive, NULL);
+            position += 1;
+            int start = position;
+            AstUtils_WalkExpr(for_stmt->cond_expr, MarkLive, NULL);
+            LiveStmt(for_stmt->stmt);
+            position += 1;
+            AstUtils_WalkExpr(for_stmt->loop_expr, MarkLive, NULL);
+            ExtendLoop(start);
+        } break;
+        case AST_NULL_STMT: {
+        } break;
+        default: {
+            ReportInternalError("StackFrame::LiveStmt - unknown statement");
+        } break;
+    }
+}
+
+// Position a variable is ordered by when assigning slots, unreferenced variables go last
+static int StartPosition(struct FrameVar *var) {
+    return var->first >= 0 ? var->first : INT_MAX;
+}
+
+// Assign the stack slot of every local variable of a function and return the size of the frame in bytes
+int StackFrame_Layout(struct FunctionDef *function, bool share_slots) {
+    struct List *var_decls = &function->var_decls;
+    int num_vars = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        num_vars += ((struct VarDeclaration *) List_Get(var_decls, i))->declarators.count;
+    }
+    frame_vars = NEW_ARRAY(MEMORY_SYMBOLS, struct FrameVar, num_vars);
+
+    num_frame_vars = 0;
+    for (int i = 0; i < var_decls->count; ++i) {
+        struct VarDeclaration *var_declaration = (struct VarDeclaration *) List_Get(var_decls, i);
+        int size_in_bytes = bytes[var_declaration->type];
+        if (size_in_bytes == 0) {
+            ReportInternalError("StackFrame::Layout - unexpected sizeof type");
+        }
+
+        struct List *declarators = &var_declaration->declarators;
+        for (int j = 0; j < declarators->count; ++j) {
+            struct Declarator *declarator = (struct Declarator *) List_Get(declarators, j);
+            if (i >= NUM_ARG_REGS && i < function->num_params) {
+                // Stack arguments stay where the caller pushed them, above the return address and saved rbp
+                declarator->rbp_offset = -(16 + (i - NUM_ARG_REGS) * 8);
+                continue;
+            }
+
+            struct FrameVar *var = &frame_vars[num_frame_vars++];
+            var->declarator = declarator;
+            var->first = -1;
+            var->last = -1;
+
+            if (declarator->array_dimensions > 0) {
+                int total_vars = 1;
+                for (int k = 0; k < declarator->array_dimensions; ++k) {
+                    total_vars *= declarator->array_sizes[k];
+                }
+                var->size = size_in_bytes * total_vars;
+                var->align = size_in_bytes;
+            } else if (declarator->pointer_inderection > 0) {
+                var->size = bytes[PRIMTYPE_PTR];
+                var->align = bytes[PRIMTYPE_PTR];
+            } else {
+                var->size = size_in_bytes;
+                var->align = size_in_bytes;
+            }
+
+            // Parameters are stored on entry, and arrays are reached through pointers that may outlive any use
+            if (i < function->num_params) Touch(var, 0, 0);
+            if (!share_slots || declarator->array_dimensions > 0) Touch(var, 0, INT_MAX);
+        }
+    }
+
+    position = 0;
+    LiveStmt((struct AstNode *) function->body);
+
+    // Visit the variables in the order they become live
+    int *order = NEW_ARRAY(MEMORY_SYMBOLS, int, num_frame_vars);
+    for (int i = 0; i < num_frame_vars; ++i) {
+        int j = i;
+        while (j > 0 && StartPosition(&frame_vars[order[j - 1]]) > StartPosition(&frame_vars[i])) {
+            order[j] = order[j - 1];
+            j -= 1;
+        }
+        order[j] = i;
+    }
+
+    // Place each variable in a free slot of its size, or in a new slot
+    struct FrameSlot *slots = NEW_ARRAY(MEMORY_SYMBOLS, struct FrameSlot, num_frame_vars);
+    int num_slots = 0;
+    for (int i = 0; i < num_frame_vars; ++i) {
+        struct FrameVar *var = &frame_vars[order[i]];
+        var->slot = -1;
+        for (int j = 0; j < num_slots && var->slot < 0; ++j) {
+            struct FrameSlot *slot = &slots[j];
+            bool is_free = var->first >= 0 ? slot->size == var->size && slot->align == var->align && slot->end < var->first
+                                           : slot->size >= var->size && slot->align >= var->align;
+            if (share_slots && is_free) {
+                var->slot = j;
+            }
+        }
+
+        if (var->slot >= 0) {
+            num_shared_slots += 1;
+            num_bytes_saved += var->size;
+        } else {
+            var->slot = num_slots++;
+            slots[var->slot].size = var->size;
+            slots[var->slot].align = var->align;
+            slots[var->slot].end = -1;
+        }
+        if (var->last > slots[var->slot].end) {
+            slots[var->slot].end = var->last;
+        }
+    }
+
+    // Place the most aligned slots nearest to the frame base so no padding is needed between slots
+    int offset = 0;
+    for (int align = bytes[PRIMTYPE_PTR]; align >= 1; align /= 2) {
+        for (int i = 0; i < num_slots; ++i) {
+            if (slots[i].align == align) {
+                offset = Align(offset + slots[i].size, align);
+                slots[i].offset = offset;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_frame_vars; ++i) {
+        frame_vars[i].declarator->rbp_offset = slots[frame_vars[i].slot].offset;
+    }
+
+    Memory_Free(MEMORY_SYMBOLS, slots);
+    Memory_Free(MEMORY_SYMBOLS, order);
+    Memory_Free(MEMORY_SYMBOLS, frame_vars);
+    frame_vars = NULL;
+    num_frame_vars = 0;
+    return offset;
+}
+
+// Bytes above rbp: the return address, the saved rbp and the arguments passed on the stack
+int StackFrame_ArgsSize(struct FunctionDef *function) {
+    int num_stack_args = function->num_params > NUM_ARG_REGS ? function->num_params - NUM_ARG_REGS : 0;
+    return 16 + num_stack_args * 8;
+}
+
+static bool IsReg(struct Operand *operand, enum Reg reg) {
+    return operand->kind == OPERAND_REG && operand->reg == reg;
+}
+
+// Check whether an operand uses rbp or rsp in a way that cannot be rebased, such as mov rax, rsp
+static bool UsesFrameRegs(struct Operand *operand) {
+    if (operand->kind == OPERAND_REG) {
+        return operand->reg == REG_RBP || operand->reg == REG_RSP;
+    }
+    if (operand->kind == OPERAND_MEM) {
+        return operand->reg == REG_RSP || operand->index == REG_RBP || operand->index == REG_RSP;
+    }
+    return false;
+}
+
+// mov rsp, rbp / pop rbp
+static bool IsEpilogue(struct InstructionBuffer *buffer, int index) {
+    if (index + 1 >= buffer->count) {
+        return false;
+    }
+    struct Instruction *restore = &buffer->data[index];
+    struct Instruction *pop = &buffer->data[index + 1];
+    return restore->opcode == OP_MOV && IsReg(&restore->dst, REG_RSP) && IsReg(&restore->src, REG_RBP) &&
+           pop->opcode == OP_POP && IsReg(&pop->dst, REG_RBP);
+}
+
+static void SetInstruction(struct Instruction *instr, enum Opcode opcode, struct Operand dst, struct Operand src) {
+    instr->opcode = opcode;
+    instr->condition = COND_NONE;
+    instr->dst = dst;
+    instr->src = src;
+}
+
+// Address an rbp based operand through rsp, where rsp sits distance bytes below the return address.
+// Locals keep their offsets below the return address, while the arguments above it move down by the
+// saved rbp that is no longer pushed
+static void Rebase(struct Operand *operand, int distance) {
+    if (operand->kind != OPERAND_MEM || operand->reg != REG_RBP) {
+        return;
+    }
+    operand->reg = REG_RSP;
+    operand->value += distance + (operand->value >= 0 ? -8 : 0);
+}
+
+// Rewrite the finished code of a function to address its locals through rsp instead of rbp, or through
+// the red zone when it is a leaf, removing the frame pointer setup where it is not needed
+void StackFrame_Finalize(struct InstructionBuffer *buffer, int frame_size) {
+    int prologue = 0;
+    while (prologue < buffer->count &&
+           !(buffer->data[prologue].opcode == OP_PUSH && IsReg(&buffer->data[prologue].dst, REG_RBP))) {
+        prologue += 1;
+    }
+    if (prologue + 1 >= buffer->count) {
+        ReportInternalError("StackFrame::Finalize - missing prologue");
+    }
+
+    int body = prologue + 2;
+    int alloc = -1;
+    if (body < buffer->count && buffer->data[body].opcode == OP_SUB && IsReg(&buffer->data[body].dst, REG_RSP)) {
+        alloc = body++;
+    }
+
+    // Count the bytes pushed before each instruction, since rsp moves with them. Control flow only
+    // happens between statements, where nothing is pushed; code that breaks this keeps its frame pointer
+    int *depth = NEW_ARRAY(MEMORY_SYMBOLS, int, buffer->count);
+    int pushed = 0;
+    bool has_call = false;
+    bool has_push = false;
+    bool can_omit = true;
+    for (int i = body; i < buffer->count; ++i) {
+        struct Instruction *instr = &buffer->data[i];
+        depth[i] = pushed;
+        if (IsEpilogue(buffer, i)) {
+            can_omit = can_omit && pushed == 0;
+            i += 1;
+            continue;
+        }
+
+        if ((instr->opcode == OP_SUB || instr->opcode == OP_ADD) && IsReg(&instr->dst, REG_RSP) &&
+            instr->src.kind == OPERAND_IMM) {
+            // Padding and stack arguments of calls
+            pushed += instr->opcode == OP_SUB ? (int) instr->src.value : -(int) instr->src.value;
+            has_push = true;
+            continue;
+        }
+
+        switch (instr->opcode) {
+            case OP_PUSH:   { pushed += 8; has_push = true; } break;
+            case OP_POP:    { pushed -= 8; can_omit = can_omit && instr->dst.kind == OPERAND_REG; } break;
+            case OP_CALL:   { has_call = true; } break;
+            case OP_LABEL:
+            case OP_JCC:
+            case OP_JMP:
+            case OP_RET:    { can_omit = can_omit && pushed == 0; } break;
+            default:        break;
+        }
+        if (pushed < 0 || UsesFrameRegs(&instr->dst) || UsesFrameRegs(&instr->src)) {
+            can_omit = false;
+        }
+    }
+
+    // A leaf that pushes nothing keeps its locals in the 128 bytes below rsp without allocating them
+    bool red_zone = options.red_zone && !has_call && !has_push && frame_size <= STACK_FRAME_RED_ZONE;
+    if (!options.omit_frame_pointer || !can_omit) {
+        if (red_zone && alloc >= 0) {
+            buffer->data[alloc].opcode = OP_NOP;
+            InstructionBuffer_Compact(buffer);
+            num_red_zone_leaves += 1;
+        }
+        Memory_Free(MEMORY_SYMBOLS, depth);
+        return;
+    }
+
+    // Calls need rsp 16 byte aligned, and the return address leaves it 8 bytes off
+    int size = frame_size;
+    if (red_zone) {
+        size = 0;
+    } else if (has_call) {
+        size = Align(frame_size + 8, 16) - 8;
+    }
+
+    for (int i = body; i < buffer->count; ++i) {
+        if (IsEpilogue(buffer, i)) {
+            if (size > 0) {
+                SetInstruction(&buffer->data[i], OP_ADD, Operand_Reg(REG_RSP, 8), Operand_Imm(size));
+            } else {
+                buffer->data[i].opcode = OP_NOP;
+            }
+            buffer->data[i + 1].opcode = OP_NOP;
+            i += 1;
+            continue;
+        }
+        Rebase(&buffer->data[i].dst, size + depth[i]);
+        Rebase(&buffer->data[i].src, size + depth[i]);
+    }
+
+    if (size > 0) {
+        SetInstruction(&buffer->data[prologue], OP_SUB, Operand_Reg(REG_RSP, 8), Operand_Imm(size));
+    } else {
+        buffer->data[prologue].opcode = OP_NOP;
+    }
+    buffer->data[prologue + 1].opcode = OP_NOP;
+    if (alloc >= 0) {
+        buffer->data[alloc].opcode = OP_NOP;
+    }
+    InstructionBuffer_Compact(buffer);
+
+    num_frames_omitted += 1;
+    if (red_zone) num_red_zone_leaves += 1;
+    Memory_Free(MEMORY_SYMBOLS, depth);
+}
+
+// Print how many frames were shrunk or removed
+void StackFrame_PrintStats(FILE *file) {
+    fprintf(file, "stack-frame:\n");
+    fprintf(file, "  %-20s %d\n", "frames-omitted", num_frames_omitted);
+    fprintf(file, "  %-20s %d\n", "red-zone-leaves", num_red_zone_leaves);
+    fprintf(file, "  %-20s %d\n", "shared-slots", num_shared_slots);
+    fprintf(file, "  %-20s %d\n", "bytes-saved", num_bytes_saved);
+}
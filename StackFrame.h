@@ -0,0 +1,25 @@
+#ifndef BMS_STACK_FRAME_H
+#define BMS_STACK_FRAME_H
+
+#include "AstNode.h"
+#include "Instruction.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+#define STACK_FRAME_RED_ZONE 128        // Bytes below rsp that a leaf function may use without allocating them
+
+// Assign the stack slot of every local variable of a function, letting variables whose lifetimes do not
+// overlap share a slot, and return the size of the frame in bytes
+int StackFrame_Layout(struct FunctionDef *function, bool share_slots);
+
+// Bytes above rbp: the return address, the saved rbp and the arguments passed on the stack
+int StackFrame_ArgsSize(struct FunctionDef *function);
+
+// Rewrite the finished code of a function to address its locals through rsp instead of rbp, or through
+// the red zone when it is a leaf, removing the frame pointer setup where it is not needed
+void StackFrame_Finalize(struct InstructionBuffer *buffer, int frame_size);
+
+// Print how many frames were shrunk or removed
+void StackFrame_PrintStats(FILE *file);
+
+#endif // BMS_STACK_FRAME_H
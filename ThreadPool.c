@@ -0,0 +1,155 @@
+#include "ThreadPool.h"
+#include "Memory.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A batch of items shared by the workers, each taking the next index until none are left
+struct ThreadPoolBatch {
+    ThreadPoolTask task;
+    void *context;
+    int count;
+    atomic_int next;
+};
+
+// Workers wait between batches instead of ending, so a compile creates its threads once. The calling
+// thread only changes the workers while no batch is running.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers;
+static int num_workers;
+static struct ThreadPoolBatch *current_batch;
+static int generation;              // Batches started so far, workers wait for it to change
+static int num_finished;            // Workers done with the current batch
+static bool stopping;
+
+static int num_batches = 0;
+static int num_items = 0;
+static int max_threads = 0;
+static int num_threads_started = 0;
+
+static void Work(struct ThreadPoolBatch *batch) {
+    for (;;) {
+        int index = atomic_fetch_add(&batch->next, 1);
+        if (index >= batch->count) {
+            break;
+        }
+        batch->task(batch->context, index);
+    }
+}
+
+// Work on every batch started after the given generation, until the pool is shut down
+static void *WorkerMain(void *arg) {
+    int seen = (int) (intptr_t) arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&batch_ready, &lock);
+        }
+        if (generation == seen) {
+            break;
+        }
+        seen = generation;
+        struct ThreadPoolBatch *batch = current_batch;
+        pthread_mutex_unlock(&lock);
+        Work(batch);
+        pthread_mutex_lock(&lock);
+        num_finished += 1;
+        if (num_finished == num_workers) {
+            pthread_cond_signal(&batch_done);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Grow the pool to count workers. Threads that cannot be created leave their share to the others.
+static void StartWorkers(int count) {
+    if (count <= num_workers) {
+        return;
+    }
+    workers = (pthread_t *) Memory_Realloc(MEMORY_CODEGEN, workers, sizeof(pthread_t) * count);
+    while (num_workers < count) {
+        if (pthread_create(&workers[num_workers], NULL, WorkerMain, (void *) (intptr_t) generation) != 0) {
+            break;
+        }
+        num_workers += 1;
+        num_threads_started += 1;
+    }
+}
+
+// Call task for every index below count, spread over up to num_threads threads including the
+// calling one, and return once all calls have returned
+void ThreadPool_Run(int count, ThreadPoolTask task, void *context, int num_threads) {
+    struct ThreadPoolBatch batch = { task, context, count, 0 };
+    if (num_threads > count) {
+        num_threads = count;
+    }
+
+    // The calling thread works too, so a single thread runs everything in place
+    int used = 1;
+    if (num_threads > 1) {
+        StartWorkers(num_threads - 1);
+    }
+    if (num_threads > 1 && num_workers > 0) {
+        pthread_mutex_lock(&lock);
+        current_batch = &batch;
+        num_finished = 0;
+        generation += 1;
+        pthread_cond_broadcast(&batch_ready);
+        pthread_mutex_unlock(&lock);
+
+        Work(&batch);
+
+        pthread_mutex_lock(&lock);
+        while (num_finished < num_workers) {
+            pthread_cond_wait(&batch_done, &lock);
+        }
+        current_batch = NULL;
+        pthread_mutex_unlock(&lock);
+        used += num_workers;
+    } else {
+        Work(&batch);
+    }
+
+    num_batches += 1;
+    num_items += count;
+    if (used > max_threads) {
+        max_threads = used;
+    }
+}
+
+// End the workers, the next batch starts new ones
+void ThreadPool_Shutdown() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&batch_ready);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    Memory_Free(MEMORY_CODEGEN, workers);
+    workers = NULL;
+    num_workers = 0;
+    stopping = false;
+}
+
+// Number of processors online, the number of threads to use when none was chosen
+int ThreadPool_DefaultThreads() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+}
+
+// Print how many batches and items were run, the most threads used and how many were created
+void ThreadPool_PrintStats(FILE *file) {
+    fprintf(file, "thread-pool:\n");
+    fprintf(file, "  %-20s %d\n", "batches", num_batches);
+    fprintf(file, "  %-20s %d\n", "items", num_items);
+    fprintf(file, "  %-20s %d\n", "max-threads", max_threads);
+    fprintf(file, "  %-20s %d\n", "threads-started", num_threads_started);
+}
@@ -0,0 +1,24 @@
+#ifndef BMS_THREAD_POOL_H
+#define BMS_THREAD_POOL_H
+
+#include <stdio.h>
+
+// Work on one item of a batch, such as generating the code of one function
+typedef void (*ThreadPoolTask)(void *context, int index);
+
+// Call task for every index below count, spread over up to num_threads threads including the
+// calling one, and return once all calls have returned. Items are taken in index order but may
+// finish in any order, so each call must only write state of its own item. The worker threads are
+// kept for the following batches until ThreadPool_Shutdown.
+void ThreadPool_Run(int count, ThreadPoolTask task, void *context, int num_threads);
+
+// End the worker threads once no more batches are coming, such as at the end of a compile
+void ThreadPool_Shutdown();
+
+// Number of processors online, the number of threads to use when none was chosen
+int ThreadPool_DefaultThreads();
+
+// Print how many batches and items were run, the most threads used and how many were created
+void ThreadPool_PrintStats(FILE *file);
+
+#endif // BMS_THREAD_POOL_H
@@ -0,0 +1,406 @@
+#include "ValueNumbering.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "Vectorizer.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define VN_MIN_COST 2               // Cheaper expressions are recomputed rather than kept in a local
+
+// An expression whose value is available, numbered by the structure of its operands. The first
+// occurrence is turned into an assignment of a local once a second occurrence is found.
+struct ValueEntry {
+    struct Expr *key;               // Copy of the expression as first seen
+    struct Expr **slot;             // Where the first occurrence is evaluated
+    char identifier[TOKEN_MAX_IDENTIFIER_LENGTH];
+    enum PrimitiveType type;        // PRIMTYPE_INT or PRIMTYPE_PTR
+    bool has_load;
+    bool materialized;
+    bool valid;                     // Cleared when a store or call may change the value
+    int stmt_id;
+};
+
+// The available expressions form a scoped table following the dominator tree of the structured
+// AST: statements of a block dominate the ones after them, conditions dominate both branches and
+// loop headers dominate the body. Entries added in a branch or loop body are dropped on leaving
+// it, and everything a loop may change is invalidated before entering it since the back edge
+// reaches the header with those changes.
+static struct List values;          // struct ValueEntry *
+static struct FunctionDef *current_func;
+static struct List address_taken;   // Names of the locals whose address is taken
+static int current_stmt_id;
+
+static int num_temps = 0;
+static int num_local = 0;
+static int num_global = 0;
+static int num_loads = 0;
+
+static bool IsAddressTaken(char *identifier) {
+    for (int i = 0; i < address_taken.count; ++i) {
+        if (strcmp((char *) List_Get(&address_taken, i), identifier) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void CollectAddressTaken(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        List_Add(&address_taken, expr->lhs->str_value);
+    }
+}
+
+static void VisitAddressTaken(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CollectAddressTaken, data);
+}
+
+static bool HasLoad(struct Expr *expr) {
+    if (!expr) {
+        return false;
+    }
+    return expr->type == EXPR_DEREF || HasLoad(expr->lhs) || HasLoad(expr->rhs);
+}
+
+static bool UsesAddressTaken(struct Expr *expr) {
+    if (!expr) {
+        return false;
+    }
+    if (expr->type == EXPR_VAR) {
+        return IsAddressTaken(expr->str_value);
+    }
+    return UsesAddressTaken(expr->lhs) || UsesAddressTaken(expr->rhs);
+}
+
+// Array the address points into, or NULL when it is based on a pointer or unknown
+static char *FindArrayBase(struct Expr *address) {
+    if (address->type == EXPR_VAR) {
+        struct Declarator *declarator = AstUtils_FindDeclarator(current_func, address->str_value, NULL);
+        if (declarator && declarator->array_dimensions > 0 && declarator->pointer_inderection == 0) {
+            return address->str_value;
+        }
+        return NULL;
+    }
+    if (address->type == EXPR_ADD) {
+        char *base = FindArrayBase(address->lhs);
+        return base ? base : FindArrayBase(address->rhs);
+    }
+    return NULL;
+}
+
+// Check whether a store to an address may change a value read by an expression. Distinct local
+// arrays never overlap, anything involving a pointer may.
+static bool MayAlias(struct Expr *address, struct Expr *expr) {
+    if (!expr) {
+        return false;
+    }
+    if (expr->type == EXPR_DEREF) {
+        char *a = FindArrayBase(address);
+        char *b = FindArrayBase(expr->lhs);
+        if (!a || !b || strcmp(a, b) == 0) {
+            return true;
+        }
+    }
+    return MayAlias(address, expr->lhs) || MayAlias(address, expr->rhs);
+}
+
+// Invalidate the values a store to a variable may change
+static void KillVar(char *identifier) {
+    bool memory = IsAddressTaken(identifier);
+    for (int i = 0; i < values.count; ++i) {
+        struct ValueEntry *entry = (struct ValueEntry *) List_Get(&values, i);
+        if (AstUtils_ExprUsesVar(entry->key, identifier) || (memory && entry->has_load)) {
+            entry->valid = false;
+        }
+    }
+}
+
+// Invalidate the values a store through a pointer may change
+static void KillStore(struct Expr *address) {
+    for (int i = 0; i < values.count; ++i) {
+        struct ValueEntry *entry = (struct ValueEntry *) List_Get(&values, i);
+        if (MayAlias(address, entry->key) || UsesAddressTaken(entry->key)) {
+            entry->valid = false;
+        }
+    }
+}
+
+// Invalidate the values a call may change, which is any memory reachable through a pointer
+static void KillCall() {
+    for (int i = 0; i < values.count; ++i) {
+        struct ValueEntry *entry = (struct ValueEntry *) List_Get(&values, i);
+        if (entry->has_load || UsesAddressTaken(entry->key)) {
+            entry->valid = false;
+        }
+    }
+}
+
+static void KillEffects(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ASSIGN) {
+        if (expr->lhs->type == EXPR_VAR) {
+            KillVar(expr->lhs->str_value);
+        } else {
+            KillStore(expr->lhs->lhs);
+        }
+    } else if (expr->type == EXPR_FUNC_CALL) {
+        KillCall();
+    }
+}
+
+static void VisitKillEffects(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, KillEffects, data);
+}
+
+// Type of the value of an expression, or PRIMTYPE_INVALID when it cannot be kept in a local
+static enum PrimitiveType GetValueType(struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_NUM:  return PRIMTYPE_INT;
+        case EXPR_VAR: {
+            enum PrimitiveType type = PRIMTYPE_INVALID;
+            struct Declarator *declarator = AstUtils_FindDeclarator(current_func, expr->str_value, &type);
+            if (!declarator) {
+                return PRIMTYPE_INVALID;
+            }
+            if (declarator->array_dimensions > 0 || declarator->pointer_inderection > 0) {
+                return PRIMTYPE_PTR;
+            }
+            return PRIMTYPE_INT;
+        }
+        case EXPR_DEREF: {
+            // Char and int elements are loaded as int values
+            enum PrimitiveType type = expr->operand_type;
+            if (type == PRIMTYPE_INVALID) {
+                type = AstUtils_PointeeType(current_func, expr->lhs);
+            }
+            return type == PRIMTYPE_INT || type == PRIMTYPE_CHAR ? PRIMTYPE_INT : PRIMTYPE_INVALID;
+        }
+        case EXPR_ADD:
+        case EXPR_SUB: {
+            enum PrimitiveType lhs = GetValueType(expr->lhs);
+            enum PrimitiveType rhs = GetValueType(expr->rhs);
+            if (lhs == PRIMTYPE_INVALID || rhs == PRIMTYPE_INVALID || (lhs == PRIMTYPE_PTR && rhs == PRIMTYPE_PTR)) {
+                return PRIMTYPE_INVALID;
+            }
+            if (expr->type == EXPR_SUB && rhs == PRIMTYPE_PTR) {
+                return PRIMTYPE_INVALID;
+            }
+            return lhs == PRIMTYPE_PTR || rhs == PRIMTYPE_PTR ? PRIMTYPE_PTR : PRIMTYPE_INT;
+        }
+        case EXPR_PLUS:
+        case EXPR_NEG:  return GetValueType(expr->lhs) == PRIMTYPE_INT ? PRIMTYPE_INT : PRIMTYPE_INVALID;
+        case EXPR_MUL:
+        case EXPR_DIV: {
+            bool ints = GetValueType(expr->lhs) == PRIMTYPE_INT && GetValueType(expr->rhs) == PRIMTYPE_INT;
+            return ints ? PRIMTYPE_INT : PRIMTYPE_INVALID;
+        }
+        default:        return PRIMTYPE_INVALID;
+    }
+}
+
+// Rough number of instructions saved by not recomputing an expression
+static int GetCost(struct Expr *expr) {
+    if (!expr) {
+        return 0;
+    }
+    switch (expr->type) {
+        case EXPR_NUM:
+        case EXPR_VAR:  return 0;
+        case EXPR_DEREF:
+        case EXPR_MUL:
+        case EXPR_DIV:  return 2 + GetCost(expr->lhs) + GetCost(expr->rhs);
+        default:        return 1 + GetCost(expr->lhs) + GetCost(expr->rhs);
+    }
+}
+
+static bool IsCandidate(struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_DEREF:
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_MUL:
+        case EXPR_DIV:
+        case EXPR_NEG:  break;
+        default:        return false;
+    }
+    return GetCost(expr) >= VN_MIN_COST && AstUtils_IsPure(expr) && GetValueType(expr) != PRIMTYPE_INVALID;
+}
+
+static struct ValueEntry *FindValue(struct Expr *expr) {
+    for (int i = values.count - 1; i >= 0; --i) {
+        struct ValueEntry *entry = (struct ValueEntry *) List_Get(&values, i);
+        if (entry->valid && AstUtils_ExprEquals(entry->key, expr)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct Expr *NewTempExpr(struct ValueEntry *entry) {
+    struct Expr *var = NewVariableExpr(entry->identifier);
+    var->operand_type = entry->type;
+    return var;
+}
+
+// Keep the value of the first occurrence in a local, as in (cse.0 = a[i]) * cse.0
+static void Materialize(struct ValueEntry *entry) {
+    if (entry->materialized) {
+        return;
+    }
+    snprintf(entry->identifier, sizeof(entry->identifier), "cse.%d", num_temps);
+    num_temps += 1;
+    AstUtils_AddLocal(current_func, entry->identifier, PRIMTYPE_INT, entry->type == PRIMTYPE_PTR ? 1 : 0);
+    *entry->slot = NewOperationExpr(EXPR_ASSIGN, NewTempExpr(entry), *entry->slot);
+    entry->materialized = true;
+}
+
+// Number the expressions of a tree in the order the code generator evaluates them, replacing
+// the ones already available by the local holding their value
+static void NumberExpr(struct Expr **slot) {
+    struct Expr *expr = *slot;
+    if (!expr) {
+        return;
+    }
+
+    if (IsCandidate(expr)) {
+        struct ValueEntry *entry = FindValue(expr);
+        if (entry) {
+            Materialize(entry);
+            *slot = NewTempExpr(entry);
+            if (entry->stmt_id == current_stmt_id) {
+                num_local += 1;
+            } else {
+                num_global += 1;
+            }
+            if (entry->has_load) {
+                num_loads += 1;
+            }
+            return;
+        }
+    }
+
+    // Copy the key before the operands are rewritten
+    struct Expr *key = IsCandidate(expr) ? AstUtils_CloneExpr(expr) : NULL;
+
+    switch (expr->type) {
+        case EXPR_FUNC_CALL: {
+            for (int i = 0; i < expr->args.count; ++i) {
+                NumberExpr((struct Expr **) &expr->args.data[i]);
+            }
+            KillCall();
+        } break;
+        case EXPR_ASSIGN: {
+            // The address of the target is computed before the value, the store happens last
+            if (expr->lhs->type == EXPR_DEREF) NumberExpr(&expr->lhs->lhs);
+            NumberExpr(&expr->rhs);
+            KillEffects(expr, NULL);
+        } break;
+        case EXPR_ADDR: {
+            // &a[i] computes the address of the element without loading it
+            if (expr->lhs->type == EXPR_DEREF) NumberExpr(&expr->lhs->lhs);
+        } break;
+        default: {
+            // Binary operators evaluate their right operand first
+            NumberExpr(&expr->rhs);
+            NumberExpr(&expr->lhs);
+        } break;
+    }
+
+    if (key) {
+        struct ValueEntry *entry = (struct ValueEntry *) Memory_Calloc(MEMORY_SYMBOLS, 1, sizeof(struct ValueEntry));
+        entry->key = key;
+        entry->slot = slot;
+        entry->type = GetValueType(key);
+        entry->has_load = HasLoad(key);
+        entry->valid = true;
+        entry->stmt_id = current_stmt_id;
+        List_Add(&values, entry);
+    }
+}
+
+static void NumberSlot(struct Expr **slot) {
+    current_stmt_id += 1;
+    NumberExpr(slot);
+}
+
+// Drop the entries added since a scope was entered, their first occurrence does not dominate
+// the code after it
+static void LeaveScope(int count) {
+    while (values.count > count) {
+        Memory_Free(MEMORY_SYMBOLS, List_Get(&values, values.count - 1));
+        List_Remove(&values, values.count - 1);
+    }
+}
+
+static void NumberStmt(struct AstNode *stmt) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                NumberStmt((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_VAR_DECLARATION: {
+            struct List *declarators = &((struct VarDeclaration *) stmt)->declarators;
+            for (int i = 0; i < declarators->count; ++i) {
+                NumberSlot(&((struct Declarator *) List_Get(declarators, i))->value);
+            }
+        } break;
+        case AST_EXPRESSION_STMT:   { NumberSlot(&((struct ExpressionStmt *) stmt)->expr); } break;
+        case AST_RETURN_STMT:       { NumberSlot(&((struct ReturnStmt *) stmt)->expr); } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            NumberSlot(&if_stmt->condition);
+            int count = values.count;
+            NumberStmt(if_stmt->stmt);
+            LeaveScope(count);
+            NumberStmt(if_stmt->else_branch);
+            LeaveScope(count);
+        } break;
+        case AST_WHILE_STMT: {
+            struct WhileStmt *while_stmt = (struct WhileStmt *) stmt;
+            AstUtils_WalkStmt(stmt, VisitKillEffects, NULL);
+            int count = values.count;
+            NumberSlot(&while_stmt->condition);
+            NumberStmt(while_stmt->stmt);
+            LeaveScope(count);
+        } break;
+        case AST_FOR_STMT: {
+            // The header is left alone so that the code generator still recognizes counted loops
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            AstUtils_WalkStmt(stmt, VisitKillEffects, NULL);
+            int count = values.count;
+            if (!Vectorizer_Find(for_stmt)) {
+                NumberStmt(for_stmt->stmt);
+            }
+            LeaveScope(count);
+        } break;
+    }
+}
+
+// Compute repeated expressions and loads once, keeping their value in a compiler generated local
+void ValueNumbering_Run(struct TranslationUnit *t_unit) {
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        current_func = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        List_Init(&address_taken);
+        List_Init(&values);
+        AstUtils_WalkStmt((struct AstNode *) current_func->body, VisitAddressTaken, NULL);
+
+        NumberStmt((struct AstNode *) current_func->body);
+
+        LeaveScope(0);
+        List_Free(&values);
+        List_Free(&address_taken);
+    }
+    current_func = NULL;
+}
+
+// Print how many expressions were eliminated
+void ValueNumbering_PrintStats(FILE *file) {
+    fprintf(file, "value-numbering:\n");
+    fprintf(file, "  %-20s %d\n", "eliminated-local", num_local);
+    fprintf(file, "  %-20s %d\n", "eliminated-global", num_global);
+    fprintf(file, "  %-20s %d\n", "loads-eliminated", num_loads);
+}
@@ -0,0 +1,13 @@
+#ifndef BMS_VALUE_NUMBERING_H
+#define BMS_VALUE_NUMBERING_H
+
+#include "AstNode.h"
+#include <stdio.h>
+
+// Compute repeated expressions and loads once, keeping their value in a compiler generated local
+void ValueNumbering_Run(struct TranslationUnit *t_unit);
+
+// Print how many expressions were eliminated
+void ValueNumbering_PrintStats(FILE *file);
+
+#endif // BMS_VALUE_NUMBERING_H
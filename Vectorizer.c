@@ -0,0 +1,390 @@
+#include "Vectorizer.h"
+#include "AstUtils.h"
+#include "Memory.h"
+#include "Options.h"
+#include "Register.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Static function declarations
+static void FindLoops(struct AstNode *stmt);
+
+static struct FunctionDef *current_func;
+static struct List address_taken;   // Names of the locals whose address is taken
+static struct List vector_loops;    // struct VectorLoop * of every function
+
+static int num_vectorized = 0;
+static int num_alias_checked = 0;
+
+static void CollectAddressTaken(struct Expr *expr, void *data) {
+    if (expr->type == EXPR_ADDR && expr->lhs->type == EXPR_VAR) {
+        List_Add(&address_taken, expr->lhs->str_value);
+    }
+}
+
+static void VisitAddressTaken(struct Expr **slot, void *data) {
+    AstUtils_WalkExpr(*slot, CollectAddressTaken, data);
+}
+
+static bool IsAddressTaken(char *identifier) {
+    for (int i = 0; i < address_taken.count; ++i) {
+        if (strcmp((char *) List_Get(&address_taken, i), identifier) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check for an int or char local that no pointer can change
+static bool IsScalarLocal(char *identifier) {
+    enum PrimitiveType type;
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, identifier, &type);
+    if (!declarator || (type != PRIMTYPE_INT && type != PRIMTYPE_CHAR)) {
+        return false;
+    }
+    return declarator->array_dimensions == 0 && declarator->pointer_inderection == 0 && !IsAddressTaken(identifier);
+}
+
+// Width of the elements of an int or char array or pointer, 0 for anything else
+static int GetElementSize(char *identifier, bool *is_pointer) {
+    enum PrimitiveType type;
+    struct Declarator *declarator = AstUtils_FindDeclarator(current_func, identifier, &type);
+    if (!declarator || (type != PRIMTYPE_INT && type != PRIMTYPE_CHAR)) {
+        return 0;
+    }
+
+    if (declarator->array_dimensions == 1 && declarator->pointer_inderection == 0) {
+        *is_pointer = false;
+    } else if (declarator->array_dimensions == 0 && declarator->pointer_inderection == 1 && !IsAddressTaken(identifier)) {
+        *is_pointer = true;
+    } else {
+        return 0;
+    }
+    return bytes[type];
+}
+
+// Match the address a + i * size of an element of an array or pointer, recording a as a base
+static struct VectorBase *MatchAccess(struct VectorLoop *loop, struct Expr *address) {
+    if (address->type != EXPR_ADD || address->lhs->type != EXPR_VAR) {
+        return NULL;
+    }
+
+    struct Expr *index = address->rhs;
+    long long scale = 1;
+    if (index->type == EXPR_MUL && index->rhs->type == EXPR_NUM) {
+        scale = index->rhs->int_value;
+        index = index->lhs;
+    }
+    if (index->type != EXPR_VAR || strcmp(index->str_value, loop->counter->str_value) != 0) {
+        return NULL;
+    }
+
+    // Every access of the loop must use the same element width so that the lanes line up
+    bool is_pointer;
+    int element_size = GetElementSize(address->lhs->str_value, &is_pointer);
+    if (element_size == 0 || element_size != scale) {
+        return NULL;
+    }
+    if (loop->element_size != 0 && loop->element_size != element_size) {
+        return NULL;
+    }
+    loop->element_size = element_size;
+
+    int i = Vectorizer_FindBase(loop, address);
+    if (i >= 0) {
+        return (struct VectorBase *) List_Get(&loop->bases, i);
+    }
+    if (loop->bases.count == VECTORIZER_MAX_BASES) {
+        return NULL;
+    }
+
+    struct VectorBase *base = (struct VectorBase *) Memory_Alloc(MEMORY_SYMBOLS, sizeof(struct VectorBase));
+    base->var = address->lhs;
+    base->is_pointer = is_pointer;
+    base->is_written = false;
+    List_Add(&loop->bases, base);
+    return base;
+}
+
+// Check that an expression can be computed in every lane at once, returning the number of
+// vector registers its evaluation needs, or 0 if it has to run one iteration at a time
+static int AnalyzeExpr(struct VectorLoop *loop, struct Expr *expr) {
+    switch (expr->type) {
+        case EXPR_VAR: {
+            if (strcmp(expr->str_value, loop->counter->str_value) == 0 || !IsScalarLocal(expr->str_value)) {
+                return 0;
+            }
+        } // Fallthrough
+        case EXPR_NUM: {
+            if (Vectorizer_FindInvariant(loop, expr) < 0) {
+                List_Add(&loop->invariants, expr);
+            }
+        } return 1;
+        case EXPR_DEREF: {
+        } return MatchAccess(loop, expr->lhs) ? 1 : 0;
+        case EXPR_PLUS: {
+        } return AnalyzeExpr(loop, expr->lhs);
+        case EXPR_NEG: {
+            // Computed as 0 - x
+            int operand = AnalyzeExpr(loop, expr->lhs);
+            return operand ? operand + 1 : 0;
+        }
+        case EXPR_MUL:
+        case EXPR_ADD:
+        case EXPR_SUB: {
+            int lhs = AnalyzeExpr(loop, expr->lhs);
+            int rhs = AnalyzeExpr(loop, expr->rhs);
+            if (!lhs || !rhs) {
+                return 0;
+            }
+
+            // SSE2 has no 32-bit multiply and there is no byte multiply at all
+            if (expr->type == EXPR_MUL && (!options.avx2 || loop->element_size != 4)) {
+                return 0;
+            }
+
+            // A broadcast invariant is used directly as the second operand
+            if (Vectorizer_FindInvariant(loop, expr->rhs) >= 0) {
+                return lhs;
+            }
+            return lhs > rhs + 1 ? lhs : rhs + 1;
+        }
+        default: {
+        } return 0;
+    }
+}
+
+static void FreeLoop(struct VectorLoop *loop) {
+    for (int i = 0; i < loop->bases.count; ++i) {
+        Memory_Free(MEMORY_SYMBOLS, List_Get(&loop->bases, i));
+    }
+    List_Free(&loop->stores);
+    List_Free(&loop->bases);
+    List_Free(&loop->invariants);
+    Memory_Free(MEMORY_SYMBOLS, loop);
+}
+
+// Collect the expressions of a body made only of expression statements
+static bool CollectStatements(struct AstNode *stmt, struct List *exprs) {
+    switch (stmt->type) {
+        case AST_EXPRESSION_STMT: {
+            List_Add(exprs, ((struct ExpressionStmt *) stmt)->expr);
+        } return true;
+        case AST_NULL_STMT: {
+        } return true;
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                if (!CollectStatements((struct AstNode *) List_Get(body, i), exprs)) {
+                    return false;
+                }
+            }
+        } return true;
+        default: {
+        } return false;
+    }
+}
+
+// Check the loop control and body of a for loop, returning its vectorization plan
+static struct VectorLoop *AnalyzeLoop(struct ForStmt *for_stmt) {
+    struct Expr *step = for_stmt->loop_expr;
+    struct Expr *cond = for_stmt->cond_expr;
+    if (!step || !cond || step->type != EXPR_ASSIGN || step->lhs->type != EXPR_VAR) {
+        return NULL;
+    }
+
+    // i = i + 1 with an int counter
+    char *counter = step->lhs->str_value;
+    struct Expr *rhs = step->rhs;
+    if (rhs->type != EXPR_ADD || rhs->lhs->type != EXPR_VAR || strcmp(rhs->lhs->str_value, counter) != 0 ||
+        rhs->rhs->type != EXPR_NUM || rhs->rhs->int_value != 1) {
+        return NULL;
+    }
+    enum PrimitiveType type;
+    AstUtils_FindDeclarator(current_func, counter, &type);
+    if (!IsScalarLocal(counter) || type != PRIMTYPE_INT) {
+        return NULL;
+    }
+
+    // i < bound or i <= bound, where the body cannot change the bound
+    if ((cond->type != EXPR_LT && cond->type != EXPR_LTE) || cond->lhs->type != EXPR_VAR || strcmp(cond->lhs->str_value, counter) != 0) {
+        return NULL;
+    }
+    struct Expr *bound = cond->rhs;
+    if (bound->type != EXPR_NUM && (bound->type != EXPR_VAR || strcmp(bound->str_value, counter) == 0 || !IsScalarLocal(bound->str_value))) {
+        return NULL;
+    }
+
+    struct List exprs;
+    List_Init(&exprs);
+    bool simple_body = CollectStatements(for_stmt->stmt, &exprs);
+
+    struct VectorLoop *loop = (struct VectorLoop *) Memory_Calloc(MEMORY_SYMBOLS, 1, sizeof(struct VectorLoop));
+    loop->for_stmt = for_stmt;
+    loop->counter = step->lhs;
+    loop->bound = bound;
+    loop->inclusive = cond->type == EXPR_LTE;
+    List_Init(&loop->stores);
+    List_Init(&loop->bases);
+    List_Init(&loop->invariants);
+
+    // Only a[i] = expr, which leaves no dependence between iterations as every access uses index i
+    bool vectorizable = simple_body && exprs.count > 0;
+    for (int i = 0; vectorizable && i < exprs.count; ++i) {
+        struct Expr *expr = (struct Expr *) List_Get(&exprs, i);
+        if (expr->type != EXPR_ASSIGN || expr->lhs->type != EXPR_DEREF) {
+            vectorizable = false;
+            break;
+        }
+
+        struct Expr *store = AstUtils_CloneExpr(expr);
+        struct VectorBase *base = MatchAccess(loop, store->lhs->lhs);
+        int temps = base ? AnalyzeExpr(loop, store->rhs) : 0;
+        if (!temps) {
+            vectorizable = false;
+            break;
+        }
+        base->is_written = true;
+        loop->temps = temps > loop->temps ? temps : loop->temps;
+        List_Add(&loop->stores, store);
+    }
+    List_Free(&exprs);
+
+    if (vectorizable) {
+        loop->lanes = (options.avx2 ? 32 : 16) / loop->element_size;
+        vectorizable = loop->temps + loop->invariants.count <= VECTORIZER_NUM_REGS;
+    }
+
+    // Loops known to run fewer iterations than a vector holds are left alone
+    struct Expr *init = for_stmt->init_expr;
+    if (vectorizable && bound->type == EXPR_NUM && init && init->type == EXPR_ASSIGN && init->lhs->type == EXPR_VAR &&
+        strcmp(init->lhs->str_value, counter) == 0 && init->rhs->type == EXPR_NUM) {
+        long long trips = (long long) bound->int_value - init->rhs->int_value + (loop->inclusive ? 1 : 0);
+        vectorizable = trips >= loop->lanes;
+    }
+
+    if (!vectorizable) {
+        FreeLoop(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+// Check whether a vector loop needs runtime checks that its pointers do not overlap
+static bool NeedsAliasChecks(struct VectorLoop *loop) {
+    for (int i = 0; i < loop->bases.count; ++i) {
+        for (int j = i + 1; j < loop->bases.count; ++j) {
+            if (Vectorizer_MayAlias((struct VectorBase *) List_Get(&loop->bases, i), (struct VectorBase *) List_Get(&loop->bases, j))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void FindLoops(struct AstNode *stmt) {
+    if (!stmt) {
+        return;
+    }
+
+    switch (stmt->type) {
+        case AST_COMPOUND_STMT: {
+            struct List *body = &((struct CompoundStmt *) stmt)->body;
+            for (int i = 0; i < body->count; ++i) {
+                FindLoops((struct AstNode *) List_Get(body, i));
+            }
+        } break;
+        case AST_IF_STMT: {
+            struct IfStmt *if_stmt = (struct IfStmt *) stmt;
+            FindLoops(if_stmt->stmt);
+            FindLoops(if_stmt->else_branch);
+        } break;
+        case AST_WHILE_STMT: {
+            FindLoops(((struct WhileStmt *) stmt)->stmt);
+        } break;
+        case AST_FOR_STMT: {
+            struct ForStmt *for_stmt = (struct ForStmt *) stmt;
+            struct VectorLoop *loop = AnalyzeLoop(for_stmt);
+            if (!loop) {
+                FindLoops(for_stmt->stmt);
+                break;
+            }
+            List_Add(&vector_loops, loop);
+            num_vectorized += 1;
+            if (NeedsAliasChecks(loop)) {
+                num_alias_checked += 1;
+            }
+        } break;
+    }
+}
+
+// Find the loops that can be vectorized, the other loop passes leave these loops unchanged
+void Vectorizer_Run(struct TranslationUnit *t_unit) {
+    Vectorizer_Free();
+    List_Init(&vector_loops);
+    for (int i = 0; i < t_unit->functions.count; ++i) {
+        current_func = (struct FunctionDef *) List_Get(&t_unit->functions, i);
+        List_Init(&address_taken);
+        AstUtils_WalkStmt((struct AstNode *) current_func->body, VisitAddressTaken, NULL);
+
+        FindLoops((struct AstNode *) current_func->body);
+
+        List_Free(&address_taken);
+        current_func = NULL;
+    }
+}
+
+// Vectorization plan for a loop, or NULL if it runs one iteration at a time
+struct VectorLoop *Vectorizer_Find(struct ForStmt *for_stmt) {
+    for (int i = 0; i < vector_loops.count; ++i) {
+        struct VectorLoop *loop = (struct VectorLoop *) List_Get(&vector_loops, i);
+        if (loop->for_stmt == for_stmt) {
+            return loop;
+        }
+    }
+    return NULL;
+}
+
+// Release the plans of the last run, whose loops are gone once the translation unit is freed
+void Vectorizer_Free() {
+    for (int i = 0; i < vector_loops.count; ++i) {
+        FreeLoop((struct VectorLoop *) List_Get(&vector_loops, i));
+    }
+    List_Free(&vector_loops);
+}
+
+// Index of the array or pointer an address such as a + i * 4 is based on
+int Vectorizer_FindBase(struct VectorLoop *loop, struct Expr *address) {
+    for (int i = 0; i < loop->bases.count; ++i) {
+        struct VectorBase *base = (struct VectorBase *) List_Get(&loop->bases, i);
+        if (strcmp(base->var->str_value, address->lhs->str_value) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Check whether the elements of two bases may overlap with one of them written, needing a runtime check
+bool Vectorizer_MayAlias(struct VectorBase *a, struct VectorBase *b) {
+    return a != b && (a->is_written || b->is_written) && (a->is_pointer || b->is_pointer);
+}
+
+// Index of a constant or local in the broadcast invariants, or -1 if it is computed per lane
+int Vectorizer_FindInvariant(struct VectorLoop *loop, struct Expr *expr) {
+    if (expr->type != EXPR_NUM && expr->type != EXPR_VAR) {
+        return -1;
+    }
+    for (int i = 0; i < loop->invariants.count; ++i) {
+        if (AstUtils_ExprEquals((struct Expr *) List_Get(&loop->invariants, i), expr)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Print how many loops were vectorized
+void Vectorizer_PrintStats(FILE *file) {
+    fprintf(file, "vectorizer:\n");
+    fprintf(file, "  %-20s %d\n", "vectorized", num_vectorized);
+    fprintf(file, "  %-20s %d\n", "alias-checked", num_alias_checked);
+}
@@ -0,0 +1,54 @@
+#ifndef BMS_VECTORIZER_H
+#define BMS_VECTORIZER_H
+
+#include "AstNode.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// An int or char array, or a pointer to one, indexed by the loop counter
+struct VectorBase {
+    struct Expr *var;
+    bool is_pointer;
+    bool is_written;
+};
+
+// A loop for (i = ...; i < bound; i = i + 1) whose body only assigns a[i] = expr, where every
+// array access uses the index i, so that consecutive iterations can run in the lanes of a vector
+struct VectorLoop {
+    struct ForStmt *for_stmt;
+    struct Expr *counter;           // The loop variable i
+    struct Expr *bound;             // Constant or loop invariant local
+    bool inclusive;                 // i <= bound instead of i < bound
+    int element_size;               // 1 for char elements, 4 for int elements
+    int lanes;                      // Iterations per vector instruction
+    int temps;                      // Vector registers needed to evaluate the widest statement
+    struct List stores;             // Copies of the a[i] = expr assignments of the body
+    struct List bases;              // struct VectorBase *, at most VECTORIZER_MAX_BASES
+    struct List invariants;         // Constants and locals broadcast to every lane before the loop
+};
+
+#define VECTORIZER_MAX_BASES 6      // Arrays and pointers kept in general purpose registers
+#define VECTORIZER_NUM_REGS 16      // xmm0 to xmm15
+
+// Find the loops that can be vectorized, the other loop passes leave these loops unchanged
+void Vectorizer_Run(struct TranslationUnit *t_unit);
+
+// Vectorization plan for a loop, or NULL if it runs one iteration at a time
+struct VectorLoop *Vectorizer_Find(struct ForStmt *for_stmt);
+
+// Release the vectorization plans, after code generation has used them
+void Vectorizer_Free();
+
+// Index of the array or pointer an address such as a + i * 4 is based on
+int Vectorizer_FindBase(struct VectorLoop *loop, struct Expr *address);
+
+// Check whether the elements of two bases may overlap with one of them written, needing a runtime check
+bool Vectorizer_MayAlias(struct VectorBase *a, struct VectorBase *b);
+
+// Index of a constant or local in the broadcast invariants, or -1 if it is computed per lane
+int Vectorizer_FindInvariant(struct VectorLoop *loop, struct Expr *expr);
+
+// Print how many loops were vectorized
+void Vectorizer_PrintStats(FILE *file);
+
+#endif // BMS_VECTORIZER_H
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_REPEAT 3
+#define PATH_LENGTH 1024
+#define COMMAND_LENGTH (8 * PATH_LENGTH)
+
+// A program of the suite, read from <kernel directory>/<name>.bms. Kernels are also valid C, so the
+// system compiler builds the reference they are checked against.
+struct Kernel {
+    char *name;
+    char *description;
+};
+
+// Settings of the suite, chosen on the command line
+struct BenchmarkSettings {
+    char *compiler;                 // BMS compiler to measure
+    char *cc;                       // System C compiler, builds the references and links
+    char *cc_flags;                 // Flags of the reference builds
+    char *kernel_dir;
+    int repeat;                     // Runs of every program, the fastest is reported
+    bool json;
+    bool use_nasm;                  // Assemble the -S output with nasm instead of writing objects with -c
+    bool keep_files;                // Leave the programs and their outputs in the work directory
+};
+
+// One program run to completion
+struct RunResult {
+    int exit_code;                  // 128 + the signal if it was killed
+    double seconds;                 // Wall time of the fastest run
+    long long instructions;         // User space instructions retired by that run, -1 without perf counters
+};
+
+// How one kernel did at one optimization level
+struct LevelResult {
+    char *level;
+    char *status;                   // "ok", or the step that failed
+    struct RunResult run;
+};
+
+static struct Kernel kernels[] = {
+    { "array_loops",    "element-wise updates, reductions and prefix sums over int and char arrays" },
+    { "recursion",      "Fibonacci, Ackermann, Euclid and the towers of Hanoi" },
+    { "arithmetic",     "Collatz chains, Newton square roots and a modular hash" },
+    { "printf_output",  "formatted output of numbers and strings through printf" },
+    { "sieve",          "sieve of Eratosthenes over a char array" },
+    { "matrix",         "multiplication of 120 x 120 int matrices" },
+    { "tail_calls",     "tail calls of printf with local char arrays as format and argument" },
+};
+
+static char *all_levels[] = { "-O0", "-O1", "-O2", "-O3", "-Os" };
+
+#define NUM_KERNELS ((int) (sizeof(kernels) / sizeof(kernels[0])))
+#define NUM_LEVELS ((int) (sizeof(all_levels) / sizeof(all_levels[0])))
+
+static struct BenchmarkSettings settings = {
+    .compiler = "./compiler",
+    .cc = "cc",
+    .cc_flags = "-O2",
+    .kernel_dir = "benchmarks/kernels",
+    .repeat = DEFAULT_REPEAT,
+};
+
+static char work_dir[] = "/tmp/bms-benchmark-XXXXXX";
+static bool perf_counters = true;   // Cleared by the first run the instructions cannot be counted for
+
+static void PrintUsage(FILE *file) {
+    fprintf(file,
+        "usage: code_benchmark [options] [-O0 -O1 -O2 -O3 -Os]\n"
+        "  --compiler=PATH      BMS compiler to measure (default ./compiler)\n"
+        "  --cc=PATH            C compiler building the references and linking (default cc)\n"
+        "  --cc-flags=FLAGS     flags of the reference builds (default -O2)\n"
+        "  --kernels=DIR        directory of the kernels (default benchmarks/kernels)\n"
+        "  --kernel=NAME        run only this kernel, may be repeated\n"
+        "  --repeat=N           run every program N times and keep the fastest (default %d)\n"
+        "  --nasm               assemble -S output with nasm instead of writing objects with -c\n"
+        "  --json               print the results as JSON instead of a table\n"
+        "  --keep               keep the programs and their outputs in the work directory\n"
+        "Without -O options every optimization level is measured.\n",
+        DEFAULT_REPEAT);
+}
+
+static double Now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+// Path of a file of a kernel in the work directory, such as array_loops-O2.out
+static void WorkPath(char *path, char *name, char *level, char *suffix) {
+    snprintf(path, PATH_LENGTH, "%s/%s%s%s", work_dir, name, level, suffix);
+}
+
+// Check whether a program was built and run, even if it gave the wrong result
+static bool HasRun(char *status) {
+    return strcmp(status, "compile-error") != 0 && strcmp(status, "link-error") != 0 && strcmp(status, "run-error") != 0;
+}
+
+// Run a shell command, returning whether it succeeded
+static bool RunCommand(char *command) {
+    int status = system(command);
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Count the user space instructions of a process from its next exec on, or return -1 if the kernel
+// offers no such counter
+static int OpenInstructionCounter(pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// Run a program once with its output going to a file. The child waits on a pipe until the counter
+// is attached, so the count starts with its exec.
+static bool RunOnce(char *program, char *output_path, struct RunResult *result) {
+    int ready[2];
+    if (pipe(ready) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(ready[0]);
+        close(ready[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(ready[1]);
+        char byte;
+        if (read(ready[0], &byte, 1) != 1) {
+            _exit(127);
+        }
+        int output = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output < 0 || dup2(output, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(output);
+        execl(program, program, (char *) NULL);
+        _exit(127);
+    }
+
+    close(ready[0]);
+    int counter = OpenInstructionCounter(pid);
+    double start = Now();
+    if (write(ready[1], "x", 1) != 1) {
+        kill(pid, SIGKILL);
+    }
+    close(ready[1]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    result->seconds = Now() - start;
+    result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    result->instructions = -1;
+    if (counter >= 0) {
+        long long count = 0;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+            result->instructions = count;
+        }
+        close(counter);
+    }
+    if (result->instructions < 0) {
+        perf_counters = false;
+    }
+    return true;
+}
+
+// Run a program settings.repeat times, keeping the fastest run
+static bool RunProgram(char *program, char *output_path, struct RunResult *result) {
+    for (int i = 0; i < settings.repeat; ++i) {
+        struct RunResult run;
+        if (!RunOnce(program, output_path, &run)) {
+            return false;
+        }
+        if (i == 0 || run.seconds < result->seconds) {
+            *result = run;
+        }
+    }
+    return true;
+}
+
+static bool SameContents(char *path_a, char *path_b) {
+    FILE *a = fopen(path_a, "rb");
+    FILE *b = fopen(path_b, "rb");
+    bool same = a && b;
+    while (same) {
+        int c = fgetc(a);
+        same = c == fgetc(b);
+        if (c == EOF) {
+            break;
+        }
+    }
+    if (a) fclose(a);
+    if (b) fclose(b);
+    return same;
+}
+
+// Build a kernel with the system C compiler and run it, the output every level is compared with
+static char *RunReference(struct Kernel *kernel, char *source, struct RunResult *result) {
+    char program[PATH_LENGTH];
+    char output[PATH_LENGTH];
+    char command[COMMAND_LENGTH];
+    WorkPath(program, kernel->name, "-cc", "");
+    WorkPath(output, kernel->name, "-cc", ".out");
+
+    // BMS calls printf without declaring it
+    snprintf(command, sizeof(command), "%s %s -w -include stdio.h -x c '%s' -o '%s'", settings.cc,
+        settings.cc_flags, source, program);
+    if (!RunCommand(command)) {
+        return "compile-error";
+    }
+    if (!RunProgram(program, output, result)) {
+        return "run-error";
+    }
+    return "ok";
+}
+
+// Compile, assemble and link a kernel at one optimization level, run it and check it against the
+// reference
+static char *RunLevel(struct Kernel *kernel, char *source, char *level, struct RunResult *reference, struct RunResult *result) {
+    char object[PATH_LENGTH];
+    char assembly[PATH_LENGTH];
+    char program[PATH_LENGTH];
+    char output[PATH_LENGTH];
+    char reference_output[PATH_LENGTH];
+    char command[COMMAND_LENGTH];
+    WorkPath(object, kernel->name, level, ".o");
+    WorkPath(assembly, kernel->name, level, ".asm");
+    WorkPath(program, kernel->name, level, "");
+    WorkPath(output, kernel->name, level, ".out");
+    WorkPath(reference_output, kernel->name, "-cc", ".out");
+
+    if (settings.use_nasm) {
+        snprintf(command, sizeof(command), "'%s' -S %s '%s' -o '%s' && nasm -felf64 '%s' -o '%s'", settings.compiler,
+            level, source, assembly, assembly, object);
+    } else {
+        snprintf(command, sizeof(command), "'%s' -c %s '%s' -o '%s'", settings.compiler, level, source, object);
+    }
+    if (!RunCommand(command)) {
+        return "compile-error";
+    }
+    snprintf(command, sizeof(command), "%s -no-pie '%s' -o '%s'", settings.cc, object, program);
+    if (!RunCommand(command)) {
+        return "link-error";
+    }
+    if (!RunProgram(program, output, result)) {
+        return "run-error";
+    }
+
+    if (!reference) {
+        return "unchecked";
+    }
+    if (result->exit_code != reference->exit_code) {
+        return "wrong-exit-code";
+    }
+    if (!SameContents(output, reference_output)) {
+        return "wrong-output";
+    }
+    return "ok";
+}
+
+static void RemoveWorkFiles(struct Kernel *kernel) {
+    static char *suffixes[] = { "", ".o", ".asm", ".out" };
+    char path[PATH_LENGTH];
+    for (int i = 0; i < 4; ++i) {
+        WorkPath(path, kernel->name, "-cc", suffixes[i]);
+        unlink(path);
+        for (int l = 0; l < NUM_LEVELS; ++l) {
+            WorkPath(path, kernel->name, all_levels[l], suffixes[i]);
+            unlink(path);
+        }
+    }
+}
+
+static void PrintJsonRun(FILE *file, struct RunResult *run) {
+    fprintf(file, "\"exit_code\": %d, \"seconds\": %.6f, \"instructions\": ", run->exit_code, run->seconds);
+    if (run->instructions >= 0) {
+        fprintf(file, "%lld", run->instructions);
+    } else {
+        fprintf(file, "null");
+    }
+}
+
+static void PrintTableRow(FILE *file, char *kernel, char *level, char *status, struct RunResult *run, struct RunResult *reference) {
+    fprintf(file, "%-16s %-5s %-16s", kernel, level, status);
+    if (!run) {
+        fprintf(file, "\n");
+        return;
+    }
+    fprintf(file, " %4d %10.4f", run->exit_code, run->seconds);
+    if (run->instructions >= 0) {
+        fprintf(file, " %15lld", run->instructions);
+    } else {
+        fprintf(file, " %15s", "-");
+    }
+    if (reference && reference->seconds > 0) {
+        fprintf(file, " %8.2f", run->seconds / reference->seconds);
+    }
+    fprintf(file, "\n");
+}
+
+int main(int argc, char **argv) {
+    char *levels[NUM_LEVELS];
+    int num_levels = 0;
+    bool selected[NUM_KERNELS];
+    bool any_selected = false;
+    memset(selected, 0, sizeof(selected));
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--compiler=", 11) == 0) {
+            settings.compiler = arg + 11;
+        } else if (strncmp(arg, "--cc=", 5) == 0) {
+            settings.cc = arg + 5;
+        } else if (strncmp(arg, "--cc-flags=", 11) == 0) {
+            settings.cc_flags = arg + 11;
+        } else if (strncmp(arg, "--kernels=", 10) == 0) {
+            settings.kernel_dir = arg + 10;
+        } else if (strncmp(arg, "--kernel=", 9) == 0) {
+            int k = 0;
+            while (k < NUM_KERNELS && strcmp(kernels[k].name, arg + 9) != 0) {
+                k += 1;
+            }
+            if (k == NUM_KERNELS) {
+                fprintf(stderr, "error: unknown kernel '%s'\n", arg + 9);
+                return 1;
+            }
+            selected[k] = true;
+            any_selected = true;
+        } else if (strncmp(arg, "--repeat=", 9) == 0) {
+            settings.repeat = atoi(arg + 9) > 0 ? atoi(arg + 9) : 1;
+        } else if (strcmp(arg, "--nasm") == 0) {
+            settings.use_nasm = true;
+        } else if (strcmp(arg, "--json") == 0) {
+            settings.json = true;
+        } else if (strcmp(arg, "--keep") == 0) {
+            settings.keep_files = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            PrintUsage(stdout);
+            return 0;
+        } else {
+            int l = 0;
+            while (l < NUM_LEVELS && strcmp(all_levels[l], arg) != 0) {
+                l += 1;
+            }
+            if (l == NUM_LEVELS) {
+                fprintf(stderr, "error: unknown option '%s'\n", arg);
+                PrintUsage(stderr);
+                return 1;
+            }
+            if (num_levels < NUM_LEVELS) {
+                levels[num_levels] = all_levels[l];
+                num_levels += 1;
+            }
+        }
+    }
+    if (num_levels == 0) {
+        memcpy(levels, all_levels, sizeof(all_levels));
+        num_levels = NUM_LEVELS;
+    }
+    if (!mkdtemp(work_dir)) {
+        fprintf(stderr, "error: cannot create a work directory\n");
+        return 1;
+    }
+
+    // The kernels write their output to files, so stdout gets only the results
+    FILE *out = stdout;
+    if (settings.json) {
+        fprintf(out, "{\n");
+        fprintf(out, "  \"benchmark\": \"generated-code\",\n");
+        fprintf(out, "  \"compiler\": \"%s\",\n", settings.compiler);
+        fprintf(out, "  \"reference\": \"%s %s\",\n", settings.cc, settings.cc_flags);
+        fprintf(out, "  \"repeat\": %d,\n", settings.repeat);
+        fprintf(out, "  \"kernels\": [\n");
+    } else {
+        fprintf(out, "%-16s %-5s %-16s %4s %10s %15s %8s\n", "kernel", "level", "status", "exit", "seconds",
+            "instructions", "vs-cc");
+    }
+
+    int num_failures = 0;
+    bool first_kernel = true;
+    for (int k = 0; k < NUM_KERNELS; ++k) {
+        if (any_selected && !selected[k]) {
+            continue;
+        }
+        struct Kernel *kernel = &kernels[k];
+        char source[PATH_LENGTH];
+        snprintf(source, sizeof(source), "%s/%s.bms", settings.kernel_dir, kernel->name);
+
+        struct RunResult reference;
+        char *reference_status = RunReference(kernel, source, &reference);
+        bool has_reference = strcmp(reference_status, "ok") == 0;
+
+        struct LevelResult results[NUM_LEVELS];
+        for (int l = 0; l < num_levels; ++l) {
+            results[l].level = levels[l];
+            results[l].status = RunLevel(kernel, source, levels[l], has_reference ? &reference : NULL, &results[l].run);
+            if (strcmp(results[l].status, "ok") != 0) {
+                num_failures += 1;
+            }
+        }
+
+        if (settings.json) {
+            fprintf(out, "%s    {\n", first_kernel ? "" : ",\n");
+            fprintf(out, "      \"name\": \"%s\",\n", kernel->name);
+            fprintf(out, "      \"description\": \"%s\",\n", kernel->description);
+            fprintf(out, "      \"reference\": { \"status\": \"%s\"", reference_status);
+            if (has_reference) {
+                fprintf(out, ", ");
+                PrintJsonRun(out, &reference);
+            }
+            fprintf(out, " },\n");
+            fprintf(out, "      \"levels\": [\n");
+            for (int l = 0; l < num_levels; ++l) {
+                struct LevelResult *result = &results[l];
+                fprintf(out, "        { \"level\": \"%s\", \"status\": \"%s\"", result->level, result->status);
+                if (HasRun(result->status)) {
+                    fprintf(out, ", ");
+                    PrintJsonRun(out, &result->run);
+                    if (has_reference && reference.seconds > 0) {
+                        fprintf(out, ", \"relative_to_reference\": %.3f", result->run.seconds / reference.seconds);
+                    }
+                }
+                fprintf(out, " }%s\n", l + 1 < num_levels ? "," : "");
+            }
+            fprintf(out, "      ]\n");
+            fprintf(out, "    }");
+        } else {
+            PrintTableRow(out, kernel->name, "cc", reference_status, has_reference ? &reference : NULL, NULL);
+            for (int l = 0; l < num_levels; ++l) {
+                struct LevelResult *result = &results[l];
+                PrintTableRow(out, kernel->name, result->level, result->status, HasRun(result->status) ? &result->run : NULL,
+                    has_reference ? &reference : NULL);
+            }
+        }
+        fflush(out);
+        first_kernel = false;
+
+        if (!settings.keep_files) {
+            RemoveWorkFiles(kernel);
+        }
+    }
+
+    if (settings.json) {
+        fprintf(out, "\n  ],\n");
+        fprintf(out, "  \"perf_counters\": %s,\n", perf_counters ? "true" : "false");
+        fprintf(out, "  \"failures\": %d\n", num_failures);
+        fprintf(out, "}\n");
+    } else {
+        if (!perf_counters) {
+            fprintf(out, "instructions not counted, perf counters are not available\n");
+        }
+        fprintf(out, "%d failures\n", num_failures);
+    }
+
+    if (settings.keep_files) {
+        fprintf(stderr, "programs kept in %s\n", work_dir);
+    } else {
+        rmdir(work_dir);
+    }
+    return num_failures > 0 ? 1 : 0;
+}
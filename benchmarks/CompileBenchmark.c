@@ -0,0 +1,233 @@
+#include "Assembly.h"
+#include "AstUtils.h"
+#include "CodeGeneratorX86.h"
+#include "Lexer.h"
+#include "Memory.h"
+#include "Options.h"
+#include "Parser.h"
+#include "SourceGenerator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_REPEAT 3
+#define DEFAULT_SEED 1
+
+// Throughput of the compiler on one generated program. The times are the fastest of the
+// repetitions, the one least disturbed by the rest of the machine.
+struct BenchmarkResult {
+    enum SourceShape shape;
+    int size;
+    int source_bytes;
+    int tokens;
+    int ast_nodes;                  // Statements and expressions of the parsed program
+    int instructions;               // Machine instructions generated, without labels and padding
+    double lex_seconds;
+    double parse_seconds;
+    double codegen_seconds;         // AST passes of the optimization level, code generation and output
+};
+
+static void PrintUsage(FILE *file) {
+    fprintf(file,
+        "usage: compile_benchmark [options] [compiler options]\n"
+        "  --shape=NAME         small-functions, deep-expressions, long-loops, macro-heavy or all (default)\n"
+        "  --size=N             size of the generated programs, each shape has its own default\n"
+        "  --repeat=N           measure every phase N times and keep the fastest (default %d)\n"
+        "  --seed=N             seed of the generated programs (default %d)\n"
+        "  --json               print the results as JSON instead of a table\n"
+        "  --emit               print the generated program instead of measuring it\n"
+        "Compiler options such as -O2, -c or -j4 select what code generation does.\n",
+        DEFAULT_REPEAT, DEFAULT_SEED);
+}
+
+static double Now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static int LexProgram(char *code, int length) {
+    struct Lexer lexer;
+    Lexer_Init(&lexer, code, length);
+    int count = 0;
+    while (Lexer_PeekToken(&lexer).type != TOKEN_END_OF_FILE) {
+        Lexer_EatToken(&lexer);
+        count += 1;
+    }
+    return count;
+}
+
+static struct TranslationUnit *ParseProgram(char *code, int length) {
+    struct Lexer lexer;
+    Lexer_Init(&lexer, code, length);
+    return Parser_MakeAst(&lexer);
+}
+
+// Generate code for the program into the void, the passes change the AST so each call needs a
+// translation unit of its own
+static void GenerateProgram(struct TranslationUnit *t_unit, FILE *sink) {
+    CodeGeneratorX86_GenerateCode(sink, t_unit);
+    fflush(sink);
+}
+
+static void Measure(struct BenchmarkResult *result, char *code, int length, int repeat, FILE *sink) {
+    result->lex_seconds = 0;
+    for (int i = 0; i < repeat; ++i) {
+        double start = Now();
+        result->tokens = LexProgram(code, length);
+        double seconds = Now() - start;
+        if (i == 0 || seconds < result->lex_seconds) result->lex_seconds = seconds;
+    }
+
+    struct TranslationUnit **t_units = NEW_ARRAY(MEMORY_AST, struct TranslationUnit *, repeat);
+    for (int i = 0; i < repeat; ++i) {
+        double start = Now();
+        t_units[i] = ParseProgram(code, length);
+        double seconds = Now() - start;
+        if (i == 0 || seconds < result->parse_seconds) result->parse_seconds = seconds;
+    }
+    int num_stmts = 0;
+    int num_exprs = 0;
+    AstUtils_CountNodes(t_units[0], &num_stmts, &num_exprs);
+    result->ast_nodes = num_stmts + num_exprs;
+
+    for (int i = 0; i < repeat; ++i) {
+        int instructions_before = GetNumInstructions();
+        double start = Now();
+        GenerateProgram(t_units[i], sink);
+        double seconds = Now() - start;
+        if (i == 0 || seconds < result->codegen_seconds) result->codegen_seconds = seconds;
+        result->instructions = GetNumInstructions() - instructions_before;
+    }
+    Memory_Free(MEMORY_AST, t_units);
+}
+
+static double PerSecond(int count, double seconds) {
+    return seconds > 0 ? (double) count / seconds : 0;
+}
+
+static void PrintTable(FILE *file, struct BenchmarkResult *results, int num_results) {
+    fprintf(file, "%-18s %8s %10s %10s %12s %14s %14s %16s\n", "shape", "size", "bytes", "tokens", "ast-nodes",
+        "tokens/s", "ast-nodes/s", "instructions/s");
+    for (int i = 0; i < num_results; ++i) {
+        struct BenchmarkResult *result = &results[i];
+        fprintf(file, "%-18s %8d %10d %10d %12d %14.0f %14.0f %16.0f\n", SourceGenerator_ShapeName(result->shape),
+            result->size, result->source_bytes, result->tokens, result->ast_nodes,
+            PerSecond(result->tokens, result->lex_seconds), PerSecond(result->ast_nodes, result->parse_seconds),
+            PerSecond(result->instructions, result->codegen_seconds));
+    }
+}
+
+static void PrintJson(FILE *file, struct BenchmarkResult *results, int num_results, int repeat, unsigned seed) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"benchmark\": \"compile\",\n");
+    fprintf(file, "  \"optimization_level\": %d,\n", options.optimization_level);
+    fprintf(file, "  \"optimize_for_size\": %s,\n", options.optimize_for_size ? "true" : "false");
+    fprintf(file, "  \"emit_object\": %s,\n", options.emit_object ? "true" : "false");
+    fprintf(file, "  \"threads\": %d,\n", options.num_threads);
+    fprintf(file, "  \"repeat\": %d,\n", repeat);
+    fprintf(file, "  \"seed\": %u,\n", seed);
+    fprintf(file, "  \"results\": [\n");
+    for (int i = 0; i < num_results; ++i) {
+        struct BenchmarkResult *result = &results[i];
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"shape\": \"%s\",\n", SourceGenerator_ShapeName(result->shape));
+        fprintf(file, "      \"size\": %d,\n", result->size);
+        fprintf(file, "      \"source_bytes\": %d,\n", result->source_bytes);
+        fprintf(file, "      \"tokens\": %d,\n", result->tokens);
+        fprintf(file, "      \"ast_nodes\": %d,\n", result->ast_nodes);
+        fprintf(file, "      \"instructions\": %d,\n", result->instructions);
+        fprintf(file, "      \"lex_seconds\": %.6f,\n", result->lex_seconds);
+        fprintf(file, "      \"parse_seconds\": %.6f,\n", result->parse_seconds);
+        fprintf(file, "      \"codegen_seconds\": %.6f,\n", result->codegen_seconds);
+        fprintf(file, "      \"tokens_per_second\": %.0f,\n", PerSecond(result->tokens, result->lex_seconds));
+        fprintf(file, "      \"ast_nodes_per_second\": %.0f,\n", PerSecond(result->ast_nodes, result->parse_seconds));
+        fprintf(file, "      \"instructions_per_second\": %.0f\n", PerSecond(result->instructions, result->codegen_seconds));
+        fprintf(file, "    }%s\n", i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+int main(int argc, char **argv) {
+    bool all_shapes = true;
+    enum SourceShape selected_shape = SHAPE_SMALL_FUNCTIONS;
+    int size = 0;
+    int repeat = DEFAULT_REPEAT;
+    unsigned seed = DEFAULT_SEED;
+    bool json = false;
+    bool emit = false;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--shape=", 8) == 0) {
+            all_shapes = strcmp(arg + 8, "all") == 0;
+            if (!all_shapes && !SourceGenerator_FindShape(arg + 8, &selected_shape)) {
+                fprintf(stderr, "error: unknown shape '%s'\n", arg + 8);
+                return 1;
+            }
+        } else if (strncmp(arg, "--size=", 7) == 0) {
+            size = atoi(arg + 7);
+        } else if (strncmp(arg, "--repeat=", 9) == 0) {
+            repeat = atoi(arg + 9) > 0 ? atoi(arg + 9) : 1;
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            seed = (unsigned) strtoul(arg + 7, NULL, 10);
+        } else if (strcmp(arg, "--json") == 0) {
+            json = true;
+        } else if (strcmp(arg, "--emit") == 0) {
+            emit = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            PrintUsage(stdout);
+            return 0;
+        } else if (!Options_Parse(arg)) {
+            fprintf(stderr, "error: unknown option '%s'\n", arg);
+            PrintUsage(stderr);
+            return 1;
+        }
+    }
+
+    FILE *sink = fopen("/dev/null", "wb");
+    if (!emit && !sink) {
+        fprintf(stderr, "error: cannot open /dev/null\n");
+        return 1;
+    }
+
+    struct BenchmarkResult results[SHAPE_COUNT];
+    int num_results = 0;
+    for (int i = 0; i < SHAPE_COUNT; ++i) {
+        enum SourceShape shape = (enum SourceShape) i;
+        if (!all_shapes && shape != selected_shape) {
+            continue;
+        }
+
+        int shape_size = size > 0 ? size : SourceGenerator_DefaultSize(shape);
+        int length = 0;
+        char *code = SourceGenerator_Generate(shape, shape_size, seed, &length);
+        if (emit) {
+            fwrite(code, 1, length, stdout);
+            free(code);
+            continue;
+        }
+
+        struct BenchmarkResult *result = &results[num_results];
+        num_results += 1;
+        result->shape = shape;
+        result->size = shape_size;
+        result->source_bytes = length;
+        Measure(result, code, length, repeat, sink);
+        free(code);
+    }
+
+    if (!emit) {
+        if (json) {
+            PrintJson(stdout, results, num_results, repeat, seed);
+        } else {
+            PrintTable(stdout, results, num_results);
+        }
+    }
+    if (sink) {
+        fclose(sink);
+    }
+    return 0;
+}
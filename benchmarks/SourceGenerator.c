@@ -0,0 +1,319 @@
+#include "SourceGenerator.h"
+#include "ReportError.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_DEEP_FUNCTIONS 16       // Functions of the deep-expressions shape, each with one expression
+#define NUM_LOOP_FUNCTIONS 4        // Functions of the long-loops shape, each with one loop nest
+#define LOOP_ARRAY_SIZE 64          // Elements of the arrays the long-loops shape iterates over
+#define MACRO_STATEMENTS 16         // Statements of each function of the macro-heavy shape
+
+// Growable program text
+struct SourceText {
+    int capacity;
+    int count;
+    char *data;
+};
+
+static struct {
+    char *name;
+    int default_size;
+} shapes[SHAPE_COUNT] = {
+    [SHAPE_SMALL_FUNCTIONS]  = { "small-functions", 2000 },
+    [SHAPE_DEEP_EXPRESSIONS] = { "deep-expressions", 200 },
+    [SHAPE_LONG_LOOPS]       = { "long-loops", 500 },
+    [SHAPE_MACRO_HEAVY]      = { "macro-heavy", 500 },
+};
+
+static void Write(struct SourceText *text, char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text->data + text->count, text->capacity - text->count, format, args);
+        va_end(args);
+        if (length < 0) {
+            ReportInternalError("SourceGenerator::Write - cannot format '%s'", format);
+        }
+        if (text->count + length < text->capacity) {
+            text->count += length;
+            return;
+        }
+
+        text->capacity = text->capacity * 2 > text->count + length + 1 ? text->capacity * 2 : text->count + length + 1;
+        text->data = (char *) realloc(text->data, text->capacity);
+        if (!text->data) {
+            exit(1);
+        }
+    }
+}
+
+// xorshift32, so the programs do not depend on the C library's rand
+static unsigned NextRandom(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Random number from low to high, both included
+static int RandomBetween(unsigned *state, int low, int high) {
+    return low + (int) (NextRandom(state) % (unsigned) (high - low + 1));
+}
+
+static void WriteSmallFunction(struct SourceText *text, unsigned *state, int index) {
+    int variant = index == 0 ? 0 : RandomBetween(state, 0, 2);
+    switch (variant) {
+        case 0: {
+            Write(text, "int f%d(int a, int b) {\n", index);
+            Write(text, "    int c;\n");
+            Write(text, "    c = a * %d + b;\n", RandomBetween(state, 2, 9));
+            Write(text, "    c = c - c / 1000 * 1000;\n");
+            Write(text, "    if (c > %d) {\n", RandomBetween(state, 100, 900));
+            Write(text, "        c = c - %d;\n", RandomBetween(state, 1, 99));
+            Write(text, "    }\n");
+            Write(text, "    return c;\n");
+            Write(text, "}\n");
+        } break;
+        case 1: {
+            Write(text, "int f%d(int a, int b) {\n", index);
+            Write(text, "    int c;\n");
+            Write(text, "    int i;\n");
+            Write(text, "    c = a;\n");
+            Write(text, "    i = 0;\n");
+            Write(text, "    while (i < %d) {\n", RandomBetween(state, 2, 5));
+            Write(text, "        c = c + b * %d;\n", RandomBetween(state, 2, 9));
+            Write(text, "        i = i + 1;\n");
+            Write(text, "    }\n");
+            Write(text, "    return c - c / 1000 * 1000;\n");
+            Write(text, "}\n");
+        } break;
+        default: {
+            // Calls make the inliner and the call sequences part of the work
+            Write(text, "int f%d(int a, int b) {\n", index);
+            Write(text, "    return f%d(b, a + %d) - a / %d;\n", RandomBetween(state, 0, index - 1), RandomBetween(state, 1, 9), RandomBetween(state, 2, 9));
+            Write(text, "}\n");
+        } break;
+    }
+}
+
+static void WriteSmallFunctions(struct SourceText *text, unsigned *state, int size) {
+    for (int i = 0; i < size; ++i) {
+        WriteSmallFunction(text, state, i);
+    }
+
+    Write(text, "int main() {\n");
+    Write(text, "    int s;\n");
+    Write(text, "    s = 1;\n");
+    for (int i = 0; i < size; ++i) {
+        Write(text, "    s = f%d(s, %d);\n", i, RandomBetween(state, 1, 99));
+    }
+    Write(text, "    return s - s / 256 * 256;\n");
+    Write(text, "}\n");
+}
+
+static void WriteLeaf(struct SourceText *text, unsigned *state) {
+    switch (RandomBetween(state, 0, 3)) {
+        case 0:     { Write(text, "a"); } break;
+        case 1:     { Write(text, "b"); } break;
+        case 2:     { Write(text, "c"); } break;
+        default:    { Write(text, "%d", RandomBetween(state, 1, 99)); } break;
+    }
+}
+
+// Write an expression nested depth levels deep over the parameters a, b and c. One operand of
+// every operator is a leaf, so the text grows linearly with the depth.
+static void WriteDeepExpr(struct SourceText *text, unsigned *state, int depth) {
+    if (depth == 0) {
+        WriteLeaf(text, state);
+        return;
+    }
+
+    static char operators[] = { '+', '-', '*', '/' };
+    char operator = operators[RandomBetween(state, 0, 3)];
+    Write(text, "(");
+    if (operator == '/') {
+        // Divide by constants only, so the program never divides by zero
+        WriteDeepExpr(text, state, depth - 1);
+        Write(text, " / %d", RandomBetween(state, 1, 9));
+    } else if (RandomBetween(state, 0, 1) == 0) {
+        WriteDeepExpr(text, state, depth - 1);
+        Write(text, " %c ", operator);
+        WriteLeaf(text, state);
+    } else {
+        WriteLeaf(text, state);
+        Write(text, " %c ", operator);
+        WriteDeepExpr(text, state, depth - 1);
+    }
+    Write(text, ")");
+}
+
+static void WriteDeepExpressions(struct SourceText *text, unsigned *state, int size) {
+    for (int i = 0; i < NUM_DEEP_FUNCTIONS; ++i) {
+        Write(text, "int e%d(int a, int b, int c) {\n", i);
+        Write(text, "    return ");
+        WriteDeepExpr(text, state, size);
+        Write(text, ";\n");
+        Write(text, "}\n");
+    }
+
+    Write(text, "int main() {\n");
+    Write(text, "    int s;\n");
+    Write(text, "    s = 0;\n");
+    for (int i = 0; i < NUM_DEEP_FUNCTIONS; ++i) {
+        Write(text, "    s = s + e%d(%d, %d, %d);\n", i, RandomBetween(state, 1, 9), RandomBetween(state, 1, 9), RandomBetween(state, 1, 9));
+    }
+    Write(text, "    return s - s / 256 * 256;\n");
+    Write(text, "}\n");
+}
+
+static void WriteLoopStatement(struct SourceText *text, unsigned *state) {
+    switch (RandomBetween(state, 0, 5)) {
+        case 0:     { Write(text, "            a[i] = a[i] + b[i] * %d;\n", RandomBetween(state, 2, 9)); } break;
+        case 1:     { Write(text, "            b[i] = b[i] - a[i] / %d;\n", RandomBetween(state, 1, 9)); } break;
+        case 2:     { Write(text, "            s = s + a[i] - b[i];\n"); } break;
+        case 3:     { Write(text, "            t = t + s / %d;\n", RandomBetween(state, 1, 9)); } break;
+        case 4: {
+            Write(text, "            if (a[i] > b[i]) {\n");
+            Write(text, "                s = s + %d;\n", RandomBetween(state, 1, 99));
+            Write(text, "            } else {\n");
+            Write(text, "                s = s - %d;\n", RandomBetween(state, 1, 99));
+            Write(text, "            }\n");
+        } break;
+        default:    { Write(text, "            a[i] = a[i] - a[i] / 4096 * 4096;\n"); } break;
+    }
+}
+
+static void WriteLongLoops(struct SourceText *text, unsigned *state, int size) {
+    for (int f = 0; f < NUM_LOOP_FUNCTIONS; ++f) {
+        Write(text, "int loop%d(int n) {\n", f);
+        Write(text, "    int a[%d];\n", LOOP_ARRAY_SIZE);
+        Write(text, "    int b[%d];\n", LOOP_ARRAY_SIZE);
+        Write(text, "    int i;\n");
+        Write(text, "    int j;\n");
+        Write(text, "    int s;\n");
+        Write(text, "    int t;\n");
+        Write(text, "    s = 0;\n");
+        Write(text, "    t = %d;\n", RandomBetween(state, 1, 99));
+        Write(text, "    for (i = 0; i < %d; i = i + 1) {\n", LOOP_ARRAY_SIZE);
+        Write(text, "        a[i] = i * %d + %d;\n", RandomBetween(state, 2, 9), RandomBetween(state, 1, 99));
+        Write(text, "        b[i] = %d - i;\n", LOOP_ARRAY_SIZE);
+        Write(text, "    }\n");
+        Write(text, "    for (j = 0; j < n; j = j + 1) {\n");
+        Write(text, "        for (i = 0; i < %d; i = i + 1) {\n", LOOP_ARRAY_SIZE);
+        for (int i = 0; i < size; ++i) {
+            WriteLoopStatement(text, state);
+        }
+        Write(text, "        }\n");
+        Write(text, "        s = s - s / 65536 * 65536 + t;\n");
+        Write(text, "        t = t - t / 1024 * 1024;\n");
+        Write(text, "    }\n");
+        Write(text, "    return s;\n");
+        Write(text, "}\n");
+    }
+
+    Write(text, "int main() {\n");
+    Write(text, "    int s;\n");
+    Write(text, "    s = 0;\n");
+    for (int f = 0; f < NUM_LOOP_FUNCTIONS; ++f) {
+        Write(text, "    s = s + loop%d(%d);\n", f, RandomBetween(state, 5, 20));
+    }
+    Write(text, "    return s - s / 256 * 256;\n");
+    Write(text, "}\n");
+}
+
+// Every macro expands to a positive constant, so any of them can be a divisor
+static void WriteMacro(struct SourceText *text, unsigned *state, int index) {
+    switch (RandomBetween(state, 0, 2)) {
+        case 0:     { Write(text, "#define M%d %d\n", index, RandomBetween(state, 1, 999)); } break;
+        case 1:     { Write(text, "#define M%d (%d * %d + %d)\n", index, RandomBetween(state, 1, 99), RandomBetween(state, 1, 99), RandomBetween(state, 0, 99)); } break;
+        default:    { Write(text, "#define M%d (%d - %d)\n", index, RandomBetween(state, 100, 999), RandomBetween(state, 0, 99)); } break;
+    }
+}
+
+static void WriteMacroHeavy(struct SourceText *text, unsigned *state, int size) {
+    for (int i = 0; i < size; ++i) {
+        WriteMacro(text, state, i);
+    }
+
+    int num_functions = size / MACRO_STATEMENTS + 1;
+    for (int f = 0; f < num_functions; ++f) {
+        Write(text, "int m%d(int x) {\n", f);
+        Write(text, "    int y;\n");
+        Write(text, "    y = x + M%d;\n", RandomBetween(state, 0, size - 1));
+        for (int i = 0; i < MACRO_STATEMENTS; ++i) {
+            int a = RandomBetween(state, 0, size - 1);
+            int b = RandomBetween(state, 0, size - 1);
+            int c = RandomBetween(state, 0, size - 1);
+            switch (RandomBetween(state, 0, 2)) {
+                case 0:     { Write(text, "    y = y + M%d * M%d - M%d;\n", a, b, c); } break;
+                case 1:     { Write(text, "    y = y - y / M%d + M%d;\n", a, b); } break;
+                default:    { Write(text, "    y = y - y / 4096 * 4096 + M%d;\n", a); } break;
+            }
+        }
+        Write(text, "    return y;\n");
+        Write(text, "}\n");
+    }
+
+    Write(text, "int main() {\n");
+    Write(text, "    int s;\n");
+    Write(text, "    s = 0;\n");
+    for (int f = 0; f < num_functions; ++f) {
+        Write(text, "    s = m%d(s - s / 256 * 256);\n", f);
+    }
+    Write(text, "    return s - s / 256 * 256;\n");
+    Write(text, "}\n");
+}
+
+// Write a BMS program of the given shape, the same for the same size and seed. The text is null
+// terminated and must be freed by the caller.
+char *SourceGenerator_Generate(enum SourceShape shape, int size, unsigned seed, int *length) {
+    struct SourceText text = { 4096, 0, NULL };
+    text.data = (char *) malloc(text.capacity);
+    if (!text.data) {
+        exit(1);
+    }
+    text.data[0] = '\0';
+
+    // xorshift never leaves zero
+    unsigned state = seed != 0 ? seed : 1;
+    if (size < 1) {
+        size = 1;
+    }
+    switch (shape) {
+        case SHAPE_SMALL_FUNCTIONS:     { WriteSmallFunctions(&text, &state, size); } break;
+        case SHAPE_DEEP_EXPRESSIONS:    { WriteDeepExpressions(&text, &state, size); } break;
+        case SHAPE_LONG_LOOPS:          { WriteLongLoops(&text, &state, size); } break;
+        case SHAPE_MACRO_HEAVY:         { WriteMacroHeavy(&text, &state, size); } break;
+        default: {
+            ReportInternalError("SourceGenerator::Generate - unknown shape %d", shape);
+        } break;
+    }
+
+    *length = text.count;
+    return text.data;
+}
+
+// Size used when none is given, chosen so that every shape compiles in a comparable time
+int SourceGenerator_DefaultSize(enum SourceShape shape) {
+    return shapes[shape].default_size;
+}
+
+// Name of a shape as used on the command line and in reports, e.g. "small-functions"
+char *SourceGenerator_ShapeName(enum SourceShape shape) {
+    return shapes[shape].name;
+}
+
+// Look up a shape by its name, returning false if there is none
+bool SourceGenerator_FindShape(char *name, enum SourceShape *shape) {
+    for (int i = 0; i < SHAPE_COUNT; ++i) {
+        if (strcmp(shapes[i].name, name) == 0) {
+            *shape = (enum SourceShape) i;
+            return true;
+        }
+    }
+    return false;
+}
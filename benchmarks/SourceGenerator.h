@@ -0,0 +1,28 @@
+#ifndef BMS_SOURCE_GENERATOR_H
+#define BMS_SOURCE_GENERATOR_H
+
+#include <stdbool.h>
+
+// The kinds of programs the generator writes, each stressing other parts of the compiler
+enum SourceShape {
+    SHAPE_SMALL_FUNCTIONS,          // size functions of a few statements each, all called from main
+    SHAPE_DEEP_EXPRESSIONS,         // Expressions nested size levels deep
+    SHAPE_LONG_LOOPS,               // Nested loops over arrays with size statements in the inner body
+    SHAPE_MACRO_HEAVY,              // size #define constants, used by every statement
+    SHAPE_COUNT,
+};
+
+// Write a BMS program of the given shape, the same for the same size and seed. The text is null
+// terminated and must be freed by the caller.
+char *SourceGenerator_Generate(enum SourceShape shape, int size, unsigned seed, int *length);
+
+// Size used when none is given, chosen so that every shape compiles in a comparable time
+int SourceGenerator_DefaultSize(enum SourceShape shape);
+
+// Name of a shape as used on the command line and in reports, e.g. "small-functions"
+char *SourceGenerator_ShapeName(enum SourceShape shape);
+
+// Look up a shape by its name, returning false if there is none
+bool SourceGenerator_FindShape(char *name, enum SourceShape *shape);
+
+#endif // BMS_SOURCE_GENERATOR_H
@@ -1,11 +1,12 @@
 #include "Lexer.h"
+#include "Memory.h"
 #include "ReportError.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define NEW_TYPE(type) ((struct type *) malloc(sizeof(struct type)))
+#define NEW_TYPE(type) ((struct type *) Memory_Alloc(MEMORY_TOKENS, sizeof(struct type)))
 
 typedef bool (*IsAllowedInSequenceFunction)(char *);
 
@@ -203,7 +204,7 @@ static void ParseDirectiveValue(struct Lexer *l, char *value) {
         if (token.type == TOKEN_END_OF_FILE) {
             break;
         }
-        struct Token *t = (struct Token *) malloc(sizeof(struct Token));
+        struct Token *t = (struct Token *) Memory_Alloc(MEMORY_TOKENS, sizeof(struct Token));
         t->int_value = token.int_value;
         t->line = token.line;
         t->location = token.location;
@@ -212,6 +213,8 @@ static void ParseDirectiveValue(struct Lexer *l, char *value) {
         List_Add(&l->token_queue, t);
         Lexer_EatToken(&temp_l);
     }
+    List_Free(&temp_l.token_queue);
+    List_Free(&temp_l.directives);
 }
 
 void Lexer_EatToken(struct Lexer *l) {
@@ -227,6 +230,10 @@ void Lexer_EatToken(struct Lexer *l) {
         AddToken(l, *t);
         return;
     } else if (l->token_queue_tail == l->token_queue.count) {
+        // The expansion was copied into the token cache, so its tokens are no longer needed
+        for (int i = 0; i < l->token_queue.count; ++i) {
+            Memory_Free(MEMORY_TOKENS, List_Get(&l->token_queue, i));
+        }
         l->token_queue_tail = 0;
         l->token_queue.count = 0;
     } else {
@@ -1,14 +1,15 @@
 #include "List.h"
+#include "Memory.h"
 #include <stdlib.h>
 #include <string.h>
 
 // Reallocate memory for the list when capacity is exceeded
 static void Reallocate(struct List *l) {
     l->capacity = l->capacity == 0 ? 1 : l->capacity * 2; // Double the capacity
-    void **new_data = (void **) malloc(sizeof(void *) * l->capacity);
+    void **new_data = (void **) Memory_Alloc(MEMORY_LISTS, sizeof(void *) * l->capacity);
     if (l->data) {
         memcpy(new_data, l->data, l->count * sizeof(void *));
-        free(l->data);
+        Memory_Free(MEMORY_LISTS, l->data);
     }
     l->data = new_data;
 }
@@ -25,7 +26,7 @@ void List_Add(struct List *l, void *element) {
 // Free the list and its data
 void List_Free(struct List *l) {
     if (l->data) {
-        free(l->data);
+        Memory_Free(MEMORY_LISTS, l->data);
     }
     l->capacity = 0;
     l->count = 0;
@@ -44,7 +45,7 @@ void *List_Get(struct List *l, int index) {
 void List_Init(struct List *l) {
     l->capacity = 16; // Initial capacity
     l->count = 0;
-    l->data = malloc(sizeof(void *) * l->capacity);
+    l->data = Memory_Alloc(MEMORY_LISTS, sizeof(void *) * l->capacity);
     if (!l->data) {
         // Handle malloc failure
         exit(1);
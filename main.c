@@ -1,23 +1,200 @@
+#include "BytecodeGenerator.h"
+#include "CodeGeneratorX86.h"
+#include "Interpreter.h"
+#include "Jit.h"
 #include "Lexer.h"
+#include "Options.h"
+#include "Parser.h"
+#include "PassManager.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int main() {
-    // Test input
-    char code[] = "int main() { float x = 3.14; return 0; }";
+// What to do with the translation unit once it is parsed
+enum DriverMode {
+    MODE_COMPILE,                   // Write assembly text (-S) or an object file (-c)
+    MODE_RUN,                       // -run, compile into memory and call main
+    MODE_INTERPRET,                 // -interp, run main on the bytecode interpreter
+};
 
-    // Initialize the lexer
+static void PrintUsage(FILE *file) {
+    fprintf(file,
+        "usage: compiler [options] input.bms\n"
+        "  -o file              write the output to file instead of stdout\n"
+        "  -S, -c               write assembly text (default) or an ELF64 object\n"
+        "  -run                 compile into memory and exit with the result of main\n"
+        "  -interp              run main on the bytecode interpreter, -fstats adds its call profile\n"
+        "  -O0 -O1 -O2 -O3 -Os  optimization level, -fdump-passes prints its passes\n"
+        "  -ftime-report        print the time and memory of every phase and pass\n"
+        "  -fstats              print the counters of every pass\n"
+        "  --mem-report         print the allocations of every phase and subsystem\n"
+        "  --mem-report-json=F  write the same report as JSON to the file F\n"
+        "  -jN                  generate functions on N threads\n");
+}
+
+// Read a whole file into a null terminated buffer, or return NULL
+static char *ReadFile(char *path, int *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *code = size >= 0 ? (char *) malloc(size + 1) : NULL;
+    if (code && fread(code, 1, size, file) != (size_t) size) {
+        free(code);
+        code = NULL;
+    }
+    fclose(file);
+
+    if (code) {
+        code[size] = '\0';
+        *length = (int) size;
+    }
+    return code;
+}
+
+// Write the memory report as JSON, returning false if the file cannot be written
+static bool WriteMemoryJson(char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    PassManager_WriteMemoryJson(file);
+    return fclose(file) == 0;
+}
+
+// Compile into memory of this process and return the result of main
+static int RunJit(struct TranslationUnit *t_unit) {
+    struct JitCode jit;
+    Jit_Init(&jit);
+    JitFunction entry = CodeGeneratorX86_GenerateJit(&jit, t_unit);
+    if (!entry) {
+        fprintf(stderr, "error: main is not defined or an external function could not be resolved\n");
+        return 1;
+    }
+
+    PassManager_BeginPhase("run");
+    int result = entry();
+    fflush(stdout);
+    PassManager_EndPhase(NULL);
+    Jit_Free(&jit);
+    return result;
+}
+
+// Run main on the bytecode interpreter and return its result
+static int RunInterpreter(struct TranslationUnit *t_unit) {
+    struct BytecodeProgram program;
+    BytecodeProgram_Init(&program);
+    PassManager_BeginPhase("bytecode");
+    BytecodeGenerator_GenerateCode(&program, t_unit);
+    PassManager_EndPhase(NULL);
+
+    PassManager_BeginPhase("interpret");
+    int result = (int) Interpreter_Run(&program, "main");
+    fflush(stdout);
+    PassManager_EndPhase(NULL);
+
+    if (options.print_stats) {
+        BytecodeGenerator_PrintStats(stderr);
+        Interpreter_PrintStats(stderr);
+        Interpreter_PrintProfile(stderr, &program);
+    }
+    BytecodeProgram_Free(&program);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    enum DriverMode mode = MODE_COMPILE;
+    char *input_path = NULL;
+    char *output_path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            output_path = argv[i + 1];
+            i += 1;
+        } else if (strcmp(arg, "-run") == 0) {
+            mode = MODE_RUN;
+        } else if (strcmp(arg, "-interp") == 0) {
+            mode = MODE_INTERPRET;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            PrintUsage(stdout);
+            return 0;
+        } else if (arg[0] == '-') {
+            if (!Options_Parse(arg)) {
+                fprintf(stderr, "error: unknown option '%s'\n", arg);
+                PrintUsage(stderr);
+                return 1;
+            }
+        } else if (!input_path) {
+            input_path = arg;
+        } else {
+            fprintf(stderr, "error: more than one input file\n");
+            return 1;
+        }
+    }
+
+    if (options.dump_passes) {
+        PassManager_PrintPipeline(stderr);
+    }
+    if (!input_path) {
+        if (options.dump_passes) {
+            return 0;
+        }
+        PrintUsage(stderr);
+        return 1;
+    }
+
+    PassManager_BeginPhase("read");
+    int length = 0;
+    char *code = ReadFile(input_path, &length);
+    PassManager_EndPhase(NULL);
+    if (!code) {
+        fprintf(stderr, "error: cannot read '%s'\n", input_path);
+        return 1;
+    }
+
+    // The parser pulls its tokens from the lexer, so both are timed together
+    PassManager_BeginPhase("parse");
     struct Lexer lexer;
-    Lexer_Init(&lexer, code, strlen(code));
+    Lexer_Init(&lexer, code, length);
+    struct TranslationUnit *t_unit = Parser_MakeAst(&lexer);
+    PassManager_EndPhase(t_unit);
 
-    // Tokenize and print tokens
-    while (true) {
-        struct Token token = Lexer_PeekToken(&lexer);
-        if (token.type == TOKEN_END_OF_FILE) break;
-        PrintToken(token);
-        Lexer_EatToken(&lexer);
+    int status = 0;
+    switch (mode) {
+        case MODE_COMPILE: {
+            FILE *output = output_path ? fopen(output_path, "wb") : stdout;
+            if (!output) {
+                fprintf(stderr, "error: cannot write '%s'\n", output_path);
+                return 1;
+            }
+            CodeGeneratorX86_GenerateCode(output, t_unit);
+            if (output != stdout && fclose(output) != 0) {
+                fprintf(stderr, "error: cannot write '%s'\n", output_path);
+                status = 1;
+            }
+        } break;
+        case MODE_RUN:          { status = RunJit(t_unit); } break;
+        case MODE_INTERPRET:    { status = RunInterpreter(t_unit); } break;
     }
 
-    return 0;
+    if (options.time_report) {
+        PassManager_PrintTimeReport(stderr);
+    }
+    if (options.print_stats) {
+        PassManager_PrintStats(stderr);
+    }
+    if (options.mem_report) {
+        PassManager_PrintMemoryReport(stderr);
+    }
+    if (options.mem_report_json && !WriteMemoryJson(options.mem_report_json)) {
+        fprintf(stderr, "error: cannot write '%s'\n", options.mem_report_json);
+        status = 1;
+    }
+    free(code);
+    return status;
 }